@@ -8,7 +8,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
 #include <time.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "../common/cbasetypes.hpp"
 #include "../common/cli.hpp"
@@ -22,6 +29,7 @@
 #include "../common/socket.hpp"
 #include "../common/strlib.hpp"
 #include "../common/timer.hpp"
+#include "../common/utils.hpp"
 
 #include "char_clif.hpp"
 #include "char_cnslif.hpp"
@@ -71,6 +79,7 @@ int subnet_count = 0;
 DBMap* auth_db; // uint32 account_id -> struct auth_node*
 DBMap* online_char_db; // uint32 account_id -> struct online_char_data*
 DBMap* char_db_; // uint32 char_id -> struct mmo_charstatus*
+static std::unordered_map<uint64, std::vector<struct item>> char_memitemdata_cache; // item rows as they are in the database, see char_memitemdata_key
 DBMap* char_get_authdb() { return auth_db; }
 DBMap* char_get_onlinedb() { return online_char_db; }
 DBMap* char_get_chardb() { return char_db_; }
@@ -163,10 +172,16 @@ void char_set_char_offline(uint32 char_id, uint32 account_id){
 		if (cp)
 			idb_remove(char_db_,char_id);
 
+		char_memitemdata_cache_remove(char_id, TABLE_INVENTORY, 0);
+		char_memitemdata_cache_remove(char_id, TABLE_CART, 0);
+
 		if( SQL_ERROR == Sql_Query(sql_handle, "UPDATE `%s` SET `online`='0' WHERE `char_id`='%d' LIMIT 1", schema_config.char_db, char_id) )
 			Sql_ShowDebug(sql_handle);
 	}
 
+	for( auto& storage : interServerDb )
+		char_memitemdata_cache_remove(account_id, TABLE_STORAGE, storage.first);
+
 	if ((character = (struct online_char_data*)idb_get(online_char_db, account_id)) != NULL)
 	{	//We don't free yet to avoid aCalloc/aFree spamming during char change. [Skotlex]
 		if( character->server > -1 )
@@ -265,105 +280,115 @@ DBData char_create_charstatus(DBKey key, va_list args) {
 	return db_ptr2data(cp);
 }
 
-int char_mmo_char_tosql(uint32 char_id, struct mmo_charstatus* p){
+/**
+ * Builds the statements that write the changes between two states of a character.
+ * @param char_id: Character ID
+ * @param p: Status to save
+ * @param cp: Status as it is in the database
+ * @param statements: Statements to run in order, in a single transaction
+ * @param save_status: Saved parts, for the save log
+ */
+static void char_mmo_char_statements(uint32 char_id, struct mmo_charstatus* p, struct mmo_charstatus* cp, std::vector<std::string>& statements, char* save_status){
 	int i = 0;
 	int count = 0;
 	int diff = 0;
-	char save_status[128]; //For displaying save information. [Skotlex]
-	struct mmo_charstatus *cp;
-	int errors = 0; //If there are any errors while saving, "cp" will not be updated at the end.
 	StringBuf buf;
 
-	if (char_id!=p->char_id) return 0;
-
-	cp = (struct mmo_charstatus *)idb_ensure(char_db_, char_id, char_create_charstatus);
-
 	StringBuf_Init(&buf);
-	memset(save_status, 0, sizeof(save_status));
 
-	if (
-		(p->base_exp != cp->base_exp) || (p->base_level != cp->base_level) ||
-		(p->job_level != cp->job_level) || (p->job_exp != cp->job_exp) ||
-		(p->zeny != cp->zeny) ||
-		(p->last_point.map != cp->last_point.map) ||
-		(p->last_point.x != cp->last_point.x) || (p->last_point.y != cp->last_point.y) ||
-		(p->max_hp != cp->max_hp) || (p->hp != cp->hp) ||
-		(p->max_sp != cp->max_sp) || (p->sp != cp->sp) ||
-		(p->status_point != cp->status_point) || (p->skill_point != cp->skill_point) ||
-		(p->str != cp->str) || (p->agi != cp->agi) || (p->vit != cp->vit) ||
-		(p->int_ != cp->int_) || (p->dex != cp->dex) || (p->luk != cp->luk) ||
-		(p->option != cp->option) ||
-		(p->party_id != cp->party_id) || (p->guild_id != cp->guild_id) ||
-		(p->pet_id != cp->pet_id) || (p->weapon != cp->weapon) || (p->hom_id != cp->hom_id) ||
-		(p->ele_id != cp->ele_id) || (p->shield != cp->shield) || (p->head_top != cp->head_top) ||
-		(p->head_mid != cp->head_mid) || (p->head_bottom != cp->head_bottom) || (p->delete_date != cp->delete_date) ||
-		(p->rename != cp->rename) || (p->robe != cp->robe) || (p->character_moves != cp->character_moves) ||
-		(p->unban_time != cp->unban_time) || (p->font != cp->font) || (p->uniqueitem_counter != cp->uniqueitem_counter) ||
-		(p->hotkey_rowshift != cp->hotkey_rowshift) || (p->clan_id != cp->clan_id ) || (p->title_id != cp->title_id) ||
-		(p->show_equip != cp->show_equip) || (p->hotkey_rowshift2 != cp->hotkey_rowshift2) ||
-		(p->max_ap != cp->max_ap) || (p->ap != cp->ap) || (p->trait_point != cp->trait_point) ||
-		(p->pow != cp->pow) || (p->sta != cp->sta) || (p->wis != cp->wis) ||
-		(p->spl != cp->spl) || (p->con != cp->con) || (p->crt != cp->crt)
-	)
-	{	//Save status
-		if( SQL_ERROR == Sql_Query(sql_handle, "UPDATE `%s` SET `base_level`='%d', `job_level`='%d',"
-			"`base_exp`='%" PRIu64 "', `job_exp`='%" PRIu64 "', `zeny`='%d',"
-			"`max_hp`='%u',`hp`='%u',`max_sp`='%u',`sp`='%u',`status_point`='%d',`skill_point`='%d',"
-			"`str`='%d',`agi`='%d',`vit`='%d',`int`='%d',`dex`='%d',`luk`='%d',"
-			"`option`='%d',`party_id`='%d',`guild_id`='%d',`pet_id`='%d',`homun_id`='%d',`elemental_id`='%d',"
-			"`weapon`='%d',`shield`='%d',`head_top`='%d',`head_mid`='%d',`head_bottom`='%d',"
-			"`last_map`='%s',`last_x`='%d',`last_y`='%d',`save_map`='%s',`save_x`='%d',`save_y`='%d', `rename`='%d',"
-			"`delete_date`='%lu',`robe`='%d',`moves`='%d',`font`='%u',`uniqueitem_counter`='%u',"
-			"`hotkey_rowshift`='%d', `clan_id`='%d', `title_id`='%lu', `show_equip`='%d', `hotkey_rowshift2`='%d',"
-			"`max_ap`='%u',`ap`='%u',`trait_point`='%d',"
-			"`pow`='%d',`sta`='%d',`wis`='%d',`spl`='%d',`con`='%d',`crt`='%d'"
-			" WHERE `account_id`='%d' AND `char_id` = '%d'",
-			schema_config.char_db, p->base_level, p->job_level,
-			p->base_exp, p->job_exp, p->zeny,
-			p->max_hp, p->hp, p->max_sp, p->sp, p->status_point, p->skill_point,
-			p->str, p->agi, p->vit, p->int_, p->dex, p->luk,
-			p->option, p->party_id, p->guild_id, p->pet_id, p->hom_id, p->ele_id,
-			p->weapon, p->shield, p->head_top, p->head_mid, p->head_bottom,
-			mapindex_id2name(p->last_point.map), p->last_point.x, p->last_point.y,
-			mapindex_id2name(p->save_point.map), p->save_point.x, p->save_point.y, p->rename,
-			(unsigned long)p->delete_date, // FIXME: platform-dependent size
-			p->robe, p->character_moves, p->font, p->uniqueitem_counter,
-			p->hotkey_rowshift, p->clan_id, p->title_id, p->show_equip, p->hotkey_rowshift2,
-			p->max_ap, p->ap, p->trait_point,
-			p->pow, p->sta, p->wis, p->spl, p->con, p->crt,
-			p->account_id, p->char_id) )
-		{
-			Sql_ShowDebug(sql_handle);
-			errors++;
-		} else
-			strcat(save_status, " status");
-	}
-
-	//Values that will seldom change (to speed up saving)
-	if (
-		(p->hair != cp->hair) || (p->hair_color != cp->hair_color) || (p->clothes_color != cp->clothes_color) ||
-		(p->body != cp->body) || (p->class_ != cp->class_) ||
-		(p->partner_id != cp->partner_id) || (p->father != cp->father) ||
-		(p->mother != cp->mother) || (p->child != cp->child) ||
- 		(p->karma != cp->karma) || (p->manner != cp->manner) ||
-		(p->fame != cp->fame) || (p->inventory_slots != cp->inventory_slots)
-	)
+	// Only the columns that changed are written
+#define CHAR_SAVE_COLUMN(changed,column,fmt,value) \
+	if( (changed) ) { \
+		StringBuf_Printf(&buf, "%s`" column "`='" fmt "'", (count++ ? "," : ""), (value)); \
+	}
+#define CHAR_SAVE_FIELD(column,fmt,field) CHAR_SAVE_COLUMN(p->field != cp->field, column, fmt, p->field)
+
+	StringBuf_Clear(&buf);
+	count = 0;
+
+	//Save status
+	CHAR_SAVE_FIELD("base_level", "%d", base_level);
+	CHAR_SAVE_FIELD("job_level", "%d", job_level);
+	CHAR_SAVE_FIELD("base_exp", "%" PRIu64, base_exp);
+	CHAR_SAVE_FIELD("job_exp", "%" PRIu64, job_exp);
+	CHAR_SAVE_FIELD("zeny", "%d", zeny);
+	CHAR_SAVE_FIELD("max_hp", "%u", max_hp);
+	CHAR_SAVE_FIELD("hp", "%u", hp);
+	CHAR_SAVE_FIELD("max_sp", "%u", max_sp);
+	CHAR_SAVE_FIELD("sp", "%u", sp);
+	CHAR_SAVE_FIELD("status_point", "%d", status_point);
+	CHAR_SAVE_FIELD("skill_point", "%d", skill_point);
+	CHAR_SAVE_FIELD("str", "%d", str);
+	CHAR_SAVE_FIELD("agi", "%d", agi);
+	CHAR_SAVE_FIELD("vit", "%d", vit);
+	CHAR_SAVE_FIELD("int", "%d", int_);
+	CHAR_SAVE_FIELD("dex", "%d", dex);
+	CHAR_SAVE_FIELD("luk", "%d", luk);
+	CHAR_SAVE_FIELD("option", "%d", option);
+	CHAR_SAVE_FIELD("party_id", "%d", party_id);
+	CHAR_SAVE_FIELD("guild_id", "%d", guild_id);
+	CHAR_SAVE_FIELD("pet_id", "%d", pet_id);
+	CHAR_SAVE_FIELD("homun_id", "%d", hom_id);
+	CHAR_SAVE_FIELD("elemental_id", "%d", ele_id);
+	CHAR_SAVE_FIELD("weapon", "%d", weapon);
+	CHAR_SAVE_FIELD("shield", "%d", shield);
+	CHAR_SAVE_FIELD("head_top", "%d", head_top);
+	CHAR_SAVE_FIELD("head_mid", "%d", head_mid);
+	CHAR_SAVE_FIELD("head_bottom", "%d", head_bottom);
+	CHAR_SAVE_COLUMN(p->last_point.map != cp->last_point.map, "last_map", "%s", mapindex_id2name(p->last_point.map));
+	CHAR_SAVE_FIELD("last_x", "%d", last_point.x);
+	CHAR_SAVE_FIELD("last_y", "%d", last_point.y);
+	CHAR_SAVE_COLUMN(p->save_point.map != cp->save_point.map, "save_map", "%s", mapindex_id2name(p->save_point.map));
+	CHAR_SAVE_FIELD("save_x", "%d", save_point.x);
+	CHAR_SAVE_FIELD("save_y", "%d", save_point.y);
+	CHAR_SAVE_FIELD("rename", "%d", rename);
+	CHAR_SAVE_COLUMN(p->delete_date != cp->delete_date, "delete_date", "%lu", (unsigned long)p->delete_date); // FIXME: platform-dependent size
+	CHAR_SAVE_FIELD("robe", "%d", robe);
+	CHAR_SAVE_FIELD("moves", "%d", character_moves);
+	CHAR_SAVE_FIELD("font", "%u", font);
+	CHAR_SAVE_FIELD("uniqueitem_counter", "%u", uniqueitem_counter);
+	CHAR_SAVE_FIELD("hotkey_rowshift", "%d", hotkey_rowshift);
+	CHAR_SAVE_FIELD("clan_id", "%d", clan_id);
+	CHAR_SAVE_FIELD("title_id", "%lu", title_id);
+	CHAR_SAVE_FIELD("show_equip", "%d", show_equip);
+	CHAR_SAVE_FIELD("hotkey_rowshift2", "%d", hotkey_rowshift2);
+	CHAR_SAVE_FIELD("max_ap", "%u", max_ap);
+	CHAR_SAVE_FIELD("ap", "%u", ap);
+	CHAR_SAVE_FIELD("trait_point", "%d", trait_point);
+	CHAR_SAVE_FIELD("pow", "%d", pow);
+	CHAR_SAVE_FIELD("sta", "%d", sta);
+	CHAR_SAVE_FIELD("wis", "%d", wis);
+	CHAR_SAVE_FIELD("spl", "%d", spl);
+	CHAR_SAVE_FIELD("con", "%d", con);
+	CHAR_SAVE_FIELD("crt", "%d", crt);
+	if( count )
+		strcat(save_status, " status");
+
+	//Values that will seldom change
+	diff = count;
+	CHAR_SAVE_FIELD("class", "%d", class_);
+	CHAR_SAVE_FIELD("hair", "%d", hair);
+	CHAR_SAVE_FIELD("hair_color", "%d", hair_color);
+	CHAR_SAVE_FIELD("clothes_color", "%d", clothes_color);
+	CHAR_SAVE_FIELD("body", "%d", body);
+	CHAR_SAVE_FIELD("partner_id", "%u", partner_id);
+	CHAR_SAVE_FIELD("father", "%u", father);
+	CHAR_SAVE_FIELD("mother", "%u", mother);
+	CHAR_SAVE_FIELD("child", "%u", child);
+	CHAR_SAVE_FIELD("karma", "%d", karma);
+	CHAR_SAVE_FIELD("manner", "%d", manner);
+	CHAR_SAVE_FIELD("fame", "%d", fame);
+	CHAR_SAVE_FIELD("inventory_slots", "%hu", inventory_slots);
+	if( count > diff )
+		strcat(save_status, " status2");
+
+#undef CHAR_SAVE_FIELD
+#undef CHAR_SAVE_COLUMN
+
+	if( count )
 	{
-		if( SQL_ERROR == Sql_Query(sql_handle, "UPDATE `%s` SET `class`='%d',"
-			"`hair`='%d', `hair_color`='%d', `clothes_color`='%d', `body`='%d',"
-			"`partner_id`='%u', `father`='%u', `mother`='%u', `child`='%u',"
-			"`karma`='%d',`manner`='%d', `fame`='%d', `inventory_slots`='%hu'"
-			" WHERE  `account_id`='%d' AND `char_id` = '%d'",
-			schema_config.char_db, p->class_,
-			p->hair, p->hair_color, p->clothes_color, p->body,
-			p->partner_id, p->father, p->mother, p->child,
-			p->karma, p->manner, p->fame, p->inventory_slots,
-			p->account_id, p->char_id) )
-		{
-			Sql_ShowDebug(sql_handle);
-			errors++;
-		} else
-			strcat(save_status, " status2");
+		StringBuf_Printf(&buf, " WHERE `account_id`='%d' AND `char_id` = '%d'", p->account_id, p->char_id);
+		statements.push_back(std::string("UPDATE `") + schema_config.char_db + "` SET " + StringBuf_Value(&buf));
 	}
 
 	/* Mercenary Owner */
@@ -372,10 +397,10 @@ int char_mmo_char_tosql(uint32 char_id, struct mmo_charstatus* p){
 		(p->spear_calls != cp->spear_calls) || (p->spear_faith != cp->spear_faith) ||
 		(p->sword_calls != cp->sword_calls) || (p->sword_faith != cp->sword_faith) )
 	{
-		if (mercenary_owner_tosql(char_id, p))
-			strcat(save_status, " mercenary");
-		else
-			errors++;
+		StringBuf_Clear(&buf);
+		mercenary_owner_tosql_statement(&buf, char_id, p);
+		statements.emplace_back(StringBuf_Value(&buf), StringBuf_Length(&buf));
+		strcat(save_status, " mercenary");
 	}
 
 	//memo points
@@ -384,11 +409,9 @@ int char_mmo_char_tosql(uint32 char_id, struct mmo_charstatus* p){
 		char esc_mapname[NAME_LENGTH*2+1];
 
 		//`memo` (`memo_id`,`char_id`,`map`,`x`,`y`)
-		if( SQL_ERROR == Sql_Query(sql_handle, "DELETE FROM `%s` WHERE `char_id`='%d'", schema_config.memo_db, p->char_id) )
-		{
-			Sql_ShowDebug(sql_handle);
-			errors++;
-		}
+		StringBuf_Clear(&buf);
+		StringBuf_Printf(&buf, "DELETE FROM `%s` WHERE `char_id`='%d'", schema_config.memo_db, p->char_id);
+		statements.emplace_back(StringBuf_Value(&buf), StringBuf_Length(&buf));
 
 		//insert here.
 		StringBuf_Clear(&buf);
@@ -405,13 +428,7 @@ int char_mmo_char_tosql(uint32 char_id, struct mmo_charstatus* p){
 			}
 		}
 		if( count )
-		{
-			if( SQL_ERROR == Sql_QueryStr(sql_handle, StringBuf_Value(&buf)) )
-			{
-				Sql_ShowDebug(sql_handle);
-				errors++;
-			}
-		}
+			statements.emplace_back(StringBuf_Value(&buf), StringBuf_Length(&buf));
 		strcat(save_status, " memo");
 	}
 
@@ -419,11 +436,9 @@ int char_mmo_char_tosql(uint32 char_id, struct mmo_charstatus* p){
 	if( memcmp(p->skill, cp->skill, sizeof(p->skill)) )
 	{
 		//`skill` (`char_id`, `id`, `lv`)
-		if( SQL_ERROR == Sql_Query(sql_handle, "DELETE FROM `%s` WHERE `char_id`='%d'", schema_config.skill_db, p->char_id) )
-		{
-			Sql_ShowDebug(sql_handle);
-			errors++;
-		}
+		StringBuf_Clear(&buf);
+		StringBuf_Printf(&buf, "DELETE FROM `%s` WHERE `char_id`='%d'", schema_config.skill_db, p->char_id);
+		statements.emplace_back(StringBuf_Value(&buf), StringBuf_Length(&buf));
 
 		StringBuf_Clear(&buf);
 		StringBuf_Printf(&buf, "INSERT INTO `%s`(`char_id`,`id`,`lv`,`flag`) VALUES ", schema_config.skill_db);
@@ -444,13 +459,7 @@ int char_mmo_char_tosql(uint32 char_id, struct mmo_charstatus* p){
 			}
 		}
 		if( count )
-		{
-			if( SQL_ERROR == Sql_QueryStr(sql_handle, StringBuf_Value(&buf)) )
-			{
-				Sql_ShowDebug(sql_handle);
-				errors++;
-			}
-		}
+			statements.emplace_back(StringBuf_Value(&buf), StringBuf_Length(&buf));
 
 		strcat(save_status, " skills");
 	}
@@ -466,11 +475,9 @@ int char_mmo_char_tosql(uint32 char_id, struct mmo_charstatus* p){
 
 	if(diff == 1)
 	{	//Save friends
-		if( SQL_ERROR == Sql_Query(sql_handle, "DELETE FROM `%s` WHERE `char_id`='%d'", schema_config.friend_db, char_id) )
-		{
-			Sql_ShowDebug(sql_handle);
-			errors++;
-		}
+		StringBuf_Clear(&buf);
+		StringBuf_Printf(&buf, "DELETE FROM `%s` WHERE `char_id`='%d'", schema_config.friend_db, char_id);
+		statements.emplace_back(StringBuf_Value(&buf), StringBuf_Length(&buf));
 
 		StringBuf_Clear(&buf);
 		StringBuf_Printf(&buf, "INSERT INTO `%s` (`char_id`, `friend_id`) VALUES ", schema_config.friend_db);
@@ -485,13 +492,7 @@ int char_mmo_char_tosql(uint32 char_id, struct mmo_charstatus* p){
 			}
 		}
 		if( count )
-		{
-			if( SQL_ERROR == Sql_QueryStr(sql_handle, StringBuf_Value(&buf)) )
-			{
-				Sql_ShowDebug(sql_handle);
-				errors++;
-			}
-		}
+			statements.emplace_back(StringBuf_Value(&buf), StringBuf_Length(&buf));
 		strcat(save_status, " friends");
 	}
 
@@ -510,62 +511,454 @@ int char_mmo_char_tosql(uint32 char_id, struct mmo_charstatus* p){
 		}
 	}
 	if(diff) {
-		if( SQL_ERROR == Sql_QueryStr(sql_handle, StringBuf_Value(&buf)) )
-		{
-			Sql_ShowDebug(sql_handle);
-			errors++;
-		} else
-			strcat(save_status, " hotkeys");
+		statements.emplace_back(StringBuf_Value(&buf), StringBuf_Length(&buf));
+		strcat(save_status, " hotkeys");
 	}
 #endif
 	StringBuf_Destroy(&buf);
-	if (save_status[0]!='\0' && charserv_config.save_log)
+}
+
+/**
+ * Writes the changes of a character on the main connection.
+ * @param char_id: Character ID
+ * @param p: Status to save
+ * @param cp: Status as it is in the database, updated on success
+ * @return True if success, False if failed
+ */
+static bool char_mmo_char_write(uint32 char_id, struct mmo_charstatus* p, struct mmo_charstatus* cp){
+	std::vector<std::string> statements;
+	char save_status[128]; //For displaying save information. [Skotlex]
+	int errors = 0; //If there are any errors while saving, "cp" will not be updated at the end.
+
+	if( memcmp(p, cp, sizeof(struct mmo_charstatus)) == 0 )
+		return true; // nothing changed since the last save
+
+	memset(save_status, 0, sizeof(save_status));
+	char_mmo_char_statements(char_id, p, cp, statements, save_status);
+
+	if( statements.empty() ){
+		memcpy(cp, p, sizeof(struct mmo_charstatus));
+		return true;
+	}
+
+	// Everything is written in a single transaction
+	if( SQL_ERROR == Sql_QueryStr(sql_handle, "START TRANSACTION") ) {
+		Sql_ShowDebug(sql_handle);
+		return false;
+	}
+
+	for( const std::string& statement : statements ){
+		if( SQL_ERROR == Sql_QueryStr(sql_handle, statement.c_str()) ){
+			Sql_ShowDebug(sql_handle);
+			errors++;
+			break;
+		}
+	}
+
+	if( !errors && SQL_ERROR == Sql_QueryStr(sql_handle, "COMMIT") )
+	{
+		Sql_ShowDebug(sql_handle);
+		errors++;
+	}
+	if( errors )
+		Sql_QueryStr(sql_handle, "ROLLBACK");
+
+	if (!errors && save_status[0]!='\0' && charserv_config.save_log)
 		ShowInfo("Saved char %d - %s:%s.\n", char_id, p->name, save_status);
 	if (!errors)
 		memcpy(cp, p, sizeof(struct mmo_charstatus));
+	return errors == 0;
+}
+
+/**
+ * Write-behind queue of the character saves.
+ * Saves sent by the map-servers are acknowledged into the queue and coalesced per character;
+ * the changes against the last written state are flushed on the background connections
+ * once they are older than save_write_behind_delay, or at once on logout.
+ * Items are still written synchronously, so a save that goes along with changed items is
+ * written at once as well, and the items never get ahead of the zeny (see char_save_items).
+ */
+struct s_char_save {
+	struct mmo_charstatus status; // Last status received
+	struct mmo_charstatus base; // Status as it is in the database
+	t_tick due; // When the pending status has to be written
+	bool pending; // Whether status has not been sent yet
+	bool running; // Whether a flush is running on a background connection
+	uint8 retries; // Failed flushes in a row
+};
+
+struct s_char_save_batch {
+	struct mmo_charstatus status; // Status being written
+	char save_status[128]; // Saved parts, for the save log
+};
+
+#define CHAR_SAVE_RETRIES 3 // Failed flushes of a character before it is written on the main connection
+
+static std::unordered_map<uint32, std::unique_ptr<s_char_save>> char_save_queue;
+static std::unordered_set<uint32> char_save_items_chars; // Characters whose inventory or cart changed since their last save
+static std::unordered_set<uint32> char_save_items_accounts; // Accounts whose storage changed since the last save of one of their characters
+static SqlAsync* char_save_pool = NULL;
+
+static void char_save_submit(uint32 char_id, s_char_save* entry);
+
+/**
+ * Completion callback of a flush sent on a background connection.
+ */
+static void char_save_callback(SqlAsyncResult* result, intptr_t data){
+	struct s_char_save_batch* batch = reinterpret_cast<s_char_save_batch*>(data);
+	uint32 char_id = batch->status.char_id;
+	auto it = char_save_queue.find(char_id);
+
+	if( it == char_save_queue.end() ){
+		delete batch;
+		return;
+	}
+
+	s_char_save* entry = it->second.get();
+
+	entry->running = false;
+	if( SQL_SUCCESS == SqlAsyncResult_Status(result) ){
+		memcpy(&entry->base, &batch->status, sizeof(struct mmo_charstatus));
+		entry->retries = 0;
+		if( batch->save_status[0] != '\0' && charserv_config.save_log )
+			ShowInfo("Saved char %d - %s:%s.\n", char_id, batch->status.name, batch->save_status);
+	}else{
+		SqlAsyncResult_ShowDebug(result);
+		if( ++entry->retries > CHAR_SAVE_RETRIES ){
+			ShowWarning("char_save_callback: Couldn't save char %d - %s after %d attempts, writing it on the main connection.\n", char_id, batch->status.name, entry->retries);
+			entry->retries = 0;
+			entry->pending = false;
+			if( !char_mmo_char_write(char_id, &entry->status, &entry->base) ){// keep the changes, the timer tries again
+				entry->pending = true;
+				entry->due = gettick() + charserv_config.save_write_behind_delay;
+			}
+		}else if( !entry->pending ){// try again with the same status
+			entry->pending = true;
+			entry->due = gettick() + charserv_config.save_write_behind_delay;
+		}
+	}
+	delete batch;
+
+	if( entry->pending ){
+		if( DIFF_TICK(gettick(), entry->due) >= 0 )
+			char_save_submit(char_id, entry);
+	}else if( memcmp(&entry->status, &entry->base, sizeof(struct mmo_charstatus)) == 0 || idb_get(char_db_, char_id) == NULL )
+		char_save_queue.erase(it); // written, or dropped and the character is gone
+}
+
+/**
+ * Sends the pending status of a character to a background connection.
+ * All the statements of a character run in one transaction on the same connection, in order.
+ * @param char_id: Character ID
+ * @param entry: Queue entry of the character, removed if there is nothing to write
+ */
+static void char_save_submit(uint32 char_id, s_char_save* entry){
+	struct s_char_save_batch* batch;
+	std::vector<std::string> statements;
+	SqlAsyncQuery* query;
+
+	entry->pending = false;
+
+	batch = new s_char_save_batch();
+	memcpy(&batch->status, &entry->status, sizeof(struct mmo_charstatus));
+	char_mmo_char_statements(char_id, &batch->status, &entry->base, statements, batch->save_status);
+
+	if( statements.empty() ){
+		delete batch;
+		memcpy(&entry->base, &entry->status, sizeof(struct mmo_charstatus));
+		char_save_queue.erase(char_id);
+		return;
+	}
+
+	query = SqlAsyncQuery_Malloc();
+	for( const std::string& statement : statements )
+		SqlAsyncQuery_Append(query, "%s", statement.c_str());
+
+	if( SQL_SUCCESS == SqlAsync_Execute(char_save_pool, query, char_id, char_save_callback, reinterpret_cast<intptr_t>(batch)) ){
+		entry->running = true;
+		return;
+	}
+
+	// Couldn't queue it, write it on the main connection
+	delete batch;
+	char_mmo_char_write(char_id, &entry->status, &entry->base);
+	if( memcmp(&entry->status, &entry->base, sizeof(struct mmo_charstatus)) == 0 )
+		char_save_queue.erase(char_id);
+}
+
+/**
+ * Queues the save of a character.
+ * Saves of the same character are coalesced until they are written.
+ * @param char_id: Character ID
+ * @param p: Status to save
+ * @param flush: Whether to write it now instead of after save_write_behind_delay (logout)
+ * @return 0
+ */
+int char_mmo_char_queue(uint32 char_id, struct mmo_charstatus* p, bool flush){
+	struct mmo_charstatus *cp;
+	s_char_save* entry;
+
+	if( char_save_pool == NULL )
+		return char_mmo_char_tosql(char_id, p);
+
+	if (char_id!=p->char_id) return 0;
+
+	// Items were written since the last save, don't let them get ahead of the status
+	bool items = char_save_items_chars.erase(char_id) > 0;
+
+	if( char_save_items_accounts.erase(p->account_id) > 0 )
+		items = true;
+
+	cp = (struct mmo_charstatus *)idb_ensure(char_db_, char_id, char_create_charstatus);
+
+	auto it = char_save_queue.find(char_id);
+
+	if( it == char_save_queue.end() ){
+		if( memcmp(p, cp, sizeof(struct mmo_charstatus)) == 0 )
+			return 0; // nothing changed since the last save
+
+		entry = new s_char_save();
+		memcpy(&entry->base, cp, sizeof(struct mmo_charstatus));
+		char_save_queue[char_id].reset(entry);
+	}else
+		entry = it->second.get();
+
+	// The cached status is what the map-servers get back, keep it current
+	memcpy(cp, p, sizeof(struct mmo_charstatus));
+	memcpy(&entry->status, p, sizeof(struct mmo_charstatus));
+
+	if( !entry->pending ){
+		entry->pending = true;
+		entry->due = gettick() + charserv_config.save_write_behind_delay;
+	}
+	if( flush || items )
+		entry->due = gettick();
+
+	if( !entry->running && DIFF_TICK(gettick(), entry->due) >= 0 )
+		char_save_submit(char_id, entry);
+	if( items )
+		char_mmo_char_flush(char_id);
 	return 0;
 }
 
-/// Saves an array of 'item' entries into the specified table.
-int char_memitemdata_to_sql(const struct item items[], int max, int id, enum storage_type tableswitch, uint8 stor_id) {
-	StringBuf buf;
-	SqlStmt* stmt;
-	int i, j, offset = 0, errors = 0;
-	const char *tablename, *selectoption, *printname;
-	struct item item; // temp storage variable
-	bool* flag; // bit array for inventory matching
-	bool found;
+/**
+ * Waits until the queued saves of a character have been written.
+ * Used before anything reads the character back from the database.
+ * @param char_id: Character ID
+ */
+void char_mmo_char_flush(uint32 char_id){
+	int attempts = 0;
 
-	switch (tableswitch) {
-		case TABLE_INVENTORY:
-			printname = "Inventory";
-			tablename = schema_config.inventory_db;
-			selectoption = "char_id";
+	for( ;; ){
+		auto it = char_save_queue.find(char_id);
+
+		if( it == char_save_queue.end() )
 			break;
+		if( !it->second->running ){
+			if( !it->second->pending )
+				break;
+			if( ++attempts > CHAR_SAVE_RETRIES + 1 ){// the database keeps failing, the changes stay queued
+				ShowError("char_mmo_char_flush: Couldn't save char %d - %s, it is written again later.\n", char_id, it->second->status.name);
+				break;
+			}
+			char_save_submit(char_id, it->second.get());
+			continue;
+		}
+
+		Sql_AsyncPoll(0);
+		it = char_save_queue.find(char_id);
+		if( it != char_save_queue.end() && it->second->running )
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+/**
+ * Waits until the queued saves of all characters of an account have been written.
+ * @param account_id: Account ID
+ */
+void char_mmo_char_flush_account(uint32 account_id){
+	std::vector<uint32> char_ids;
+
+	for( const auto& it : char_save_queue ){
+		if( it.second->status.account_id == account_id )
+			char_ids.push_back(it.first);
+	}
+
+	for( uint32 char_id : char_ids )
+		char_mmo_char_flush(char_id);
+}
+
+/**
+ * Called before the item rows of an owner are changed on the main connection.
+ * Writes the queued status of the owner first, and makes its next save skip the queue,
+ * so that the zeny written never lags behind the items.
+ * @param id: Owner ID (char, account or guild)
+ * @param tableswitch: Table type
+ */
+static void char_save_items(int id, enum storage_type tableswitch){
+	if( char_save_pool == NULL )
+		return;
+
+	switch( tableswitch ){
+		case TABLE_INVENTORY:
 		case TABLE_CART:
-			printname = "Cart";
-			tablename = schema_config.cart_db;
-			selectoption = "char_id";
+			char_mmo_char_flush(id);
+			char_save_items_chars.insert(id);
 			break;
 		case TABLE_STORAGE:
-			printname = inter_premiumStorage_getPrintableName(stor_id);
-			tablename = inter_premiumStorage_getTableName(stor_id);
-			selectoption = "account_id";
-			break;
-		case TABLE_GUILD_STORAGE:
-			printname = "Guild Storage";
-			tablename = schema_config.guild_storage_db;
-			selectoption = "guild_id";
+			char_mmo_char_flush_account(id);
+			char_save_items_accounts.insert(id);
 			break;
 		default:
-			ShowError("Invalid table name!\n");
-			return 1;
+			break; // guild storages are not tied to a status
 	}
+}
+
+/**
+ * Timer event to write the queued saves that are due.
+ */
+static TIMER_FUNC(char_save_timer){
+	std::vector<uint32> due;
+
+	for( const auto& it : char_save_queue ){
+		if( it.second->pending && !it.second->running && DIFF_TICK(tick, it.second->due) >= 0 )
+			due.push_back(it.first);
+	}
+
+	for( uint32 char_id : due ){
+		auto it = char_save_queue.find(char_id);
+
+		if( it != char_save_queue.end() )
+			char_save_submit(char_id, it->second.get());
+	}
+	return 0;
+}
+
+/**
+ * Opens the background connections of the save queue.
+ */
+static void char_save_init(void){
+	if( !charserv_config.save_write_behind )
+		return;
+
+	if( (char_save_pool = inter_sql_async_connect(charserv_config.save_workers)) == NULL ){
+		ShowWarning("Character saves are written synchronously.\n");
+		return;
+	}
+
+	add_timer_func_list(char_save_timer, "char_save_timer");
+	add_timer_interval(gettick() + 100, char_save_timer, 0, 0, 100);
+}
 
-	// The following code compares inventory with current database values
-	// and performs modification/deletion/insertion only on relevant rows.
-	// This approach is more complicated than a trivial delete&insert, but
-	// it significantly reduces cpu load on the database server.
+/**
+ * Writes all the queued saves and closes the background connections.
+ * Saves that the background connections couldn't write are written on the main connection.
+ * @return True if every queued save was written, False otherwise
+ */
+static bool char_save_final(void){
+	std::vector<uint32> char_ids;
+	bool saved = true;
+
+	if( char_save_pool == NULL )
+		return true;
+
+	// Send everything first so the connections write in parallel
+	for( const auto& it : char_save_queue )
+		char_ids.push_back(it.first);
+	for( uint32 char_id : char_ids ){
+		auto it = char_save_queue.find(char_id);
+
+		if( it != char_save_queue.end() && it->second->pending && !it->second->running )
+			char_save_submit(char_id, it->second.get());
+	}
+	for( uint32 char_id : char_ids )
+		char_mmo_char_flush(char_id);
+
+	// There is no later at shutdown, write what is left on the main connection
+	for( const auto& it : char_save_queue ){
+		s_char_save* entry = it.second.get();
+
+		if( !entry->pending && memcmp(&entry->status, &entry->base, sizeof(struct mmo_charstatus)) == 0 )
+			continue;
+		if( !char_mmo_char_write(it.first, &entry->status, &entry->base) ){
+			ShowError("char_save_final: Couldn't save char %d - %s, its last changes are lost.\n", it.first, entry->status.name);
+			saved = false;
+		}
+	}
+
+	char_save_queue.clear();
+	char_save_items_chars.clear();
+	char_save_items_accounts.clear();
+	SqlAsync_Free(char_save_pool);
+	char_save_pool = NULL;
+	return saved;
+}
+
+/**
+ * Saves a character and waits until it has been written.
+ * @param char_id: Character ID
+ * @param p: Status to save
+ * @return 0
+ */
+int char_mmo_char_tosql(uint32 char_id, struct mmo_charstatus* p){
+	struct mmo_charstatus *cp;
+
+	if (char_id!=p->char_id) return 0;
+
+	if( char_save_pool != NULL ){
+		char_mmo_char_queue(char_id, p, true);
+		char_mmo_char_flush(char_id);
+		return 0;
+	}
+
+	cp = (struct mmo_charstatus *)idb_ensure(char_db_, char_id, char_create_charstatus);
+	char_mmo_char_write(char_id, p, cp);
+	return 0;
+}
+
+/**
+ * Key of the cached item rows of an owner
+ * @param id: Owner ID (char, account or guild)
+ * @param tableswitch: Table type
+ * @param stor_id: Storage ID, only used by storages
+ */
+static uint64 char_memitemdata_key(int id, enum storage_type tableswitch, uint8 stor_id) {
+	if (tableswitch != TABLE_STORAGE)
+		stor_id = 0;
+	return ((uint64)tableswitch << 40) | ((uint64)stor_id << 32) | (uint32)id;
+}
+
+/**
+ * Forgets the cached item rows of an owner.
+ * Must be called when the rows are changed in the database by anything else than char_memitemdata_to_sql.
+ * @param id: Owner ID (char, account or guild)
+ * @param tableswitch: Table type
+ * @param stor_id: Storage ID, only used by storages
+ */
+void char_memitemdata_cache_remove(int id, enum storage_type tableswitch, uint8 stor_id) {
+	char_memitemdata_cache.erase(char_memitemdata_key(id, tableswitch, stor_id));
+}
+
+/**
+ * Reads all item rows of an owner.
+ * @param rows: Rows, including their database id
+ * @param id: Owner ID
+ * @param tableswitch: Table type
+ * @param tablename: Table name
+ * @param selectoption: Owner column
+ * @return True if success, False if failed
+ */
+static bool char_memitemdata_select(std::vector<struct item>& rows, int id, enum storage_type tableswitch, const char* tablename, const char* selectoption) {
+	StringBuf buf;
+	SqlStmt* stmt;
+	int i, j, offset = 0;
+	struct item item;
+
+	stmt = SqlStmt_Malloc(sql_handle);
+	if (stmt == NULL) {
+		SqlStmt_ShowDebug(stmt);
+		return false;
+	}
 
 	StringBuf_Init(&buf);
 	StringBuf_AppendStr(&buf, "SELECT `id`, `nameid`, `amount`, `equip`, `identify`, `refine`, `attribute`, `expire_time`, `bound`, `unique_id`, `enchantgrade`");
@@ -573,26 +966,26 @@ int char_memitemdata_to_sql(const struct item items[], int max, int id, enum sto
 		StringBuf_Printf(&buf, ", `favorite`, `equip_switch`");
 		offset = 2;
 	}
-
-	for( i = 0; i < MAX_SLOTS; ++i )
-		StringBuf_Printf(&buf, ", `card%d`", i);
-	for( i = 0; i < MAX_ITEM_RDM_OPT; ++i ) {
-		StringBuf_Printf(&buf, ", `option_id%d`", i);
-		StringBuf_Printf(&buf, ", `option_val%d`", i);
-		StringBuf_Printf(&buf, ", `option_parm%d`", i);
+	for( j = 0; j < MAX_SLOTS; ++j )
+		StringBuf_Printf(&buf, ", `card%d`", j);
+	for( j = 0; j < MAX_ITEM_RDM_OPT; ++j ) {
+		StringBuf_Printf(&buf, ", `option_id%d`", j);
+		StringBuf_Printf(&buf, ", `option_val%d`", j);
+		StringBuf_Printf(&buf, ", `option_parm%d`", j);
 	}
-	StringBuf_Printf(&buf, " FROM `%s` WHERE `%s`='%d'", tablename, selectoption, id);
+	StringBuf_Printf(&buf, " FROM `%s` WHERE `%s`=? ORDER BY `nameid`", tablename, selectoption );
 
-	stmt = SqlStmt_Malloc(sql_handle);
 	if( SQL_ERROR == SqlStmt_PrepareStr(stmt, StringBuf_Value(&buf))
+	||  SQL_ERROR == SqlStmt_BindParam(stmt, 0, SQLDT_INT, &id, 0)
 	||  SQL_ERROR == SqlStmt_Execute(stmt) )
 	{
 		SqlStmt_ShowDebug(stmt);
 		SqlStmt_Free(stmt);
 		StringBuf_Destroy(&buf);
-		return 1;
+		return false;
 	}
 
+	memset(&item, 0, sizeof(item));
 	SqlStmt_BindColumn(stmt, 0, SQLDT_INT,       &item.id,          0, NULL, NULL);
 	SqlStmt_BindColumn(stmt, 1, SQLDT_UINT,      &item.nameid,      0, NULL, NULL);
 	SqlStmt_BindColumn(stmt, 2, SQLDT_SHORT,     &item.amount,      0, NULL, NULL);
@@ -601,8 +994,8 @@ int char_memitemdata_to_sql(const struct item items[], int max, int id, enum sto
 	SqlStmt_BindColumn(stmt, 5, SQLDT_CHAR,      &item.refine,      0, NULL, NULL);
 	SqlStmt_BindColumn(stmt, 6, SQLDT_CHAR,      &item.attribute,   0, NULL, NULL);
 	SqlStmt_BindColumn(stmt, 7, SQLDT_UINT,      &item.expire_time, 0, NULL, NULL);
-	SqlStmt_BindColumn(stmt, 8, SQLDT_UINT,      &item.bound,       0, NULL, NULL);
-	SqlStmt_BindColumn(stmt, 9, SQLDT_UINT64,    &item.unique_id,   0, NULL, NULL);
+	SqlStmt_BindColumn(stmt, 8, SQLDT_CHAR,      &item.bound,       0, NULL, NULL);
+	SqlStmt_BindColumn(stmt, 9, SQLDT_ULONGLONG, &item.unique_id,   0, NULL, NULL);
 	SqlStmt_BindColumn(stmt,10, SQLDT_INT8,      &item.enchantgrade,0, NULL, NULL);
 	if (tableswitch == TABLE_INVENTORY){
 		SqlStmt_BindColumn(stmt, 11, SQLDT_CHAR, &item.favorite,    0, NULL, NULL);
@@ -615,12 +1008,97 @@ int char_memitemdata_to_sql(const struct item items[], int max, int id, enum sto
 		SqlStmt_BindColumn(stmt, 12+offset+MAX_SLOTS+i*3, SQLDT_SHORT, &item.option[i].value, 0, NULL, NULL);
 		SqlStmt_BindColumn(stmt, 13+offset+MAX_SLOTS+i*3, SQLDT_CHAR, &item.option[i].param, 0, NULL, NULL);
 	}
+
+	rows.clear();
+	rows.reserve((size_t)SqlStmt_NumRows(stmt));
+	while( SQL_SUCCESS == SqlStmt_NextRow(stmt) )
+		rows.push_back(item);
+
+	SqlStmt_FreeResult(stmt);
+	SqlStmt_Free(stmt);
+	StringBuf_Destroy(&buf);
+
+	return true;
+}
+
+/**
+ * Appends the values of an item row, in the column order of the item tables.
+ * @param buf: Statement
+ * @param item: Item
+ * @param tableswitch: Table type
+ */
+static void char_memitemdata_values(StringBuf* buf, const struct item* item, enum storage_type tableswitch) {
+	int j;
+
+	StringBuf_Printf(buf, "'%u', '%d', '%u', '%d', '%d', '%d', '%u', '%d', '%" PRIu64 "', '%d'",
+		item->nameid, item->amount, item->equip, item->identify, item->refine, item->attribute, item->expire_time, item->bound, item->unique_id, item->enchantgrade);
+	if (tableswitch == TABLE_INVENTORY)
+		StringBuf_Printf(buf, ", '%d', '%u'", item->favorite, item->equipSwitch);
+	for( j = 0; j < MAX_SLOTS; ++j )
+		StringBuf_Printf(buf, ", '%u'", item->card[j]);
+	for( j = 0; j < MAX_ITEM_RDM_OPT; ++j ) {
+		StringBuf_Printf(buf, ", '%d'", item->option[j].id);
+		StringBuf_Printf(buf, ", '%d'", item->option[j].value);
+		StringBuf_Printf(buf, ", '%d'", item->option[j].param);
+	}
+}
+
+/// Saves an array of 'item' entries into the specified table.
+int char_memitemdata_to_sql(const struct item items[], int max, int id, enum storage_type tableswitch, uint8 stor_id) {
+	StringBuf buf, columns;
+	int i, j;
+	const char *tablename, *selectoption, *printname;
+	bool* flag; // bit array for inventory matching
+	std::vector<struct item> saved; // rows once the changes are written
+	std::vector<int> deleted; // ids of the rows to delete
+	std::vector<size_t> updated; // rows of saved that changed
+	std::vector<int> inserted; // items without a row
+	uint64 key = char_memitemdata_key(id, tableswitch, stor_id);
+
+	switch (tableswitch) {
+		case TABLE_INVENTORY:
+			printname = "Inventory";
+			tablename = schema_config.inventory_db;
+			selectoption = "char_id";
+			break;
+		case TABLE_CART:
+			printname = "Cart";
+			tablename = schema_config.cart_db;
+			selectoption = "char_id";
+			break;
+		case TABLE_STORAGE:
+			printname = inter_premiumStorage_getPrintableName(stor_id);
+			tablename = inter_premiumStorage_getTableName(stor_id);
+			selectoption = "account_id";
+			break;
+		case TABLE_GUILD_STORAGE:
+			printname = "Guild Storage";
+			tablename = schema_config.guild_storage_db;
+			selectoption = "guild_id";
+			break;
+		default:
+			ShowError("Invalid table name!\n");
+			return 1;
+	}
+
+	// The following code compares inventory with the rows last read from or
+	// written to the database, which are kept in memory, and performs
+	// modification/deletion/insertion only on relevant rows.
+	// The rows are only read again after they were dropped from memory.
+	auto cache = char_memitemdata_cache.find(key);
+
+	if (cache == char_memitemdata_cache.end()) {
+		std::vector<struct item> rows;
+
+		if (!char_memitemdata_select(rows, id, tableswitch, tablename, selectoption))
+			return 1;
+		cache = char_memitemdata_cache.emplace(key, std::move(rows)).first;
+	}
+
 	// bit array indicating which inventory items have already been matched
 	flag = (bool*) aCalloc(max, sizeof(bool));
 
-	while( SQL_SUCCESS == SqlStmt_NextRow(stmt) )
-	{
-		found = false;
+	for (const struct item& item : cache->second) {
 		// search for the presence of the item in the char's inventory
 		for( i = 0; i < max; ++i )
 		{
@@ -639,7 +1117,7 @@ int char_memitemdata_to_sql(const struct item items[], int max, int id, enum sto
 				ARR_FIND( 0, MAX_SLOTS, j, items[i].card[j] != item.card[j] );
 				ARR_FIND( 0, MAX_ITEM_RDM_OPT, k, items[i].option[k].id != item.option[k].id || items[i].option[k].value != item.option[k].value || items[i].option[k].param != item.option[k].param );
 				
-				if( j == MAX_SLOTS &&
+				if( !(j == MAX_SLOTS &&
 					k == MAX_ITEM_RDM_OPT &&
 					items[i].amount == item.amount &&
 					items[i].equip == item.equip &&
@@ -649,105 +1127,154 @@ int char_memitemdata_to_sql(const struct item items[], int max, int id, enum sto
 					items[i].expire_time == item.expire_time &&
 					items[i].bound == item.bound &&
 					items[i].enchantgrade == item.enchantgrade &&
-					(tableswitch != TABLE_INVENTORY || (items[i].favorite == item.favorite && items[i].equipSwitch == item.equipSwitch)) )
-				;	//Do nothing.
-				else
-				{
-					// update all fields.
-					StringBuf_Clear(&buf);
-					StringBuf_Printf(&buf, "UPDATE `%s` SET `amount`='%d', `equip`='%u', `identify`='%d', `refine`='%d',`attribute`='%d', `expire_time`='%u', `bound`='%d', `unique_id`='%" PRIu64 "', `enchantgrade`='%d'",
-						tablename, items[i].amount, items[i].equip, items[i].identify, items[i].refine, items[i].attribute, items[i].expire_time, items[i].bound, items[i].unique_id, items[i].enchantgrade);
-					if (tableswitch == TABLE_INVENTORY)
-						StringBuf_Printf(&buf, ", `favorite`='%d', `equip_switch`='%u'", items[i].favorite, items[i].equipSwitch);
-					for( j = 0; j < MAX_SLOTS; ++j )
-						StringBuf_Printf(&buf, ", `card%d`=%u", j, items[i].card[j]);
-					for( j = 0; j < MAX_ITEM_RDM_OPT; ++j ) {
-						StringBuf_Printf(&buf, ", `option_id%d`=%d", j, items[i].option[j].id);
-						StringBuf_Printf(&buf, ", `option_val%d`=%d", j, items[i].option[j].value);
-						StringBuf_Printf(&buf, ", `option_parm%d`=%d", j, items[i].option[j].param);
-					}
-					StringBuf_Printf(&buf, " WHERE `id`='%d' LIMIT 1", item.id);
-
-					if( SQL_ERROR == Sql_QueryStr(sql_handle, StringBuf_Value(&buf)) )
-					{
-						Sql_ShowDebug(sql_handle);
-						errors++;
-					}
-				}
+					(tableswitch != TABLE_INVENTORY || (items[i].favorite == item.favorite && items[i].equipSwitch == item.equipSwitch))) )
+					updated.push_back(saved.size());
 
-				found = flag[i] = true; //Item dealt with,
+				saved.push_back(items[i]);
+				saved.back().id = item.id;
+				flag[i] = true; //Item dealt with,
 				break; //skip to next item in the db.
 			}
 		}
-		if( !found )
-		{// Item not present in inventory, remove it.
-			if( SQL_ERROR == Sql_Query(sql_handle, "DELETE from `%s` where `id`='%d' LIMIT 1", tablename, item.id) )
-			{
-				Sql_ShowDebug(sql_handle);
-				errors++;
-			}
-		}
+		if( i == max ) // Item not present in inventory, remove it.
+			deleted.push_back(item.id);
 	}
-	SqlStmt_Free(stmt);
 
-	StringBuf_Clear(&buf);
-	StringBuf_Printf(&buf, "INSERT INTO `%s`(`%s`, `nameid`, `amount`, `equip`, `identify`, `refine`, `attribute`, `expire_time`, `bound`, `unique_id`, `enchantgrade`", tablename, selectoption);
+	for( i = 0; i < max; ++i ) {
+		// non-matched items are inserted into the db as new items
+		if( items[i].nameid != 0 && !flag[i] )
+			inserted.push_back(i);
+	}
+	aFree(flag);
+
+	if( deleted.empty() && updated.empty() && inserted.empty() )
+		return 0;
+
+	char_save_items(id, tableswitch);
+
+	StringBuf_Init(&buf);
+	StringBuf_Init(&columns);
+
+	StringBuf_Printf(&columns, "`%s`, `nameid`, `amount`, `equip`, `identify`, `refine`, `attribute`, `expire_time`, `bound`, `unique_id`, `enchantgrade`", selectoption);
 	if (tableswitch == TABLE_INVENTORY)
-		StringBuf_Printf(&buf, ", `favorite`, `equip_switch`");
+		StringBuf_Printf(&columns, ", `favorite`, `equip_switch`");
 	for( j = 0; j < MAX_SLOTS; ++j )
-		StringBuf_Printf(&buf, ", `card%d`", j);
+		StringBuf_Printf(&columns, ", `card%d`", j);
 	for( j = 0; j < MAX_ITEM_RDM_OPT; ++j ) {
-		StringBuf_Printf(&buf, ", `option_id%d`", j);
-		StringBuf_Printf(&buf, ", `option_val%d`", j);
-		StringBuf_Printf(&buf, ", `option_parm%d`", j);
+		StringBuf_Printf(&columns, ", `option_id%d`", j);
+		StringBuf_Printf(&columns, ", `option_val%d`", j);
+		StringBuf_Printf(&columns, ", `option_parm%d`", j);
 	}
-	StringBuf_AppendStr(&buf, ") VALUES ");
 
-	found = false;
-	// insert non-matched items into the db as new items
-	for( i = 0; i < max; ++i )
+	// All the changes of an owner are written in a single transaction
+	if( SQL_ERROR == Sql_QueryStr(sql_handle, "START TRANSACTION") )
 	{
-		// skip empty and already matched entries
-		if( items[i].nameid == 0 || flag[i] )
-			continue;
+		Sql_ShowDebug(sql_handle);
+		StringBuf_Destroy(&columns);
+		StringBuf_Destroy(&buf);
+		return 1;
+	}
 
-		if( found )
-			StringBuf_AppendStr(&buf, ",");
-		else
-			found = true;
+	bool success = true;
+
+	if( !deleted.empty() ) {
+		StringBuf_Printf(&buf, "DELETE FROM `%s` WHERE `%s`='%d' AND `id` IN (", tablename, selectoption, id);
+		for( size_t n = 0; n < deleted.size(); ++n )
+			StringBuf_Printf(&buf, "%s'%d'", n ? "," : "", deleted[n]);
+		StringBuf_AppendStr(&buf, ")");
 
-		StringBuf_Printf(&buf, "('%d', '%u', '%d', '%u', '%d', '%d', '%d', '%u', '%d', '%" PRIu64 "', '%d'",
-			id, items[i].nameid, items[i].amount, items[i].equip, items[i].identify, items[i].refine, items[i].attribute, items[i].expire_time, items[i].bound, items[i].unique_id, items[i].enchantgrade);
+		if( SQL_ERROR == Sql_QueryStr(sql_handle, StringBuf_Value(&buf)) ) {
+			Sql_ShowDebug(sql_handle);
+			success = false;
+		}
+	}
+
+	if( success && !updated.empty() ) {
+		// Rewrite the changed rows by id, in a single statement
+		StringBuf_Clear(&buf);
+		StringBuf_Printf(&buf, "INSERT INTO `%s`(`id`, %s) VALUES ", tablename, StringBuf_Value(&columns));
+		for( size_t n = 0; n < updated.size(); ++n ) {
+			const struct item* item = &saved[updated[n]];
+
+			StringBuf_Printf(&buf, "%s('%d', '%d', ", n ? "," : "", item->id, id);
+			char_memitemdata_values(&buf, item, tableswitch);
+			StringBuf_AppendStr(&buf, ")");
+		}
+		StringBuf_AppendStr(&buf, " ON DUPLICATE KEY UPDATE `nameid`=VALUES(`nameid`), `amount`=VALUES(`amount`), `equip`=VALUES(`equip`), `identify`=VALUES(`identify`), `refine`=VALUES(`refine`), `attribute`=VALUES(`attribute`), `expire_time`=VALUES(`expire_time`), `bound`=VALUES(`bound`), `unique_id`=VALUES(`unique_id`), `enchantgrade`=VALUES(`enchantgrade`)");
 		if (tableswitch == TABLE_INVENTORY)
-			StringBuf_Printf(&buf, ", '%d', '%u'", items[i].favorite, items[i].equipSwitch);
+			StringBuf_AppendStr(&buf, ", `favorite`=VALUES(`favorite`), `equip_switch`=VALUES(`equip_switch`)");
 		for( j = 0; j < MAX_SLOTS; ++j )
-			StringBuf_Printf(&buf, ", '%u'", items[i].card[j]);
+			StringBuf_Printf(&buf, ", `card%d`=VALUES(`card%d`)", j, j);
 		for( j = 0; j < MAX_ITEM_RDM_OPT; ++j ) {
-			StringBuf_Printf(&buf, ", '%d'", items[i].option[j].id);
-			StringBuf_Printf(&buf, ", '%d'", items[i].option[j].value);
-			StringBuf_Printf(&buf, ", '%d'", items[i].option[j].param);
+			StringBuf_Printf(&buf, ", `option_id%d`=VALUES(`option_id%d`)", j, j);
+			StringBuf_Printf(&buf, ", `option_val%d`=VALUES(`option_val%d`)", j, j);
+			StringBuf_Printf(&buf, ", `option_parm%d`=VALUES(`option_parm%d`)", j, j);
+		}
+
+		if( SQL_ERROR == Sql_QueryStr(sql_handle, StringBuf_Value(&buf)) ) {
+			Sql_ShowDebug(sql_handle);
+			success = false;
 		}
-		StringBuf_AppendStr(&buf, ")");
 	}
 
-	if( found && SQL_ERROR == Sql_QueryStr(sql_handle, StringBuf_Value(&buf)) )
-	{
+	bool known_ids = true;
+
+	if( success && !inserted.empty() ) {
+		StringBuf_Clear(&buf);
+		StringBuf_Printf(&buf, "INSERT INTO `%s`(%s) VALUES ", tablename, StringBuf_Value(&columns));
+		for( size_t n = 0; n < inserted.size(); ++n ) {
+			StringBuf_Printf(&buf, "%s('%d', ", n ? "," : "", id);
+			char_memitemdata_values(&buf, &items[inserted[n]], tableswitch);
+			StringBuf_AppendStr(&buf, ")");
+		}
+
+		if( SQL_ERROR == Sql_QueryStr(sql_handle, StringBuf_Value(&buf)) ) {
+			Sql_ShowDebug(sql_handle);
+			success = false;
+		}
+		// Fetch the ids of the new rows, they are given in insertion order
+		else if( SQL_ERROR == Sql_Query(sql_handle, "SELECT `id` FROM `%s` WHERE `%s`='%d' AND `id`>=LAST_INSERT_ID() ORDER BY `id`", tablename, selectoption, id) ) {
+			Sql_ShowDebug(sql_handle);
+			known_ids = false;
+		} else {
+			if( Sql_NumRows(sql_handle) != inserted.size() )
+				known_ids = false;
+
+			for( size_t n = 0; n < inserted.size() && SQL_SUCCESS == Sql_NextRow(sql_handle); ++n ) {
+				char* data;
+
+				Sql_GetData(sql_handle, 0, &data, NULL);
+				saved.push_back(items[inserted[n]]);
+				saved.back().id = atoi(data);
+			}
+			Sql_FreeResult(sql_handle);
+		}
+	}
+
+	if( success && SQL_ERROR == Sql_QueryStr(sql_handle, "COMMIT") ) {
 		Sql_ShowDebug(sql_handle);
-		errors++;
+		success = false;
 	}
 
+	if( !success ) {
+		Sql_QueryStr(sql_handle, "ROLLBACK");
+		// Read the rows again on the next save
+		char_memitemdata_cache.erase(cache);
+	} else if( !known_ids )
+		char_memitemdata_cache.erase(cache);
+	else
+		cache->second.swap(saved);
+
 	ShowInfo("Saved %s (%d) data to table %s for %s: %d\n", printname, stor_id, tablename, selectoption, id);
+	StringBuf_Destroy(&columns);
 	StringBuf_Destroy(&buf);
-	aFree(flag);
 
-	return errors;
+	return success ? 0 : 1;
 }
 
 bool char_memitemdata_from_sql(struct s_storage* p, int max, int id, enum storage_type tableswitch, uint8 stor_id) {
-	StringBuf buf;
-	SqlStmt* stmt;
-	int i,j, offset = 0, max2;
-	struct item item, *storage;
+	int i, max2;
+	struct item *storage;
 	const char *tablename, *selectoption, *printname;
 
 	switch (tableswitch) {
@@ -790,69 +1317,19 @@ bool char_memitemdata_from_sql(struct s_storage* p, int max, int id, enum storag
 	p->stor_id = stor_id;
 	p->max_amount = max2;
 
-	stmt = SqlStmt_Malloc(sql_handle);
-	if (stmt == NULL) {
-		SqlStmt_ShowDebug(stmt);
-		return false;
-	}
-
-	StringBuf_Init(&buf);
-	StringBuf_AppendStr(&buf, "SELECT `id`,`nameid`,`amount`,`equip`,`identify`,`refine`,`attribute`,`expire_time`,`bound`,`unique_id`,`enchantgrade`");
-	if (tableswitch == TABLE_INVENTORY) {
-		StringBuf_Printf(&buf, ", `favorite`, `equip_switch`");
-		offset = 2;
-	}
-	for( j = 0; j < MAX_SLOTS; ++j )
-		StringBuf_Printf(&buf, ",`card%d`", j);
-	for( j = 0; j < MAX_ITEM_RDM_OPT; ++j ) {
-		StringBuf_Printf(&buf, ", `option_id%d`", j);
-		StringBuf_Printf(&buf, ", `option_val%d`", j);
-		StringBuf_Printf(&buf, ", `option_parm%d`", j);
-	}
-	StringBuf_Printf(&buf, " FROM `%s` WHERE `%s`=? ORDER BY `nameid`", tablename, selectoption );
+	std::vector<struct item> rows;
 
-	if( SQL_ERROR == SqlStmt_PrepareStr(stmt, StringBuf_Value(&buf))
-		||	SQL_ERROR == SqlStmt_BindParam(stmt, 0, SQLDT_INT, &id, 0)
-		||	SQL_ERROR == SqlStmt_Execute(stmt) )
-	{
-		SqlStmt_ShowDebug(stmt);
-		SqlStmt_Free(stmt);
-		StringBuf_Destroy(&buf);
+	if (!char_memitemdata_select(rows, id, tableswitch, tablename, selectoption))
 		return false;
-	}
-
-	SqlStmt_BindColumn(stmt, 0, SQLDT_INT,          &item.id,        0, NULL, NULL);
-	SqlStmt_BindColumn(stmt, 1, SQLDT_UINT,         &item.nameid,    0, NULL, NULL);
-	SqlStmt_BindColumn(stmt, 2, SQLDT_SHORT,        &item.amount,    0, NULL, NULL);
-	SqlStmt_BindColumn(stmt, 3, SQLDT_UINT,         &item.equip,     0, NULL, NULL);
-	SqlStmt_BindColumn(stmt, 4, SQLDT_CHAR,         &item.identify,  0, NULL, NULL);
-	SqlStmt_BindColumn(stmt, 5, SQLDT_CHAR,         &item.refine,    0, NULL, NULL);
-	SqlStmt_BindColumn(stmt, 6, SQLDT_CHAR,         &item.attribute, 0, NULL, NULL);
-	SqlStmt_BindColumn(stmt, 7, SQLDT_UINT,         &item.expire_time, 0, NULL, NULL);
-	SqlStmt_BindColumn(stmt, 8, SQLDT_CHAR,         &item.bound,     0, NULL, NULL);
-	SqlStmt_BindColumn(stmt, 9, SQLDT_ULONGLONG,    &item.unique_id, 0, NULL, NULL);
-	SqlStmt_BindColumn(stmt,10, SQLDT_INT8,         &item.enchantgrade, 0, NULL, NULL);
-	if (tableswitch == TABLE_INVENTORY){
-		SqlStmt_BindColumn(stmt, 11, SQLDT_CHAR, &item.favorite,    0, NULL, NULL);
-		SqlStmt_BindColumn(stmt, 12, SQLDT_UINT, &item.equipSwitch, 0, NULL, NULL);
-	}
-	for( i = 0; i < MAX_SLOTS; ++i )
-		SqlStmt_BindColumn(stmt, 11+offset+i, SQLDT_UINT, &item.card[i],   0, NULL, NULL);
- 	for( i = 0; i < MAX_ITEM_RDM_OPT; ++i ) {
-		SqlStmt_BindColumn(stmt, 11+offset+MAX_SLOTS+i*3, SQLDT_SHORT, &item.option[i].id, 0, NULL, NULL);
-		SqlStmt_BindColumn(stmt, 12+offset+MAX_SLOTS+i*3, SQLDT_SHORT, &item.option[i].value, 0, NULL, NULL);
-		SqlStmt_BindColumn(stmt, 13+offset+MAX_SLOTS+i*3, SQLDT_CHAR, &item.option[i].param, 0, NULL, NULL);
- 	}
 
-	for( i = 0; i < max && SQL_SUCCESS == SqlStmt_NextRow(stmt); ++i )
-		memcpy(&storage[i], &item, sizeof(item));
+	for( i = 0; i < max && i < (int)rows.size(); ++i )
+		memcpy(&storage[i], &rows[i], sizeof(struct item));
 
 	p->amount = i;
 	ShowInfo("Loaded %s data from table %s for %s: %d (total: %d)\n", printname, tablename, selectoption, id, p->amount);
 
-	SqlStmt_FreeResult(stmt);
-	SqlStmt_Free(stmt);
-	StringBuf_Destroy(&buf);
+	// Keep every row, the ones that did not fit are removed by the next save
+	char_memitemdata_cache[char_memitemdata_key(id, tableswitch, stor_id)].swap(rows);
 
 	return true;
 }
@@ -915,6 +1392,8 @@ int char_mmo_chars_fromsql(struct char_session_data* sd, uint8* buf, uint8* coun
 	char last_map[MAP_NAME_LENGTH_EXT];
 	char sex[2];
 
+	char_mmo_char_flush_account(sd->account_id);
+
 	stmt = SqlStmt_Malloc(sql_handle);
 	if( stmt == NULL ) {
 		SqlStmt_ShowDebug(stmt);
@@ -1048,6 +1527,8 @@ int char_mmo_char_fromsql(uint32 char_id, struct mmo_charstatus* p, bool load_ev
 
 	if (charserv_config.save_log) ShowInfo("Char load request (%d)\n", char_id);
 
+	char_mmo_char_flush(char_id); // read back the queued saves
+
 	stmt = SqlStmt_Malloc(sql_handle);
 	if( stmt == NULL )
 	{
@@ -1272,7 +1753,7 @@ int char_mmo_char_fromsql(uint32 char_id, struct mmo_charstatus* p, bool load_ev
 
 //==========================================================================================================
 int char_mmo_sql_init(void) {
-	char_db_= idb_alloc(DB_OPT_RELEASE_DATA);
+	char_db_= idb_alloc((DBOptions)(DB_OPT_RELEASE_DATA|DB_OPT_OPEN_HASH));
 
 	ShowStatus("Characters per Account: '%d'.\n", charserv_config.char_config.char_per_account);
 
@@ -1557,6 +2038,8 @@ int char_divorce_char_sql(int partner_id1, int partner_id2){
 		Sql_ShowDebug(sql_handle);
 	if( SQL_ERROR == Sql_Query(sql_handle, "DELETE FROM `%s` WHERE (`nameid`='%u' OR `nameid`='%u') AND (`char_id`='%d' OR `char_id`='%d') LIMIT 2", schema_config.inventory_db, WEDDING_RING_M, WEDDING_RING_F, partner_id1, partner_id2) )
 		Sql_ShowDebug(sql_handle);
+	char_memitemdata_cache_remove(partner_id1, TABLE_INVENTORY, 0);
+	char_memitemdata_cache_remove(partner_id2, TABLE_INVENTORY, 0);
 	chmapif_send_ackdivorce(partner_id1, partner_id2);
 	return 0;
 }
@@ -1585,6 +2068,8 @@ enum e_char_del_response char_delete(struct char_session_data* sd, uint32 char_i
 		return CHAR_DELETE_NOTFOUND;
 	}
 
+	char_mmo_char_flush(char_id);
+
 	if (SQL_ERROR == Sql_Query(sql_handle, "SELECT `name`,`account_id`,`party_id`,`guild_id`,`base_level`,`homun_id`,`partner_id`,`father`,`mother`,`elemental_id`,`delete_date` FROM `%s` WHERE `account_id`='%u' AND `char_id`='%u'", schema_config.char_db, sd->account_id, char_id)){
 		Sql_ShowDebug(sql_handle);
 		return CHAR_DELETE_DATABASE;
@@ -1707,6 +2192,9 @@ enum e_char_del_response char_delete(struct char_session_data* sd, uint32 char_i
 	if( SQL_ERROR == Sql_Query(sql_handle, "DELETE FROM `%s` WHERE `char_id`='%d'", schema_config.cart_db, char_id) )
 		Sql_ShowDebug(sql_handle);
 
+	char_memitemdata_cache_remove(char_id, TABLE_INVENTORY, 0);
+	char_memitemdata_cache_remove(char_id, TABLE_CART, 0);
+
 	/* delete memo areas */
 	if( SQL_ERROR == Sql_Query(sql_handle, "DELETE FROM `%s` WHERE `char_id`='%d'", schema_config.memo_db, char_id) )
 		Sql_ShowDebug(sql_handle);
@@ -2753,6 +3241,9 @@ void char_set_defaults(){
 	safestrncpy(charserv_config.char_config.char_name_letters,"",sizeof(charserv_config.char_config.char_name_letters)); // list of letters/symbols allowed (or not) in a character name. by [Yor]
 
 	charserv_config.save_log = 1; // show loading/saving messages
+	charserv_config.save_write_behind = false;
+	charserv_config.save_write_behind_delay = 1000;
+	charserv_config.save_workers = 2;
 	charserv_config.log_char = 1;	// loggin char or not [devil]
 	charserv_config.log_inter = 1;	// loggin inter or not [devil]
 	charserv_config.char_check_db =1;
@@ -2985,6 +3476,12 @@ bool char_config_read(const char* cfgName, bool normal){
 				charserv_config.autosave_interval = DEFAULT_AUTOSAVE_INTERVAL;
 		} else if (strcmpi(w1, "save_log") == 0) {
 			charserv_config.save_log = config_switch(w2);
+		} else if (strcmpi(w1, "save_write_behind") == 0) {
+			charserv_config.save_write_behind = config_switch(w2) != 0;
+		} else if (strcmpi(w1, "save_write_behind_delay") == 0) {
+			charserv_config.save_write_behind_delay = cap_value(atoi(w2), 0, 60000);
+		} else if (strcmpi(w1, "save_workers") == 0) {
+			charserv_config.save_workers = cap_value(atoi(w2), 1, 16);
 #ifdef RENEWAL
 		} else if (strcmpi(w1, "start_point") == 0) {
 #else
@@ -3134,6 +3631,7 @@ void do_final(void)
 
 	char_set_all_offline(-1);
 	char_set_all_offline_sql();
+	bool saved = char_save_final();
 
 	inter_final();
 
@@ -3156,7 +3654,10 @@ void do_final(void)
 	Sql_Free(sql_handle);
 	mapindex_final();
 
-	ShowStatus("Finished.\n");
+	if( saved )
+		ShowStatus("Finished.\n");
+	else
+		ShowError("Finished, but some character saves couldn't be written.\n");
 }
 
 
@@ -3222,8 +3723,9 @@ int do_init(int argc, char **argv)
 	inter_init_sql((argc > 2) ? argv[2] : SQL_CONF_NAME); // inter server configuration
 
 	auth_db = idb_alloc(DB_OPT_RELEASE_DATA);
-	online_char_db = idb_alloc(DB_OPT_RELEASE_DATA);
+	online_char_db = idb_alloc((DBOptions)(DB_OPT_RELEASE_DATA|DB_OPT_OPEN_HASH));
 	char_mmo_sql_init();
+	char_save_init();
 	char_read_fame_list(); //Read fame lists.
 
 	if ((naddr_ != 0) && (!(charserv_config.login_ip) || !(charserv_config.char_ip) ))
@@ -168,6 +168,9 @@ struct CharServ_Config {
 #endif
 
 	int save_log; // show loading/saving messages
+	bool save_write_behind; // queue the saves and write them on background connections
+	int save_write_behind_delay; // milliseconds a queued save may wait to be written
+	int save_workers; // background connections writing the queued saves
 	int log_char;	// loggin char or not [devil]
 	int log_inter;	// loggin inter or not [devil]
 	int char_check_db;	///cheking sql-table at begining ?
@@ -289,6 +292,9 @@ TIMER_FUNC(char_chardb_waiting_disconnect);
 int char_mmo_gender(const struct char_session_data *sd, const struct mmo_charstatus *p, char sex);
 int char_mmo_char_tobuf(uint8* buffer, struct mmo_charstatus* p);
 int char_mmo_char_tosql(uint32 char_id, struct mmo_charstatus* p);
+int char_mmo_char_queue(uint32 char_id, struct mmo_charstatus* p, bool flush);
+void char_mmo_char_flush(uint32 char_id);
+void char_mmo_char_flush_account(uint32 account_id);
 int char_mmo_char_fromsql(uint32 char_id, struct mmo_charstatus* p, bool load_everything);
 int char_mmo_chars_fromsql(struct char_session_data* sd, uint8* buf, uint8* count = nullptr);
 enum e_char_del_response char_delete(struct char_session_data* sd, uint32 char_id);
@@ -296,6 +302,7 @@ int char_rename_char_sql(struct char_session_data *sd, uint32 char_id);
 int char_divorce_char_sql(int partner_id1, int partner_id2);
 int char_memitemdata_to_sql(const struct item items[], int max, int id, enum storage_type tableswitch, uint8 stor_id);
 bool char_memitemdata_from_sql(struct s_storage* p, int max, int id, enum storage_type tableswitch, uint8 stor_id);
+void char_memitemdata_cache_remove(int id, enum storage_type tableswitch, uint8 stor_id);
 
 int char_married(int pl1,int pl2);
 int char_child(int parent_id, int child_id);
@@ -409,7 +409,10 @@ int chmapif_parse_reqsavechar(int fd, int id){
 		{
 			struct mmo_charstatus char_dat;
 			memcpy(&char_dat, RFIFOP(fd,13), sizeof(struct mmo_charstatus));
-			char_mmo_char_tosql(cid, &char_dat);
+			if (RFIFOB(fd,12)) // final save, wait until it is written before acknowledging it
+				char_mmo_char_tosql(cid, &char_dat);
+			else
+				char_mmo_char_queue(cid, &char_dat, false);
 		} else {	//This may be valid on char-server reconnection, when re-sending characters that already logged off.
 			ShowError("parse_from_map (save-char): Received data for non-existant/offline character (%d:%d).\n", aid, cid);
 			char_set_char_online(id, cid, aid);
@@ -43,14 +43,26 @@ bool mercenary_owner_fromsql(uint32 char_id, struct mmo_charstatus *status)
 	return true;
 }
 
+/// Builds the statement that saves the mercenary owner data of a character.
+void mercenary_owner_tosql_statement(StringBuf* buf, uint32 char_id, struct mmo_charstatus *status)
+{
+	StringBuf_Printf(buf, "REPLACE INTO `%s` (`char_id`, `merc_id`, `arch_calls`, `arch_faith`, `spear_calls`, `spear_faith`, `sword_calls`, `sword_faith`) VALUES ('%d', '%d', '%d', '%d', '%d', '%d', '%d', '%d')",
+		schema_config.mercenary_owner_db, char_id, status->mer_id, status->arch_calls, status->arch_faith, status->spear_calls, status->spear_faith, status->sword_calls, status->sword_faith);
+}
+
 bool mercenary_owner_tosql(uint32 char_id, struct mmo_charstatus *status)
 {
-	if( SQL_ERROR == Sql_Query(sql_handle, "REPLACE INTO `%s` (`char_id`, `merc_id`, `arch_calls`, `arch_faith`, `spear_calls`, `spear_faith`, `sword_calls`, `sword_faith`) VALUES ('%d', '%d', '%d', '%d', '%d', '%d', '%d', '%d')",
-		schema_config.mercenary_owner_db, char_id, status->mer_id, status->arch_calls, status->arch_faith, status->spear_calls, status->spear_faith, status->sword_calls, status->sword_faith) )
+	StringBuf buf;
+
+	StringBuf_Init(&buf);
+	mercenary_owner_tosql_statement(&buf, char_id, status);
+	if( SQL_ERROR == Sql_QueryStr(sql_handle, StringBuf_Value(&buf)) )
 	{
 		Sql_ShowDebug(sql_handle);
+		StringBuf_Destroy(&buf);
 		return false;
 	}
+	StringBuf_Destroy(&buf);
 
 	return true;
 }
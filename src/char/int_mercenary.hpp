@@ -5,6 +5,7 @@
 #define INT_MERCENARY_HPP
 
 #include "../common/cbasetypes.hpp"
+#include "../common/strlib.hpp" // StringBuf
 
 int inter_mercenary_sql_init(void);
 void inter_mercenary_sql_final(void);
@@ -12,6 +13,7 @@ int inter_mercenary_parse_frommap(int fd);
 
 // Mercenary Owner Database
 bool mercenary_owner_fromsql(uint32 char_id, struct mmo_charstatus *status);
+void mercenary_owner_tosql_statement(StringBuf* buf, uint32 char_id, struct mmo_charstatus *status);
 bool mercenary_owner_tosql(uint32 char_id, struct mmo_charstatus *status);
 bool mercenary_owner_delete(uint32 char_id);
 
@@ -399,6 +399,7 @@ bool mapif_parse_itembound_retrieve(int fd)
 		mapif_itembound_ack(fd,account_id,guild_id);
 		return true;
 	}
+	char_memitemdata_cache_remove(char_id, TABLE_INVENTORY, 0);
 
 	// Send the deleted items to map-server to store them in guild storage [Cydh]
 	mapif_itembound_store2gstorage(fd, guild_id, items, count);
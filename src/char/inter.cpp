@@ -1004,6 +1004,26 @@ int inter_init_sql(const char *file)
 	return 0;
 }
 
+/**
+ * Opens a pool of background connections to the character database
+ * @param connections: Number of connections, each served by its own thread
+ * @return Connected pool or NULL on failure
+ */
+SqlAsync* inter_sql_async_connect(size_t connections)
+{
+	SqlAsync* pool = SqlAsync_Malloc();
+
+	if( SQL_ERROR == SqlAsync_Connect(pool, connections, char_server_id, char_server_pw, char_server_ip, (uint16)char_server_port, char_server_db, default_codepage) )
+	{
+		ShowError("Couldn't open background connections with username = '%s', password = '%s', host = '%s', port = '%d', database = '%s'\n",
+			char_server_id, char_server_pw, char_server_ip, char_server_port, char_server_db);
+		SqlAsync_Free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
 // finalize
 void inter_final(void)
 {
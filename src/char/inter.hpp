@@ -27,6 +27,7 @@ public:
 extern InterServerDatabase interServerDb;
 
 int inter_init_sql(const char *file);
+SqlAsync* inter_sql_async_connect(size_t connections);
 void inter_final(void);
 int inter_parse_frommap(int fd);
 int inter_mapif_init(int fd);
@@ -379,6 +379,7 @@ int main (int argc, char **argv)
 	// Main runtime cycle
 	while (runflag != CORE_ST_STOP) { 
 		t_tick next = do_timer(gettick_nocache());
+		next = Sql_AsyncPoll(next);
 		do_sockets(next);
 	}
 
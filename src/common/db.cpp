@@ -10,6 +10,8 @@
  *  (5) Public functions
  *
  *  The databases are structured as a hashtable of RED-BLACK trees.
+ *  Databases created with DB_OPT_OPEN_HASH keep their entries in blocks
+ *  instead, indexed by a resizable open addressing hashtable.
  *
  *  <B>Properties of the RED-BLACK trees being used:</B>
  *  1. The value of any node is greater than the value of its left child and
@@ -47,6 +49,7 @@
  *  - create a db that organizes itself by splaying
  *
  *  HISTORY:
+ *    2026/10/18 - Added the open addressing mode (DB_OPT_OPEN_HASH).
  *    2013/08/25 - Added int64/uint64 support for keys [Ind/Hercules]
  *    2013/04/27 - Added ERS to speed up iterator memory allocation [Ind/Hercules]
  *    2012/03/09 - Added enum for data types (int, uint, void*)
@@ -87,6 +90,9 @@
  *  DBNColor        - Enumeration of colors of the nodes.                    *
  *  DBNode          - Structure of a node in RED-BLACK trees.                *
  *  struct db_free  - Structure that holds a deleted node to be freed.       *
+ *  DB_HASH_BLOCK   - Define with the number of entries in an entry block.   *
+ *  struct db_hash_entry - Structure of an entry in open addressing mode.    *
+ *  struct db_hash_slot  - Structure of a slot of the open addressing index. *
  *  DBMap_impl      - Structure of the database.                             *
  *  stats           - Statistics about the database system.                  *
 \*****************************************************************************/
@@ -157,6 +163,71 @@ struct db_free {
 	DBNode **root;
 };
 
+/**
+ * Number of entries allocated at once in open addressing mode.
+ * Entries are never moved, so the data pointers returned by the database
+ * stay valid while the index grows.
+ * @private
+ * @see DBMap_impl#blocks
+ */
+#define DB_HASH_BLOCK_BITS 6
+#define DB_HASH_BLOCK (1<<DB_HASH_BLOCK_BITS)
+
+/**
+ * Marks an empty index slot and the end of the entry lists.
+ * @private
+ */
+#define DB_HASH_NONE UINT32_MAX
+
+/**
+ * Minimum capacity of the open addressing index, has to be a power of two.
+ * @private
+ */
+#define DB_HASH_MIN_SLOTS 16
+
+/**
+ * State of an entry in open addressing mode.
+ * @private
+ * @see struct db_hash_entry
+ */
+enum db_hash_state : uint8 {
+	DB_HASH_FREE,
+	DB_HASH_USED,
+	DB_HASH_DELETED,
+};
+
+/**
+ * An entry of a database in open addressing mode.
+ * @param key Key of this database entry
+ * @param data Data of this database entry
+ * @param hash Hash of the key
+ * @param next Next entry in the free or deleted list
+ * @param state State of the entry
+ * @private
+ * @see DBMap_impl#blocks
+ */
+struct db_hash_entry {
+	DBKey key;
+	DBData data;
+	uint32 hash;
+	uint32 next;
+	enum db_hash_state state;
+};
+
+/**
+ * A slot of the open addressing index.
+ * The full hash is kept in the slot to skip comparing keys and to get the
+ * probe distance without touching the entry.
+ * @param entry Index of the entry or DB_HASH_NONE if the slot is empty
+ * @param hash Hash of the key of the entry
+ * @private
+ * @see DBMap_impl#slots
+ */
+struct db_hash_slot {
+	uint32 entry;
+	uint32 hash;
+};
+
 /**
  * Complete database structure.
  * @param vtable Interface of the database
@@ -171,6 +242,13 @@ struct db_free {
  * @param hash Hasher of the database
  * @param release Releaser of the database
  * @param ht Hashtable of RED-BLACK trees
+ * @param cache Last accessed node
+ * @param blocks Blocks of entries in open addressing mode
+ * @param slots Robin Hood index of the entries in open addressing mode
+ * @param slot_mask Capacity of slots minus one, 0 if slots isn't allocated
+ * @param entry_count Number of entries allocated in blocks
+ * @param entry_free First entry that can be reused
+ * @param entry_deleted First entry deleted while the database was locked
  * @param type Type of the database
  * @param options Options of the database
  * @param item_count Number of items in the database
@@ -197,6 +275,13 @@ typedef struct DBMap_impl {
 	DBReleaser release;
 	DBNode *ht[HASH_SIZE];
 	DBNode *cache;
+	// Open addressing mode (DB_OPT_OPEN_HASH)
+	struct db_hash_entry **blocks;
+	struct db_hash_slot *slots;
+	uint32 slot_mask;
+	uint32 entry_count;
+	uint32 entry_free;
+	uint32 entry_deleted;
 	DBType type;
 	DBOptions options;
 	uint32 item_count;
@@ -208,7 +293,8 @@ typedef struct DBMap_impl {
  * Complete iterator structure.
  * @param vtable Interface of the iterator
  * @param db Parent database
- * @param ht_index Current index of the hashtable
+ * @param ht_index Current index of the hashtable or current entry in open
+ *          addressing mode
  * @param node Current node
  * @private
  * @see #DBIterator
@@ -346,6 +432,10 @@ struct eri *db_alloc_ers;
  *  db_is_key_null     - Returns not 0 if the key is considered NULL.        *
  *  db_dup_key         - Duplicate a key for internal use.                   *
  *  db_dup_key_free    - Free the duplicated key.                            *
+ *  db_hash_find       - Look for a key in the open addressing index.        *
+ *  db_hash_grow       - Make room in the open addressing index.             *
+ *  db_hash_delete     - Remove an entry in open addressing mode.            *
+ *  db_hash_free_deleted - Free the entries deleted while locked.            *
  *  db_free_add        - Add a node to the free_list of a database.          *
  *  db_free_remove     - Remove a node from the free_list of a database.     *
  *  db_free_lock       - Increment the free_lock of a database.              *
@@ -695,6 +785,239 @@ static void db_dup_key_free(DBMap_impl* db, DBKey key)
 	}
 }
 
+/**
+ * Returns the entry with the specified index in open addressing mode.
+ * @param db Target database
+ * @param id Index of the entry
+ * @return Entry
+ * @private
+ * @see DBMap_impl#blocks
+ */
+static inline struct db_hash_entry* db_hash_entry_get(DBMap_impl* db, uint32 id)
+{
+	return &db->blocks[id>>DB_HASH_BLOCK_BITS][id&(DB_HASH_BLOCK-1)];
+}
+
+/**
+ * Hashes a key for the open addressing index.
+ * The hashers of the integer types return the key itself, so the result is
+ * mixed to spread consecutive ids over the whole index.
+ * @param db Target database
+ * @param key Key to be hashed
+ * @return Hash of the key
+ * @private
+ */
+static uint32 db_hash_key(DBMap_impl* db, DBKey key)
+{
+	uint64 hash = db->hash(key, db->maxlen);
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return (uint32)hash;
+}
+
+/**
+ * Returns the distance of a slot to the slot its hash points to.
+ * @param db Target database
+ * @param pos Position of the slot
+ * @return Probe distance
+ * @private
+ */
+static inline uint32 db_hash_distance(DBMap_impl* db, uint32 pos)
+{
+	return (pos - db->slots[pos].hash)&db->slot_mask;
+}
+
+/**
+ * Looks for the slot of a key in the open addressing index.
+ * Entries that were deleted are not in the index anymore.
+ * @param db Target database
+ * @param key Key of the entry
+ * @param hash Hash of the key
+ * @return Position of the slot or DB_HASH_NONE if not found
+ * @private
+ */
+static uint32 db_hash_find(DBMap_impl* db, DBKey key, uint32 hash)
+{
+	uint32 pos, dist;
+
+	if (db->slots == NULL)
+		return DB_HASH_NONE;
+	for (pos = hash&db->slot_mask, dist = 0; ; pos = (pos+1)&db->slot_mask, dist++) {
+		struct db_hash_slot *slot = &db->slots[pos];
+
+		if (slot->entry == DB_HASH_NONE)
+			return DB_HASH_NONE;
+		if (db_hash_distance(db, pos) < dist)
+			return DB_HASH_NONE; // the key would have been placed here
+		if (slot->hash == hash && db->cmp(key, db_hash_entry_get(db, slot->entry)->key, db->maxlen) == 0)
+			return pos;
+	}
+}
+
+/**
+ * Puts an entry in the open addressing index.
+ * Slots closer to their home are taken over by the entry being inserted
+ * (Robin Hood hashing), which keeps the probe sequences short.
+ * NOTE: The index must have at least one empty slot.
+ * @param db Target database
+ * @param entry Index of the entry
+ * @param hash Hash of the key of the entry
+ * @private
+ */
+static void db_hash_insert_slot(DBMap_impl* db, uint32 entry, uint32 hash)
+{
+	struct db_hash_slot cur;
+	uint32 pos, dist;
+
+	cur.entry = entry;
+	cur.hash = hash;
+	for (pos = hash&db->slot_mask, dist = 0; ; pos = (pos+1)&db->slot_mask, dist++) {
+		struct db_hash_slot *slot = &db->slots[pos];
+		uint32 slot_dist;
+
+		if (slot->entry == DB_HASH_NONE) {
+			*slot = cur;
+			return;
+		}
+		slot_dist = db_hash_distance(db, pos);
+		if (slot_dist < dist) {
+			struct db_hash_slot tmp = *slot;
+
+			*slot = cur;
+			cur = tmp;
+			dist = slot_dist;
+		}
+	}
+}
+
+/**
+ * Removes a slot from the open addressing index.
+ * The following slots are shifted back, so no tombstones are needed.
+ * @param db Target database
+ * @param pos Position of the slot
+ * @private
+ */
+static void db_hash_erase_slot(DBMap_impl* db, uint32 pos)
+{
+	for (;;) {
+		uint32 next = (pos+1)&db->slot_mask;
+
+		if (db->slots[next].entry == DB_HASH_NONE || db_hash_distance(db, next) == 0) {
+			db->slots[pos].entry = DB_HASH_NONE;
+			return;
+		}
+		db->slots[pos] = db->slots[next];
+		pos = next;
+	}
+}
+
+/**
+ * Makes sure the open addressing index has room for one more entry.
+ * The index is doubled when it would be more than 7/8 full.
+ * @param db Target database
+ * @private
+ */
+static void db_hash_grow(DBMap_impl* db)
+{
+	struct db_hash_slot *old_slots = db->slots;
+	uint32 old_capacity = (old_slots ? db->slot_mask+1 : 0);
+	uint32 capacity, i;
+
+	if (old_slots && (uint64)(db->item_count+1)*8 <= (uint64)old_capacity*7)
+		return;
+
+	capacity = (old_slots ? old_capacity*2 : DB_HASH_MIN_SLOTS);
+	CREATE(db->slots, struct db_hash_slot, capacity);
+	for (i = 0; i < capacity; i++)
+		db->slots[i].entry = DB_HASH_NONE;
+	db->slot_mask = capacity-1;
+	for (i = 0; i < old_capacity; i++) {
+		if (old_slots[i].entry != DB_HASH_NONE)
+			db_hash_insert_slot(db, old_slots[i].entry, old_slots[i].hash);
+	}
+	aFree(old_slots);
+}
+
+/**
+ * Gets an unused entry in open addressing mode.
+ * Reuses freed entries before allocating a new block.
+ * @param db Target database
+ * @return Index of the entry
+ * @private
+ */
+static uint32 db_hash_alloc_entry(DBMap_impl* db)
+{
+	uint32 id;
+
+	DB_COUNTSTAT(db_node_alloc);
+	if (db->entry_free != DB_HASH_NONE) {
+		id = db->entry_free;
+		db->entry_free = db_hash_entry_get(db, id)->next;
+		return id;
+	}
+	if ((db->entry_count&(DB_HASH_BLOCK-1)) == 0) { // all blocks are full
+		uint32 block = db->entry_count>>DB_HASH_BLOCK_BITS;
+
+		RECREATE(db->blocks, struct db_hash_entry*, block+1);
+		CREATE(db->blocks[block], struct db_hash_entry, DB_HASH_BLOCK);
+	}
+	return db->entry_count++;
+}
+
+/**
+ * Removes the entry of a slot in open addressing mode.
+ * The entry leaves the index at once, but is only reused after the database
+ * is unlocked, so iterators and pointers to its data stay valid until then.
+ * If the key isn't duplicated, the key is duplicated and released.
+ * @param db Target database
+ * @param pos Position of the slot
+ * @private
+ * @see #db_hash_free_deleted(DBMap_impl*)
+ */
+static void db_hash_delete(DBMap_impl* db, uint32 pos)
+{
+	uint32 id = db->slots[pos].entry;
+	struct db_hash_entry *entry = db_hash_entry_get(db, id);
+
+	DB_COUNTSTAT(db_free_add);
+	db_hash_erase_slot(db, pos);
+	if (!(db->options&DB_OPT_DUP_KEY)) { // Make sure we have a key until the entry is freed
+		DBKey old_key = entry->key;
+		entry->key = db_dup_key(db, entry->key);
+		db->release(old_key, entry->data, DB_RELEASE_KEY);
+	}
+	entry->state = DB_HASH_DELETED;
+	entry->next = db->entry_deleted;
+	db->entry_deleted = id;
+	db->item_count--;
+}
+
+/**
+ * Frees the entries deleted while the database was locked.
+ * NOTE: Frees the duplicated keys of the entries
+ * @param db Target database
+ * @private
+ * @see #db_free_unlock(DBMap_impl*)
+ */
+static void db_hash_free_deleted(DBMap_impl* db)
+{
+	while (db->entry_deleted != DB_HASH_NONE) {
+		uint32 id = db->entry_deleted;
+		struct db_hash_entry *entry = db_hash_entry_get(db, id);
+
+		db->entry_deleted = entry->next;
+		db_dup_key_free(db, entry->key);
+		DB_COUNTSTAT(db_node_free);
+		entry->state = DB_HASH_FREE;
+		entry->next = db->entry_free;
+		db->entry_free = id;
+	}
+}
+
 /**
  * Add a node to the free_list of the database.
  * Marks the node as deleted.
@@ -826,6 +1149,10 @@ static void db_free_unlock(DBMap_impl* db)
 	if (db->free_lock)
 		return; // Not last lock
 
+	if (db->options&DB_OPT_OPEN_HASH) {
+		db_hash_free_deleted(db);
+		return;
+	}
 	for (i = 0; i < db->free_count ; i++) {
 		db_rebalance_erase(db->free_list[i].node, db->free_list[i].root);
 		db_dup_key_free(db, db->free_list[i].node->key);
@@ -1212,6 +1539,7 @@ static void db_release_both(DBKey key, DBData data, DBRelease which)
  *  db_obj_size     - Return the size of the database.                       *
  *  db_obj_type     - Return the type of the database.                       *
  *  db_obj_options  - Return the options of the database.                    *
+ *  dbit_hash_*, db_hash_* - Versions for the open addressing mode.           *
 \*****************************************************************************/
 
 /**
@@ -2235,7 +2563,8 @@ static int db_obj_vdestroy(DBMap* self, DBApply func, va_list args)
 	aFree(db->free_list);
 	db->free_list = NULL;
 	db->free_max = 0;
-	ers_destroy(db->nodes);
+	if (db->nodes)
+		ers_destroy(db->nodes);
 	db_free_unlock(db);
 	ers_free(db_alloc_ers, db);
 	return sum;
@@ -2340,6 +2669,521 @@ static DBOptions db_obj_options(DBMap* self)
 	return options;
 }
 
+/**
+ * Fetches the first entry in a database in open addressing mode.
+ * @param self Iterator
+ * @param out_key Key of the entry
+ * @return Data of the entry
+ * @protected
+ * @see DBIterator#first
+ */
+static DBData* dbit_hash_first(DBIterator* self, DBKey* out_key)
+{
+	DBIterator_impl* it = (DBIterator_impl*)self;
+
+	DB_COUNTSTAT(dbit_first);
+	// position before the first entry
+	it->ht_index = -1;
+	return self->next(self, out_key);
+}
+
+/**
+ * Fetches the last entry in a database in open addressing mode.
+ * @param self Iterator
+ * @param out_key Key of the entry
+ * @return Data of the entry
+ * @protected
+ * @see DBIterator#last
+ */
+static DBData* dbit_hash_last(DBIterator* self, DBKey* out_key)
+{
+	DBIterator_impl* it = (DBIterator_impl*)self;
+
+	DB_COUNTSTAT(dbit_last);
+	// position after the last entry
+	it->ht_index = (int)it->db->entry_count;
+	return self->prev(self, out_key);
+}
+
+/**
+ * Fetches the next entry in a database in open addressing mode.
+ * The entries are visited in the order of their position in the blocks.
+ * @param self Iterator
+ * @param out_key Key of the entry
+ * @return Data of the entry
+ * @protected
+ * @see DBIterator#next
+ */
+static DBData* dbit_hash_next(DBIterator* self, DBKey* out_key)
+{
+	DBIterator_impl* it = (DBIterator_impl*)self;
+	DBMap_impl* db = it->db;
+	int64 i;
+
+	DB_COUNTSTAT(dbit_next);
+	for (i = (int64)it->ht_index+1; i < (int64)db->entry_count; i++) {
+		struct db_hash_entry *entry = db_hash_entry_get(db, (uint32)i);
+
+		if (entry->state == DB_HASH_USED) { // found next entry
+			it->ht_index = (int)i;
+			if (out_key)
+				memcpy(out_key, &entry->key, sizeof(DBKey));
+			return &entry->data;
+		}
+	}
+	it->ht_index = (int)db->entry_count;
+	return NULL; // not found
+}
+
+/**
+ * Fetches the previous entry in a database in open addressing mode.
+ * @param self Iterator
+ * @param out_key Key of the entry
+ * @return Data of the entry
+ * @protected
+ * @see DBIterator#prev
+ */
+static DBData* dbit_hash_prev(DBIterator* self, DBKey* out_key)
+{
+	DBIterator_impl* it = (DBIterator_impl*)self;
+	DBMap_impl* db = it->db;
+	int64 i;
+
+	DB_COUNTSTAT(dbit_prev);
+	for (i = min((int64)it->ht_index, (int64)db->entry_count)-1; i >= 0; i--) {
+		struct db_hash_entry *entry = db_hash_entry_get(db, (uint32)i);
+
+		if (entry->state == DB_HASH_USED) { // found previous entry
+			it->ht_index = (int)i;
+			if (out_key)
+				memcpy(out_key, &entry->key, sizeof(DBKey));
+			return &entry->data;
+		}
+	}
+	it->ht_index = -1;
+	return NULL; // not found
+}
+
+/**
+ * Returns true if the fetched entry exists in open addressing mode.
+ * @param self Iterator
+ * @return true if the entry exists
+ * @protected
+ * @see DBIterator#exists
+ */
+static bool dbit_hash_exists(DBIterator* self)
+{
+	DBIterator_impl* it = (DBIterator_impl*)self;
+
+	DB_COUNTSTAT(dbit_exists);
+	return (it->ht_index >= 0 && (uint32)it->ht_index < it->db->entry_count && db_hash_entry_get(it->db, it->ht_index)->state == DB_HASH_USED);
+}
+
+/**
+ * Removes the current entry from a database in open addressing mode.
+ * @param self Iterator
+ * @param out_data Data of the removed entry.
+ * @return 1 if entry was removed, 0 otherwise
+ * @protected
+ * @see DBIterator#remove
+ */
+static int dbit_hash_remove(DBIterator* self, DBData *out_data)
+{
+	DBIterator_impl* it = (DBIterator_impl*)self;
+	DBMap_impl* db = it->db;
+	struct db_hash_entry *entry;
+
+	DB_COUNTSTAT(dbit_remove);
+	if (!self->exists(self))
+		return 0;
+	entry = db_hash_entry_get(db, it->ht_index);
+	db->release(entry->key, entry->data, DB_RELEASE_DATA);
+	if (out_data)
+		memcpy(out_data, &entry->data, sizeof(DBData));
+	db_hash_delete(db, db_hash_find(db, entry->key, entry->hash));
+	return 1;
+}
+
+/**
+ * Returns a new iterator for a database in open addressing mode.
+ * @param self Database
+ * @return New iterator
+ * @protected
+ * @see #db_obj_iterator(DBMap*)
+ */
+static DBIterator* db_hash_iterator(DBMap* self)
+{
+	DBIterator* iter = db_obj_iterator(self);
+
+	iter->first  = dbit_hash_first;
+	iter->last   = dbit_hash_last;
+	iter->next   = dbit_hash_next;
+	iter->prev   = dbit_hash_prev;
+	iter->exists = dbit_hash_exists;
+	iter->remove = dbit_hash_remove;
+	return iter;
+}
+
+/**
+ * Returns true if the entry exists in a database in open addressing mode.
+ * @param self Interface of the database
+ * @param key Key that identifies the entry
+ * @return true is the entry exists
+ * @protected
+ * @see DBMap#exists
+ */
+static bool db_hash_exists(DBMap* self, DBKey key)
+{
+	DBMap_impl* db = (DBMap_impl*)self;
+
+	DB_COUNTSTAT(db_exists);
+	if (db == NULL) return false; // nullpo candidate
+	if (!(db->options&DB_OPT_ALLOW_NULL_KEY) && db_is_key_null(db->type, key)) {
+		return false; // nullpo candidate
+	}
+	return (db_hash_find(db, key, db_hash_key(db, key)) != DB_HASH_NONE);
+}
+
+/**
+ * Get the data of the entry identified by the key in a database in open
+ * addressing mode.
+ * @param self Interface of the database
+ * @param key Key that identifies the entry
+ * @return Data of the entry or NULL if not found
+ * @protected
+ * @see DBMap#get
+ */
+static DBData* db_hash_get(DBMap* self, DBKey key)
+{
+	DBMap_impl* db = (DBMap_impl*)self;
+	uint32 pos;
+
+	DB_COUNTSTAT(db_get);
+	if (db == NULL) return NULL; // nullpo candidate
+	if (!(db->options&DB_OPT_ALLOW_NULL_KEY) && db_is_key_null(db->type, key)) {
+		ShowError("db_get: Attempted to retrieve non-allowed NULL key for db allocated at %s:%d\n",db->alloc_file, db->alloc_line);
+		return NULL; // nullpo candidate
+	}
+
+	pos = db_hash_find(db, key, db_hash_key(db, key));
+	if (pos == DB_HASH_NONE)
+		return NULL;
+	return &db_hash_entry_get(db, db->slots[pos].entry)->data;
+}
+
+/**
+ * Get the data of the entries matched by <code>match</code> in a database in
+ * open addressing mode.
+ * @param self Interface of the database
+ * @param buf Buffer to put the data of the matched entries
+ * @param max Maximum number of data entries to be put into buf
+ * @param match Function that matches the database entries
+ * @param args Extra arguments for match
+ * @return The number of entries that matched
+ * @protected
+ * @see DBMap#vgetall
+ */
+static unsigned int db_hash_vgetall(DBMap* self, DBData **buf, unsigned int max, DBMatcher match, va_list args)
+{
+	DBMap_impl* db = (DBMap_impl*)self;
+	unsigned int ret = 0;
+	uint32 i;
+
+	DB_COUNTSTAT(db_vgetall);
+	if (db == NULL) return 0; // nullpo candidate
+	if (match == NULL) return 0; // nullpo candidate
+
+	db_free_lock(db);
+	for (i = 0; i < db->entry_count; i++) {
+		struct db_hash_entry *entry = db_hash_entry_get(db, i);
+		va_list argscopy;
+
+		if (entry->state != DB_HASH_USED)
+			continue;
+		va_copy(argscopy, args);
+		if (match(entry->key, entry->data, argscopy) == 0) {
+			if (buf && ret < max)
+				buf[ret] = &entry->data;
+			ret++;
+		}
+		va_end(argscopy);
+	}
+	db_free_unlock(db);
+	return ret;
+}
+
+/**
+ * Get the data of the entry identified by the key in a database in open
+ * addressing mode, creating it if it doesn't exist yet.
+ * @param self Interface of the database
+ * @param key Key that identifies the entry
+ * @param create Function used to create the data if the entry doesn't exist
+ * @param args Extra arguments for create
+ * @return Data of the entry
+ * @protected
+ * @see DBMap#vensure
+ */
+static DBData* db_hash_vensure(DBMap* self, DBKey key, DBCreateData create, va_list args)
+{
+	DBMap_impl* db = (DBMap_impl*)self;
+	struct db_hash_entry *entry;
+	uint32 hash, pos, id;
+	va_list argscopy;
+
+	DB_COUNTSTAT(db_vensure);
+	if (db == NULL) return NULL; // nullpo candidate
+	if (create == NULL) {
+		ShowError("db_ensure: Create function is NULL for db allocated at %s:%d\n",db->alloc_file, db->alloc_line);
+		return NULL; // nullpo candidate
+	}
+	if (!(db->options&DB_OPT_ALLOW_NULL_KEY) && db_is_key_null(db->type, key)) {
+		ShowError("db_ensure: Attempted to use non-allowed NULL key for db allocated at %s:%d\n",db->alloc_file, db->alloc_line);
+		return NULL; // nullpo candidate
+	}
+
+	hash = db_hash_key(db, key);
+	pos = db_hash_find(db, key, hash);
+	if (pos != DB_HASH_NONE)
+		return &db_hash_entry_get(db, db->slots[pos].entry)->data;
+
+	if (db->item_count == UINT32_MAX) {
+		ShowError("db_vensure: item_count overflow, aborting item insertion.\n"
+				"Database allocated at %s:%d",
+				db->alloc_file, db->alloc_line);
+		return NULL;
+	}
+	db_free_lock(db);
+	db_hash_grow(db);
+	id = db_hash_alloc_entry(db);
+	entry = db_hash_entry_get(db, id);
+	entry->hash = hash;
+	entry->state = DB_HASH_USED;
+	entry->data.type = DB_DATA_PTR;
+	entry->data.u.ptr = NULL;
+	// put key and data in the entry
+	if (db->options&DB_OPT_DUP_KEY) {
+		entry->key = db_dup_key(db, key);
+		if (db->options&DB_OPT_RELEASE_KEY)
+			db->release(key, entry->data, DB_RELEASE_KEY);
+	} else {
+		entry->key = key;
+	}
+	db_hash_insert_slot(db, id, hash);
+	db->item_count++;
+	va_copy(argscopy, args);
+	entry->data = create(key, argscopy);
+	va_end(argscopy);
+	db_free_unlock(db);
+	return &entry->data;
+}
+
+/**
+ * Put the data identified by the key in a database in open addressing mode.
+ * NOTE: Uses the new key, the old one is released.
+ * @param self Interface of the database
+ * @param key Key that identifies the data
+ * @param data Data to be put in the database
+ * @param out_data Previous data if the entry exists
+ * @return 1 if if the entry already exists, 0 otherwise
+ * @protected
+ * @see DBMap#put
+ */
+static int db_hash_put(DBMap* self, DBKey key, DBData data, DBData *out_data)
+{
+	DBMap_impl* db = (DBMap_impl*)self;
+	struct db_hash_entry *entry;
+	uint32 hash, pos;
+	int retval = 0;
+
+	DB_COUNTSTAT(db_put);
+	if (db == NULL) return 0; // nullpo candidate
+	if (db->global_lock) {
+		ShowError("db_put: Database is being destroyed, aborting entry insertion.\n"
+				"Database allocated at %s:%d\n",
+				db->alloc_file, db->alloc_line);
+		return 0; // nullpo candidate
+	}
+	if (!(db->options&DB_OPT_ALLOW_NULL_KEY) && db_is_key_null(db->type, key)) {
+		ShowError("db_put: Attempted to use non-allowed NULL key for db allocated at %s:%d\n",db->alloc_file, db->alloc_line);
+		return 0; // nullpo candidate
+	}
+	if (!(db->options&DB_OPT_ALLOW_NULL_DATA) && (data.type == DB_DATA_PTR && data.u.ptr == NULL)) {
+		ShowError("db_put: Attempted to use non-allowed NULL data for db allocated at %s:%d\n",db->alloc_file, db->alloc_line);
+		return 0; // nullpo candidate
+	}
+
+	if (db->item_count == UINT32_MAX) {
+		ShowError("db_put: item_count overflow, aborting item insertion.\n"
+				"Database allocated at %s:%d",
+				db->alloc_file, db->alloc_line);
+		return 0;
+	}
+	db_free_lock(db);
+	hash = db_hash_key(db, key);
+	pos = db_hash_find(db, key, hash);
+	if (pos != DB_HASH_NONE) { // equal entry, replace
+		entry = db_hash_entry_get(db, db->slots[pos].entry);
+		db->release(entry->key, entry->data, DB_RELEASE_BOTH);
+		if (out_data)
+			memcpy(out_data, &entry->data, sizeof(*out_data));
+		retval = 1;
+	} else { // allocate a new entry
+		uint32 id;
+
+		db_hash_grow(db);
+		id = db_hash_alloc_entry(db);
+		entry = db_hash_entry_get(db, id);
+		entry->hash = hash;
+		entry->state = DB_HASH_USED;
+		db_hash_insert_slot(db, id, hash);
+		db->item_count++;
+	}
+	// put key and data in the entry
+	if (db->options&DB_OPT_DUP_KEY) {
+		entry->key = db_dup_key(db, key);
+		if (db->options&DB_OPT_RELEASE_KEY)
+			db->release(key, data, DB_RELEASE_KEY);
+	} else {
+		entry->key = key;
+	}
+	entry->data = data;
+	db_free_unlock(db);
+	return retval;
+}
+
+/**
+ * Remove an entry from a database in open addressing mode.
+ * NOTE: The key (of the database) is released in {@link #db_hash_delete(DBMap_impl*,uint32)}.
+ * @param self Interface of the database
+ * @param key Key that identifies the entry
+ * @param out_data Previous data if the entry exists
+ * @return 1 if if the entry already exists, 0 otherwise
+ * @protected
+ * @see DBMap#remove
+ */
+static int db_hash_remove(DBMap* self, DBKey key, DBData *out_data)
+{
+	DBMap_impl* db = (DBMap_impl*)self;
+	struct db_hash_entry *entry;
+	uint32 pos;
+
+	DB_COUNTSTAT(db_remove);
+	if (db == NULL) return 0; // nullpo candidate
+	if (db->global_lock) {
+		ShowError("db_remove: Database is being destroyed. Aborting entry deletion.\n"
+				"Database allocated at %s:%d\n",
+				db->alloc_file, db->alloc_line);
+		return 0; // nullpo candidate
+	}
+	if (!(db->options&DB_OPT_ALLOW_NULL_KEY) && db_is_key_null(db->type, key)) {
+		ShowError("db_remove: Attempted to use non-allowed NULL key for db allocated at %s:%d\n",db->alloc_file, db->alloc_line);
+		return 0; // nullpo candidate
+	}
+
+	pos = db_hash_find(db, key, db_hash_key(db, key));
+	if (pos == DB_HASH_NONE)
+		return 0;
+	db_free_lock(db);
+	entry = db_hash_entry_get(db, db->slots[pos].entry);
+	db->release(entry->key, entry->data, DB_RELEASE_DATA);
+	if (out_data)
+		memcpy(out_data, &entry->data, sizeof(*out_data));
+	db_hash_delete(db, pos);
+	db_free_unlock(db);
+	return 1;
+}
+
+/**
+ * Apply <code>func</code> to every entry in a database in open addressing
+ * mode.
+ * @param self Interface of the database
+ * @param func Function to be applied
+ * @param args Extra arguments for func
+ * @return Sum of the values returned by func
+ * @protected
+ * @see DBMap#vforeach
+ */
+static int db_hash_vforeach(DBMap* self, DBApply func, va_list args)
+{
+	DBMap_impl* db = (DBMap_impl*)self;
+	int sum = 0;
+	uint32 i;
+
+	DB_COUNTSTAT(db_vforeach);
+	if (db == NULL) return 0; // nullpo candidate
+	if (func == NULL) {
+		ShowError("db_foreach: Passed function is NULL for db allocated at %s:%d\n",db->alloc_file, db->alloc_line);
+		return 0; // nullpo candidate
+	}
+
+	db_free_lock(db);
+	for (i = 0; i < db->entry_count; i++) {
+		struct db_hash_entry *entry = db_hash_entry_get(db, i);
+		va_list argscopy;
+
+		if (entry->state != DB_HASH_USED)
+			continue;
+		va_copy(argscopy, args);
+		sum += func(entry->key, &entry->data, argscopy);
+		va_end(argscopy);
+	}
+	db_free_unlock(db);
+	return sum;
+}
+
+/**
+ * Removes all entries from a database in open addressing mode and frees the
+ * entry blocks and the index.
+ * @param self Interface of the database
+ * @param func Function to be applied to every entry before deleting
+ * @param args Extra arguments for func
+ * @return Sum of values returned by func
+ * @protected
+ * @see DBMap#vclear
+ */
+static int db_hash_vclear(DBMap* self, DBApply func, va_list args)
+{
+	DBMap_impl* db = (DBMap_impl*)self;
+	int sum = 0;
+	uint32 i;
+
+	DB_COUNTSTAT(db_vclear);
+	if (db == NULL) return 0; // nullpo candidate
+
+	db_free_lock(db);
+	// func might add entries, so entry_count is checked on every step
+	for (i = 0; i < db->entry_count; i++) {
+		struct db_hash_entry *entry = db_hash_entry_get(db, i);
+
+		if (entry->state == DB_HASH_DELETED) {
+			db_dup_key_free(db, entry->key);
+		} else if (entry->state == DB_HASH_USED) {
+			if (func) {
+				va_list argscopy;
+				va_copy(argscopy, args);
+				sum += func(entry->key, &entry->data, argscopy);
+				va_end(argscopy);
+			}
+			db->release(entry->key, entry->data, DB_RELEASE_BOTH);
+		}
+		entry->state = DB_HASH_FREE;
+		DB_COUNTSTAT(db_node_free);
+	}
+	for (i = 0; i < (db->entry_count+DB_HASH_BLOCK-1)>>DB_HASH_BLOCK_BITS; i++)
+		aFree(db->blocks[i]);
+	aFree(db->blocks);
+	aFree(db->slots);
+	db->blocks = NULL;
+	db->slots = NULL;
+	db->slot_mask = 0;
+	db->entry_count = 0;
+	db->entry_free = DB_HASH_NONE;
+	db->entry_deleted = DB_HASH_NONE;
+	db->item_count = 0;
+	db_free_unlock(db);
+	return sum;
+}
+
 /*****************************************************************************\
  *  (5) Section with public functions.
  *  db_fix_options     - Apply database type restrictions to the options.
@@ -2555,6 +3399,17 @@ DBMap* db_alloc(const char *file, const char *func, int line, DBType type, DBOpt
 	db->vtable.size     = db_obj_size;
 	db->vtable.type     = db_obj_type;
 	db->vtable.options  = db_obj_options;
+	if (options&DB_OPT_OPEN_HASH) {
+		db->vtable.iterator = db_hash_iterator;
+		db->vtable.exists   = db_hash_exists;
+		db->vtable.get      = db_hash_get;
+		db->vtable.vgetall  = db_hash_vgetall;
+		db->vtable.vensure  = db_hash_vensure;
+		db->vtable.put      = db_hash_put;
+		db->vtable.remove   = db_hash_remove;
+		db->vtable.vforeach = db_hash_vforeach;
+		db->vtable.vclear   = db_hash_vclear;
+	}
 	/* File and line of allocation */
 	db->alloc_file = file;
 	db->alloc_line = line;
@@ -2564,14 +3419,24 @@ DBMap* db_alloc(const char *file, const char *func, int line, DBType type, DBOpt
 	db->free_max = 0;
 	db->free_lock = 0;
 	/* Other */
-	snprintf(ers_name, 50, "db_alloc:nodes:%s:%s:%d",func,file,line);
-	db->nodes = ers_new(sizeof(struct dbn),ers_name,ERS_DBN_OPTIONS);
+	if (options&DB_OPT_OPEN_HASH) { // entries are kept in blocks of the database
+		db->nodes = NULL;
+	} else {
+		snprintf(ers_name, 50, "db_alloc:nodes:%s:%s:%d",func,file,line);
+		db->nodes = ers_new(sizeof(struct dbn),ers_name,ERS_DBN_OPTIONS);
+	}
 	db->cmp = db_default_cmp(type);
 	db->hash = db_default_hash(type);
 	db->release = db_default_release(type, options);
 	for (i = 0; i < HASH_SIZE; i++)
 		db->ht[i] = NULL;
 	db->cache = NULL;
+	db->blocks = NULL;
+	db->slots = NULL;
+	db->slot_mask = 0;
+	db->entry_count = 0;
+	db->entry_free = DB_HASH_NONE;
+	db->entry_deleted = DB_HASH_NONE;
 	db->type = type;
 	db->options = options;
 	db->item_count = 0;
@@ -66,6 +66,9 @@ typedef struct ers_cache
 	// Allocated object size, including ers_list size
 	unsigned int ObjectSize;
 
+	// Offset of the entry in the object, 0 when the reuse link is stored in the free entry itself
+	unsigned int Offset;
+
 	// Number of ers_instances referencing this
 	int ReferenceCount;
 
@@ -87,6 +90,9 @@ typedef struct ers_cache
 	// Objects in-use count
 	unsigned int UsedObjs;
 
+	// Highest objects in-use count
+	unsigned int PeakObjs;
+
 	// Default = ERS_BLOCK_ENTRIES, can be adjusted for performance for individual cache sizes.
 	unsigned int ChunkSize;
 
@@ -133,12 +139,14 @@ static ers_cache_t *ers_find_cache(unsigned int size, enum ERSOptions Options) {
 
 	CREATE(cache, ers_cache_t, 1);
 	cache->ObjectSize = size;
+	cache->Offset = ( Options&ERS_OPT_CACHE_LINE ) ? 0 : sizeof(struct ers_list);
 	cache->ReferenceCount = 0;
 	cache->ReuseList = NULL;
 	cache->Blocks = NULL;
 	cache->Free = 0;
 	cache->Used = 0;
 	cache->UsedObjs = 0;
+	cache->PeakObjs = 0;
 	cache->Max = 0;
 	cache->ChunkSize = ERS_BLOCK_ENTRIES;
 	cache->Options = (enum ERSOptions)(Options & ERS_CACHE_OPTIONS);
@@ -178,9 +186,24 @@ static void ers_free_cache(ers_cache_t *cache, bool remove)
 	aFree(cache);
 }
 
+/**
+ * Returns the first object of a block, aligned to a cache line for ERS_OPT_CACHE_LINE caches.
+ * Blocks of such caches are allocated with ERS_CACHE_LINE extra bytes of room.
+ */
+static unsigned char *ers_block_base(ers_cache_t *cache, unsigned int index)
+{
+	unsigned char *block = cache->Blocks[index];
+
+	if( cache->Options&ERS_OPT_CACHE_LINE )
+		block += ( ERS_CACHE_LINE - (uintptr_t)block % ERS_CACHE_LINE ) % ERS_CACHE_LINE;
+
+	return block;
+}
+
 static void *ers_obj_alloc_entry(ERS *self)
 {
 	struct ers_instance_t *instance = (struct ers_instance_t *)self;
+	ers_cache_t *cache;
 	void *ret;
 
 	if (instance == NULL) {
@@ -188,27 +211,33 @@ static void *ers_obj_alloc_entry(ERS *self)
 		return NULL;
 	}
 
-	if (instance->Cache->ReuseList != NULL) {
-		ret = (void *)((unsigned char *)instance->Cache->ReuseList + sizeof(struct ers_list));
-		instance->Cache->ReuseList = instance->Cache->ReuseList->Next;
-	} else if (instance->Cache->Free > 0) {
-		instance->Cache->Free--;
-		ret = &instance->Cache->Blocks[instance->Cache->Used - 1][instance->Cache->Free * instance->Cache->ObjectSize + sizeof(struct ers_list)];
+	cache = instance->Cache;
+
+	if (cache->ReuseList != NULL) {
+		ret = (void *)((unsigned char *)cache->ReuseList + cache->Offset);
+		cache->ReuseList = cache->ReuseList->Next;
+		if( cache->Offset == 0 && (cache->Options&ERS_OPT_CLEAN) )
+			((struct ers_list *)ret)->Next = NULL; // the link lived in the entry
+	} else if (cache->Free > 0) {
+		cache->Free--;
+		ret = ers_block_base(cache, cache->Used - 1) + cache->Free * cache->ObjectSize + cache->Offset;
 	} else {
-		if (instance->Cache->Used == instance->Cache->Max) {
-			instance->Cache->Max = (instance->Cache->Max * 4) + 3;
-			RECREATE(instance->Cache->Blocks, unsigned char *, instance->Cache->Max);
+		if (cache->Used == cache->Max) {
+			cache->Max = (cache->Max * 4) + 3;
+			RECREATE(cache->Blocks, unsigned char *, cache->Max);
 		}
 
-		CREATE(instance->Cache->Blocks[instance->Cache->Used], unsigned char, instance->Cache->ObjectSize * instance->Cache->ChunkSize);
-		instance->Cache->Used++;
+		CREATE(cache->Blocks[cache->Used], unsigned char, cache->ObjectSize * cache->ChunkSize + ( (cache->Options&ERS_OPT_CACHE_LINE) ? ERS_CACHE_LINE : 0 ));
+		cache->Used++;
 
-		instance->Cache->Free = instance->Cache->ChunkSize -1;
-		ret = &instance->Cache->Blocks[instance->Cache->Used - 1][instance->Cache->Free * instance->Cache->ObjectSize + sizeof(struct ers_list)];
+		cache->Free = cache->ChunkSize -1;
+		ret = ers_block_base(cache, cache->Used - 1) + cache->Free * cache->ObjectSize + cache->Offset;
 	}
 
 	instance->Count++;
-	instance->Cache->UsedObjs++;
+	cache->UsedObjs++;
+	if( cache->UsedObjs > cache->PeakObjs )
+		cache->PeakObjs = cache->UsedObjs;
 
 	return ret;
 }
@@ -216,7 +245,7 @@ static void *ers_obj_alloc_entry(ERS *self)
 static void ers_obj_free_entry(ERS *self, void *entry)
 {
 	struct ers_instance_t *instance = (struct ers_instance_t *)self;
-	struct ers_list *reuse = (struct ers_list *)((unsigned char *)entry - sizeof(struct ers_list));
+	struct ers_list *reuse;
 
 	if (instance == NULL) {
 		ShowError("ers_obj_free_entry: NULL object, aborting entry freeing.\n");
@@ -226,8 +255,10 @@ static void ers_obj_free_entry(ERS *self, void *entry)
 		return;
 	}
 
+	reuse = (struct ers_list *)((unsigned char *)entry - instance->Cache->Offset);
+
 	if( instance->Cache->Options & ERS_OPT_CLEAN )
-		memset((unsigned char*)reuse + sizeof(struct ers_list), 0, instance->Cache->ObjectSize - sizeof(struct ers_list));
+		memset(entry, 0, instance->Cache->ObjectSize - instance->Cache->Offset);
 
 	reuse->Next = instance->Cache->ReuseList;
 	instance->Cache->ReuseList = reuse;
@@ -295,12 +326,19 @@ ERS *ers_new(uint32 size, const char *name, enum ERSOptions options)
 	struct ers_instance_t *instance;
 	CREATE(instance,struct ers_instance_t, 1);
 
-	size += sizeof(struct ers_list);
+	if( options&ERS_OPT_CACHE_LINE ) {
+		// The reuse link is kept in the free entry, so the entry itself starts the object
+		if( size < sizeof(struct ers_list) )
+			size = sizeof(struct ers_list);
+		size += ( ERS_CACHE_LINE - size % ERS_CACHE_LINE ) % ERS_CACHE_LINE;
+	} else {
+		size += sizeof(struct ers_list);
 
 #if ERS_ALIGNED > 1 // If it's aligned to 1-byte boundaries, no need to bother.
-	if (size % ERS_ALIGNED)
-		size += ERS_ALIGNED - size % ERS_ALIGNED;
+		if (size % ERS_ALIGNED)
+			size += ERS_ALIGNED - size % ERS_ALIGNED;
 #endif
+	}
 
 	instance->VTable.alloc = ers_obj_alloc_entry;
 	instance->VTable.free = ers_obj_free_entry;
@@ -331,14 +369,20 @@ ERS *ers_new(uint32 size, const char *name, enum ERSOptions options)
 
 void ers_report(void) {
 	ers_cache_t *cache;
+	struct ers_instance_t *instance;
 	unsigned int cache_c = 0, blocks_u = 0, blocks_a = 0, memory_b = 0, memory_t = 0;
 
 	for (cache = CacheList; cache; cache = cache->Next) {
 		cache_c++;
 		ShowMessage(CL_BOLD"[ERS Cache of size '" CL_NORMAL "" CL_WHITE "%u" CL_NORMAL "" CL_BOLD "' report]\n" CL_NORMAL, cache->ObjectSize);
 		ShowMessage("\tinstances          : %u\n", cache->ReferenceCount);
+		for (instance = InstanceList; instance; instance = instance->Next)
+			if (instance->Cache == cache)
+				ShowMessage("\t  %-16u : %s\n", instance->Count, instance->Name);
 		ShowMessage("\tblocks in use      : %u/%u\n", cache->UsedObjs, cache->UsedObjs+cache->Free);
+		ShowMessage("\tblocks peak        : %u\n", cache->PeakObjs);
 		ShowMessage("\tblocks unused      : %u\n", cache->Free);
+		ShowMessage("\tchunk size         : %u%s\n", cache->ChunkSize, (cache->Options&ERS_OPT_CACHE_LINE) ? " (cache line aligned)" : "");
 		ShowMessage("\tmemory in use      : %.2f MB\n", cache->UsedObjs == 0 ? 0. : (double)((cache->UsedObjs * cache->ObjectSize)/1024)/1024);
 		ShowMessage("\tmemory allocated   : %.2f MB\n", (cache->Free+cache->UsedObjs) == 0 ? 0. : (double)(((cache->UsedObjs+cache->Free) * cache->ObjectSize)/1024)/1024);
 		blocks_u += cache->UsedObjs;
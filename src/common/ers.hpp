@@ -70,6 +70,14 @@
 #	define ERS_ALIGNED 1
 #endif /* not ERS_ALIGN_ENTRY */
 
+/**
+ * Size of a cache line, used by managers created with ERS_OPT_CACHE_LINE.
+ * Must be a power of two.
+ */
+#ifndef ERS_CACHE_LINE
+#	define ERS_CACHE_LINE 64
+#endif /* not ERS_CACHE_LINE */
+
 enum ERSOptions {
 	ERS_OPT_NONE        = 0x00,
 	ERS_OPT_CLEAR       = 0x01,/* silently clears any entries left in the manager upon destruction */
@@ -77,9 +85,10 @@ enum ERSOptions {
 	ERS_OPT_FREE_NAME   = 0x04,/* name is dynamic memory, and should be freed */
 	ERS_OPT_CLEAN       = 0x08,/* clears used memory upon ers_free so that its all new to be reused on the next alloc */
 	ERS_OPT_FLEX_CHUNK  = 0x10,/* signs that it should look for its own cache given it'll have a dynamic chunk size, so that it doesn't affect the other ERS it'd otherwise be sharing */
+	ERS_OPT_CACHE_LINE  = 0x20,/* entries start on a cache line and are padded to a multiple of ERS_CACHE_LINE, so two entries never share a line */
 
 	/* Compound, is used to determine whether it should be looking for a cache of matching options */
-	ERS_CACHE_OPTIONS   = ERS_OPT_CLEAN|ERS_OPT_FLEX_CHUNK,
+	ERS_CACHE_OPTIONS   = ERS_OPT_CLEAN|ERS_OPT_FLEX_CHUNK|ERS_OPT_CACHE_LINE,
 	ERS_CLEAN_OPTIONS   = ERS_OPT_CLEAN|ERS_OPT_CLEAR,
 	ERS_DBN_OPTIONS     = ERS_OPT_CLEAN|ERS_OPT_WAIT|ERS_OPT_FREE_NAME,
 };
@@ -0,0 +1,83 @@
+// Copyright (c) rAthena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#ifndef MAPCACHE_HPP
+#define MAPCACHE_HPP
+
+#include "cbasetypes.hpp"
+#include "mmo.hpp" // MAP_NAME_LENGTH
+
+// Layout of the map cache files (db/map_cache.dat), all values are little endian.
+//
+// Version 1:
+//   map_cache_main_header
+//   for every map: map_cache_map_info followed by the compressed cells
+// Maps can only be found by walking through the whole file.
+//
+// Version 2:
+//   map_cache_header
+//   uint32 index[index_size]: hashed name index, entry of the map table or MAP_CACHE_INDEX_EMPTY
+//   map_cache_entry maps[map_count]: map table
+//   compressed cells of every map
+// The index uses linear probing over map_cache_hash of the map name.
+
+// This is the main header found at the very beginning of a version 1 map cache
+struct map_cache_main_header {
+	uint32 file_size;
+	uint16 map_count;
+};
+
+// This is the header appended before every compressed map cells info in a version 1 map cache
+struct map_cache_map_info {
+	char name[MAP_NAME_LENGTH];
+	int16 xs;
+	int16 ys;
+	int32 len;
+};
+
+#define MAP_CACHE_MAGIC "RAMC"
+#define MAP_CACHE_VERSION 2
+#define MAP_CACHE_INDEX_EMPTY UINT32_MAX
+
+// This is the header found at the very beginning of a version 2 map cache
+struct map_cache_header {
+	char magic[4]; // MAP_CACHE_MAGIC
+	uint32 version;
+	uint32 file_size;
+	uint32 map_count;
+	uint32 index_size; // power of two
+};
+
+// Entry of the map table of a version 2 map cache
+struct map_cache_entry {
+	char name[MAP_NAME_LENGTH];
+	int16 xs;
+	int16 ys;
+	uint32 offset; // offset of the compressed cells from the start of the file
+	uint32 len; // length of the compressed cells
+};
+
+/// Hashes a map name for the index of a version 2 map cache (32 bit FNV-1a)
+static inline uint32 map_cache_hash( const char* name ){
+	uint32 hash = 2166136261U;
+
+	for( size_t i = 0; i < MAP_NAME_LENGTH && name[i] != '\0'; i++ ){
+		hash ^= (uint8)name[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/// Returns the number of index slots for a version 2 map cache, keeping the index at most half full
+static inline uint32 map_cache_index_size( uint32 map_count ){
+	uint32 size = 16;
+
+	while( size < map_count * 2 ){
+		size <<= 1;
+	}
+
+	return size;
+}
+
+#endif /* MAPCACHE_HPP */
@@ -15,13 +15,28 @@
 	#include <sys/ioctl.h>
 	#include <sys/socket.h>
 	#include <sys/time.h>
+	#include <sys/uio.h>
 	#include <unistd.h>
 
 	#if defined(__linux__) || defined(__linux)
 		#include <linux/tcp.h>
 
 		#ifdef SOCKET_EPOLL
+			#include <atomic>
+			#include <thread>
+			#include <vector>
+
 			#include <sys/epoll.h>
+			#include <sys/eventfd.h>
+		#endif
+
+		#ifdef SOCKET_IO_URING
+			#include <vector>
+
+			#include <linux/io_uring.h>
+			#include <poll.h>
+			#include <sys/mman.h>
+			#include <sys/syscall.h>
 		#endif
 	#else 
 		#include <netinet/in.h>
@@ -224,8 +239,29 @@ char* sErr(int code)
 	static int epfd = SOCKET_ERROR;
 	static struct epoll_event epevent;
 	static struct epoll_event *epevents = nullptr;
+
+	// Edge-triggered mode: client/server sessions are only notified on state changes,
+	// reads are drained until EAGAIN and EPOLLOUT is only requested while the kernel send buffer is full
+	static bool epoll_edge_triggered = false;
+	// Maximum amount of bytes received/sent per client session and cycle in edge-triggered mode (0 = unlimited)
+	static size_t epoll_recv_budget = 0;
+	static size_t epoll_send_budget = 0;
+
+	// Amount of network I/O threads that perform recv/send for all connected sessions (0 = disabled)
+	static int io_threads = 0;
+#endif
+
+#ifdef SOCKET_IO_URING
+	// io_uring based Event Dispatcher, replaces select/epoll when enabled
+	static bool uring_enabled = false;
+#else
+	static const bool uring_enabled = false;
 #endif
 
+// Sessions that may still hold unread data, because their budget or their read fifo was exhausted
+static int recv_pending_array[MAXCONN];
+static int recv_pending_count = 0;
+
 int fd_max;
 time_t last_tick;
 time_t stall_time = 60;
@@ -258,6 +294,12 @@ static time_t socket_data_last_tick = 0;
 // The connection is closed if it goes over the limit.
 #define WFIFO_MAX (1*1024*1024)
 
+// Shared packets smaller than this are copied into the write fifo,
+// because queueing a reference costs about as much as copying them.
+#define WFIFO_SHARED_MIN 64
+// Maximum amount of buffers that are passed to a single sendmsg call
+#define WFIFO_IOV_MAX 256
+
 struct socket_data* session[MAXCONN];
 
 #ifdef SEND_SHORTLIST
@@ -295,6 +337,14 @@ void set_defaultparse(ParseFunc defaultparse)
 	default_func_parse = defaultparse;
 }
 
+// Called right before the send queues are flushed, so packets collected during the cycle can be sent
+PresendFunc func_presend = NULL;
+
+void set_presend(PresendFunc presend)
+{
+	func_presend = presend;
+}
+
 
 /*======================================
  *	CORE : Socket options
@@ -307,47 +357,1377 @@ void set_nonblocking(int fd, unsigned long yes)
 		ShowError("set_nonblocking: Failed to set socket #%d to non-blocking mode (%s) - Please report this!!!\n", fd, error_msg());
 }
 
-void setsocketopts(int fd,int delay_timeout){
-	int yes = 1; // reuse fix
+void setsocketopts(int fd,int delay_timeout){
+	int yes = 1; // reuse fix
+
+#if !defined(WIN32)
+	// set SO_REAUSEADDR to true, unix only. on windows this option causes
+	// the previous owner of the socket to give up, which is not desirable
+	// in most cases, neither compatible with unix.
+	sSetsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char *)&yes,sizeof(yes));
+#ifdef SO_REUSEPORT
+	sSetsockopt(fd,SOL_SOCKET,SO_REUSEPORT,(char *)&yes,sizeof(yes));
+#endif
+#endif
+
+	// Set the socket into no-delay mode; otherwise packets get delayed for up to 200ms, likely creating server-side lag.
+	// The RO protocol is mainly single-packet request/response, plus the FIFO model already does packet grouping anyway.
+	sSetsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&yes, sizeof(yes));
+
+	// force the socket into no-wait, graceful-close mode (should be the default, but better make sure)
+	//(https://msdn.microsoft.com/en-us/library/windows/desktop/ms737582%28v=vs.85%29.aspx)
+	{
+		struct linger opt;
+		opt.l_onoff = 0; // SO_DONTLINGER
+		opt.l_linger = 0; // Do not care
+		if( sSetsockopt(fd, SOL_SOCKET, SO_LINGER, (char*)&opt, sizeof(opt)) )
+			ShowWarning("setsocketopts: Unable to set SO_LINGER mode for connection #%d!\n", fd);
+	}
+	if(delay_timeout){
+#if defined(WIN32)
+		int timeout = delay_timeout * 1000;
+#else
+		struct timeval timeout;
+		timeout.tv_sec = delay_timeout;
+		timeout.tv_usec = 0;
+#endif
+
+		if (sSetsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout,sizeof(timeout)) < 0)
+			ShowError("setsocketopts: Unable to set SO_RCVTIMEO timeout for connection #%d!\n", fd);
+		if (sSetsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout,sizeof(timeout)) < 0)
+			ShowError("setsocketopts: Unable to set SO_SNDTIMEO timeout for connection #%d!\n", fd);
+	}
+}
+
+/*======================================
+ *	CORE : Pending reads
+ *--------------------------------------*/
+/// The session may still hold unread data, read it again in the next cycle.
+static void recv_pending_add(int fd)
+{
+	if( session[fd]->flag.read_pending )
+		return;
+
+	session[fd]->flag.read_pending = 1;
+	recv_pending_array[recv_pending_count++] = fd;
+}
+
+#ifdef SOCKET_EPOLL
+/*======================================
+ *	CORE : Edge-triggered epoll helpers
+ *--------------------------------------*/
+/// Returns the epoll events a connected session is registered with.
+static uint32 epoll_session_events(void)
+{
+	return epoll_edge_triggered ? ( EPOLLIN | EPOLLET ) : EPOLLIN;
+}
+
+/// Changes the epoll events a session is registered with.
+static void epoll_modify(int fd, uint32 events)
+{
+	epevent.data.fd = fd;
+	epevent.events = events;
+
+	if( epoll_ctl( epfd, EPOLL_CTL_MOD, fd, &epevent ) == SOCKET_ERROR ){
+		ShowError( "epoll_modify: Failed to modify epoll events for socket #%d: %s\n", fd, error_msg() );
+		set_eof( fd );
+	}
+}
+
+/// The kernel send buffer of the session is full, wait for EPOLLOUT before sending again.
+static void epoll_wait_writable(int fd)
+{
+	if( session[fd]->flag.wait_writable )
+		return;
+
+	session[fd]->flag.wait_writable = 1;
+	epoll_modify( fd, epoll_session_events() | EPOLLOUT );
+}
+
+/// The session received EPOLLOUT, queue the remaining data for sending.
+static void epoll_writable(int fd)
+{
+	if( !session[fd]->flag.wait_writable )
+		return;
+
+	session[fd]->flag.wait_writable = 0;
+	epoll_modify( fd, epoll_session_events() );
+#ifdef SEND_SHORTLIST
+	send_shortlist_add_fd( fd );
+#endif
+}
+
+#endif
+
+#ifdef SOCKET_EPOLL
+/*======================================
+ *	CORE : Network I/O threads
+ *--------------------------------------
+ * When io_threads is set, connected sessions are owned by I/O threads.
+ * They recv into and send from lock-free single producer/single consumer
+ * rings of the session, the game thread only copies between these rings
+ * and the RFIFO/WFIFO of the session and never calls recv/send itself.
+ * Packets are still framed by the parse functions on the game thread,
+ * as only they know the packet lengths of their protocol.
+ * I/O threads must not use the memory manager or the console output.
+ */
+
+/// Lock-free byte ring with a single producer and a single consumer thread.
+class spsc_ring{
+private:
+	uint8* buffer;
+	size_t mask;
+	std::atomic<size_t> head; // written by the producer
+	std::atomic<size_t> tail; // written by the consumer
+
+public:
+	spsc_ring( size_t capacity ) : buffer( new uint8[capacity] ), mask( capacity - 1 ), head( 0 ), tail( 0 ){
+	}
+
+	~spsc_ring(){
+		delete[] buffer;
+	}
+
+	size_t readable(){
+		return this->head.load() - this->tail.load();
+	}
+
+	size_t writable(){
+		return this->mask + 1 - this->readable();
+	}
+
+	/// Producer: returns the contiguous free space at the write position.
+	size_t write_span( uint8** ptr ){
+		size_t pos = this->head.load( std::memory_order_relaxed );
+		size_t len = zmin( this->mask + 1 - ( pos - this->tail.load() ), this->mask + 1 - ( pos & this->mask ) );
+
+		*ptr = this->buffer + ( pos & this->mask );
+		return len;
+	}
+
+	void commit_write( size_t len ){
+		this->head.store( this->head.load( std::memory_order_relaxed ) + len );
+	}
+
+	/// Consumer: returns the contiguous data at the read position.
+	size_t read_span( uint8** ptr ){
+		size_t pos = this->tail.load( std::memory_order_relaxed );
+		size_t len = zmin( this->head.load() - pos, this->mask + 1 - ( pos & this->mask ) );
+
+		*ptr = this->buffer + ( pos & this->mask );
+		return len;
+	}
+
+	void commit_read( size_t len ){
+		this->tail.store( this->tail.load( std::memory_order_relaxed ) + len );
+	}
+
+	/// Producer: copies as much as fits into the ring.
+	size_t write( const uint8* data, size_t len ){
+		size_t total = 0;
+		uint8* ptr;
+		size_t span;
+
+		while( total < len && ( span = this->write_span( &ptr ) ) > 0 ){
+			span = zmin( span, len - total );
+			memcpy( ptr, data + total, span );
+			this->commit_write( span );
+			total += span;
+		}
+
+		return total;
+	}
+
+	/// Consumer: copies as much as is available out of the ring.
+	size_t read( uint8* data, size_t len ){
+		size_t total = 0;
+		uint8* ptr;
+		size_t span;
+
+		while( total < len && ( span = this->read_span( &ptr ) ) > 0 ){
+			span = zmin( span, len - total );
+			memcpy( data + total, ptr, span );
+			this->commit_read( span );
+			total += span;
+		}
+
+		return total;
+	}
+};
+
+/// Lock-free queue of values with a single producer and a single consumer thread.
+template <typename T> class spsc_queue{
+private:
+	std::vector<T> buffer;
+	size_t mask;
+	std::atomic<size_t> head;
+	std::atomic<size_t> tail;
+
+public:
+	spsc_queue( size_t capacity ) : buffer( capacity ), mask( capacity - 1 ), head( 0 ), tail( 0 ){
+	}
+
+	bool push( const T& value ){
+		size_t pos = this->head.load( std::memory_order_relaxed );
+
+		if( pos - this->tail.load( std::memory_order_acquire ) > this->mask ){
+			return false;
+		}
+
+		this->buffer[pos & this->mask] = value;
+		this->head.store( pos + 1, std::memory_order_release );
+		return true;
+	}
+
+	bool pop( T& value ){
+		size_t pos = this->tail.load( std::memory_order_relaxed );
+
+		if( pos == this->head.load( std::memory_order_acquire ) ){
+			return false;
+		}
+
+		value = this->buffer[pos & this->mask];
+		this->tail.store( pos + 1, std::memory_order_release );
+		return true;
+	}
+};
+
+// Size of the receive ring of an outgoing (server) session
+#define IO_RX_RING_SIZE (16*1024)
+// Size of the send ring of an outgoing (server) session, the WFIFO holds everything that does not fit
+#define IO_TX_RING_SIZE (64*1024)
+// Ring sizes of accepted sessions, which are mostly clients.
+// Accepted server connections work with them too, they just take more cycles for large packets.
+#define IO_RX_RING_SIZE_CLIENT (4*1024)
+#define IO_TX_RING_SIZE_CLIENT (8*1024)
+
+/// Connection state shared between the game thread and the I/O thread of a session
+struct socket_io{
+	int fd;
+	int worker;
+	spsc_ring rx; // I/O thread -> game thread
+	spsc_ring tx; // game thread -> I/O thread
+	std::atomic<bool> eof; // set by the I/O thread when the connection ended or failed
+	std::atomic<bool> rx_notified; // the game thread was notified about new data or eof
+	std::atomic<bool> rx_stalled; // the I/O thread stopped reading because rx is full
+	std::atomic<bool> tx_queued; // the I/O thread was told about new data in tx
+	std::atomic<bool> tx_blocked; // the game thread waits for space in tx
+	bool closing; // game thread only: the session was closed, waiting for the I/O thread to release it
+	bool want_out; // I/O thread only: registered for EPOLLOUT
+
+	socket_io( int session_fd, int worker_index, bool server ) : fd( session_fd ), worker( worker_index ),
+		rx( server ? IO_RX_RING_SIZE : IO_RX_RING_SIZE_CLIENT ), tx( server ? IO_TX_RING_SIZE : IO_TX_RING_SIZE_CLIENT ),
+		eof( false ), rx_notified( false ), rx_stalled( false ), tx_queued( false ), tx_blocked( false ), closing( false ), want_out( false ){
+	}
+};
+
+enum e_io_command{
+	IO_CMD_SEND, // tx has new data
+	IO_CMD_RESUME, // rx has space again
+	IO_CMD_CLOSE, // session was closed by the game thread
+	IO_CMD_STOP, // terminate the I/O thread
+};
+
+enum e_io_notify{
+	IO_NOTIFY_RECV, // rx has new data or the connection ended
+	IO_NOTIFY_SPACE, // tx has space again
+	IO_NOTIFY_CLOSED, // the I/O thread released the session
+};
+
+struct s_io_message{
+	int type;
+	struct socket_io* io;
+};
+
+struct s_io_worker{
+	std::thread thread;
+	int epfd;
+	int wakefd;
+	spsc_queue<s_io_message> commands; // game thread -> I/O thread
+	spsc_queue<s_io_message> notifications; // I/O thread -> game thread
+
+	s_io_worker( size_t capacity ) : epfd( SOCKET_ERROR ), wakefd( SOCKET_ERROR ), commands( capacity ), notifications( capacity ){
+	}
+};
+
+static std::vector<s_io_worker*> io_workers;
+static struct socket_io* session_io[MAXCONN];
+static int io_wakefd = SOCKET_ERROR; // wakes the game thread, registered in epfd
+static int io_next_worker = 0;
+
+/// Wakes up the owner of an eventfd.
+static void io_wakeup(int fd)
+{
+	uint64 value = 1;
+
+	if( write( fd, &value, sizeof( value ) ) < 0 ){
+		// the counter can not overflow in practice, the owner is awake anyway
+	}
+}
+
+/// I/O thread: tells the game thread about the session.
+static void io_notify(struct s_io_worker* worker, int type, struct socket_io* io, bool& wake)
+{
+	s_io_message message = { type, io };
+
+	while( !worker->notifications.push( message ) ){
+		// never happens, the queue holds a few messages per session
+		std::this_thread::yield();
+	}
+
+	wake = true;
+}
+
+/// I/O thread: receives from the socket until EAGAIN or until rx is full.
+static void io_worker_recv(struct s_io_worker* worker, struct socket_io* io, bool& wake)
+{
+	bool received = false;
+
+	while( !io->eof.load() ){
+		uint8* ptr;
+		size_t span = io->rx.write_span( &ptr );
+
+		if( span == 0 ){
+			// stop reading until the game thread made space, but check again in case it just did
+			io->rx_stalled.store( true );
+
+			if( io->rx.writable() == 0 || !io->rx_stalled.exchange( false ) ){
+				break;
+			}
+
+			continue;
+		}
+
+		ssize_t len = sRecv( io->fd, (char*)ptr, span, 0 );
+
+		if( len > 0 ){
+			io->rx.commit_write( len );
+			received = true;
+			continue;
+		}
+
+		if( len == 0 || sErrno != S_EWOULDBLOCK ){
+			io->eof.store( true );
+			received = true;
+		}
+
+		break;
+	}
+
+	if( received && !io->rx_notified.exchange( true ) ){
+		io_notify( worker, IO_NOTIFY_RECV, io, wake );
+	}
+}
+
+/// I/O thread: sends from tx until it is empty or until the kernel send buffer is full.
+static void io_worker_send(struct s_io_worker* worker, struct socket_io* io, bool& wake)
+{
+	bool blocked = false;
+
+	while( !io->eof.load() ){
+		uint8* ptr;
+		size_t span = io->tx.read_span( &ptr );
+
+		if( span == 0 ){
+			break;
+		}
+
+		ssize_t len = sSend( io->fd, (const char*)ptr, span, MSG_NOSIGNAL );
+
+		if( len > 0 ){
+			io->tx.commit_read( len );
+
+			if( (size_t)len < span ){
+				blocked = true;
+				break;
+			}
+
+			continue;
+		}
+
+		if( sErrno == S_EWOULDBLOCK ){
+			blocked = true;
+		}else{
+			io->eof.store( true );
+
+			if( !io->rx_notified.exchange( true ) ){
+				io_notify( worker, IO_NOTIFY_RECV, io, wake );
+			}
+		}
+
+		break;
+	}
+
+	if( blocked != io->want_out && !io->eof.load() ){
+		struct epoll_event event = {};
+
+		event.data.ptr = io;
+		event.events = EPOLLIN | EPOLLET | ( blocked ? EPOLLOUT : 0 );
+		epoll_ctl( worker->epfd, EPOLL_CTL_MOD, io->fd, &event );
+		io->want_out = blocked;
+	}
+
+	if( io->tx_blocked.load() && io->tx.writable() > 0 && io->tx_blocked.exchange( false ) ){
+		io_notify( worker, IO_NOTIFY_SPACE, io, wake );
+	}
+}
+
+/// I/O thread main loop.
+static void io_worker_main(struct s_io_worker* worker)
+{
+	struct epoll_event events[256];
+
+	for( ;; ){
+		int count = epoll_wait( worker->epfd, events, ARRAYLENGTH( events ), -1 );
+		bool wake = false;
+
+		for( int i = 0; i < count; i++ ){
+			struct socket_io* io = (struct socket_io*)events[i].data.ptr;
+
+			if( io == nullptr ){
+				uint64 value;
+
+				if( read( worker->wakefd, &value, sizeof( value ) ) < 0 ){
+					// spurious wakeup
+				}
+
+				continue;
+			}
+
+			if( ( events[i].events & EPOLLHUP ) && !( events[i].events & EPOLLERR ) ){
+				// the peer closed the connection, read what it sent before
+				io_worker_recv( worker, io, wake );
+
+				if( !io->rx_stalled.load() && !io->eof.load() ){
+					io->eof.store( true );
+
+					if( !io->rx_notified.exchange( true ) ){
+						io_notify( worker, IO_NOTIFY_RECV, io, wake );
+					}
+				}
+
+				continue;
+			}
+
+			if( events[i].events & EPOLLERR ){
+				io->eof.store( true );
+
+				if( !io->rx_notified.exchange( true ) ){
+					io_notify( worker, IO_NOTIFY_RECV, io, wake );
+				}
+
+				continue;
+			}
+
+			if( events[i].events & EPOLLIN ){
+				io_worker_recv( worker, io, wake );
+			}
+
+			if( events[i].events & EPOLLOUT ){
+				io_worker_send( worker, io, wake );
+			}
+		}
+
+		s_io_message message;
+		bool stop = false;
+
+		while( worker->commands.pop( message ) ){
+			struct socket_io* io = message.io;
+
+			switch( message.type ){
+				case IO_CMD_SEND:
+					io->tx_queued.store( false );
+					io_worker_send( worker, io, wake );
+					break;
+				case IO_CMD_RESUME:
+					io_worker_recv( worker, io, wake );
+					break;
+				case IO_CMD_CLOSE:
+					// best effort, send what is left
+					io_worker_send( worker, io, wake );
+					epoll_ctl( worker->epfd, EPOLL_CTL_DEL, io->fd, nullptr );
+					io_notify( worker, IO_NOTIFY_CLOSED, io, wake );
+					break;
+				case IO_CMD_STOP:
+					stop = true;
+					break;
+			}
+		}
+
+		if( wake ){
+			io_wakeup( io_wakefd );
+		}
+
+		if( stop ){
+			return;
+		}
+	}
+}
+
+/// Game thread: sends a command to the I/O thread of the session.
+static void io_command(int type, struct socket_io* io)
+{
+	struct s_io_worker* worker = io_workers[io->worker];
+	s_io_message message = { type, io };
+
+	while( !worker->commands.push( message ) ){
+		// never happens, the queue holds a few messages per session
+		std::this_thread::yield();
+	}
+
+	io_wakeup( worker->wakefd );
+}
+
+/// Game thread: copies received data from rx into the RFIFO.
+static int io_recv_to_fifo(int fd)
+{
+	struct socket_io* io = session_io[fd];
+
+	if( !session_isActive(fd) || io == nullptr )
+		return -1;
+
+	io->rx_notified.store( false );
+
+	size_t len = io->rx.read( session[fd]->rdata + session[fd]->rdata_size, RFIFOSPACE(fd) );
+
+	if( len > 0 ){
+		session[fd]->rdata_size += len;
+		session[fd]->rdata_tick = last_tick;
+#ifdef SHOW_SERVER_STATS
+		socket_data_i += len;
+		socket_data_qi += len;
+		if (!session[fd]->flag.server)
+		{
+			socket_data_ci += len;
+		}
+#endif
+	}
+
+	if( io->rx_stalled.load() && io->rx.writable() > 0 && io->rx_stalled.exchange( false ) ){
+		io_command( IO_CMD_RESUME, io );
+	}
+
+	if( io->rx.readable() > 0 ){
+		// read fifo is full, continue after the data was parsed
+		recv_pending_add(fd);
+	}else if( io->eof.load() ){
+		set_eof(fd);
+	}
+
+	return 0;
+}
+
+/// Game thread: moves data from the WFIFO into tx.
+static int io_send_from_fifo(int fd)
+{
+	struct socket_io* io = session_io[fd];
+
+	if( !session_isValid(fd) || io == nullptr )
+		return -1;
+
+	if( session[fd]->wdata_size == 0 || session[fd]->flag.wait_writable )
+		return 0; // nothing to send or tx is still full
+
+	if( io->eof.load() ){
+#ifdef SHOW_SERVER_STATS
+		socket_data_qo -= session[fd]->wdata_size;
+#endif
+		session[fd]->wdata_size = 0; // Clear the send queue as we can't send anymore.
+		set_eof(fd);
+		return 0;
+	}
+
+	size_t len = io->tx.write( session[fd]->wdata, session[fd]->wdata_size );
+
+	if( len < session[fd]->wdata_size ){
+		// wait for the I/O thread to make space, but check again in case it just did
+		io->tx_blocked.store( true );
+
+		if( io->tx.writable() > 0 && io->tx_blocked.exchange( false ) ){
+			len += io->tx.write( session[fd]->wdata + len, session[fd]->wdata_size - len );
+		}
+
+		if( len < session[fd]->wdata_size && io->tx_blocked.load() ){
+			session[fd]->flag.wait_writable = 1;
+		}
+	}
+
+	if( len > 0 ){
+		session[fd]->wdata_tick = last_tick;
+
+		if( len < session[fd]->wdata_size )
+			memmove(session[fd]->wdata, session[fd]->wdata + len, session[fd]->wdata_size - len);
+
+		session[fd]->wdata_size -= len;
+#ifdef SHOW_SERVER_STATS
+		socket_data_o += len;
+		socket_data_qo -= len;
+		if (!session[fd]->flag.server)
+		{
+			socket_data_co += len;
+		}
+#endif
+
+		if( !io->tx_queued.exchange( true ) ){
+			io_command( IO_CMD_SEND, io );
+		}
+	}
+
+	return 0;
+}
+
+/// Game thread: hands a connected session over to an I/O thread.
+/// @param server: outgoing connection to another server, gets larger rings
+static bool io_attach(int fd, bool server)
+{
+	int index = io_next_worker++ % io_threads;
+	struct socket_io* io = new socket_io( fd, index, server );
+	struct epoll_event event = {};
+
+	event.data.ptr = io;
+	event.events = EPOLLIN | EPOLLET;
+
+	if( epoll_ctl( io_workers[index]->epfd, EPOLL_CTL_ADD, fd, &event ) == SOCKET_ERROR ){
+		delete io;
+		return false;
+	}
+
+	session_io[fd] = io;
+	session[fd]->func_recv = io_recv_to_fifo;
+	session[fd]->func_send = io_send_from_fifo;
+
+	return true;
+}
+
+/// Game thread: the session was closed, the I/O thread closes the socket once it released it.
+/// Until then the fd can not be reused.
+static bool io_detach(int fd)
+{
+	struct socket_io* io = session_io[fd];
+
+	if( io == nullptr )
+		return false;
+
+	session_io[fd] = nullptr;
+	io->closing = true;
+	io_command( IO_CMD_CLOSE, io );
+
+	return true;
+}
+
+/// Game thread: handles the notifications of all I/O threads.
+static void io_process_notifications(void)
+{
+	uint64 value;
+
+	if( read( io_wakefd, &value, sizeof( value ) ) < 0 ){
+		// nothing pending
+	}
+
+	for( s_io_worker* worker : io_workers ){
+		s_io_message message;
+
+		while( worker->notifications.pop( message ) ){
+			struct socket_io* io = message.io;
+
+			if( io->closing ){
+				if( message.type == IO_NOTIFY_CLOSED ){
+					sShutdown( io->fd, SHUT_RDWR );
+					sClose( io->fd );
+					delete io;
+				}
+				continue;
+			}
+
+			switch( message.type ){
+				case IO_NOTIFY_RECV:
+					if( !session[io->fd]->flag.read_pending ){
+						session[io->fd]->func_recv( io->fd );
+					}
+					break;
+				case IO_NOTIFY_SPACE:
+					session[io->fd]->flag.wait_writable = 0;
+#ifdef SEND_SHORTLIST
+					send_shortlist_add_fd( io->fd );
+#endif
+					break;
+			}
+		}
+	}
+}
+
+/// Game thread: starts the I/O threads.
+static void io_threads_init(void)
+{
+	size_t capacity = 1;
+
+	// each session has at most a few messages queued in each direction
+	while( capacity < 4 * MAXCONN ){
+		capacity <<= 1;
+	}
+
+	io_wakefd = eventfd( 0, EFD_NONBLOCK );
+
+	if( io_wakefd == SOCKET_ERROR ){
+		ShowError( "io_threads_init: Failed to create eventfd: %s\n", error_msg() );
+		exit( EXIT_FAILURE );
+	}
+
+	epevent.data.fd = io_wakefd;
+	epevent.events = EPOLLIN;
+
+	if( epoll_ctl( epfd, EPOLL_CTL_ADD, io_wakefd, &epevent ) == SOCKET_ERROR ){
+		ShowError( "io_threads_init: Failed to add eventfd to epoll event dispatcher: %s\n", error_msg() );
+		exit( EXIT_FAILURE );
+	}
+
+	for( int i = 0; i < io_threads; i++ ){
+		s_io_worker* worker = new s_io_worker( capacity );
+		struct epoll_event event = {};
+
+		worker->epfd = epoll_create( MAXCONN );
+		worker->wakefd = eventfd( 0, EFD_NONBLOCK );
+
+		if( worker->epfd == SOCKET_ERROR || worker->wakefd == SOCKET_ERROR ){
+			ShowError( "io_threads_init: Failed to create I/O thread %d: %s\n", i, error_msg() );
+			exit( EXIT_FAILURE );
+		}
+
+		event.data.ptr = nullptr;
+		event.events = EPOLLIN;
+		epoll_ctl( worker->epfd, EPOLL_CTL_ADD, worker->wakefd, &event );
+
+		worker->thread = std::thread( io_worker_main, worker );
+		io_workers.push_back( worker );
+	}
+
+	ShowInfo( "Server uses '" CL_WHITE "%d" CL_RESET "' network I/O threads\n", io_threads );
+}
+
+/// Game thread: stops the I/O threads and releases the remaining sessions.
+static void io_threads_final(void)
+{
+	for( s_io_worker* worker : io_workers ){
+		s_io_message message = { IO_CMD_STOP, nullptr };
+
+		while( !worker->commands.push( message ) ){
+			std::this_thread::yield();
+		}
+
+		io_wakeup( worker->wakefd );
+		worker->thread.join();
+	}
+
+	io_process_notifications();
+
+	for( s_io_worker* worker : io_workers ){
+		sClose( worker->epfd );
+		sClose( worker->wakefd );
+		delete worker;
+	}
+
+	io_workers.clear();
+	sClose( io_wakefd );
+	io_wakefd = SOCKET_ERROR;
+}
+#endif
+
+#ifdef SOCKET_IO_URING
+/*======================================
+ *	CORE : io_uring based Event Dispatcher
+ *--------------------------------------
+ * Every connected session keeps a multishot recv armed, which receives into
+ * buffers that were registered with the kernel once. Listeners are watched
+ * with poll requests. Sends and re-armed requests are only queued and are
+ * submitted together with the wait for completions, so a whole cycle costs a
+ * single io_uring_enter call instead of one recv/send call per session.
+ */
+
+// Size of a registered receive buffer
+#define URING_BUFFER_SIZE 4096
+// Amount of registered receive buffers (power of two)
+#define URING_BUFFER_COUNT 2048
+// Buffer group of the registered receive buffers
+#define URING_BUFFER_GROUP 0
+
+// The lowest bit of the user data tells the operation apart
+#define URING_OP_RECV 0
+#define URING_OP_SEND 1
+
+struct s_uring_session{
+	int fd;
+	bool listener; // waits for connections instead of receiving data
+	bool closing; // the session was closed, waiting for the outstanding requests
+	bool recv_armed; // a recv (or poll for listeners) request is outstanding
+	bool recv_paused; // the stash is full, recv is armed again once it was emptied
+	bool send_inflight; // a send request is outstanding
+	uint8* tx_buf; // data that is being sent, swapped with the WFIFO
+	size_t tx_cap, tx_size, tx_pos;
+	std::vector<uint8> tx_rest; // data of a closed session that is sent after tx_buf
+	std::vector<uint8> stash; // received data that did not fit into the RFIFO, at most the RFIFO size
+};
+
+static struct{
+	int fd;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_local_tail; // includes the requests that were not yet published
+	struct io_uring_sqe* sqes;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+	void* ring;
+	size_t ring_size;
+	size_t sqes_size;
+	struct io_uring_buf_ring* buf_ring;
+	size_t buf_ring_size;
+	uint8* buffers;
+	unsigned short buf_tail;
+	int sessions; // allocated session states, including closing ones
+} uring;
+
+static struct s_uring_session* session_uring[MAXCONN];
+
+/// Returns the next free submission queue entry, submits the queue if it is full.
+static struct io_uring_sqe* uring_get_sqe(void)
+{
+	while( uring.sq_local_tail - __atomic_load_n( uring.sq_head, __ATOMIC_ACQUIRE ) >= uring.sq_entries ){
+		__atomic_store_n( uring.sq_tail, uring.sq_local_tail, __ATOMIC_RELEASE );
+
+		if( syscall( __NR_io_uring_enter, uring.fd, uring.sq_entries, 0, 0, nullptr, 0 ) < 0 && sErrno != S_EINTR ){
+			ShowFatalError( "uring_get_sqe: io_uring_enter() failed, %s!\n", error_msg() );
+			exit( EXIT_FAILURE );
+		}
+	}
+
+	unsigned index = uring.sq_local_tail & uring.sq_mask;
+	struct io_uring_sqe* sqe = &uring.sqes[index];
+
+	memset( sqe, 0, sizeof( struct io_uring_sqe ) );
+	uring.sq_array[index] = index;
+	uring.sq_local_tail++;
+
+	return sqe;
+}
+
+/// Publishes the queued requests and returns how many the kernel did not consume yet.
+static unsigned uring_publish(void)
+{
+	__atomic_store_n( uring.sq_tail, uring.sq_local_tail, __ATOMIC_RELEASE );
+
+	return uring.sq_local_tail - __atomic_load_n( uring.sq_head, __ATOMIC_ACQUIRE );
+}
+
+/// Submits all queued requests without waiting for completions.
+static void uring_submit(void)
+{
+	unsigned count;
+
+	while( ( count = uring_publish() ) > 0 ){
+		if( syscall( __NR_io_uring_enter, uring.fd, count, 0, 0, nullptr, 0 ) < 0 && sErrno != S_EINTR ){
+			ShowFatalError( "uring_submit: io_uring_enter() failed, %s!\n", error_msg() );
+			exit( EXIT_FAILURE );
+		}
+	}
+}
+
+/// Hands a receive buffer back to the kernel, published with the next batch of completions.
+static void uring_buffer_return(unsigned short bid)
+{
+	// the entries are not accessed through bufs[], its flexible array member has a different offset in C++
+	struct io_uring_buf* buf = (struct io_uring_buf*)uring.buf_ring + ( uring.buf_tail & ( URING_BUFFER_COUNT - 1 ) );
+
+	buf->addr = (uint64)( uring.buffers + (size_t)bid * URING_BUFFER_SIZE );
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+	uring.buf_tail++;
+}
+
+/// Queues the receive request of a session.
+static void uring_arm_recv(struct s_uring_session* st)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe();
+
+	sqe->fd = st->fd;
+	sqe->user_data = (uint64)(uintptr_t)st | URING_OP_RECV;
+
+	if( st->listener ){
+		// one accept per completion, the poll request is armed again afterwards
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = POLLIN;
+	}else{
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BUFFER_GROUP;
+	}
+
+	st->recv_armed = true;
+}
+
+/// Queues a send request for the remaining data of the send buffer.
+/// Closed sessions do not wait for space in the kernel send buffer, like a nonblocking send.
+static void uring_arm_send(struct s_uring_session* st)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = st->fd;
+	sqe->addr = (uint64)(uintptr_t)( st->tx_buf + st->tx_pos );
+	sqe->len = (uint32)( st->tx_size - st->tx_pos );
+	sqe->msg_flags = MSG_NOSIGNAL | ( st->closing ? MSG_DONTWAIT : 0 );
+	sqe->user_data = (uint64)(uintptr_t)st | URING_OP_SEND;
+
+	st->send_inflight = true;
+}
+
+/// Queues the cancellation of an outstanding request of a session.
+static void uring_cancel(struct s_uring_session* st, uint64 op)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uint64)(uintptr_t)st | op;
+	sqe->user_data = 0;
+}
+
+/// Frees the state of a closed session and closes its socket once the kernel released it.
+static void uring_release(struct s_uring_session* st)
+{
+	if( !st->closing || st->recv_armed || st->send_inflight )
+		return;
+
+	sShutdown( st->fd, SHUT_RDWR );
+	sClose( st->fd );
+	aFree( st->tx_buf );
+	delete st;
+	uring.sessions--;
+}
+
+/// Copies received data into the RFIFO, keeps what does not fit for later.
+static void uring_deliver(struct s_uring_session* st, const uint8* data, size_t len)
+{
+	int fd = st->fd;
+	size_t copied = 0;
+
+	if( !session_isActive(fd) )
+		return;
+
+	if( st->stash.empty() ){
+		copied = zmin( len, RFIFOSPACE(fd) );
+		memcpy( session[fd]->rdata + session[fd]->rdata_size, data, copied );
+		session[fd]->rdata_size += copied;
+	}
+
+	if( copied < len ){
+		st->stash.insert( st->stash.end(), data + copied, data + len );
+		recv_pending_add(fd);
+
+		// stop receiving until the parser caught up, the kernel keeps the rest
+		if( st->stash.size() >= session[fd]->max_rdata && !st->recv_paused ){
+			st->recv_paused = true;
+
+			if( st->recv_armed )
+				uring_cancel( st, URING_OP_RECV );
+		}
+	}
+
+	session[fd]->rdata_tick = last_tick;
+#ifdef SHOW_SERVER_STATS
+	socket_data_i += len;
+	socket_data_qi += len;
+	if (!session[fd]->flag.server)
+	{
+		socket_data_ci += len;
+	}
+#endif
+}
+
+/// Moves data that did not fit into the RFIFO before.
+static int uring_recv_to_fifo(int fd)
+{
+	struct s_uring_session* st = session_uring[fd];
+
+	if( !session_isActive(fd) || st == nullptr )
+		return -1;
+
+	size_t len = zmin( st->stash.size(), RFIFOSPACE(fd) );
+
+	if( len > 0 ){
+		memcpy( session[fd]->rdata + session[fd]->rdata_size, st->stash.data(), len );
+		session[fd]->rdata_size += len;
+		st->stash.erase( st->stash.begin(), st->stash.begin() + len );
+	}
+
+	if( !st->stash.empty() ){
+		// read fifo is full, continue after the data was parsed
+		recv_pending_add(fd);
+	}else if( st->recv_paused ){
+		st->recv_paused = false;
+
+		if( !st->recv_armed )
+			uring_arm_recv( st );
+	}
+
+	return 0;
+}
+
+/// Hands the WFIFO to the kernel and continues with an empty one.
+static int uring_send_from_fifo(int fd)
+{
+	struct s_uring_session* st = session_uring[fd];
+
+	if( !session_isValid(fd) || st == nullptr )
+		return -1;
+
+	if( session[fd]->wdata_size == 0 || st->send_inflight )
+		return 0; // nothing to send or the previous send did not complete yet
+
+	uint8* buf = session[fd]->wdata;
+	size_t cap = session[fd]->max_wdata;
+
+	session[fd]->wdata = st->tx_buf;
+	session[fd]->max_wdata = st->tx_cap;
+	st->tx_buf = buf;
+	st->tx_cap = cap;
+	st->tx_size = session[fd]->wdata_size;
+	st->tx_pos = 0;
+	session[fd]->wdata_size = 0;
+	session[fd]->wdata_tick = last_tick;
+	// the send shortlist picks the session up again once the send completed
+	session[fd]->flag.wait_writable = 1;
+
+	uring_arm_send( st );
+
+	return 0;
+}
+
+/// Handles a single completion.
+static void uring_complete(struct io_uring_cqe* cqe)
+{
+	struct s_uring_session* st = (struct s_uring_session*)(uintptr_t)( cqe->user_data & ~(uint64)1 );
+	int fd = st->fd;
+
+	if( ( cqe->user_data & 1 ) == URING_OP_SEND ){
+		if( cqe->res > 0 ){
+			st->tx_pos += cqe->res;
+#ifdef SHOW_SERVER_STATS
+			socket_data_o += cqe->res;
+			socket_data_qo -= cqe->res;
+			if( !st->closing && !session[fd]->flag.server )
+			{
+				socket_data_co += cqe->res;
+			}
+#endif
+			if( st->tx_pos < st->tx_size ){
+				uring_arm_send( st );
+				return;
+			}
+		}else if( !st->closing ){
+			set_eof(fd);
+		}
+
+		if( st->closing && ( cqe->res > 0 || cqe->res == -ECANCELED ) ){
+			// send what is left of the closed session without waiting
+			if( st->tx_pos < st->tx_size ){
+				uring_arm_send( st );
+				return;
+			}
+
+			if( !st->tx_rest.empty() ){
+				if( st->tx_cap < st->tx_rest.size() ){
+					aFree( st->tx_buf );
+					st->tx_cap = st->tx_rest.size();
+					st->tx_buf = (uint8*)aMalloc( st->tx_cap );
+				}
+				memcpy( st->tx_buf, st->tx_rest.data(), st->tx_rest.size() );
+				st->tx_size = st->tx_rest.size();
+				st->tx_pos = 0;
+				st->tx_rest.clear();
+				uring_arm_send( st );
+				return;
+			}
+		}
+
+#ifdef SHOW_SERVER_STATS
+		socket_data_qo -= st->tx_size - st->tx_pos;
+#endif
+		st->send_inflight = false;
+
+		if( st->closing ){
+			uring_release( st );
+			return;
+		}
+
+		session[fd]->flag.wait_writable = 0;
+#ifdef SEND_SHORTLIST
+		if( session[fd]->wdata_size )
+			send_shortlist_add_fd(fd);
+#endif
+		return;
+	}
+
+	bool more = ( cqe->flags & IORING_CQE_F_MORE ) != 0;
+
+	if( !more ){
+		st->recv_armed = false;
+	}
+
+	if( cqe->flags & IORING_CQE_F_BUFFER ){
+		unsigned short bid = (unsigned short)( cqe->flags >> IORING_CQE_BUFFER_SHIFT );
+
+		if( cqe->res > 0 && !st->closing ){
+			uring_deliver( st, uring.buffers + (size_t)bid * URING_BUFFER_SIZE, cqe->res );
+		}
+
+		uring_buffer_return( bid );
+	}
+
+	if( st->closing ){
+		uring_release( st );
+		return;
+	}
+
+	if( st->listener ){
+		if( cqe->res > 0 ){
+			session[fd]->func_recv(fd);
+		}
+
+		uring_arm_recv( st );
+	}else if( cqe->res == 0 || ( cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED ) ){
+		// Normal connection end or an error
+		set_eof(fd);
+	}else if( !more && !st->recv_paused ){
+		// the kernel ran out of buffers, stopped the multishot request or it was paused before
+		uring_arm_recv( st );
+	}
+}
+
+/// Submits the queued requests, waits for completions until the next tick at most and handles them.
+/// Returns false if it was interrupted by a signal.
+static bool uring_dispatch(t_tick next)
+{
+	unsigned count = uring_publish();
+	bool ready = __atomic_load_n( uring.cq_tail, __ATOMIC_ACQUIRE ) != *uring.cq_head;
+
+	if( count > 0 || !ready ){
+		struct __kernel_timespec ts;
+		struct io_uring_getevents_arg arg = {};
+
+		ts.tv_sec = next / 1000;
+		ts.tv_nsec = next % 1000 * 1000000;
+		arg.ts = (uint64)(uintptr_t)&ts;
+
+		if( syscall( __NR_io_uring_enter, uring.fd, count, ready ? 0 : 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof( arg ) ) < 0 ){
+			if( sErrno == S_EINTR ){
+				return false; // interrupted by a signal, just loop and try again
+			}
+
+			if( sErrno != ETIME && sErrno != EBUSY ){
+				ShowFatalError( "do_sockets: io_uring_enter() failed, %s!\n", error_msg() );
+				exit( EXIT_FAILURE );
+			}
+		}
+	}
+
+	last_tick = time(NULL);
+
+	unsigned head = *uring.cq_head;
+	unsigned tail = __atomic_load_n( uring.cq_tail, __ATOMIC_ACQUIRE );
+
+	for( ; head != tail; head++ ){
+		struct io_uring_cqe* cqe = &uring.cqes[head & uring.cq_mask];
+
+		// cancellations carry no session
+		if( cqe->user_data != 0 )
+			uring_complete( cqe );
+	}
+
+	__atomic_store_n( uring.cq_head, head, __ATOMIC_RELEASE );
+	__atomic_store_n( &uring.buf_ring->tail, uring.buf_tail, __ATOMIC_RELEASE );
+
+	return true;
+}
+
+/// Lets the session be handled by io_uring.
+static void uring_attach(int fd, bool listener)
+{
+	struct s_uring_session* st = new s_uring_session();
+
+	st->fd = fd;
+	st->listener = listener;
+	st->closing = false;
+	st->recv_armed = false;
+	st->recv_paused = false;
+	st->send_inflight = false;
+	st->tx_cap = WFIFO_SIZE;
+	st->tx_buf = (uint8*)aMalloc( st->tx_cap );
+	st->tx_size = st->tx_pos = 0;
+
+	session_uring[fd] = st;
+	uring.sessions++;
+
+	if( !listener ){
+		session[fd]->func_recv = uring_recv_to_fifo;
+		session[fd]->func_send = uring_send_from_fifo;
+	}
+
+	uring_arm_recv( st );
+}
+
+/// The session is being closed, its state is released and the socket is closed once the kernel
+/// completed all requests. Until then the fd can not be reused.
+/// Data that was queued for sending is still sent, without waiting for the client to read it.
+/// Returns false if the session is not handled by io_uring.
+static bool uring_detach(int fd)
+{
+	struct s_uring_session* st = session_uring[fd];
+
+	if( st == nullptr )
+		return false;
+
+	// the WFIFO could not be handed over while the previous send is outstanding
+	if( !st->listener && st->send_inflight && session[fd] != nullptr && session[fd]->wdata_size > 0 ){
+		st->tx_rest.assign( session[fd]->wdata, session[fd]->wdata + session[fd]->wdata_size );
+		session[fd]->wdata_size = 0;
+	}
+
+	uring_submit();
+
+	session_uring[fd] = nullptr;
+	st->closing = true;
+
+	if( !st->recv_armed && !st->send_inflight ){
+		uring_release( st );
+		return true;
+	}
+
+	if( st->listener ){
+		// shutting down a listening socket does not complete its poll request
+		struct io_uring_sqe* sqe = uring_get_sqe();
+
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = (uint64)(uintptr_t)st | URING_OP_RECV;
+		sqe->user_data = 0;
+	}else{
+		if( st->recv_armed )
+			uring_cancel( st, URING_OP_RECV );
+		// a send waiting for space is retried without waiting
+		if( st->send_inflight )
+			uring_cancel( st, URING_OP_SEND );
+	}
+	uring_submit();
+
+	return true;
+}
+
+/// Creates the ring and registers the receive buffers.
+/// Returns false if io_uring is not available.
+static bool uring_init(void)
+{
+	struct io_uring_params params = {};
+	struct io_uring_buf_reg reg = {};
+	unsigned entries = 64;
+
+	// a few requests per session and cycle at most
+	while( entries < 2 * MAXCONN && entries < 16384 ){
+		entries <<= 1;
+	}
+
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = entries * 4;
+
+	uring.fd = (int)syscall( __NR_io_uring_setup, entries, &params );
+
+	if( uring.fd < 0 ){
+		ShowWarning( "uring_init: io_uring_setup() failed, %s!\n", error_msg() );
+		return false;
+	}
+
+	if( !( params.features & IORING_FEAT_SINGLE_MMAP ) || !( params.features & IORING_FEAT_EXT_ARG ) ){
+		ShowWarning( "uring_init: The kernel is too old for the io_uring event dispatcher.\n" );
+		sClose( uring.fd );
+		return false;
+	}
+
+	uring.ring_size = zmax( params.sq_off.array + params.sq_entries * sizeof( unsigned ), params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe ) );
+	uring.ring = mmap( nullptr, uring.ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING );
+	uring.sqes_size = params.sq_entries * sizeof( struct io_uring_sqe );
+	uring.sqes = (struct io_uring_sqe*)mmap( nullptr, uring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES );
+
+	if( uring.ring == MAP_FAILED || uring.sqes == MAP_FAILED ){
+		ShowError( "uring_init: Failed to map the io_uring queues, %s!\n", error_msg() );
+		exit( EXIT_FAILURE );
+	}
+
+	uint8* ring = (uint8*)uring.ring;
+
+	uring.sq_head = (unsigned*)( ring + params.sq_off.head );
+	uring.sq_tail = (unsigned*)( ring + params.sq_off.tail );
+	uring.sq_array = (unsigned*)( ring + params.sq_off.array );
+	uring.sq_mask = *(unsigned*)( ring + params.sq_off.ring_mask );
+	uring.sq_entries = params.sq_entries;
+	uring.sq_local_tail = *uring.sq_tail;
+	uring.cq_head = (unsigned*)( ring + params.cq_off.head );
+	uring.cq_tail = (unsigned*)( ring + params.cq_off.tail );
+	uring.cq_mask = *(unsigned*)( ring + params.cq_off.ring_mask );
+	uring.cqes = (struct io_uring_cqe*)( ring + params.cq_off.cqes );
+
+	// the buffer ring has to be page aligned
+	uring.buf_ring_size = URING_BUFFER_COUNT * sizeof( struct io_uring_buf );
+	uring.buf_ring = (struct io_uring_buf_ring*)mmap( nullptr, uring.buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0 );
+
+	if( uring.buf_ring == MAP_FAILED ){
+		ShowError( "uring_init: Failed to allocate the io_uring buffer ring, %s!\n", error_msg() );
+		exit( EXIT_FAILURE );
+	}
+
+	reg.ring_addr = (uint64)(uintptr_t)uring.buf_ring;
+	reg.ring_entries = URING_BUFFER_COUNT;
+	reg.bgid = URING_BUFFER_GROUP;
+
+	if( syscall( __NR_io_uring_register, uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 ){
+		ShowWarning( "uring_init: The kernel does not support registered buffer rings (%s).\n", error_msg() );
+		munmap( uring.buf_ring, uring.buf_ring_size );
+		munmap( uring.sqes, uring.sqes_size );
+		munmap( uring.ring, uring.ring_size );
+		sClose( uring.fd );
+		return false;
+	}
+
+	uring.buffers = (uint8*)aMalloc( (size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE );
+	uring.buf_tail = 0;
+
+	for( unsigned short bid = 0; bid < URING_BUFFER_COUNT; bid++ ){
+		uring_buffer_return( bid );
+	}
+
+	__atomic_store_n( &uring.buf_ring->tail, uring.buf_tail, __ATOMIC_RELEASE );
 
-#if !defined(WIN32)
-	// set SO_REAUSEADDR to true, unix only. on windows this option causes
-	// the previous owner of the socket to give up, which is not desirable
-	// in most cases, neither compatible with unix.
-	sSetsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char *)&yes,sizeof(yes));
-#ifdef SO_REUSEPORT
-	sSetsockopt(fd,SOL_SOCKET,SO_REUSEPORT,(char *)&yes,sizeof(yes));
-#endif
-#endif
+	ShowInfo( "Server uses '" CL_WHITE "io_uring" CL_RESET "' with " CL_WHITE "%u" CL_RESET " submission entries as event dispatcher\n", uring.sq_entries );
 
-	// Set the socket into no-delay mode; otherwise packets get delayed for up to 200ms, likely creating server-side lag.
-	// The RO protocol is mainly single-packet request/response, plus the FIFO model already does packet grouping anyway.
-	sSetsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&yes, sizeof(yes));
+	return true;
+}
 
-	// force the socket into no-wait, graceful-close mode (should be the default, but better make sure)
-	//(https://msdn.microsoft.com/en-us/library/windows/desktop/ms737582%28v=vs.85%29.aspx)
-	{
-		struct linger opt;
-		opt.l_onoff = 0; // SO_DONTLINGER
-		opt.l_linger = 0; // Do not care
-		if( sSetsockopt(fd, SOL_SOCKET, SO_LINGER, (char*)&opt, sizeof(opt)) )
-			ShowWarning("setsocketopts: Unable to set SO_LINGER mode for connection #%d!\n", fd);
+/// Waits for the closed sessions and destroys the ring.
+static void uring_final(void)
+{
+	// the sessions were closed already, collect their last completions
+	for( int i = 0; i < 100 && uring.sessions > 0; i++ ){
+		uring_dispatch( 10 );
 	}
-	if(delay_timeout){
-#if defined(WIN32)
-		int timeout = delay_timeout * 1000;
-#else
-		struct timeval timeout;
-		timeout.tv_sec = delay_timeout;
-		timeout.tv_usec = 0;
-#endif
 
-		if (sSetsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout,sizeof(timeout)) < 0)
-			ShowError("setsocketopts: Unable to set SO_RCVTIMEO timeout for connection #%d!\n", fd);
-		if (sSetsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout,sizeof(timeout)) < 0)
-			ShowError("setsocketopts: Unable to set SO_SNDTIMEO timeout for connection #%d!\n", fd);
-	}
+	munmap( uring.buf_ring, uring.buf_ring_size );
+	munmap( uring.sqes, uring.sqes_size );
+	munmap( uring.ring, uring.ring_size );
+	sClose( uring.fd );
+	aFree( uring.buffers );
 }
+#endif
 
 /*======================================
  *	CORE : Socket Sub Function
@@ -371,6 +1751,46 @@ int recv_to_fifo(int fd)
 	if( !session_isActive(fd) )
 		return -1;
 
+#ifdef SOCKET_EPOLL
+	if( epoll_edge_triggered ){
+		size_t budget = ( epoll_recv_budget && !session[fd]->flag.server ) ? epoll_recv_budget : SIZE_MAX;
+		size_t total = 0;
+
+		// The socket will not be signaled again until it was read until EAGAIN
+		while( RFIFOSPACE(fd) > 0 && total < budget ){
+			len = sRecv(fd, (char *) session[fd]->rdata + session[fd]->rdata_size, (int)zmin(RFIFOSPACE(fd), budget - total), 0);
+
+			if( len == SOCKET_ERROR ){
+				if( sErrno != S_EWOULDBLOCK ){
+					set_eof(fd);
+				}
+				return 0; // drained or failed
+			}
+
+			if( len == 0 ){
+				set_eof(fd);
+				return 0;
+			}
+
+			session[fd]->rdata_size += len;
+			session[fd]->rdata_tick = last_tick;
+			total += len;
+#ifdef SHOW_SERVER_STATS
+			socket_data_i += len;
+			socket_data_qi += len;
+			if (!session[fd]->flag.server)
+			{
+				socket_data_ci += len;
+			}
+#endif
+		}
+
+		// budget or read fifo exhausted, there might still be data left in the socket
+		recv_pending_add(fd);
+		return 0;
+	}
+#endif
+
 	len = sRecv(fd, (char *) session[fd]->rdata + session[fd]->rdata_size, (int)RFIFOSPACE(fd), 0);
 
 	if( len == SOCKET_ERROR )
@@ -401,6 +1821,102 @@ int recv_to_fifo(int fd)
 	return 0;
 }
 
+/// Releases all shared packets queued in the send queue of the session.
+static void wfifo_clear_packets(int fd)
+{
+	for( size_t i = 0; i < session[fd]->wpackets_count; i++ )
+		socket_packet_release(session[fd]->wpackets[i].packet);
+
+	session[fd]->wpackets_count = 0;
+	session[fd]->wpackets_size = 0;
+}
+
+/// Removes len sent bytes from the front of the send queue.
+static void wfifo_consume(int fd, size_t len)
+{
+	struct socket_data* s = session[fd];
+	size_t wpos = 0; // bytes of wdata that were sent
+	size_t done = 0; // shared packets that were sent completely
+
+	while( len > 0 ){
+		if( done < s->wpackets_count && s->wpackets[done].pos == wpos ){
+			struct socket_packet_ref* ref = &s->wpackets[done];
+			size_t n = zmin(len, ref->packet->len - ref->sent);
+
+			ref->sent += n;
+			s->wpackets_size -= n;
+			len -= n;
+
+			if( ref->sent == ref->packet->len ){
+				socket_packet_release(ref->packet);
+				done++;
+			}
+		}else{
+			size_t end = ( done < s->wpackets_count ) ? s->wpackets[done].pos : s->wdata_size;
+			size_t n = zmin(len, end - wpos);
+
+			wpos += n;
+			len -= n;
+		}
+	}
+
+	// some data could not be transferred?
+	// shift unsent data to the beginning of the queue
+	if( wpos < s->wdata_size )
+		memmove(s->wdata, s->wdata + wpos, s->wdata_size - wpos);
+
+	s->wdata_size -= wpos;
+
+	if( done > 0 || wpos > 0 ){
+		s->wpackets_count -= done;
+		memmove(s->wpackets, s->wpackets + done, s->wpackets_count * sizeof(struct socket_packet_ref));
+
+		for( size_t i = 0; i < s->wpackets_count; i++ )
+			s->wpackets[i].pos -= wpos;
+	}
+}
+
+#ifndef WIN32
+/// Sends up to wlen bytes of a send queue that holds shared packets, with a single system call.
+static int send_gather(int fd, size_t wlen)
+{
+	struct socket_data* s = session[fd];
+	struct iovec iov[WFIFO_IOV_MAX];
+	struct msghdr msg;
+	size_t count = 0;
+	size_t wpos = 0;
+
+	for( size_t i = 0; i <= s->wpackets_count && count < WFIFO_IOV_MAX && wlen > 0; i++ ){
+		size_t end = ( i < s->wpackets_count ) ? s->wpackets[i].pos : s->wdata_size;
+
+		// data of the fifo in front of the packet
+		if( end > wpos ){
+			iov[count].iov_base = s->wdata + wpos;
+			iov[count].iov_len = zmin(end - wpos, wlen);
+			wlen -= iov[count].iov_len;
+			wpos = end;
+			count++;
+		}
+
+		if( i == s->wpackets_count || count == WFIFO_IOV_MAX || wlen == 0 )
+			break;
+
+		struct socket_packet_ref* ref = &s->wpackets[i];
+
+		iov[count].iov_base = ref->packet->data + ref->sent;
+		iov[count].iov_len = zmin(ref->packet->len - ref->sent, wlen);
+		wlen -= iov[count].iov_len;
+		count++;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+
+	return (int)sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+#endif
+
 int send_from_fifo(int fd)
 {
 	int len;
@@ -408,34 +1924,60 @@ int send_from_fifo(int fd)
 	if( !session_isValid(fd) )
 		return -1;
 
-	if( session[fd]->wdata_size == 0 )
+	if( session[fd]->wdata_size == 0 && session[fd]->wpackets_count == 0 )
 		return 0; // nothing to send
 
-	len = sSend(fd, (const char *) session[fd]->wdata, (int)session[fd]->wdata_size, MSG_NOSIGNAL);
+	size_t wlen = session[fd]->wdata_size + session[fd]->wpackets_size;
+
+#ifdef SOCKET_EPOLL
+	if( epoll_edge_triggered ){
+		if( session[fd]->flag.wait_writable )
+			return 0; // kernel send buffer is still full
+
+		if( epoll_send_budget && !session[fd]->flag.server ){
+			if( session[fd]->wdata_cycle >= epoll_send_budget )
+				return 0; // budget of this cycle is spent, the shortlist keeps the session
+			wlen = zmin(wlen, epoll_send_budget - session[fd]->wdata_cycle);
+		}
+	}
+#endif
+
+#ifndef WIN32
+	if( session[fd]->wpackets_count > 0 )
+		len = send_gather(fd, wlen);
+	else
+#endif
+	len = sSend(fd, (const char *) session[fd]->wdata, (int)wlen, MSG_NOSIGNAL);
 
 	if( len == SOCKET_ERROR )
 	{//An exception has occured
 		if( sErrno != S_EWOULDBLOCK ) {
 			//ShowDebug("send_from_fifo: %s, ending connection #%d\n", error_msg(), fd);
 #ifdef SHOW_SERVER_STATS
-			socket_data_qo -= session[fd]->wdata_size;
+			socket_data_qo -= session[fd]->wdata_size + session[fd]->wpackets_size;
 #endif
 			session[fd]->wdata_size = 0; //Clear the send queue as we can't send anymore. [Skotlex]
+			wfifo_clear_packets(fd);
 			set_eof(fd);
 		}
+#ifdef SOCKET_EPOLL
+		else if( epoll_edge_triggered )
+			epoll_wait_writable(fd);
+#endif
 		return 0;
 	}
 
 	if( len > 0 )
 	{
+#ifdef SOCKET_EPOLL
+		// a partial send means the kernel send buffer is full
+		if( (size_t)len < wlen && epoll_edge_triggered )
+			epoll_wait_writable(fd);
+#endif
 		session[fd]->wdata_tick = last_tick;
+		session[fd]->wdata_cycle += len;
 
-		// some data could not be transferred?
-		// shift unsent data to the beginning of the queue
-		if( (size_t)len < session[fd]->wdata_size )
-			memmove(session[fd]->wdata, session[fd]->wdata + len, session[fd]->wdata_size - len);
-
-		session[fd]->wdata_size -= len;
+		wfifo_consume(fd, len);
 #ifdef SHOW_SERVER_STATS
 		socket_data_o += len;
 		socket_data_qo -= len;
@@ -504,13 +2046,15 @@ int connect_client(int listen_fd)
 
 #ifndef SOCKET_EPOLL
 	// Select Based Event Dispatcher
-	sFD_SET(fd,&readfds);
+	if( !uring_enabled )
+		sFD_SET(fd,&readfds);
 #else
 	// Epoll based Event Dispatcher
 	epevent.data.fd = fd;
-	epevent.events = EPOLLIN;
+	epevent.events = epoll_session_events();
 
-	if( epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &epevent ) == SOCKET_ERROR ){
+	// Sessions owned by network I/O threads are registered in their event dispatcher instead
+	if( !uring_enabled && io_threads == 0 && epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &epevent ) == SOCKET_ERROR ){
 		ShowError( "connect_client: Failed to add to epoll event dispatcher for new socket #%d: %s\n", fd, error_msg() );
 		sClose( fd );
 		return -1;
@@ -522,6 +2066,19 @@ int connect_client(int listen_fd)
 	create_session(fd, recv_to_fifo, send_from_fifo, default_func_parse);
 	session[fd]->client_addr = ntohl(client_address.sin_addr.s_addr);
 
+#ifdef SOCKET_IO_URING
+	if( uring_enabled )
+		uring_attach( fd, false );
+#endif
+
+#ifdef SOCKET_EPOLL
+	if( io_threads > 0 && !io_attach( fd, false ) ){
+		ShowError( "connect_client: Failed to hand new socket #%d to a network I/O thread: %s\n", fd, error_msg() );
+		do_close( fd );
+		return -1;
+	}
+#endif
+
 	return fd;
 }
 
@@ -571,13 +2128,14 @@ int make_listen_bind(uint32 ip, uint16 port)
 
 #ifndef SOCKET_EPOLL
 	// Select Based Event Dispatcher
-	sFD_SET(fd, &readfds);
+	if( !uring_enabled )
+		sFD_SET(fd, &readfds);
 #else
 	// Epoll based Event Dispatcher
 	epevent.data.fd = fd;
 	epevent.events = EPOLLIN;
 
-	if( epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &epevent ) == SOCKET_ERROR ){
+	if( !uring_enabled && epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &epevent ) == SOCKET_ERROR ){
 		ShowError( "make_listen_bind: failed to add listener socket #%d to epoll event dispatcher: %s\n", fd, error_msg() );
 		sClose(fd);
 		exit(EXIT_FAILURE);
@@ -591,6 +2149,11 @@ int make_listen_bind(uint32 ip, uint16 port)
 	session[fd]->rdata_tick = 0; // disable timeouts on this socket
 	session[fd]->wdata_tick = 0;
 
+#ifdef SOCKET_IO_URING
+	if( uring_enabled )
+		uring_attach( fd, true );
+#endif
+
 	return fd;
 }
 
@@ -698,13 +2261,15 @@ int make_connection(uint32 ip, uint16 port, bool silent,int timeout) {
 
 #ifndef SOCKET_EPOLL
 	// Select Based Event Dispatcher
-	sFD_SET(fd,&readfds);
+	if( !uring_enabled )
+		sFD_SET(fd,&readfds);
 #else
 	// Epoll based Event Dispatcher
 	epevent.data.fd = fd;
-	epevent.events = EPOLLIN;
+	epevent.events = epoll_session_events();
 
-	if( epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &epevent ) == SOCKET_ERROR ){
+	// Sessions owned by network I/O threads are registered in their event dispatcher instead
+	if( !uring_enabled && io_threads == 0 && epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &epevent ) == SOCKET_ERROR ){
 		ShowError( "make_connection: failed to add socket #%d to epoll event dispatcher: %s\n", fd, error_msg() );
 		sClose(fd);
 		return -1;
@@ -716,6 +2281,19 @@ int make_connection(uint32 ip, uint16 port, bool silent,int timeout) {
 	create_session(fd, recv_to_fifo, send_from_fifo, default_func_parse);
 	session[fd]->client_addr = ntohl(remote_address.sin_addr.s_addr);
 
+#ifdef SOCKET_IO_URING
+	if( uring_enabled )
+		uring_attach( fd, false );
+#endif
+
+#ifdef SOCKET_EPOLL
+	if( io_threads > 0 && !io_attach( fd, true ) ){
+		ShowError( "make_connection: failed to hand socket #%d to a network I/O thread: %s\n", fd, error_msg() );
+		do_close( fd );
+		return -1;
+	}
+#endif
+
 	return fd;
 }
 
@@ -740,10 +2318,12 @@ static void delete_session(int fd)
 	{
 #ifdef SHOW_SERVER_STATS
 		socket_data_qi -= session[fd]->rdata_size - session[fd]->rdata_pos;
-		socket_data_qo -= session[fd]->wdata_size;
+		socket_data_qo -= session[fd]->wdata_size + session[fd]->wpackets_size;
 #endif
+		wfifo_clear_packets(fd);
 		aFree(session[fd]->rdata);
 		aFree(session[fd]->wdata);
+		aFree(session[fd]->wpackets);
 		aFree(session[fd]->session_data);
 		aFree(session[fd]);
 		session[fd] = NULL;
@@ -858,7 +2438,7 @@ int WFIFOSET(int fd, size_t len)
 			return 0;
 		}
 
-		if( s->wdata_size+len > WFIFO_MAX ) {// reached maximum write fifo size
+		if( s->wdata_size+s->wpackets_size+len > WFIFO_MAX ) {// reached maximum write fifo size
 			ShowError("WFIFOSET: Maximum write buffer size for client connection %d exceeded, most likely caused by packet 0x%04x (len=%" PRIuPTR ", ip=%lu.%lu.%lu.%lu).\n", fd, WFIFOW(fd,0), len, CONVIP(s->client_addr));
 			set_eof(fd);
 			return 0;
@@ -887,28 +2467,84 @@ int WFIFOSET(int fd, size_t len)
 	return 0;
 }
 
-int do_sockets(t_tick next)
+/// Queues a packet that is sent to several sessions.
+/// The data is copied into *packet once and only referenced by the send queue of every further session.
+/// Small packets and sessions that are not sent by send_from_fifo get a copy in their WFIFO instead.
+/// The caller has to release *packet with socket_packet_release after the last session.
+int WFIFOSET_SHARED(int fd, const void* buf, size_t len, struct socket_packet** packet)
 {
-#ifndef SOCKET_EPOLL
-	fd_set rfd;
-	struct timeval timeout;
-#endif
-	int ret,i;
+	struct socket_data* s = session[fd];
 
-	// PRESEND Timers are executed before do_sendrecv and can send packets and/or set sessions to eof.
-	// Send remaining data and process client-side disconnects here.
-#ifdef SEND_SHORTLIST
-	send_shortlist_do_sends();
-#else
-	for (i = 1; i < fd_max; i++)
+	if( !session_isValid(fd) || s->wdata == NULL )
+		return 0;
+
+#ifndef WIN32
+	if( len < WFIFO_SHARED_MIN || len > socket_max_client_packet || s->flag.server || s->func_send != send_from_fifo )
+#endif
 	{
-		if(!session[i])
-			continue;
+		WFIFOHEAD(fd, len);
+		memcpy(WFIFOP(fd,0), buf, len);
+		return WFIFOSET(fd, len);
+	}
 
-		if(session[i]->wdata_size)
-			session[i]->func_send(i);
+	if( s->wdata_size+s->wpackets_size+len > WFIFO_MAX ) {// reached maximum write fifo size
+		ShowError("WFIFOSET_SHARED: Maximum write buffer size for client connection %d exceeded, most likely caused by packet 0x%04x (len=%" PRIuPTR ", ip=%lu.%lu.%lu.%lu).\n", fd, RBUFW(buf,0), len, CONVIP(s->client_addr));
+		set_eof(fd);
+		return 0;
+	}
+
+	if( *packet == NULL ) {
+		// the caller holds the first reference
+		*packet = (struct socket_packet*)aMalloc(sizeof(struct socket_packet) + len);
+		(*packet)->refcount = 1;
+		(*packet)->len = len;
+		(*packet)->data = (uint8*)(*packet + 1);
+		memcpy((*packet)->data, buf, len);
+	}
+
+	if( s->wpackets_count == s->max_wpackets ) {
+		s->max_wpackets = s->max_wpackets ? 2 * s->max_wpackets : 16;
+		RECREATE(s->wpackets, struct socket_packet_ref, s->max_wpackets);
 	}
+
+	struct socket_packet_ref* ref = &s->wpackets[s->wpackets_count++];
+
+	ref->pos = s->wdata_size;
+	ref->sent = 0;
+	ref->packet = *packet;
+	(*packet)->refcount++;
+
+	s->wpackets_size += len;
+#ifdef SHOW_SERVER_STATS
+	socket_data_qo += len;
+#endif
+
+#ifdef SEND_SHORTLIST
+	send_shortlist_add_fd(fd);
+#endif
+
+	return 0;
+}
+
+/// Drops a reference to a shared packet, the last one frees it.
+void socket_packet_release(struct socket_packet* packet)
+{
+	if( packet == NULL )
+		return;
+
+	if( --packet->refcount == 0 )
+		aFree(packet);
+}
+
+/// Waits for socket events until the next timer tick at most and lets the sessions receive.
+/// Returns false if it was interrupted by a signal.
+static bool socket_dispatch(t_tick next)
+{
+#ifndef SOCKET_EPOLL
+	fd_set rfd;
+	struct timeval timeout;
 #endif
+	int ret,i;
 
 #ifndef SOCKET_EPOLL
 	// Select based Event Dispatcher
@@ -927,7 +2563,7 @@ int do_sockets(t_tick next)
 			ShowFatalError("do_sockets: select() failed, %s!\n", error_msg());
 			exit(EXIT_FAILURE);
 		}
-		return 0; // interrupted by a signal, just loop and try again
+		return false; // interrupted by a signal, just loop and try again
 	}
 #else
 	// Epoll based Event Dispatcher
@@ -940,7 +2576,7 @@ int do_sockets(t_tick next)
 			exit( EXIT_FAILURE );
 		}
 
-		return 0; // interrupted by a signal, just loop and try again
+		return false; // interrupted by a signal, just loop and try again
 	}
 #endif
 
@@ -962,14 +2598,28 @@ int do_sockets(t_tick next)
 		int fd = it->data.fd;
 		struct socket_data *sock = session[fd];
 
+		if( fd == io_wakefd ){
+			// network I/O threads have news
+			io_process_notifications();
+			continue;
+		}
+
 		if( !sock ){
 			continue;
 		}
 
-		if( ( it->events & (EPOLLERR|EPOLLHUP) ) || !( it->events & EPOLLIN ) ){
+		if( ( it->events & (EPOLLERR|EPOLLHUP) ) || !( it->events & (EPOLLIN|EPOLLOUT) ) ){
 			// Got Error on this connection
 			set_eof( fd );
-		}else if( it->events & EPOLLIN ){
+			continue;
+		}
+
+		if( it->events & EPOLLOUT ){
+			// kernel send buffer has space again
+			epoll_writable( fd );
+		}
+
+		if( ( it->events & EPOLLIN ) && !sock->flag.read_pending ){
 			// data waiting
 			sock->func_recv( fd );
 		}
@@ -986,7 +2636,75 @@ int do_sockets(t_tick next)
 	}
 #endif
 
+	return true;
+}
+
+int do_sockets(t_tick next)
+{
+	int i;
+	// sessions that were left pending by the previous cycle
+	int pending = recv_pending_count;
+
+	// PRESEND Timers are executed before do_sendrecv and can send packets and/or set sessions to eof.
+	// Send remaining data and process client-side disconnects here.
+	if( func_presend )
+		func_presend();
+
+#ifdef SEND_SHORTLIST
+	send_shortlist_do_sends();
+#else
+	for (i = 1; i < fd_max; i++)
+	{
+		if(!session[i])
+			continue;
+
+		if(session[i]->wdata_size || session[i]->wpackets_count)
+			session[i]->func_send(i);
+	}
+#endif
+
+	// Sessions with unread data will not be signaled again, do not wait for new events.
+	// Sessions whose read fifo is full have to be parsed first, they do not count.
+	for( i = 0; i < pending; i++ ){
+		int fd = recv_pending_array[i];
+
+		if( session_isActive( fd ) && RFIFOSPACE( fd ) > 0 ){
+			next = 0;
+			break;
+		}
+	}
+
+#ifdef SOCKET_IO_URING
+	if( uring_enabled ){
+		if( !uring_dispatch(next) )
+			return 0; // interrupted by a signal, just loop and try again
+	}else
+#endif
+	if( !socket_dispatch(next) )
+		return 0; // interrupted by a signal, just loop and try again
+
+	// Continue reading sessions that still hold data, they got no new event
+	for( i = 0; i < pending; i++ ){
+		int fd = recv_pending_array[i];
+
+		if( !session_isActive( fd ) || !session[fd]->flag.read_pending ){
+			continue;
+		}
+
+		session[fd]->flag.read_pending = 0;
+		session[fd]->func_recv( fd );
+	}
+
+	// Keep the sessions that were added during this cycle
+	if( pending > 0 ){
+		recv_pending_count -= pending;
+		memmove( recv_pending_array, recv_pending_array + pending, recv_pending_count * sizeof( int ) );
+	}
+
 	// POSTSEND Send remaining data and handle eof sessions.
+	if( func_presend )
+		func_presend();
+
 #ifdef SEND_SHORTLIST
 	send_shortlist_do_sends();
 #else
@@ -995,7 +2713,7 @@ int do_sockets(t_tick next)
 		if(!session[i])
 			continue;
 
-		if(session[i]->wdata_size)
+		if(session[i]->wdata_size || session[i]->wpackets_count)
 			session[i]->func_send(i);
 
 		if(session[i]->flag.eof) //func_send can't free a session, this is safe.
@@ -1011,6 +2729,9 @@ int do_sockets(t_tick next)
 		if(!session[i])
 			continue;
 
+		// the send budget applies per cycle
+		session[i]->wdata_cycle = 0;
+
 		if (session[i]->rdata_tick && DIFF_TICK(last_tick, session[i]->rdata_tick) > stall_time) {
 			if( session[i]->flag.server ) {/* server is special */
 				if( session[i]->flag.ping != 2 )/* only update if necessary otherwise it'd resend the ping unnecessarily */
@@ -1355,6 +3076,23 @@ int socket_config_read(const char* cfgName)
 				epoll_maxevents = 16;
 			}
 		}
+		else if( !strcmpi( w1, "io_threads" ) ){
+			io_threads = max( atoi( w2 ), 0 );
+		}
+		else if( !strcmpi( w1, "epoll_edge_triggered" ) ){
+			epoll_edge_triggered = config_switch( w2 ) != 0;
+		}
+		else if( !strcmpi( w1, "epoll_recv_budget" ) ){
+			epoll_recv_budget = (size_t)max( atoi( w2 ), 0 );
+		}
+		else if( !strcmpi( w1, "epoll_send_budget" ) ){
+			epoll_send_budget = (size_t)max( atoi( w2 ), 0 );
+		}
+#endif
+#ifdef SOCKET_IO_URING
+		else if( !strcmpi( w1, "io_uring" ) ){
+			uring_enabled = config_switch( w2 ) != 0;
+		}
 #endif
 #endif
 		else if (!strcmpi(w1, "import"))
@@ -1400,12 +3138,22 @@ void socket_final(void)
 	aFree(session[0]);
 	session[0] = NULL;
 
+#ifdef SOCKET_IO_URING
+	if( uring_enabled ){
+		uring_final();
+	}
+#endif
+
 #ifdef WIN32
 	// Shut down windows networking
 	if( WSACleanup() != 0 ){
 		ShowError("socket_final: WinSock could not be cleaned up! %s\n", error_msg() );
 	}
 #elif defined(SOCKET_EPOLL)
+	if( io_threads > 0 ){
+		io_threads_final();
+	}
+
 	if( epfd != SOCKET_ERROR ){
 		sClose(epfd);
 		epfd = SOCKET_ERROR;
@@ -1426,6 +3174,15 @@ void do_close(int fd)
 
 	flush_fifo(fd); // Try to send what's left (although it might not succeed since it's a nonblocking socket)
 
+#ifdef SOCKET_IO_URING
+	// io_uring based Event Dispatcher
+	// The send was only queued, the socket is closed once it completed
+	if( uring_enabled && uring_detach(fd) ){
+		if (session[fd]) delete_session(fd);
+		return;
+	}
+#endif
+
 #ifndef SOCKET_EPOLL
 	// Select based Event Dispatcher
 	sFD_CLR(fd, &readfds);// this needs to be done before closing the socket
@@ -1434,6 +3191,12 @@ void do_close(int fd)
 	epevent.data.fd = fd;
 	epevent.events = EPOLLIN;
 	epoll_ctl( epfd, EPOLL_CTL_DEL, fd, &epevent ); // removing the socket from epoll when it's being closed is not required but recommended
+
+	// The network I/O thread sends what's left and closes the socket afterwards
+	if( io_detach( fd ) ){
+		if (session[fd]) delete_session(fd);
+		return;
+	}
 #endif
 
 	sShutdown(fd, SHUT_RDWR); // Disallow further reads/writes
@@ -1605,6 +3368,30 @@ void socket_init(void)
 
 	socket_config_read(SOCKET_CONF_FILENAME);
 
+#ifdef SOCKET_IO_URING
+	if( uring_enabled && !uring_init() ){
+		ShowWarning( "socket_init: io_uring is not available, falling back to the default event dispatcher.\n" );
+		uring_enabled = false;
+	}
+
+#ifdef SOCKET_EPOLL
+	if( uring_enabled && io_threads > 0 ){
+		ShowWarning( "socket_init: io_threads can not be used together with io_uring, disabling them.\n" );
+		io_threads = 0;
+	}
+#endif
+#endif
+
+#ifdef SOCKET_EPOLL
+	if( epoll_edge_triggered ){
+		ShowInfo( "Epoll event dispatcher uses '" CL_WHITE "edge-triggered" CL_RESET "' notifications\n" );
+	}
+
+	if( io_threads > 0 ){
+		io_threads_init();
+	}
+#endif
+
 	// initialise last send-receive tick
 	last_tick = time(NULL);
 
@@ -1723,7 +3510,7 @@ void send_shortlist_do_sends()
 		if( session[fd] )
 		{
 			// Send data
-			if( session[fd]->wdata_size )
+			if( session[fd]->wdata_size || session[fd]->wpackets_count )
 				session[fd]->func_send(fd);
 
 			// If it's been marked as eof, call the parse func on it so that
@@ -1733,7 +3520,8 @@ void send_shortlist_do_sends()
 
 			// If the session still exists, is not eof and has things left to
 			// be sent from it we'll re-add it to the shortlist.
-			if( session_isActive(fd) && session[fd]->wdata_size )
+			// Sessions waiting for EPOLLOUT or a send completion are re-added afterwards.
+			if( session_isActive(fd) && ( session[fd]->wdata_size || session[fd]->wpackets_count ) && !session[fd]->flag.wait_writable )
 				send_shortlist_add_fd(fd);
 		}
 	}
@@ -82,6 +82,23 @@
 typedef int (*RecvFunc)(int fd);
 typedef int (*SendFunc)(int fd);
 typedef int (*ParseFunc)(int fd);
+typedef void (*PresendFunc)(void);
+
+/// Immutable packet that is queued by reference in the send queue of several sessions
+struct socket_packet
+{
+	int refcount;
+	size_t len;
+	uint8* data;
+};
+
+/// Shared packet in the send queue of a session, sent before the byte at pos of wdata
+struct socket_packet_ref
+{
+	size_t pos; // position in wdata
+	size_t sent; // bytes of the packet that were sent already
+	struct socket_packet* packet;
+};
 
 struct socket_data
 {
@@ -89,6 +106,8 @@ struct socket_data
 		unsigned char eof : 1;
 		unsigned char server : 1;
 		unsigned char ping : 2;
+		unsigned char wait_writable : 1; // edge-triggered epoll: kernel send buffer is full, waiting for EPOLLOUT
+		unsigned char read_pending : 1; // edge-triggered epoll: socket may still hold unread data
 	} flag;
 
 	uint32 client_addr; // remote client address
@@ -100,6 +119,11 @@ struct socket_data
 	time_t rdata_tick; // time of last recv (for detecting timeouts); zero when timeout is disabled
 	time_t wdata_tick; // time of last send (for detecting timeouts);
 
+	struct socket_packet_ref* wpackets; // shared packets queued in between the data of wdata
+	size_t wpackets_count, max_wpackets;
+	size_t wpackets_size; // bytes of the shared packets that were not sent yet
+	size_t wdata_cycle; // edge-triggered epoll: bytes sent during the current cycle
+
 	RecvFunc func_recv;
 	SendFunc func_send;
 	ParseFunc func_parse;
@@ -130,6 +154,8 @@ int make_connection(uint32 ip, uint16 port, bool silent, int timeout);
 int realloc_fifo(int fd, unsigned int rfifo_size, unsigned int wfifo_size);
 int realloc_writefifo(int fd, size_t addition);
 int WFIFOSET(int fd, size_t len);
+int WFIFOSET_SHARED(int fd, const void* buf, size_t len, struct socket_packet** packet);
+void socket_packet_release(struct socket_packet* packet);
 int RFIFOSKIP(int fd, size_t len);
 
 int do_sockets(t_tick next);
@@ -142,6 +168,7 @@ extern void flush_fifos(void);
 extern void set_nonblocking(int fd, unsigned long yes);
 
 void set_defaultparse(ParseFunc defaultparse);
+void set_presend(PresendFunc presend);
 
 
 /// Server operation request
@@ -10,6 +10,16 @@
 #include <mysql.h>
 #include <stdlib.h>// strtoul
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "cbasetypes.hpp"
 #include "malloc.hpp"
 #include "showmsg.hpp"
@@ -25,8 +35,6 @@
 
 #define SQL_CONF_NAME "conf/inter_athena.conf"
 
-void ra_mysql_error_handler(unsigned int ecode);
-
 int mysql_reconnect_type;
 unsigned int mysql_reconnect_count;
 
@@ -102,6 +110,15 @@ unsigned int Sql_GetError( Sql* self ){
 	return mysql_errno( &self->handle );
 }
 
+/**
+ * Retrieves the message of the last error.
+ * @param self : sql handle
+ * @return last error message
+ */
+const char* Sql_GetErrorText( Sql* self ){
+	return mysql_error( &self->handle );
+}
+
 static int Sql_P_Keepalive(Sql* self);
 
 /**
@@ -247,6 +264,18 @@ static int Sql_P_Keepalive(Sql* self)
 
 
 
+/// Stops the periodic ping of the connection.
+void Sql_DisableKeepalive(Sql* self)
+{
+	if( self && self->keepalive != INVALID_TIMER )
+	{
+		delete_timer(self->keepalive, Sql_P_KeepaliveTimer);
+		self->keepalive = INVALID_TIMER;
+	}
+}
+
+
+
 /// Escapes a string.
 size_t Sql_EscapeString(Sql* self, char *out_to, const char *from)
 {
@@ -338,6 +367,23 @@ int Sql_QueryStr(Sql* self, const char* query)
 
 
 
+/// Executes a query from a worker thread.
+int Sql_QueryThreaded(Sql* self, const char* query, size_t length)
+{
+	if( self == NULL )
+		return SQL_ERROR;
+
+	Sql_FreeResult(self);
+	if( mysql_real_query(&self->handle, query, (unsigned long)length) )
+		return SQL_ERROR;
+	self->result = mysql_store_result(&self->handle);
+	if( mysql_errno(&self->handle) != 0 )
+		return SQL_ERROR;
+	return SQL_SUCCESS;
+}
+
+
+
 /// Returns the number of the AUTO_INCREMENT column of the last INSERT/UPDATE query.
 uint64 Sql_LastInsertId(Sql* self)
 {
@@ -996,6 +1042,662 @@ void SqlStmt_Free(SqlStmt* self)
 
 
 
+///////////////////////////////////////////////////////////////////////////////
+// Asynchronous queries
+///////////////////////////////////////////////////////////////////////////////
+
+
+
+/// Longest wait of the core loop while queries are running, in milliseconds
+#define SQL_ASYNC_POLL_INTERVAL 10
+
+/// Idle time after which a worker pings its connection, in seconds
+#define SQL_ASYNC_PING_INTERVAL 3600
+
+/// Parameter of an async query, numbers are already formatted
+struct s_sql_async_param
+{
+	bool bound;
+	bool quote;// escaped and quoted by the worker
+	std::string value;
+};
+
+/// Query waiting to be submitted
+struct SqlAsyncQuery
+{
+	std::string query;
+	std::vector<s_sql_async_param> params;
+	std::vector<std::string> statements;// run after query, in the same transaction
+};
+
+/// Submitted query and its result
+struct SqlAsyncResult
+{
+	SqlAsyncQuery query;
+	SqlAsyncCallback callback;
+	intptr_t data;
+	SqlAsync* pool;
+
+	int status;
+	unsigned int error_code;
+	std::string error;
+	uint64 affected_rows;
+	uint64 last_insert_id;
+	uint32 columns;
+	std::vector<std::string> values;// row after row
+	std::vector<bool> nulls;
+	size_t row;// next row to fetch, the current one is row-1
+};
+
+/// Connection of a pool and the worker thread serving it
+struct s_sql_async_connection
+{
+	Sql* handle;
+	std::thread thread;
+	std::deque<SqlAsyncResult*> queue;
+	std::condition_variable wakeup;
+	size_t load;// queued and running queries
+};
+
+/// Connection pool
+struct SqlAsync
+{
+	std::vector<std::unique_ptr<s_sql_async_connection>> connections;
+	std::mutex mutex;
+	bool stopping;
+	std::atomic<size_t> pending;// submitted and not delivered yet
+};
+
+/// Finished queries waiting for Sql_AsyncPoll, shared by all pools
+static std::mutex sql_async_mutex;
+static std::vector<SqlAsyncResult*> sql_async_completed;
+static std::atomic<size_t> sql_async_running(0);
+
+
+
+/// Builds the final query text, replacing the '?' markers outside of quotes.
+///
+/// @private
+static std::string SqlAsync_P_BuildQuery(Sql* handle, const SqlAsyncQuery& query)
+{
+	std::string out;
+	size_t param = 0;
+	char quote = 0;
+
+	if( query.params.empty() )
+		return query.query;// nothing bound, the text is final
+
+	out.reserve(query.query.length());
+	for( size_t i = 0; i < query.query.length(); ++i )
+	{
+		char c = query.query[i];
+
+		if( quote )
+		{
+			if( c == '\\' && i + 1 < query.query.length() )
+			{// keep the escaped character, it can't close the quote
+				out += c;
+				out += query.query[++i];
+				continue;
+			}
+			if( c == quote )
+				quote = 0;
+		}
+		else if( c == '\'' || c == '"' || c == '`' )
+			quote = c;
+		else if( c == '?' && param < query.params.size() )
+		{
+			const s_sql_async_param& p = query.params[param++];
+
+			if( !p.bound )
+				out += "NULL";
+			else if( p.quote )
+			{
+				std::vector<char> esc(p.value.length() * 2 + 1);
+
+				Sql_EscapeStringLen(handle, esc.data(), p.value.data(), p.value.length());
+				out += '\'';
+				out += esc.data();
+				out += '\'';
+			}
+			else
+				out += p.value;
+			continue;
+		}
+		out += c;
+	}
+
+	return out;
+}
+
+
+
+/// Runs a single statement on the connection of the worker.
+///
+/// @private
+static int SqlAsync_P_Query(Sql* handle, const std::string& query)
+{
+	return Sql_QueryThreaded(handle, query.c_str(), query.length());
+}
+
+
+
+/// Runs a query on the connection of the worker.
+///
+/// @private
+static void SqlAsync_P_Run(Sql* handle, SqlAsyncResult* result)
+{
+	std::string query = SqlAsync_P_BuildQuery(handle, result->query);
+
+	if( !result->query.statements.empty() )
+	{// transaction, no result set
+		result->status = SQL_SUCCESS;
+		if( SQL_ERROR == SqlAsync_P_Query(handle, "START TRANSACTION") )
+			result->status = SQL_ERROR;
+		else
+		{
+			if( !query.empty() )
+				result->query.statements.insert(result->query.statements.begin(), query);
+			for( const std::string& statement : result->query.statements )
+			{
+				query = statement;
+				if( SQL_ERROR == SqlAsync_P_Query(handle, query) )
+				{
+					result->status = SQL_ERROR;
+					break;
+				}
+				result->affected_rows += Sql_NumRowsAffected(handle);
+				Sql_FreeResult(handle);
+			}
+			if( result->status == SQL_SUCCESS && SQL_ERROR == SqlAsync_P_Query(handle, "COMMIT") )
+				result->status = SQL_ERROR;
+		}
+		if( result->status == SQL_ERROR )
+		{
+			result->error_code = Sql_GetError(handle);
+			result->error = Sql_GetErrorText(handle);
+			SqlAsync_P_Query(handle, "ROLLBACK");
+		}
+		result->query.query.swap(query);// last statement that ran
+		return;
+	}
+
+	if( SQL_ERROR == SqlAsync_P_Query(handle, query) )
+	{
+		result->status = SQL_ERROR;
+		result->error_code = Sql_GetError(handle);
+		result->error = Sql_GetErrorText(handle);
+	}
+	else
+	{
+		result->status = SQL_SUCCESS;
+		result->affected_rows = Sql_NumRowsAffected(handle);
+		result->last_insert_id = Sql_LastInsertId(handle);
+		result->columns = Sql_NumColumns(handle);
+		while( SQL_SUCCESS == Sql_NextRow(handle) )
+		{
+			for( uint32 i = 0; i < result->columns; ++i )
+			{
+				char* data;
+				size_t len;
+
+				Sql_GetData(handle, i, &data, &len);
+				result->values.push_back(data ? std::string(data, len) : std::string());
+				result->nulls.push_back(data == NULL);
+			}
+		}
+		Sql_FreeResult(handle);
+	}
+	result->query.query.swap(query);// keep the final text for debugging
+}
+
+
+
+/// Worker thread of a connection.
+/// It must not use the memory manager or the console output, errors are reported by Sql_AsyncPoll.
+///
+/// @private
+static void SqlAsync_P_Worker(SqlAsync* pool, s_sql_async_connection* connection)
+{
+	time_t last_query = time(NULL);
+
+	Sql_ThreadInit();
+	for( ;; )
+	{
+		SqlAsyncResult* result;
+
+		{
+			std::unique_lock<std::mutex> lock(pool->mutex);
+
+			while( connection->queue.empty() && !pool->stopping )
+			{
+				if( connection->wakeup.wait_for(lock, std::chrono::seconds(SQL_ASYNC_PING_INTERVAL)) == std::cv_status::timeout
+				&&  connection->queue.empty() && time(NULL) - last_query >= SQL_ASYNC_PING_INTERVAL )
+				{// the main keepalive timer doesn't ping worker connections
+					lock.unlock();
+					Sql_Ping(connection->handle);
+					last_query = time(NULL);
+					lock.lock();
+				}
+			}
+			if( connection->queue.empty() )
+				break;// stopping, and nothing left to run
+			result = connection->queue.front();
+			connection->queue.pop_front();
+		}
+
+		SqlAsync_P_Run(connection->handle, result);
+		last_query = time(NULL);
+
+		{
+			std::lock_guard<std::mutex> lock(pool->mutex);
+
+			connection->load--;
+		}
+		{
+			std::lock_guard<std::mutex> lock(sql_async_mutex);
+
+			sql_async_completed.push_back(result);
+		}
+	}
+	Sql_ThreadEnd();
+}
+
+
+
+/// Allocates a new connection pool.
+SqlAsync* SqlAsync_Malloc(void)
+{
+	SqlAsync* self = new SqlAsync();
+
+	self->stopping = false;
+	self->pending = 0;
+	return self;
+}
+
+
+
+/// Opens the connections of the pool and starts their worker threads.
+int SqlAsync_Connect(SqlAsync* self, size_t connections, const char* user, const char* passwd, const char* host, uint16 port, const char* db, const char* encoding)
+{
+	if( self == NULL || connections == 0 || !self->connections.empty() )
+		return SQL_ERROR;
+
+	for( size_t i = 0; i < connections; ++i )
+	{
+		std::unique_ptr<s_sql_async_connection> connection(new s_sql_async_connection());
+
+		connection->handle = Sql_Malloc();
+		connection->load = 0;
+		if( SQL_ERROR == Sql_Connect(connection->handle, user, passwd, host, port, db) )
+		{
+			Sql_Free(connection->handle);
+			return SQL_ERROR;
+		}
+		Sql_DisableKeepalive(connection->handle);
+		if( encoding && encoding[0] && SQL_ERROR == Sql_SetEncoding(connection->handle, encoding) )
+			Sql_ShowDebug(connection->handle);
+		connection->thread = std::thread(SqlAsync_P_Worker, self, connection.get());
+		self->connections.push_back(std::move(connection));
+	}
+
+	return SQL_SUCCESS;
+}
+
+
+
+/// Waits for the queued queries, runs their callbacks and frees the pool.
+void SqlAsync_Free(SqlAsync* self)
+{
+	if( self == NULL )
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(self->mutex);
+
+		self->stopping = true;
+		for( auto& connection : self->connections )
+			connection->wakeup.notify_one();
+	}
+	for( auto& connection : self->connections )
+	{
+		connection->thread.join();
+		Sql_Free(connection->handle);
+	}
+	SqlAsync_Wait(self);
+	delete self;
+}
+
+
+
+/// Allocates a new query.
+SqlAsyncQuery* SqlAsyncQuery_Malloc(void)
+{
+	return new SqlAsyncQuery();
+}
+
+
+
+/// Sets the query text, with printf-style formatting.
+int SqlAsyncQuery_Prepare(SqlAsyncQuery* self, const char* query, ...)
+{
+	StringBuf buf;
+	va_list args;
+
+	if( self == NULL )
+		return SQL_ERROR;
+
+	StringBuf_Init(&buf);
+	va_start(args, query);
+	StringBuf_Vprintf(&buf, query, args);
+	va_end(args);
+	self->query.assign(StringBuf_Value(&buf), StringBuf_Length(&buf));
+	StringBuf_Destroy(&buf);
+
+	return SQL_SUCCESS;
+}
+
+
+
+/// Binds a copy of a parameter to the query.
+int SqlAsyncQuery_BindParam(SqlAsyncQuery* self, size_t idx, SqlDataType buffer_type, const void* buffer, size_t buffer_len)
+{
+	char num[64];
+
+	if( self == NULL )
+		return SQL_ERROR;
+
+	if( idx >= self->params.size() )
+		self->params.resize(idx + 1);
+
+	s_sql_async_param& param = self->params[idx];
+
+	param.bound = true;
+	param.quote = false;
+	switch( buffer_type )
+	{
+	case SQLDT_NULL: param.bound = false; return SQL_SUCCESS;
+	case SQLDT_INT8:      safesnprintf(num, sizeof(num), "%d", *(const int8*)buffer); break;
+	case SQLDT_INT16:     safesnprintf(num, sizeof(num), "%d", *(const int16*)buffer); break;
+	case SQLDT_INT32:     safesnprintf(num, sizeof(num), "%" PRId32, *(const int32*)buffer); break;
+	case SQLDT_INT64:     safesnprintf(num, sizeof(num), "%" PRId64, *(const int64*)buffer); break;
+	case SQLDT_UINT8:     safesnprintf(num, sizeof(num), "%u", *(const uint8*)buffer); break;
+	case SQLDT_UINT16:    safesnprintf(num, sizeof(num), "%u", *(const uint16*)buffer); break;
+	case SQLDT_UINT32:    safesnprintf(num, sizeof(num), "%" PRIu32, *(const uint32*)buffer); break;
+	case SQLDT_UINT64:    safesnprintf(num, sizeof(num), "%" PRIu64, *(const uint64*)buffer); break;
+	case SQLDT_CHAR:      safesnprintf(num, sizeof(num), "%d", *(const char*)buffer); break;
+	case SQLDT_SHORT:     safesnprintf(num, sizeof(num), "%d", *(const short*)buffer); break;
+	case SQLDT_INT:       safesnprintf(num, sizeof(num), "%d", *(const int*)buffer); break;
+	case SQLDT_LONG:      safesnprintf(num, sizeof(num), "%ld", *(const long*)buffer); break;
+	case SQLDT_LONGLONG:  safesnprintf(num, sizeof(num), "%" PRId64, *(const int64*)buffer); break;
+	case SQLDT_UCHAR:     safesnprintf(num, sizeof(num), "%u", *(const unsigned char*)buffer); break;
+	case SQLDT_USHORT:    safesnprintf(num, sizeof(num), "%u", *(const unsigned short*)buffer); break;
+	case SQLDT_UINT:      safesnprintf(num, sizeof(num), "%u", *(const unsigned int*)buffer); break;
+	case SQLDT_ULONG:     safesnprintf(num, sizeof(num), "%lu", *(const unsigned long*)buffer); break;
+	case SQLDT_ULONGLONG: safesnprintf(num, sizeof(num), "%" PRIu64, *(const uint64*)buffer); break;
+	case SQLDT_FLOAT:     safesnprintf(num, sizeof(num), "%.9g", *(const float*)buffer); break;
+	case SQLDT_DOUBLE:    safesnprintf(num, sizeof(num), "%.17g", *(const double*)buffer); break;
+	case SQLDT_STRING:
+	case SQLDT_ENUM:
+		param.quote = true;
+		param.value.assign((const char*)buffer, strnlen((const char*)buffer, buffer_len));
+		return SQL_SUCCESS;
+	case SQLDT_BLOB:
+		param.quote = true;
+		param.value.assign((const char*)buffer, buffer_len);
+		return SQL_SUCCESS;
+	default:
+		ShowDebug("SqlAsyncQuery_BindParam: unsupported buffer type (%d)\n", buffer_type);
+		param.bound = false;
+		return SQL_ERROR;
+	}
+	param.value = num;
+
+	return SQL_SUCCESS;
+}
+
+
+
+/// Adds a statement to run after the query text.
+int SqlAsyncQuery_Append(SqlAsyncQuery* self, const char* query, ...)
+{
+	StringBuf buf;
+	va_list args;
+
+	if( self == NULL )
+		return SQL_ERROR;
+
+	StringBuf_Init(&buf);
+	va_start(args, query);
+	StringBuf_Vprintf(&buf, query, args);
+	va_end(args);
+	self->statements.emplace_back(StringBuf_Value(&buf), StringBuf_Length(&buf));
+	StringBuf_Destroy(&buf);
+
+	return SQL_SUCCESS;
+}
+
+
+
+/// Frees a query that was not submitted.
+void SqlAsyncQuery_Free(SqlAsyncQuery* self)
+{
+	delete self;
+}
+
+
+
+/// Submits a query, the pool takes ownership of it.
+int SqlAsync_Execute(SqlAsync* self, SqlAsyncQuery* query, uint32 key, SqlAsyncCallback callback, intptr_t data)
+{
+	if( self == NULL || query == NULL || self->connections.empty() )
+	{
+		SqlAsyncQuery_Free(query);
+		return SQL_ERROR;
+	}
+
+	SqlAsyncResult* result = new SqlAsyncResult();
+
+	result->query = std::move(*query);
+	result->callback = callback;
+	result->data = data;
+	result->pool = self;
+	result->status = SQL_ERROR;
+	result->error_code = 0;
+	result->affected_rows = 0;
+	result->last_insert_id = 0;
+	result->columns = 0;
+	result->row = 0;
+	SqlAsyncQuery_Free(query);
+
+	self->pending++;
+	sql_async_running++;
+
+	std::lock_guard<std::mutex> lock(self->mutex);
+	s_sql_async_connection* connection;
+
+	if( key != 0 )
+		connection = self->connections[key % self->connections.size()].get();
+	else
+	{// least loaded connection
+		connection = self->connections[0].get();
+		for( auto& other : self->connections )
+			if( other->load < connection->load )
+				connection = other.get();
+	}
+	connection->queue.push_back(result);
+	connection->load++;
+	connection->wakeup.notify_one();
+
+	return SQL_SUCCESS;
+}
+
+
+
+/// Returns the number of queries submitted to the pool and not delivered yet.
+size_t SqlAsync_Pending(SqlAsync* self)
+{
+	return self ? self->pending.load() : 0;
+}
+
+
+
+/// Blocks until every query submitted to the pool has been delivered.
+void SqlAsync_Wait(SqlAsync* self)
+{
+	if( self == NULL )
+		return;
+
+	for( ;; )
+	{
+		Sql_AsyncPoll(0);
+		if( self->pending == 0 )
+			break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+
+
+/// Returns SQL_SUCCESS or SQL_ERROR.
+int SqlAsyncResult_Status(SqlAsyncResult* self)
+{
+	return self ? self->status : SQL_ERROR;
+}
+
+
+
+/// Returns the number of columns in each row of the result.
+uint32 SqlAsyncResult_NumColumns(SqlAsyncResult* self)
+{
+	return self ? self->columns : 0;
+}
+
+
+
+/// Returns the number of rows in the result.
+uint64 SqlAsyncResult_NumRows(SqlAsyncResult* self)
+{
+	if( self && self->columns )
+		return (uint64)(self->values.size() / self->columns);
+	return 0;
+}
+
+
+
+/// Returns the number of rows affected by the query.
+uint64 SqlAsyncResult_NumRowsAffected(SqlAsyncResult* self)
+{
+	return self ? self->affected_rows : 0;
+}
+
+
+
+/// Returns the value of the AUTO_INCREMENT column of an INSERT query.
+uint64 SqlAsyncResult_LastInsertId(SqlAsyncResult* self)
+{
+	return self ? self->last_insert_id : 0;
+}
+
+
+
+/// Fetches the next row.
+int SqlAsyncResult_NextRow(SqlAsyncResult* self)
+{
+	if( self == NULL || self->status != SQL_SUCCESS )
+		return SQL_ERROR;
+	if( self->row >= SqlAsyncResult_NumRows(self) )
+		return SQL_NO_DATA;
+	self->row++;
+	return SQL_SUCCESS;
+}
+
+
+
+/// Gets the data of a column of the current row.
+int SqlAsyncResult_GetData(SqlAsyncResult* self, size_t col, char** out_buf, size_t* out_len)
+{
+	if( self == NULL || self->row == 0 )
+		return SQL_ERROR;
+
+	if( col < self->columns )
+	{
+		size_t i = (self->row - 1) * self->columns + col;
+
+		if( out_buf ) *out_buf = self->nulls[i] ? NULL : &self->values[i][0];
+		if( out_len ) *out_len = self->values[i].length();
+	}
+	else
+	{// out of range - ignore
+		if( out_buf ) *out_buf = NULL;
+		if( out_len ) *out_len = 0;
+	}
+	return SQL_SUCCESS;
+}
+
+
+
+/// Shows debug information (query and error).
+void SqlAsyncResult_ShowDebug_(SqlAsyncResult* self, const char* debug_file, const unsigned long debug_line)
+{
+	if( self == NULL )
+		ShowDebug("at %s:%lu - self is NULL\n", debug_file, debug_line);
+	else if( self->status == SQL_ERROR )
+		ShowDebug("at %s:%lu - %s (%s)\n", debug_file, debug_line, self->query.query.c_str(), self->error.c_str());
+	else
+		ShowDebug("at %s:%lu - %s\n", debug_file, debug_line, self->query.query.c_str());
+}
+
+
+
+/// Runs the callbacks of the finished queries, called by the core loop.
+t_tick Sql_AsyncPoll(t_tick next)
+{
+	std::vector<SqlAsyncResult*> completed;
+
+	{
+		std::lock_guard<std::mutex> lock(sql_async_mutex);
+
+		completed.swap(sql_async_completed);
+	}
+
+	for( SqlAsyncResult* result : completed )
+	{
+		if( result->status == SQL_ERROR )
+		{// the worker doesn't report, it isn't allowed to use the console
+			ShowSQL("DB error - %s\n", result->error.c_str());
+			ra_mysql_error_handler(result->error_code);
+		}
+		if( result->callback )
+			result->callback(result, result->data);
+		result->pool->pending--;
+		sql_async_running--;
+		delete result;
+	}
+
+	if( sql_async_running > 0 && (next < 0 || next > SQL_ASYNC_POLL_INTERVAL) )
+		next = SQL_ASYNC_POLL_INTERVAL;
+	return next;
+}
+
+
+
+/// Sets up libmysql for a thread that uses a connection.
+void Sql_ThreadInit(void)
+{
+	mysql_thread_init();
+}
+
+
+
+/// Releases what libmysql allocated for the thread.
+void Sql_ThreadEnd(void)
+{
+	mysql_thread_end();
+}
+
+
+
 /// Receives MySQL error codes during runtime (not on first-time-connects).
 void ra_mysql_error_handler(unsigned int ecode) {
 	switch( ecode ) {
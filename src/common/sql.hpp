@@ -7,6 +7,7 @@
 #include <stdarg.h>// va_list
 
 #include "cbasetypes.hpp"
+#include "timer.hpp" // t_tick
 
 // Return codes
 #define SQL_ERROR -1
@@ -111,6 +112,12 @@ int Sql_Ping(Sql* self);
 
 
 
+/// Stops the periodic ping of the connection.
+/// Handles that are used by a worker thread must not be pinged from the main timer, they have to ping on their own.
+void Sql_DisableKeepalive(Sql* self);
+
+
+
 /// Escapes a string.
 /// The output buffer must be at least strlen(from)*2+1 in size.
 ///
@@ -154,6 +161,21 @@ int Sql_QueryStr(Sql* self, const char* query);
 
 
 
+/// Executes a query from a thread other than the main thread.
+/// Any previous result is freed.
+/// Unlike Sql_QueryStr it doesn't allocate through the memory manager and doesn't report errors,
+/// the caller hands Sql_GetError and Sql_GetErrorText to the main thread instead.
+///
+/// @return SQL_SUCCESS or SQL_ERROR
+int Sql_QueryThreaded(Sql* self, const char* query, size_t length);
+
+
+
+/// Retrieves the message of the last error.
+const char* Sql_GetErrorText(Sql* self);
+
+
+
 /// Returns the number of the AUTO_INCREMENT column of the last INSERT/UPDATE query.
 ///
 /// @return Value of the auto-increment column
@@ -350,6 +372,181 @@ void SqlStmt_ShowDebug_(SqlStmt* self, const char* debug_file, const unsigned lo
 /// Frees a SqlStmt returned by SqlStmt_Malloc.
 void SqlStmt_Free(SqlStmt* self);
 
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Asynchronous queries
+///////////////////////////////////////////////////////////////////////////////
+// A SqlAsync handle is a pool of connections, each one served by its own
+// worker thread, so a slow query no longer blocks the main loop.
+// Queries are built on the main thread and their parameters are copied, the
+// caller's buffers don't need to outlive the call. Parameters use the same
+// '?' markers as prepared statements.
+// Results are handed back to the main thread by Sql_AsyncPoll, which the core
+// loop calls next to the timers, and passed to the completion callback.
+// Queries submitted with the same non-zero key run on the same connection in
+// submission order, the others go to the connection with the least work.
+//
+// example:
+//   SqlAsyncQuery* query = SqlAsyncQuery_Malloc();
+//   SqlAsyncQuery_Prepare(query, "SELECT `value` FROM `%s` WHERE `id`=?", table);
+//   SqlAsyncQuery_BindParam(query, 0, SQLDT_INT, &id, sizeof(id));
+//   SqlAsync_Execute(pool, query, 0, my_callback, (intptr_t)id);
+
+
+
+struct SqlAsync;// Connection pool (private access)
+struct SqlAsyncQuery;// Query waiting to be submitted (private access)
+struct SqlAsyncResult;// Result of a query (private access)
+
+typedef struct SqlAsync SqlAsync;
+typedef struct SqlAsyncQuery SqlAsyncQuery;
+typedef struct SqlAsyncResult SqlAsyncResult;
+
+/// Completion callback, runs on the main thread.
+/// The result is freed once the callback returns.
+typedef void (*SqlAsyncCallback)(SqlAsyncResult* result, intptr_t data);
+
+
+
+/// Allocates a new connection pool.
+SqlAsync* SqlAsync_Malloc(void);
+
+
+
+/// Opens the connections of the pool and starts their worker threads.
+///
+/// @return SQL_SUCCESS or SQL_ERROR
+int SqlAsync_Connect(SqlAsync* self, size_t connections, const char* user, const char* passwd, const char* host, uint16 port, const char* db, const char* encoding);
+
+
+
+/// Waits for the queued queries, runs their callbacks and frees the pool.
+void SqlAsync_Free(SqlAsync* self);
+
+
+
+/// Allocates a new query.
+SqlAsyncQuery* SqlAsyncQuery_Malloc(void);
+
+
+
+/// Sets the query text, with printf-style formatting.
+///
+/// @return SQL_SUCCESS or SQL_ERROR
+int SqlAsyncQuery_Prepare(SqlAsyncQuery* self, const char* query, ...);
+
+
+
+/// Binds a copy of a parameter to the query.
+/// String, enum and blob data types need the buffer length specified.
+///
+/// @return SQL_SUCCESS or SQL_ERROR
+int SqlAsyncQuery_BindParam(SqlAsyncQuery* self, size_t idx, SqlDataType buffer_type, const void* buffer, size_t buffer_len);
+
+
+
+/// Adds a statement to run after the query text, with printf-style formatting.
+/// A query with several statements runs them in one transaction, stopping at the first error.
+/// Bound parameters only apply to the prepared query text.
+///
+/// @return SQL_SUCCESS or SQL_ERROR
+int SqlAsyncQuery_Append(SqlAsyncQuery* self, const char* query, ...);
+
+
+
+/// Frees a query that was not submitted.
+void SqlAsyncQuery_Free(SqlAsyncQuery* self);
+
+
+
+/// Submits a query, the pool takes ownership of it.
+/// The callback may be NULL when the result is not needed.
+///
+/// @return SQL_SUCCESS or SQL_ERROR
+int SqlAsync_Execute(SqlAsync* self, SqlAsyncQuery* query, uint32 key, SqlAsyncCallback callback, intptr_t data);
+
+
+
+/// Returns the number of queries submitted to the pool and not delivered yet.
+size_t SqlAsync_Pending(SqlAsync* self);
+
+
+
+/// Blocks until every query submitted to the pool has been delivered.
+/// Callbacks of all pools that complete meanwhile are run.
+void SqlAsync_Wait(SqlAsync* self);
+
+
+
+/// Returns SQL_SUCCESS or SQL_ERROR.
+int SqlAsyncResult_Status(SqlAsyncResult* self);
+
+
+
+/// Returns the number of columns in each row of the result.
+uint32 SqlAsyncResult_NumColumns(SqlAsyncResult* self);
+
+
+
+/// Returns the number of rows in the result.
+uint64 SqlAsyncResult_NumRows(SqlAsyncResult* self);
+
+
+
+/// Returns the number of rows affected by the query.
+uint64 SqlAsyncResult_NumRowsAffected(SqlAsyncResult* self);
+
+
+
+/// Returns the value of the AUTO_INCREMENT column of an INSERT query.
+uint64 SqlAsyncResult_LastInsertId(SqlAsyncResult* self);
+
+
+
+/// Fetches the next row.
+///
+/// @return SQL_SUCCESS, SQL_ERROR or SQL_NO_DATA
+int SqlAsyncResult_NextRow(SqlAsyncResult* self);
+
+
+
+/// Gets the data of a column of the current row.
+/// The data stays valid until the callback returns, NULL columns give a NULL buffer.
+///
+/// @return SQL_SUCCESS or SQL_ERROR
+int SqlAsyncResult_GetData(SqlAsyncResult* self, size_t col, char** out_buf, size_t* out_len);
+
+
+
+#if defined(SQL_REMOVE_SHOWDEBUG)
+#define SqlAsyncResult_ShowDebug(self) (void)0
+#else
+#define SqlAsyncResult_ShowDebug(self) SqlAsyncResult_ShowDebug_(self, __FILE__, __LINE__)
+#endif
+/// Shows debug information (query and error).
+void SqlAsyncResult_ShowDebug_(SqlAsyncResult* self, const char* debug_file, const unsigned long debug_line);
+
+
+
+/// Runs the callbacks of the finished queries, called by the core loop.
+/// Shortens the wait of the loop while queries are running.
+///
+/// @return the time the loop may wait for sockets
+t_tick Sql_AsyncPoll(t_tick next);
+
+
+
+/// Sets up libmysql for a thread that uses a connection, and releases it again.
+void Sql_ThreadInit(void);
+void Sql_ThreadEnd(void);
+
+
+
+/// Receives MySQL error codes during runtime (not on first-time-connects).
+/// Must be called on the main thread, errors of worker connections are passed back to it.
+void ra_mysql_error_handler(unsigned int ecode);
+
 void Sql_Init(void);
 
 #endif /* SQL_HPP */
@@ -0,0 +1,175 @@
+// Copyright (c) rAthena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#include "thread_pool.hpp"
+
+ThreadPool::ThreadPool() : task( nullptr ), generation( 0 ), remaining( 0 ), running( 0 ), stopping( false ){
+	// Worker 0 is the thread submitting the batches
+	this->workers.emplace_back( new s_worker() );
+}
+
+ThreadPool::~ThreadPool(){
+	this->stop();
+}
+
+void ThreadPool::start( size_t threads ){
+	if( threads + 1 == this->workers.size() ){
+		return;
+	}
+
+	this->stop();
+
+	this->stopping = false;
+
+	// All workers have to exist before the first thread starts stealing
+	for( size_t i = 1; i <= threads; i++ ){
+		this->workers.emplace_back( new s_worker() );
+	}
+
+	for( size_t i = 1; i <= threads; i++ ){
+		this->workers[i]->thread = std::thread( &ThreadPool::main, this, i );
+	}
+}
+
+void ThreadPool::stop(){
+	{
+		std::lock_guard<std::mutex> lock( this->mutex );
+
+		this->stopping = true;
+	}
+
+	this->wakeup.notify_all();
+
+	for( size_t i = 1; i < this->workers.size(); i++ ){
+		if( this->workers[i]->thread.joinable() ){
+			this->workers[i]->thread.join();
+		}
+	}
+
+	this->workers.resize( 1 );
+}
+
+size_t ThreadPool::size() const{
+	return this->workers.size();
+}
+
+/// Takes the next task from the front of the worker's own deque.
+bool ThreadPool::pop( size_t worker, size_t& index ){
+	s_worker& self = *this->workers[worker];
+	std::lock_guard<std::mutex> lock( self.mutex );
+
+	if( self.tasks.empty() ){
+		return false;
+	}
+
+	index = self.tasks.front();
+	self.tasks.pop_front();
+
+	return true;
+}
+
+/// Takes a task from the back of another worker's deque.
+bool ThreadPool::steal( size_t worker, size_t& index ){
+	size_t count = this->workers.size();
+
+	for( size_t i = 1; i < count; i++ ){
+		s_worker& victim = *this->workers[( worker + i ) % count];
+		std::lock_guard<std::mutex> lock( victim.mutex );
+
+		if( !victim.tasks.empty() ){
+			index = victim.tasks.back();
+			victim.tasks.pop_back();
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ThreadPool::work( size_t worker ){
+	size_t index;
+
+	while( this->pop( worker, index ) || this->steal( worker, index ) ){
+		( *this->task )( index, worker );
+
+		if( this->remaining.fetch_sub( 1 ) == 1 ){
+			// Taking the lock makes sure the submitting thread is either waiting or hasn't checked yet
+			std::lock_guard<std::mutex> lock( this->mutex );
+		}
+		this->finished.notify_all();
+	}
+}
+
+void ThreadPool::main( size_t worker ){
+	uint64 seen = 0;
+
+	for( ;; ){
+		{
+			std::unique_lock<std::mutex> lock( this->mutex );
+
+			this->wakeup.wait( lock, [&](){ return this->stopping || this->generation != seen; } );
+
+			if( this->stopping ){
+				return;
+			}
+
+			seen = this->generation;
+
+			// The batch already finished
+			if( this->task == nullptr ){
+				continue;
+			}
+
+			this->running++;
+		}
+
+		this->work( worker );
+
+		{
+			std::lock_guard<std::mutex> lock( this->mutex );
+
+			this->running--;
+		}
+
+		this->finished.notify_all();
+	}
+}
+
+void ThreadPool::run( size_t count, const Task& func ){
+	if( count == 0 ){
+		return;
+	}
+
+	size_t threads = this->workers.size();
+
+	// Give every worker a contiguous range, idle workers steal from the end of the others
+	for( size_t i = 0; i < threads; i++ ){
+		s_worker& worker = *this->workers[i];
+		std::lock_guard<std::mutex> lock( worker.mutex );
+
+		for( size_t index = i * count / threads; index < ( i + 1 ) * count / threads; index++ ){
+			worker.tasks.push_back( index );
+		}
+	}
+
+	this->remaining = count;
+
+	{
+		std::lock_guard<std::mutex> lock( this->mutex );
+
+		this->task = &func;
+		this->generation++;
+	}
+
+	this->wakeup.notify_all();
+
+	this->work( 0 );
+
+	std::unique_lock<std::mutex> lock( this->mutex );
+
+	this->finished.wait( lock, [&](){ return this->remaining == 0 && this->running == 0; } );
+
+	// Workers waking up late must not join this batch anymore
+	this->task = nullptr;
+}
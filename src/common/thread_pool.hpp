@@ -0,0 +1,62 @@
+// Copyright (c) rAthena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cbasetypes.hpp"
+
+/// Pool of worker threads running batches of independent tasks.
+/// Every worker owns a deque of task indexes and steals from the other workers once its own deque is empty.
+/// The thread submitting a batch works on it as worker 0 and returns once every task has finished.
+class ThreadPool {
+public:
+	/// Task callback, gets the task index and the index of the worker running it (0 is the submitting thread)
+	typedef std::function<void( size_t index, size_t worker )> Task;
+
+private:
+	struct s_worker {
+		std::mutex mutex;
+		std::deque<size_t> tasks;
+		std::thread thread;
+	};
+
+	std::vector<std::unique_ptr<s_worker>> workers;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	std::condition_variable finished;
+	const Task* task;
+	uint64 generation;
+	std::atomic<size_t> remaining;
+	size_t running;
+	bool stopping;
+
+	bool pop( size_t worker, size_t& index );
+	bool steal( size_t worker, size_t& index );
+	void work( size_t worker );
+	void main( size_t worker );
+
+public:
+	ThreadPool();
+	~ThreadPool();
+
+	/// Starts the given number of worker threads besides the submitting thread, restarting the pool if needed.
+	void start( size_t threads );
+	/// Stops and joins all worker threads.
+	void stop();
+	/// Number of workers including the submitting thread.
+	size_t size() const;
+	/// Runs func for every index in [0, count) and waits until all of them finished.
+	void run( size_t count, const Task& func );
+};
+
+#endif /* THREAD_POOL_HPP */
@@ -3,12 +3,23 @@
 
 #include "timer.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unordered_map>
+#include <vector>
 
 #ifdef WIN32
 #include "winapi.hpp" // GetTickCount()
 #else
+#include <unistd.h> // usleep()
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h> // __rdtsc()
 #endif
 
 #include "cbasetypes.hpp"
@@ -16,6 +27,7 @@
 #include "malloc.hpp"
 #include "nullpo.hpp"
 #include "showmsg.hpp"
+#include "strlib.hpp"
 #include "utils.hpp"
 
 // If the server can't handle processing thousands of monsters
@@ -44,8 +56,41 @@ static int free_timer_list_pos = 0;
 /// @return negative if tid1 is top, positive if tid2 is top, 0 if equal
 #define DIFFTICK_MINTOPCMP(tid1,tid2) DIFF_TICK(timer_data[tid1].tick,timer_data[tid2].tick)
 
+#ifndef TIMER_WHEEL
 // timer heap (binary heap of tid's)
 static BHEAP_VAR(int, timer_heap);
+#else
+// Hierarchical timing wheel with a resolution of 1ms.
+// The root wheel holds the timers expiring within the next 256ms, every further level
+// covers 64 times the range of the previous one. Timers of a higher level are moved
+// down (cascaded) whenever the lower levels wrap around.
+#define TIMER_WHEEL_ROOT_BITS 8
+#define TIMER_WHEEL_ROOT_SIZE (1 << TIMER_WHEEL_ROOT_BITS)
+#define TIMER_WHEEL_LEVEL_BITS 6
+#define TIMER_WHEEL_LEVEL_SIZE (1 << TIMER_WHEEL_LEVEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_RANGE ((t_tick)1 << (TIMER_WHEEL_ROOT_BITS + TIMER_WHEEL_LEVELS * TIMER_WHEEL_LEVEL_BITS))
+// slot of the timers that expired and wait for do_timer
+#define TIMER_WHEEL_EXPIRED (TIMER_WHEEL_ROOT_SIZE + TIMER_WHEEL_LEVELS * TIMER_WHEEL_LEVEL_SIZE)
+#define TIMER_WHEEL_UNLINKED -1
+
+struct timer_wheel_slot {
+	int head, tail;
+};
+
+struct timer_wheel_link {
+	int next, prev, slot;
+};
+
+// slots of all levels (intrusive doubly linked lists of tid's)
+static struct timer_wheel_slot timer_wheel[TIMER_WHEEL_EXPIRED + 1];
+// list links of the timers (array, parallel to timer_data)
+static struct timer_wheel_link* timer_wheel_links = NULL;
+// non-empty slots of the root wheel
+static uint64 timer_wheel_used[TIMER_WHEEL_ROOT_SIZE / 64];
+// first tick that was not processed by the wheel yet
+static t_tick timer_wheel_tick = 0;
+#endif
 
 
 // server startup time
@@ -195,16 +240,199 @@ t_tick gettick(void)
 #endif
 //////////////////////////////////////////////////////////////////////////
 
+#ifndef TIMER_WHEEL
 /*======================================
  * 	CORE : Timer Heap
  *--------------------------------------*/
 
 /// Adds a timer to the timer_heap
-static void push_timer_heap(int tid)
+static void push_timer(int tid)
 {
 	BHEAP_ENSURE(timer_heap, 1, 256);
 	BHEAP_PUSH(timer_heap, tid, DIFFTICK_MINTOPCMP, SWAP);
 }
+#else
+/*======================================
+ * 	CORE : Timer Wheel
+ *--------------------------------------*/
+
+/// Returns the first non-empty root slot in [index, TIMER_WHEEL_ROOT_SIZE) or TIMER_WHEEL_ROOT_SIZE if there is none
+static int timer_wheel_next_used(int index)
+{
+	for( int i = index / 64; i < TIMER_WHEEL_ROOT_SIZE / 64; i++ )
+	{
+		uint64 bits = timer_wheel_used[i];
+
+		if( i == index / 64 )
+			bits &= ~(uint64)0 << (index % 64);
+
+		if( bits == 0 )
+			continue;
+
+#if defined(__GNUC__)
+		return i * 64 + __builtin_ctzll(bits);
+#else
+		int bit = 0;
+
+		while( !(bits & 1) ) {
+			bits >>= 1;
+			bit++;
+		}
+
+		return i * 64 + bit;
+#endif
+	}
+
+	return TIMER_WHEEL_ROOT_SIZE;
+}
+
+/// Appends a timer to the list of a slot
+static void timer_wheel_append(int slot, int tid)
+{
+	struct timer_wheel_slot* list = &timer_wheel[slot];
+	struct timer_wheel_link* link = &timer_wheel_links[tid];
+
+	link->slot = slot;
+	link->next = INVALID_TIMER;
+	link->prev = list->tail;
+
+	if( list->tail != INVALID_TIMER )
+		timer_wheel_links[list->tail].next = tid;
+	else
+		list->head = tid;
+	list->tail = tid;
+
+	if( slot < TIMER_WHEEL_ROOT_SIZE )
+		timer_wheel_used[slot / 64] |= (uint64)1 << (slot % 64);
+}
+
+/// Removes a timer from the list of its slot
+static void timer_wheel_unlink(int tid)
+{
+	struct timer_wheel_link* link = &timer_wheel_links[tid];
+	struct timer_wheel_slot* list = &timer_wheel[link->slot];
+
+	if( link->prev != INVALID_TIMER )
+		timer_wheel_links[link->prev].next = link->next;
+	else
+		list->head = link->next;
+
+	if( link->next != INVALID_TIMER )
+		timer_wheel_links[link->next].prev = link->prev;
+	else
+		list->tail = link->prev;
+
+	if( list->head == INVALID_TIMER && link->slot < TIMER_WHEEL_ROOT_SIZE )
+		timer_wheel_used[link->slot / 64] &= ~((uint64)1 << (link->slot % 64));
+
+	link->slot = TIMER_WHEEL_UNLINKED;
+}
+
+/// Adds a timer to the slot matching its tick
+static void push_timer(int tid)
+{
+	t_tick tick = timer_data[tid].tick;
+	t_tick diff = DIFF_TICK(tick, timer_wheel_tick);
+	int slot;
+
+	if( diff < 0 )
+		slot = TIMER_WHEEL_EXPIRED;
+	else if( diff < TIMER_WHEEL_ROOT_SIZE )
+		slot = (int)(tick & (TIMER_WHEEL_ROOT_SIZE - 1));
+	else
+	{
+		int level, shift;
+
+		if( diff >= TIMER_WHEEL_RANGE )
+		{// out of range, it is pushed again once the last level cascades
+			tick = timer_wheel_tick + TIMER_WHEEL_RANGE - 1;
+			diff = TIMER_WHEEL_RANGE - 1;
+		}
+
+		for( level = 0; diff >= ((t_tick)1 << (TIMER_WHEEL_ROOT_BITS + (level + 1) * TIMER_WHEEL_LEVEL_BITS)); level++ );
+
+		shift = TIMER_WHEEL_ROOT_BITS + level * TIMER_WHEEL_LEVEL_BITS;
+		slot = TIMER_WHEEL_ROOT_SIZE + level * TIMER_WHEEL_LEVEL_SIZE + (int)((tick >> shift) & (TIMER_WHEEL_LEVEL_SIZE - 1));
+	}
+
+	timer_wheel_append(slot, tid);
+}
+
+/// Moves all timers of a slot to their new position
+static void timer_wheel_cascade(int slot)
+{
+	int tid = timer_wheel[slot].head;
+
+	timer_wheel[slot].head = timer_wheel[slot].tail = INVALID_TIMER;
+	if( slot < TIMER_WHEEL_ROOT_SIZE )
+		timer_wheel_used[slot / 64] &= ~((uint64)1 << (slot % 64));
+
+	while( tid != INVALID_TIMER )
+	{
+		int next = timer_wheel_links[tid].next;
+
+		push_timer(tid);
+		tid = next;
+	}
+}
+
+/// Returns the tick of the next slot the wheel has to process
+static t_tick timer_wheel_next_tick(void)
+{
+	int index = (int)(timer_wheel_tick & (TIMER_WHEEL_ROOT_SIZE - 1));
+
+	if( index == 0 )
+		return timer_wheel_tick; // cascade pending
+
+	// no used slot left means the next stop is the wrap around
+	return timer_wheel_tick + (timer_wheel_next_used(index) - index);
+}
+
+/// Advances the wheel up to tick, all timers expiring until then end up in the expired list.
+/// Empty slots are skipped at once.
+static void timer_wheel_advance(t_tick tick)
+{
+	for( ;; )
+	{
+		int index = (int)(timer_wheel_tick & (TIMER_WHEEL_ROOT_SIZE - 1));
+		int next;
+
+		if( index == 0 )
+		{
+			if( DIFF_TICK(timer_wheel_tick, tick) > 0 )
+				break;
+
+			// root wheel wrapped, cascade the current slot of every level that wrapped as well
+			for( int level = 0; level < TIMER_WHEEL_LEVELS; level++ )
+			{
+				int shift = TIMER_WHEEL_ROOT_BITS + level * TIMER_WHEEL_LEVEL_BITS;
+				int i = (int)((timer_wheel_tick >> shift) & (TIMER_WHEEL_LEVEL_SIZE - 1));
+
+				timer_wheel_cascade(TIMER_WHEEL_ROOT_SIZE + level * TIMER_WHEEL_LEVEL_SIZE + i);
+				if( i != 0 )
+					break;
+			}
+		}
+
+		next = timer_wheel_next_used(index);
+
+		if( DIFF_TICK(timer_wheel_tick + (next - index), tick) > 0 )
+		{// nothing else expired
+			if( DIFF_TICK(tick + 1, timer_wheel_tick) > 0 )
+				timer_wheel_tick = tick + 1;
+			break;
+		}
+
+		timer_wheel_tick += next - index;
+
+		if( next < TIMER_WHEEL_ROOT_SIZE )
+		{// the timers of the slot are behind the wheel now and move to the expired list
+			timer_wheel_tick++;
+			timer_wheel_cascade(next);
+		}
+	}
+}
+#endif
 
 /*==========================
  * 	Timer Management
@@ -234,6 +462,11 @@ static int acquire_timer(void)
 		else
 			CREATE(timer_data, struct TimerData, timer_data_max);
 		memset(timer_data + (timer_data_max - 256), 0, sizeof(struct TimerData)*256);
+#ifdef TIMER_WHEEL
+		RECREATE(timer_wheel_links, struct timer_wheel_link, timer_data_max);
+		for( int i = timer_data_max - 256; i < timer_data_max; i++ )
+			timer_wheel_links[i].slot = TIMER_WHEEL_UNLINKED;
+#endif
 	}
 
 	if( tid >= timer_data_num )
@@ -255,7 +488,7 @@ int add_timer(t_tick tick, TimerFunc func, int id, intptr_t data)
 	timer_data[tid].data     = data;
 	timer_data[tid].type     = TIMER_ONCE_AUTODEL;
 	timer_data[tid].interval = 1000;
-	push_timer_heap(tid);
+	push_timer(tid);
 
 	return tid;
 }
@@ -279,7 +512,7 @@ int add_timer_interval(t_tick tick, TimerFunc func, int id, intptr_t data, int i
 	timer_data[tid].data     = data;
 	timer_data[tid].type     = TIMER_INTERVAL;
 	timer_data[tid].interval = interval;
-	push_timer_heap(tid);
+	push_timer(tid);
 
 	return tid;
 }
@@ -309,6 +542,15 @@ int delete_timer(int tid, TimerFunc func)
 	timer_data[tid].func = NULL;
 	timer_data[tid].type = TIMER_ONCE_AUTODEL;
 
+#ifdef TIMER_WHEEL
+	// release it with the next do_timer instead of waiting for the original tick
+	if( timer_wheel_links[tid].slot != TIMER_WHEEL_UNLINKED && timer_wheel_links[tid].slot != TIMER_WHEEL_EXPIRED )
+	{
+		timer_wheel_unlink(tid);
+		timer_wheel_append(TIMER_WHEEL_EXPIRED, tid);
+	}
+#endif
+
 	return 0;
 }
 
@@ -323,6 +565,7 @@ t_tick addt_tickimer(int tid, t_tick tick)
 /// Returns the new tick value, or -1 if it fails.
 t_tick sett_tickimer(int tid, t_tick tick)
 {
+#ifndef TIMER_WHEEL
 	size_t i;
 
 	// search timer position
@@ -344,6 +587,421 @@ t_tick sett_tickimer(int tid, t_tick tick)
 	timer_data[tid].tick = tick;
 	BHEAP_PUSH(timer_heap, tid, DIFFTICK_MINTOPCMP, SWAP);
 	return tick;
+#else
+	if( tid < 0 || tid >= timer_data_num || timer_wheel_links[tid].slot == TIMER_WHEEL_UNLINKED )
+	{
+		ShowError("sett_tickimer: no such timer %d (%p(%s))\n", tid, timer_data[tid].func, search_timer_func_list(timer_data[tid].func));
+		return -1;
+	}
+
+	if( tick == -1 )
+		tick = 0;// add 1ms to avoid the error value -1
+
+	if( timer_data[tid].tick == tick )
+		return tick;// nothing to do, already in propper position
+
+	// move the timer to its new slot
+	timer_wheel_unlink(tid);
+	timer_data[tid].tick = tick;
+	push_timer(tid);
+	return tick;
+#endif
+}
+
+/*======================================
+ * 	Timer statistics
+ *--------------------------------------*/
+
+// execution time buckets: 0-3us exact, above log2 with 4 linear sub buckets each
+#define TIMER_STATS_EXEC_BUCKETS 128
+// lateness buckets: 0ms, 1ms, 2-3ms, 4-7ms, ..., 1024ms and more
+#define TIMER_STATS_LATE_BUCKETS 12
+
+struct s_timer_stats {
+	uint64 calls;
+	uint64 cycles; // cumulative execution time
+	uint64 max; // longest execution time in cycles
+	t_tick late_max;
+	uint64 exec[TIMER_STATS_EXEC_BUCKETS];
+	uint64 late[TIMER_STATS_LATE_BUCKETS];
+};
+
+static bool timer_stats_active = false;
+static std::unordered_map<TimerFunc, struct s_timer_stats> timer_stats;
+static struct s_timer_stats timer_stats_cycle; // do_timer itself
+static time_t timer_stats_start;
+static double timer_stats_cycles_per_us = 0;
+static int timer_stats_overdue_ms = 0;
+
+// periodic dump
+static int timer_stats_dump_tid = INVALID_TIMER;
+static int timer_stats_dump_seconds = 0;
+static char timer_stats_dump_filename[256] = "./log/timer_stats.log";
+
+// current do_timer call
+static int timer_stats_cycle_count;
+static t_tick timer_stats_cycle_late;
+static uint64 timer_stats_cycle_slowest;
+static TimerFunc timer_stats_cycle_slowest_func;
+
+/// Cycle counter used to measure the timer functions
+static inline uint64 timer_stats_clock(void)
+{
+#if defined(ENABLE_RDTSC)
+	return _rdtsc();
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	return __rdtsc();
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	uint32 lo, hi;
+
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64)hi << 32) | lo;
+#else
+	return (uint64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/// Determines the frequency of timer_stats_clock.
+/// rdtsc builds reuse the calibration done at startup, the others measure it for 20ms.
+static void timer_stats_calibrate(void)
+{
+#if defined(ENABLE_RDTSC)
+	timer_stats_cycles_per_us = RDTSC_CLOCK / 1000.;
+#else
+	auto begin = std::chrono::steady_clock::now();
+	auto end = begin;
+	uint64 t1 = timer_stats_clock(), t2;
+
+	do {
+		end = std::chrono::steady_clock::now();
+		t2 = timer_stats_clock();
+	} while( end - begin < std::chrono::milliseconds(20) );
+
+	timer_stats_cycles_per_us = (t2 - t1) / (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count() * 1000.;
+#endif
+
+	if( timer_stats_cycles_per_us <= 0 )
+		timer_stats_cycles_per_us = 1;
+}
+
+static inline double timer_stats_us(uint64 cycles)
+{
+	return cycles / timer_stats_cycles_per_us;
+}
+
+static int timer_stats_exec_bucket(uint64 us)
+{
+	int bits = 0;
+
+	if( us < 4 )
+		return (int)us;
+
+	for( uint64 v = us; v > 1; v >>= 1 )
+		bits++;
+
+	return min(4 + (bits - 2) * 4 + (int)((us >> (bits - 2)) & 3), TIMER_STATS_EXEC_BUCKETS - 1);
+}
+
+/// Upper bound of an execution time bucket in us
+static uint64 timer_stats_exec_limit(int bucket)
+{
+	if( bucket < 4 )
+		return bucket + 1;
+
+	return (uint64)(5 + (bucket - 4) % 4) << ((bucket - 4) / 4);
+}
+
+static int timer_stats_late_bucket(t_tick late)
+{
+	int bucket = 0;
+
+	while( late > 0 && bucket < TIMER_STATS_LATE_BUCKETS - 1 ) {
+		late >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+/// Returns the bucket below which 99% of all samples fall
+static int timer_stats_percentile(const uint64* buckets, int count, uint64 total)
+{
+	uint64 limit = total - total / 100;
+	uint64 sum = 0;
+	int i;
+
+	for( i = 0; i < count - 1; i++ ) {
+		sum += buckets[i];
+		if( sum >= limit )
+			break;
+	}
+
+	return i;
+}
+
+/// Adds a sample of a timer function to the statistics
+static void timer_stats_record(int tid, TimerFunc func, t_tick late, uint64 cycles)
+{
+	struct s_timer_stats& stats = timer_stats[func];
+	uint64 us = (uint64)timer_stats_us(cycles);
+
+	stats.calls++;
+	stats.cycles += cycles;
+	stats.max = max(stats.max, cycles);
+	stats.late_max = max(stats.late_max, late);
+	stats.exec[timer_stats_exec_bucket(us)]++;
+	stats.late[timer_stats_late_bucket(late)]++;
+
+	timer_stats_cycle_count++;
+	timer_stats_cycle_late = max(timer_stats_cycle_late, late);
+	if( cycles > timer_stats_cycle_slowest ) {
+		timer_stats_cycle_slowest = cycles;
+		timer_stats_cycle_slowest_func = func;
+	}
+
+	if( timer_stats_overdue_ms > 0 && us >= (uint64)timer_stats_overdue_ms * 1000 )
+		ShowWarning("Timer function %s took %.1f ms (tid=%d, id=%d, data=%" PRIdPTR ").\n", search_timer_func_list(func), us / 1000., tid, timer_data[tid].id, timer_data[tid].data);
+}
+
+/// Starts the measurement of a do_timer call
+static uint64 timer_stats_cycle_begin(void)
+{
+	timer_stats_cycle_count = 0;
+	timer_stats_cycle_late = 0;
+	timer_stats_cycle_slowest = 0;
+	timer_stats_cycle_slowest_func = NULL;
+
+	return timer_stats_clock();
+}
+
+/// Finishes the measurement of a do_timer call
+static void timer_stats_cycle_end(uint64 start)
+{
+	uint64 cycles = timer_stats_clock() - start;
+	uint64 us = (uint64)timer_stats_us(cycles);
+
+	timer_stats_cycle.calls++;
+	timer_stats_cycle.cycles += cycles;
+	timer_stats_cycle.max = max(timer_stats_cycle.max, cycles);
+	timer_stats_cycle.late_max = max(timer_stats_cycle.late_max, timer_stats_cycle_late);
+	timer_stats_cycle.exec[timer_stats_exec_bucket(us)]++;
+	timer_stats_cycle.late[timer_stats_late_bucket(timer_stats_cycle_late)]++;
+
+	if( timer_stats_overdue_ms > 0 && us >= (uint64)timer_stats_overdue_ms * 1000 && timer_stats_cycle_slowest_func != NULL )
+		ShowWarning("do_timer took %.1f ms for %d timers (up to %" PRtf " ms late), slowest was %s with %.1f ms.\n", us / 1000., timer_stats_cycle_count, timer_stats_cycle_late, search_timer_func_list(timer_stats_cycle_slowest_func), timer_stats_us(timer_stats_cycle_slowest) / 1000.);
+}
+
+/// Prints a line of the report to the console or the given file
+static void timer_stats_print(FILE* fp, const char* format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	if( fp != NULL )
+		vfprintf(fp, format, ap);
+	else
+		_vShowMessage(MSG_NONE, format, ap);
+	va_end(ap);
+}
+
+/// Writes the statistics of the timer functions, sorted by cumulative execution time.
+/// @param fp: file to write to, NULL for the console
+/// @param limit: maximum amount of timer functions, 0 for all
+static void timer_stats_write(FILE* fp, size_t limit)
+{
+	std::vector<std::pair<TimerFunc, const struct s_timer_stats*>> sorted;
+	char timestamp[24];
+	const char* names[TIMER_STATS_LATE_BUCKETS] = { "0", "1", "2", "4", "8", "16", "32", "64", "128", "256", "512", "1024+" };
+
+	for( auto& it : timer_stats )
+		sorted.push_back(std::make_pair(it.first, &it.second));
+
+	std::sort(sorted.begin(), sorted.end(), [](const std::pair<TimerFunc, const struct s_timer_stats*>& a, const std::pair<TimerFunc, const struct s_timer_stats*>& b) {
+		return a.second->cycles > b.second->cycles;
+	});
+
+	if( limit > 0 && sorted.size() > limit )
+		sorted.resize(limit);
+
+	timer_stats_print(fp, "Timer statistics at %s, collected for %.0f seconds:\n", timestamp2string(timestamp, sizeof(timestamp), time(NULL), "%Y-%m-%d %H:%M:%S"), difftime(time(NULL), timer_stats_start));
+
+	if( timer_stats_cycle.calls > 0 ) {
+		timer_stats_print(fp, "  do_timer: %" PRIu64 " calls, %.1f ms total, avg %.1f us, p99 %" PRIu64 " us, max %.1f us, up to %" PRtf " ms late\n",
+			timer_stats_cycle.calls, timer_stats_us(timer_stats_cycle.cycles) / 1000., timer_stats_us(timer_stats_cycle.cycles) / timer_stats_cycle.calls,
+			timer_stats_exec_limit(timer_stats_percentile(timer_stats_cycle.exec, TIMER_STATS_EXEC_BUCKETS, timer_stats_cycle.calls)),
+			timer_stats_us(timer_stats_cycle.max), timer_stats_cycle.late_max);
+
+		timer_stats_print(fp, "  Lateness (ms):");
+		for( int i = 0; i < TIMER_STATS_LATE_BUCKETS; i++ ) {
+			uint64 count = 0;
+
+			for( auto& it : timer_stats )
+				count += it.second.late[i];
+
+			timer_stats_print(fp, " %s: %" PRIu64, names[i], count);
+		}
+		timer_stats_print(fp, "\n");
+	}
+
+	timer_stats_print(fp, "  %-40s %12s %12s %10s %10s %10s %9s %9s\n", "Function", "Calls", "Total ms", "Avg us", "p99 us", "Max us", "Late p99", "Late max");
+
+	for( auto& it : sorted ) {
+		const struct s_timer_stats* stats = it.second;
+		int late = timer_stats_percentile(stats->late, TIMER_STATS_LATE_BUCKETS, stats->calls);
+
+		timer_stats_print(fp, "  %-40.40s %12" PRIu64 " %12.1f %10.1f %10" PRIu64 " %10.1f %9s %9" PRtf "\n",
+			search_timer_func_list(it.first), stats->calls, timer_stats_us(stats->cycles) / 1000., timer_stats_us(stats->cycles) / stats->calls,
+			timer_stats_exec_limit(timer_stats_percentile(stats->exec, TIMER_STATS_EXEC_BUCKETS, stats->calls)),
+			timer_stats_us(stats->max), names[late], stats->late_max);
+	}
+}
+
+/// Enables or disables the collection of timer statistics.
+void timer_stats_enable(bool enable)
+{
+	if( enable && !timer_stats_active ) {
+		if( timer_stats_cycles_per_us == 0 )
+			timer_stats_calibrate();
+		if( timer_stats.empty() && timer_stats_cycle.calls == 0 )
+			time(&timer_stats_start);
+	}
+
+	timer_stats_active = enable;
+}
+
+bool timer_stats_enabled(void)
+{
+	return timer_stats_active;
+}
+
+/// Discards all collected timer statistics.
+void timer_stats_reset(void)
+{
+	timer_stats.clear();
+	memset(&timer_stats_cycle, 0, sizeof(timer_stats_cycle));
+	time(&timer_stats_start);
+}
+
+/// Shows the timer functions with the highest cumulative execution time on the console.
+void timer_stats_report(int limit)
+{
+	if( !timer_stats_active && timer_stats_cycle.calls == 0 ) {
+		ShowInfo("Timer statistics are disabled.\n");
+		return;
+	}
+
+	timer_stats_write(NULL, max(limit, 0));
+}
+
+/// Appends the statistics of all timer functions to the dump file.
+bool timer_stats_dump(void)
+{
+	FILE* fp = fopen(timer_stats_dump_filename, "a");
+
+	if( fp == NULL ) {
+		ShowError("timer_stats_dump: Failed to open '%s' for writing.\n", timer_stats_dump_filename);
+		return false;
+	}
+
+	timer_stats_write(fp, 0);
+	fprintf(fp, "\n");
+	fclose(fp);
+
+	return true;
+}
+
+static TIMER_FUNC(timer_stats_dump_timer)
+{
+	if( timer_stats_active )
+		timer_stats_dump();
+
+	return 0;
+}
+
+/// Sets the file the statistics are dumped to.
+void timer_stats_set_dump_file(const char* filename)
+{
+	safestrncpy(timer_stats_dump_filename, filename, sizeof(timer_stats_dump_filename));
+}
+
+/// Dumps the statistics every given seconds, 0 stops the periodic dump.
+void timer_stats_set_dump_interval(int seconds)
+{
+	if( seconds == timer_stats_dump_seconds )
+		return;
+
+	if( timer_stats_dump_tid != INVALID_TIMER ) {
+		delete_timer(timer_stats_dump_tid, timer_stats_dump_timer);
+		timer_stats_dump_tid = INVALID_TIMER;
+	}
+
+	timer_stats_dump_seconds = max(seconds, 0);
+
+	if( timer_stats_dump_seconds > 0 ) {
+		static bool registered = false;
+
+		if( !registered ) {
+			add_timer_func_list(timer_stats_dump_timer, "timer_stats_dump_timer");
+			registered = true;
+		}
+
+		timer_stats_dump_tid = add_timer_interval(gettick() + timer_stats_dump_seconds * 1000, timer_stats_dump_timer, 0, 0, timer_stats_dump_seconds * 1000);
+	}
+}
+
+/// Warns about timer functions and do_timer calls taking longer than the given milliseconds, 0 disables it.
+void timer_stats_set_overdue(int milliseconds)
+{
+	timer_stats_overdue_ms = max(milliseconds, 0);
+}
+
+/// Runs an expired timer that was removed from the queue and releases or restarts it afterwards.
+static void execute_timer(int tid, t_tick tick, t_tick diff)
+{
+	timer_data[tid].type |= TIMER_REMOVE_HEAP;
+
+	if( timer_data[tid].func )
+	{
+		TimerFunc func = timer_data[tid].func;
+		bool measure = timer_stats_active;
+		uint64 start = measure ? timer_stats_clock() : 0;
+
+		if( diff < -1000 )
+			// timer was delayed for more than 1 second, use current tick instead
+			func(tid, tick, timer_data[tid].id, timer_data[tid].data);
+		else
+			func(tid, timer_data[tid].tick, timer_data[tid].id, timer_data[tid].data);
+
+		if( measure )
+			timer_stats_record(tid, func, max(-diff, (t_tick)0), timer_stats_clock() - start);
+	}
+
+	// in the case the function didn't change anything...
+	if( timer_data[tid].type & TIMER_REMOVE_HEAP )
+	{
+		timer_data[tid].type &= ~TIMER_REMOVE_HEAP;
+
+		switch( timer_data[tid].type )
+		{
+		default:
+		case TIMER_ONCE_AUTODEL:
+			timer_data[tid].type = 0;
+			if (free_timer_list_pos >= free_timer_list_max) {
+				free_timer_list_max += 256;
+				RECREATE(free_timer_list,int,free_timer_list_max);
+				memset(free_timer_list + (free_timer_list_max - 256), 0, 256 * sizeof(int));
+			}
+			free_timer_list[free_timer_list_pos++] = tid;
+		break;
+		case TIMER_INTERVAL:
+			if( DIFF_TICK(timer_data[tid].tick, tick) < -1000 )
+				timer_data[tid].tick = tick + timer_data[tid].interval;
+			else
+				timer_data[tid].tick += timer_data[tid].interval;
+			push_timer(tid);
+		break;
+		}
+	}
 }
 
 /// Executes all expired timers.
@@ -351,7 +1009,10 @@ t_tick sett_tickimer(int tid, t_tick tick)
 t_tick do_timer(t_tick tick)
 {
 	t_tick diff = TIMER_MAX_INTERVAL; // return value
+	bool measure = timer_stats_active;
+	uint64 start = measure ? timer_stats_cycle_begin() : 0;
 
+#ifndef TIMER_WHEEL
 	// process all timers one by one
 	while( BHEAP_LENGTH(timer_heap) )
 	{
@@ -363,45 +1024,27 @@ t_tick do_timer(t_tick tick)
 
 		// remove timer
 		BHEAP_POP(timer_heap, DIFFTICK_MINTOPCMP, SWAP);
-		timer_data[tid].type |= TIMER_REMOVE_HEAP;
-
-		if( timer_data[tid].func )
-		{
-			if( diff < -1000 )
-				// timer was delayed for more than 1 second, use current tick instead
-				timer_data[tid].func(tid, tick, timer_data[tid].id, timer_data[tid].data);
-			else
-				timer_data[tid].func(tid, timer_data[tid].tick, timer_data[tid].id, timer_data[tid].data);
-		}
+		execute_timer(tid, tick, diff);
+	}
+#else
+	// collect all expired timers at once
+	timer_wheel_advance(tick);
 
-		// in the case the function didn't change anything...
-		if( timer_data[tid].type & TIMER_REMOVE_HEAP )
-		{
-			timer_data[tid].type &= ~TIMER_REMOVE_HEAP;
+	// process them in order of expiration, timers that expire while doing so are appended
+	while( timer_wheel[TIMER_WHEEL_EXPIRED].head != INVALID_TIMER )
+	{
+		int tid = timer_wheel[TIMER_WHEEL_EXPIRED].head;
 
-			switch( timer_data[tid].type )
-			{
-			default:
-			case TIMER_ONCE_AUTODEL:
-				timer_data[tid].type = 0;
-				if (free_timer_list_pos >= free_timer_list_max) {
-					free_timer_list_max += 256;
-					RECREATE(free_timer_list,int,free_timer_list_max);
-					memset(free_timer_list + (free_timer_list_max - 256), 0, 256 * sizeof(int));
-				}
-				free_timer_list[free_timer_list_pos++] = tid;
-			break;
-			case TIMER_INTERVAL:
-				if( DIFF_TICK(timer_data[tid].tick, tick) < -1000 )
-					timer_data[tid].tick = tick + timer_data[tid].interval;
-				else
-					timer_data[tid].tick += timer_data[tid].interval;
-				push_timer_heap(tid);
-			break;
-			}
-		}
+		timer_wheel_unlink(tid);
+		execute_timer(tid, tick, DIFF_TICK(timer_data[tid].tick, tick));
 	}
 
+	diff = DIFF_TICK(timer_wheel_next_tick(), tick);
+#endif
+
+	if( measure && timer_stats_active )
+		timer_stats_cycle_end(start);
+
 	return cap_value(diff, TIMER_MIN_INTERVAL, TIMER_MAX_INTERVAL);
 }
 
@@ -515,6 +1158,13 @@ void timer_init(void)
 #endif
 
 	time(&start_time);
+
+#ifdef TIMER_WHEEL
+	for( int i = 0; i <= TIMER_WHEEL_EXPIRED; i++ )
+		timer_wheel[i].head = timer_wheel[i].tail = INVALID_TIMER;
+	memset(timer_wheel_used, 0, sizeof(timer_wheel_used));
+	timer_wheel_tick = gettick_nocache();
+#endif
 }
 
 void timer_final(void)
@@ -529,6 +1179,10 @@ void timer_final(void)
 	}
 
 	if (timer_data) aFree(timer_data);
+#ifndef TIMER_WHEEL
 	BHEAP_CLEAR(timer_heap);
+#else
+	if (timer_wheel_links) aFree(timer_wheel_links);
+#endif
 	if (free_timer_list) aFree(free_timer_list);
 }
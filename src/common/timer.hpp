@@ -68,6 +68,15 @@ const char* timestamp2string(char* str, size_t size, time_t timestamp, const cha
 void split_time(int time, int* year, int* month, int* day, int* hour, int* minute, int* second);
 double solve_time(char* modif_p);
 
+void timer_stats_enable(bool enable);
+bool timer_stats_enabled(void);
+void timer_stats_reset(void);
+void timer_stats_report(int limit);
+bool timer_stats_dump(void);
+void timer_stats_set_dump_file(const char* filename);
+void timer_stats_set_dump_interval(int seconds);
+void timer_stats_set_overdue(int milliseconds);
+
 t_tick do_timer(t_tick tick);
 void timer_init(void);
 void timer_final(void);
@@ -10122,6 +10122,10 @@ static const struct _battle_data {
 
 	{ "feature.barter",                     &battle_config.feature_barter,                  1,      0,      1,              },
 	{ "feature.barter_extended",            &battle_config.feature_barter_extended,         1,      0,      1,              },
+	{ "area_packet_batching",               &battle_config.area_packet_batching,            0,      0,      1,              },
+	{ "mob_ai_threads",                     &battle_config.mob_ai_threads,                  0,      0,      64,             },
+	{ "path_regions",                       &battle_config.path_regions,                    1,      0,      1,              },
+	{ "status_calc_deps",                   &battle_config.status_calc_deps,                0,      0,      1,              },
 
 #include "../custom/battle_config_init.inc"
 };
@@ -718,6 +718,10 @@ struct Battle_Config
 
 	int feature_barter;
 	int feature_barter_extended;
+	int area_packet_batching;
+	int mob_ai_threads;
+	int path_regions;
+	int status_calc_deps;
 
 #include "../custom/battle_config_struct.inc"
 };
@@ -50,7 +50,7 @@ static struct chat_data* chat_createchat(struct block_list* bl, const char* titl
 	cd->bl.x    = bl->x;
 	cd->bl.y    = bl->y;
 	cd->bl.type = BL_CHAT;
-	cd->bl.next = cd->bl.prev = NULL;
+	cd->bl.prev = NULL;
 
 	if( cd->bl.id == 0 ) {
 		aFree(cd);
@@ -1319,14 +1319,12 @@ int chrif_save_scdata(struct map_session_data *sd) { //parses the sc_data of the
 	chrif_check(-1);
 	tick = gettick();
 
-	WFIFOHEAD(char_fd, 14 + SC_MAX*sizeof(struct status_change_data));
+	WFIFOHEAD(char_fd, 14 + sc->data.size*sizeof(struct status_change_data));
 	WFIFOW(char_fd,0) = 0x2b1c;
 	WFIFOL(char_fd,4) = sd->status.account_id;
 	WFIFOL(char_fd,8) = sd->status.char_id;
 
-	for (i = 0; i < SC_MAX; i++) {
-		if (!sc->data[i])
-			continue;
+	for (i = sc->data.next(SC_NONE); i < SC_MAX; i = sc->data.next(i)) {
 		if (sc->data[i]->timer != INVALID_TIMER) {
 			timer = get_timer(sc->data[i]->timer);
 			if (timer == NULL || timer->func != status_change_timer)
@@ -4,11 +4,13 @@
 
 #include "clif.hpp"
 
+#include <algorithm>
 #include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <vector>
 
 #include "../common/cbasetypes.hpp"
 #include "../common/conf.hpp"
@@ -403,12 +405,10 @@ static bool clif_session_isValid(struct map_session_data *sd) {
  * - AREA_WOS (AREA WITHOUT SELF) : Not run for self
  * - AREA_CHAT_WOC : Everyone in the area of your chat without a chat
  *------------------------------------------*/
-static int clif_send_sub(struct block_list *bl, va_list ap)
+static int clif_send_sub(struct block_list *bl, const void* buf, int len, struct block_list *src_bl, enum send_target type, struct socket_packet **packet)
 {
-	struct block_list *src_bl;
 	struct map_session_data *sd;
-	unsigned char *buf;
-	int len, type, fd;
+	int fd;
 
 	nullpo_ret(bl);
 	nullpo_ret(sd = (struct map_session_data *)bl);
@@ -418,10 +418,7 @@ static int clif_send_sub(struct block_list *bl, va_list ap)
 		return 0;
 	}
 
-	buf = va_arg(ap,unsigned char*);
-	len = va_arg(ap,int);
-	nullpo_ret(src_bl = va_arg(ap,struct block_list*));
-	type = va_arg(ap,int);
+	nullpo_ret(src_bl);
 
 	switch(type) {
 	case AREA_WOS:
@@ -446,6 +443,8 @@ static int clif_send_sub(struct block_list *bl, va_list ap)
 		}
 	}
 	break;
+	default:
+	break;
 	}
 
 	/* unless visible, hold it here */
@@ -453,7 +452,7 @@ static int clif_send_sub(struct block_list *bl, va_list ap)
 		!sd->sc.data[SC_INTRAVISION] && battle_check_target(src_bl,&sd->bl,BCT_ENEMY) > 0)
 		return 0;
 
-	WFIFOHEAD(fd, len);
+	// WFIFOSET_SHARED reserves space in the write fifo only when it copies the packet
 	if (WFIFOP(fd,0) == buf) {
 		ShowError("WARNING: Invalid use of clif_send function\n");
 		ShowError("         Packet x%4x use a WFIFO of a player instead of to use a buffer.\n", WBUFW(buf,0));
@@ -464,12 +463,147 @@ static int clif_send_sub(struct block_list *bl, va_list ap)
 		return 0;
 	}
 
-	memcpy(WFIFOP(fd,0), buf, len);
-	WFIFOSET(fd,len);
+	WFIFOSET_SHARED(fd, buf, len, packet);
 
 	return 0;
 }
 
+/// Area broadcast that is sent together with the other broadcasts of the same server cycle
+struct s_area_broadcast {
+	int16 m, x, y; // position of the source when the packet was sent
+	int16 range;
+	int src_id;
+	unsigned int src_chat_id; // chat of the source, for AREA_WOSC
+	enum send_target type;
+	size_t offset; // position of the packet in clif_area_data
+	int len;
+};
+
+static std::vector<s_area_broadcast> clif_area_queue;
+static std::vector<uint8> clif_area_data;
+static std::vector<map_session_data*> clif_area_players;
+
+/// Queues an area broadcast until the end of the server cycle.
+static void clif_area_enqueue(const void* buf, int len, struct block_list* bl, enum send_target type, int16 range)
+{
+	struct s_area_broadcast entry;
+
+	entry.m = bl->m;
+	entry.x = bl->x;
+	entry.y = bl->y;
+	entry.range = range;
+	entry.src_id = bl->id;
+	entry.src_chat_id = 0;
+	entry.type = type;
+	entry.offset = clif_area_data.size();
+	entry.len = len;
+
+	if( bl->type == BL_PC )
+		entry.src_chat_id = ((struct map_session_data *)bl)->chatID;
+	else if( bl->type == BL_NPC )
+		entry.src_chat_id = ((struct npc_data *)bl)->chat_id;
+
+	clif_area_data.insert(clif_area_data.end(), (const uint8*)buf, (const uint8*)buf + len);
+	clif_area_queue.push_back(entry);
+}
+
+/// Checks if a queued broadcast is sent to the player, see clif_send_sub.
+static bool clif_area_isrecipient(const struct s_area_broadcast& entry, struct map_session_data* sd)
+{
+	if( abs(sd->bl.x - entry.x) > entry.range || abs(sd->bl.y - entry.y) > entry.range )
+		return false;
+
+	switch( entry.type ){
+		case AREA_WOS:
+			return sd->bl.id != entry.src_id;
+		case AREA_WOC:
+			return !sd->chatID && sd->bl.id != entry.src_id;
+		case AREA_WOSC:
+			return !sd->chatID || sd->chatID != entry.src_chat_id;
+		default:
+			return true;
+	}
+
+	return true;
+}
+
+/*==========================================
+ * Sends the area broadcasts of the current server cycle (called before the sessions are flushed)
+ * Broadcasts sent from the same map block share a single walk over the surrounding blocks,
+ * every client receives its packets in the order they were sent.
+ *------------------------------------------*/
+static void clif_area_flush(void)
+{
+	static std::vector<size_t> order;
+	static std::vector<std::pair<size_t, int>> deliveries; // broadcast, fd
+
+	if( clif_area_queue.empty() )
+		return;
+
+	auto block_of = []( const struct s_area_broadcast& entry ){
+		return ( (uint64)(uint16)entry.m << 32 ) | ( (uint64)( entry.x / BLOCK_SIZE ) << 16 ) | (uint64)( entry.y / BLOCK_SIZE );
+	};
+
+	order.clear();
+	for( size_t i = 0; i < clif_area_queue.size(); i++ )
+		order.push_back(i);
+
+	std::stable_sort( order.begin(), order.end(), [&]( size_t a, size_t b ){
+		return block_of( clif_area_queue[a] ) < block_of( clif_area_queue[b] );
+	} );
+
+	deliveries.clear();
+
+	for( size_t first = 0, last; first < order.size(); first = last ){
+		const struct s_area_broadcast& head = clif_area_queue[order[first]];
+		int16 x0 = head.x - head.range, y0 = head.y - head.range;
+		int16 x1 = head.x + head.range, y1 = head.y + head.range;
+
+		for( last = first + 1; last < order.size() && block_of( clif_area_queue[order[last]] ) == block_of( head ); last++ ){
+			const struct s_area_broadcast& entry = clif_area_queue[order[last]];
+
+			x0 = i16min(x0, entry.x - entry.range);
+			y0 = i16min(y0, entry.y - entry.range);
+			x1 = i16max(x1, entry.x + entry.range);
+			y1 = i16max(y1, entry.y + entry.range);
+		}
+
+		clif_area_players.clear();
+		map_foreachinallarea(head.m, x0, y0, x1, y1, BL_PC, [](struct block_list *bl) {
+			clif_area_players.push_back((struct map_session_data *)bl);
+			return 0;
+		});
+
+		for( struct map_session_data* sd : clif_area_players ){
+			// Don't send to disconnected clients.
+			if( !session_isActive(sd->fd) )
+				continue;
+
+			for( size_t i = first; i < last; i++ ){
+				if( clif_area_isrecipient( clif_area_queue[order[i]], sd ) )
+					deliveries.push_back( std::make_pair( order[i], sd->fd ) );
+			}
+		}
+	}
+
+	// restore the order in which the broadcasts were sent
+	std::sort( deliveries.begin(), deliveries.end() );
+
+	for( size_t i = 0; i < deliveries.size(); ){
+		const struct s_area_broadcast& entry = clif_area_queue[deliveries[i].first];
+		struct socket_packet* packet = NULL;
+
+		for( ; i < deliveries.size() && &clif_area_queue[deliveries[i].first] == &entry; i++ ){
+			WFIFOSET_SHARED(deliveries[i].second, &clif_area_data[entry.offset], entry.len, &packet);
+		}
+
+		socket_packet_release(packet);
+	}
+
+	clif_area_queue.clear();
+	clif_area_data.clear();
+}
+
 /*==========================================
  * Packet Delegation (called on all packets that require data to be sent to more than one client)
  * functions that are sent solely to one use whose ID it posses use WFIFOSET
@@ -483,6 +617,7 @@ int clif_send(const void* buf, int len, struct block_list* bl, enum send_target
 	std::shared_ptr<s_battleground_data> bg;
 	int x0 = 0, x1 = 0, y0 = 0, y1 = 0, fd;
 	struct s_mapiterator* iter;
+	struct socket_packet* packet = NULL; // shared by all recipients
 
 	if( type != ALL_CLIENT && type != BG_LISTEN )
 		nullpo_ret(bl);
@@ -498,9 +633,7 @@ int clif_send(const void* buf, int len, struct block_list* bl, enum send_target
 			if( session_isActive( fd = tsd->fd ) ){
 				if( type == BG_LISTEN && !(tsd->state.bg_listen || tsd->bg_queue_id) )
 					continue;
-				WFIFOHEAD( fd, len );
-				memcpy( WFIFOP( fd, 0 ), buf, len );
-				WFIFOSET( fd, len );
+				WFIFOSET_SHARED(fd, buf, len, &packet);
 			}
 		}
 		mapit_free(iter);
@@ -510,9 +643,7 @@ int clif_send(const void* buf, int len, struct block_list* bl, enum send_target
 		iter = mapit_getallusers();
 		while( ( tsd = (map_session_data*)mapit_next( iter ) ) != nullptr ){
 			if( bl->m == tsd->bl.m && session_isActive( fd = tsd->fd ) ){
-				WFIFOHEAD( fd, len );
-				memcpy( WFIFOP( fd, 0 ), buf, len );
-				WFIFOSET( fd, len );
+				WFIFOSET_SHARED(fd, buf, len, &packet);
 			}
 		}
 		mapit_free(iter);
@@ -524,12 +655,23 @@ int clif_send(const void* buf, int len, struct block_list* bl, enum send_target
 			clif_send (buf, len, bl, SELF);
 	case AREA_WOC:
 	case AREA_WOS:
-		map_foreachinallarea(clif_send_sub, bl->m, bl->x-AREA_SIZE, bl->y-AREA_SIZE, bl->x+AREA_SIZE, bl->y+AREA_SIZE,
-			BL_PC, buf, len, bl, type);
+		// the visibility check of clif_send_sub depends on the current state
+		if( battle_config.area_packet_batching && !clif_ally_only ){
+			clif_area_enqueue(buf, len, bl, type, AREA_SIZE);
+			break;
+		}
+		map_foreachinallarea(bl->m, bl->x-AREA_SIZE, bl->y-AREA_SIZE, bl->x+AREA_SIZE, bl->y+AREA_SIZE, BL_PC, [&](struct block_list *tbl) {
+			return clif_send_sub(tbl, buf, len, bl, type, &packet);
+		});
 		break;
 	case AREA_CHAT_WOC:
-		map_foreachinallarea(clif_send_sub, bl->m, bl->x-(AREA_SIZE-5), bl->y-(AREA_SIZE-5),
-			bl->x+(AREA_SIZE-5), bl->y+(AREA_SIZE-5), BL_PC, buf, len, bl, AREA_WOC);
+		if( battle_config.area_packet_batching && !clif_ally_only ){
+			clif_area_enqueue(buf, len, bl, AREA_WOC, AREA_SIZE-5);
+			break;
+		}
+		map_foreachinallarea(bl->m, bl->x-(AREA_SIZE-5), bl->y-(AREA_SIZE-5), bl->x+(AREA_SIZE-5), bl->y+(AREA_SIZE-5), BL_PC, [&](struct block_list *tbl) {
+			return clif_send_sub(tbl, buf, len, bl, AREA_WOC, &packet);
+		});
 		break;
 
 	case CHAT:
@@ -547,9 +689,7 @@ int clif_send(const void* buf, int len, struct block_list* bl, enum send_target
 				if (type == CHAT_WOS && cd->usersd[i] == sd)
 					continue;
 				if( session_isActive( fd = cd->usersd[i]->fd ) ){
-					WFIFOHEAD(fd,len);
-					memcpy(WFIFOP(fd,0), buf, len);
-					WFIFOSET(fd,len);
+					WFIFOSET_SHARED(fd, buf, len, &packet);
 				}
 			}
 		}
@@ -585,9 +725,7 @@ int clif_send(const void* buf, int len, struct block_list* bl, enum send_target
 				if( (type == PARTY_AREA || type == PARTY_AREA_WOS) && (sd->bl.x < x0 || sd->bl.y < y0 || sd->bl.x > x1 || sd->bl.y > y1) )
 					continue;
 
-				WFIFOHEAD(fd, len);
-				memcpy(WFIFOP(fd, 0), buf, len);
-				WFIFOSET(fd, len);
+				WFIFOSET_SHARED(fd, buf, len, &packet);
 			}
 			if (!enable_spy) //Skip unnecessary parsing. [Skotlex]
 				break;
@@ -595,9 +733,7 @@ int clif_send(const void* buf, int len, struct block_list* bl, enum send_target
 			iter = mapit_getallusers();
 			while( ( tsd = (map_session_data*)mapit_next( iter ) ) != nullptr ){
 				if( tsd->partyspy == p->party.party_id && session_isActive( fd = tsd->fd ) ){
-					WFIFOHEAD( fd, len );
-					memcpy( WFIFOP( fd, 0 ), buf, len );
-					WFIFOSET( tsd->fd, len );
+					WFIFOSET_SHARED(fd, buf, len, &packet);
 				}
 			}
 			mapit_free(iter);
@@ -613,9 +749,7 @@ int clif_send(const void* buf, int len, struct block_list* bl, enum send_target
 			if( type == DUEL_WOS && bl->id == tsd->bl.id )
 				continue;
 			if( sd->duel_group == tsd->duel_group && session_isActive( fd = tsd->fd ) ){
-				WFIFOHEAD( fd, len );
-				memcpy( WFIFOP( fd, 0 ), buf, len );
-				WFIFOSET( fd, len );
+				WFIFOSET_SHARED(fd, buf, len, &packet);
 			}
 		}
 		mapit_free(iter);
@@ -663,9 +797,7 @@ int clif_send(const void* buf, int len, struct block_list* bl, enum send_target
 					if( (type == GUILD_AREA || type == GUILD_AREA_WOS) && (sd->bl.x < x0 || sd->bl.y < y0 || sd->bl.x > x1 || sd->bl.y > y1) )
 						continue;
 
-					WFIFOHEAD(fd,len);
-					memcpy(WFIFOP(fd,0), buf, len);
-					WFIFOSET(fd,len);
+					WFIFOSET_SHARED(fd, buf, len, &packet);
 				}
 			}
 			if (!enable_spy) //Skip unnecessary parsing. [Skotlex]
@@ -674,9 +806,7 @@ int clif_send(const void* buf, int len, struct block_list* bl, enum send_target
 			iter = mapit_getallusers();
 			while( ( tsd = (map_session_data*)mapit_next( iter ) ) != nullptr ){
 				if( tsd->guildspy == g->guild_id && session_isActive( fd = tsd->fd ) ){
-					WFIFOHEAD( fd, len );
-					memcpy( WFIFOP( fd, 0 ), buf, len );
-					WFIFOSET( fd, len );
+					WFIFOSET_SHARED(fd, buf, len, &packet);
 				}
 			}
 			mapit_free(iter);
@@ -705,9 +835,7 @@ int clif_send(const void* buf, int len, struct block_list* bl, enum send_target
 					continue;
 				if( (type == BG_AREA || type == BG_AREA_WOS) && (sd->bl.x < x0 || sd->bl.y < y0 || sd->bl.x > x1 || sd->bl.y > y1) )
 					continue;
-				WFIFOHEAD(fd,len);
-				memcpy(WFIFOP(fd,0), buf, len);
-				WFIFOSET(fd,len);
+				WFIFOSET_SHARED(fd, buf, len, &packet);
 			}
 		}
 		break;
@@ -720,9 +848,7 @@ int clif_send(const void* buf, int len, struct block_list* bl, enum send_target
 					continue;
 				}
 
-				WFIFOHEAD(fd,len);
-				memcpy(WFIFOP(fd,0), buf, len);
-				WFIFOSET(fd,len);
+				WFIFOSET_SHARED(fd, buf, len, &packet);
 			}
 
 			if (!enable_spy) //Skip unnecessary parsing. [Skotlex]
@@ -731,9 +857,7 @@ int clif_send(const void* buf, int len, struct block_list* bl, enum send_target
 			iter = mapit_getallusers();
 			while( ( tsd = (map_session_data*)mapit_next( iter ) ) != nullptr ){
 				if( tsd->clanspy == clan->id && session_isActive( fd = tsd->fd ) ){
-					WFIFOHEAD(fd, len);
-					memcpy(WFIFOP(fd, 0), buf, len);
-					WFIFOSET(fd, len);
+					WFIFOSET_SHARED(fd, buf, len, &packet);
 				}
 			}
 			mapit_free(iter);
@@ -745,6 +869,8 @@ int clif_send(const void* buf, int len, struct block_list* bl, enum send_target
 		return -1;
 	}
 
+	socket_packet_release(packet);
+
 	return 0;
 }
 
@@ -23943,6 +24069,7 @@ void do_init_clif(void) {
 	packetdb_readdb();
 
 	set_defaultparse(clif_parse);
+	set_presend(clif_area_flush);
 	if( make_listen_bind(bind_ip,map_port) == -1 ) {
 		ShowFatalError("Failed to bind to port '" CL_WHITE "%d" CL_RESET "'\n",map_port);
 		exit(EXIT_FAILURE);
@@ -23963,5 +24090,7 @@ void do_init_clif(void) {
 }
 
 void do_final_clif(void) {
+	clif_area_queue.clear();
+	clif_area_data.clear();
 	ers_destroy(delay_clearunit_ers);
 }
@@ -1047,6 +1047,7 @@ uint64 ItemDatabase::parseBodyNode(const ryml::NodeRef& node) {
 		}
 
 		item->script = parse_script(script.c_str(), this->getCurrentFile().c_str(), this->getLineNumber(node["Script"]), SCRIPT_IGNORE_EXTERNAL_BRACKETS);
+		script_compile_bonus(item->script);
 	} else {
 		if (!exists) 
 			item->script = nullptr;
@@ -2504,6 +2505,7 @@ uint64 ComboDatabase::parseBodyNode(const ryml::NodeRef& node) {
 				combo->script = nullptr;
 			}
 			combo->script = parse_script(script.c_str(), this->getCurrentFile().c_str(), this->getLineNumber(node["Script"]), SCRIPT_IGNORE_EXTERNAL_BRACKETS);
+			script_compile_bonus(combo->script);
 		} else {
 			if (!exists) {
 				combo->script = nullptr;
@@ -3,13 +3,24 @@
 
 #include "log.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "../common/cbasetypes.hpp"
 #include "../common/nullpo.hpp"
 #include "../common/showmsg.hpp"
 #include "../common/sql.hpp" // SQL_INNODB
 #include "../common/strlib.hpp"
+#include "../common/timer.hpp"
+#include "../common/utils.hpp" // cap_value
 
 #include "battle.hpp"
 #include "homunculus.hpp"
@@ -165,45 +176,426 @@ static bool should_log_item(t_itemid nameid, int amount, int refine)
 }
 
 
+/// Log tables (or files), each one with its own column list
+enum e_log_target : uint8 {
+	LOG_TARGET_BRANCH = 0,
+	LOG_TARGET_PICK,
+	LOG_TARGET_ZENY,
+	LOG_TARGET_MVPDROP,
+	LOG_TARGET_ATCOMMAND,
+	LOG_TARGET_NPC,    ///< 'logmes' of npcs
+	LOG_TARGET_NPC_PC, ///< 'logmes' attached to a player
+	LOG_TARGET_CHAT,
+	LOG_TARGET_CASH,
+	LOG_TARGET_FEEDING,
+	LOG_TARGET_MAX
+};
+
+/// Largest formatted row (VALUES tuple or file line), longer ones are written synchronously
+#define LOG_RECORD_SIZE 1024
+
+/// Queued log line
+struct s_log_record {
+	std::atomic<size_t> sequence;
+	e_log_target target;
+	uint16 length;
+	char data[LOG_RECORD_SIZE];
+};
+
+/// Failed flush, reported by the main thread
+struct s_log_error {
+	e_log_target target;
+	int rows;
+	unsigned int code;
+	std::string message;
+};
+
+/// Interval in which the main thread reports the errors of the writer, in ms
+#define LOG_ERROR_REPORT_INTERVAL 1000
+
+/// Background writer. Log calls push fixed-size records into a bounded lock-free MPSC queue,
+/// the writer thread flushes them as multi-row INSERTs (or one file write per target) every
+/// log_config.async_interval ms, or earlier once log_config.async_rows records are waiting.
+/// A full queue makes the log call wait for the writer, so lines are never dropped.
+/// The writer thread only uses its own std::string buffers and Sql_QueryThreaded, it never allocates
+/// through the memory manager or writes to the console, its errors are reported by the main thread.
+static struct s_log_writer {
+	std::unique_ptr<s_log_record[]> queue;
+	size_t mask;
+	std::atomic<size_t> enqueue_pos;
+	std::atomic<size_t> dequeue_pos;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	std::condition_variable space;
+	bool wake;
+	bool stopping;
+	bool running;
+
+	Sql* sql_handle; ///< Connection owned by the writer thread
+	std::string insert[LOG_TARGET_MAX]; ///< "INSERT INTO `table` (columns) VALUES "
+	std::vector<s_log_error> errors; ///< Guarded by mutex
+	int report_timer;
+
+	std::atomic<uint64> written;
+	std::atomic<uint64> stalls;
+	std::atomic<uint64> failed;
+} log_writer;
+
+/// Returns the table (or file) of a log target
+static const char* log_target_name(e_log_target target)
+{
+	switch( target ) {
+		case LOG_TARGET_BRANCH:    return log_config.log_branch;
+		case LOG_TARGET_PICK:      return log_config.log_pick;
+		case LOG_TARGET_ZENY:      return log_config.log_zeny;
+		case LOG_TARGET_MVPDROP:   return log_config.log_mvpdrop;
+		case LOG_TARGET_ATCOMMAND: return log_config.log_gm;
+		case LOG_TARGET_NPC:
+		case LOG_TARGET_NPC_PC:    return log_config.log_npc;
+		case LOG_TARGET_CHAT:      return log_config.log_chat;
+		case LOG_TARGET_CASH:      return log_config.log_cash;
+		case LOG_TARGET_FEEDING:   return log_config.log_feeding;
+		case LOG_TARGET_MAX:       break;
+	}
+
+	return "";
+}
+
+/// Returns the column list of a log target
+static std::string log_target_columns(e_log_target target)
+{
+	switch( target ) {
+		case LOG_TARGET_BRANCH:    return "`branch_date`, `account_id`, `char_id`, `char_name`, `map`";
+		case LOG_TARGET_PICK: {
+			std::string columns = "`time`, `char_id`, `type`, `nameid`, `amount`, `refine`, `map`, `unique_id`, `bound`, `enchantgrade`";
+
+			for( int i = 0; i < MAX_SLOTS; ++i )
+				columns += ", `card" + std::to_string(i) + "`";
+			for( int i = 0; i < MAX_ITEM_RDM_OPT; ++i ) {
+				columns += ", `option_id" + std::to_string(i) + "`";
+				columns += ", `option_val" + std::to_string(i) + "`";
+				columns += ", `option_parm" + std::to_string(i) + "`";
+			}
+			return columns;
+		}
+		case LOG_TARGET_ZENY:      return "`time`, `char_id`, `src_id`, `type`, `amount`, `map`";
+		case LOG_TARGET_MVPDROP:   return "`mvp_date`, `kill_char_id`, `monster_id`, `prize`, `mvpexp`, `map`";
+		case LOG_TARGET_ATCOMMAND: return "`atcommand_date`, `account_id`, `char_id`, `char_name`, `map`, `command`";
+		case LOG_TARGET_NPC:       return "`npc_date`, `char_name`, `map`, `mes`";
+		case LOG_TARGET_NPC_PC:    return "`npc_date`, `account_id`, `char_id`, `char_name`, `map`, `mes`";
+		case LOG_TARGET_CHAT:      return "`time`, `type`, `type_id`, `src_charid`, `src_accountid`, `src_map`, `src_map_x`, `src_map_y`, `dst_charname`, `message`";
+		case LOG_TARGET_CASH:      return "`time`, `char_id`, `type`, `cash_type`, `amount`, `map`";
+		case LOG_TARGET_FEEDING:   return "`time`, `char_id`, `target_id`, `target_class`, `type`, `intimacy`, `item_id`, `map`, `x`, `y`";
+		case LOG_TARGET_MAX:       break;
+	}
+
+	return "";
+}
+
+/// Appends a quoted SQL string of at most max_len characters
+static void log_sql_string(StringBuf* buf, const char* str, size_t max_len)
+{
+	char esc[2 * CHAT_SIZE_MAX + 1];
+
+	Sql_EscapeStringLen(logmysql_handle, esc, str, safestrnlen(str, std::min(max_len, (size_t)CHAT_SIZE_MAX)));
+	StringBuf_Printf(buf, "'%s'", esc);
+}
+
+/// Starts a SQL row with the current time, the rows are queued so NOW() would be the flush time
+static void log_sql_row(StringBuf* buf)
+{
+	StringBuf_Printf(buf, "(FROM_UNIXTIME(%" PRId64 ")", (int64)time(NULL));
+}
+
+/// Starts a file line with the current time
+static void log_file_line(StringBuf* buf)
+{
+	char timestring[255];
+	time_t curtime;
+
+	time(&curtime);
+	strftime(timestring, sizeof(timestring), log_timestamp_format, localtime(&curtime));
+	StringBuf_Printf(buf, "%s - ", timestring);
+}
+
+/// Appends a line to a log file
+static void log_file_append(const char* path, const char* data, size_t length)
+{
+	FILE* logfp;
+
+	if( ( logfp = fopen(path, "a") ) == NULL )
+		return;
+	fwrite(data, 1, length, logfp);
+	fclose(logfp);
+}
+
+/// Writes a row directly, used when the writer is off or the row doesn't fit in a record
+static void log_write_sync(e_log_target target, const char* data, size_t length)
+{
+	if( log_config.sql_logs ) {
+		StringBuf buf;
+
+		StringBuf_Init(&buf);
+		StringBuf_Printf(&buf, LOG_QUERY " INTO `%s` (%s) VALUES ", log_target_name(target), log_target_columns(target).c_str());
+		StringBuf_AppendStr(&buf, data);
+		if( SQL_ERROR == Sql_QueryStr(logmysql_handle, StringBuf_Value(&buf)) )
+			Sql_ShowDebug(logmysql_handle);
+		StringBuf_Destroy(&buf);
+	} else
+		log_file_append(log_target_name(target), data, length);
+}
+
+/// Pushes a record, returns false if the queue is full
+static bool log_writer_push(e_log_target target, const char* data, size_t length)
+{
+	s_log_record* record;
+	size_t pos = log_writer.enqueue_pos.load(std::memory_order_relaxed);
+
+	for( ;; ) {
+		record = &log_writer.queue[pos & log_writer.mask];
+
+		intptr_t diff = (intptr_t)record->sequence.load(std::memory_order_acquire) - (intptr_t)pos;
+
+		if( diff == 0 ) {
+			if( log_writer.enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) )
+				break;
+		} else if( diff < 0 )
+			return false;
+		else
+			pos = log_writer.enqueue_pos.load(std::memory_order_relaxed);
+	}
+
+	record->target = target;
+	record->length = (uint16)length;
+	memcpy(record->data, data, length);
+	record->sequence.store(pos + 1, std::memory_order_release);
+
+	// Wake the writer once a batch is complete instead of waiting for the interval
+	if( pos + 1 - log_writer.dequeue_pos.load(std::memory_order_relaxed) == (size_t)log_config.async_rows ) {
+		std::lock_guard<std::mutex> lock(log_writer.mutex);
+
+		log_writer.wake = true;
+		log_writer.wakeup.notify_one();
+	}
+
+	return true;
+}
+
+/// Writes a formatted row of a log target
+static void log_write(e_log_target target, StringBuf* buf)
+{
+	size_t length = StringBuf_Length(buf);
+
+	if( !log_writer.running || length >= LOG_RECORD_SIZE ) {
+		log_write_sync(target, StringBuf_Value(buf), length);
+		return;
+	}
+
+	while( !log_writer_push(target, StringBuf_Value(buf), length) ) {
+		// Backpressure, wait until the writer made room
+		std::unique_lock<std::mutex> lock(log_writer.mutex);
+
+		log_writer.stalls++;
+		log_writer.wake = true;
+		log_writer.wakeup.notify_one();
+		log_writer.space.wait_for(lock, std::chrono::milliseconds(10));
+	}
+}
+
+/// Rows of a log target waiting to be written by the writer thread
+struct s_log_batch {
+	std::string data; ///< Rows, or the multi-row INSERT in SQL mode
+	std::vector<size_t> rows; ///< Offset of each row in data
+};
+
+/// Executes an INSERT of a single row, returns false if it failed
+static bool log_writer_query(e_log_target target, const char* row, size_t length)
+{
+	std::string query = log_writer.insert[target];
+
+	query.append(row, length);
+	return SQL_SUCCESS == Sql_QueryThreaded(log_writer.sql_handle, query.c_str(), query.length());
+}
+
+/// Executes a batched INSERT on the writer connection.
+/// If it fails, the connection is checked and the batch is sent again, then row by row,
+/// so that a short disconnect or a single bad row doesn't lose the whole batch.
+static void log_writer_execute(e_log_target target, s_log_batch& batch)
+{
+	int failed = 0;
+
+	if( batch.rows.empty() )
+		return;
+
+	if( SQL_ERROR == Sql_QueryThreaded(log_writer.sql_handle, batch.data.c_str(), batch.data.length()) ) {
+		unsigned int code = Sql_GetError(log_writer.sql_handle);
+		std::string message = Sql_GetErrorText(log_writer.sql_handle);
+
+		if( SQL_ERROR == Sql_Ping(log_writer.sql_handle) ) // reconnects if the connection was lost
+			failed = (int)batch.rows.size();
+		else if( SQL_ERROR == Sql_QueryThreaded(log_writer.sql_handle, batch.data.c_str(), batch.data.length()) ) {
+			for( size_t i = 0; i < batch.rows.size(); i++ ) {
+				size_t end = ( i + 1 < batch.rows.size() ) ? batch.rows[i + 1] - 1 : batch.data.length(); // rows are separated by ','
+
+				if( !log_writer_query(target, &batch.data[batch.rows[i]], end - batch.rows[i]) ) {
+					code = Sql_GetError(log_writer.sql_handle);
+					message = Sql_GetErrorText(log_writer.sql_handle);
+					failed++;
+				}
+			}
+		}
+
+		if( failed > 0 ) {
+			std::lock_guard<std::mutex> lock(log_writer.mutex);
+
+			log_writer.errors.push_back({ target, failed, code, message });
+		}
+	}
+
+	log_writer.written += batch.rows.size() - failed;
+	log_writer.failed += failed;
+
+	batch.data.clear();
+	batch.rows.clear();
+}
+
+/// Writes everything that is queued, runs on the writer thread
+static void log_writer_flush(void)
+{
+	s_log_batch batch[LOG_TARGET_MAX];
+	size_t pos = log_writer.dequeue_pos.load(std::memory_order_relaxed);
+
+	for( ;; ) {
+		s_log_record* record = &log_writer.queue[pos & log_writer.mask];
+
+		if( record->sequence.load(std::memory_order_acquire) != pos + 1 )
+			break;
+
+		e_log_target target = record->target;
+
+		if( log_config.sql_logs ) {
+			batch[target].data += batch[target].rows.empty() ? log_writer.insert[target] : std::string(",");
+			batch[target].rows.push_back(batch[target].data.length());
+			batch[target].data.append(record->data, record->length);
+			if( batch[target].rows.size() >= (size_t)log_config.async_rows )
+				log_writer_execute(target, batch[target]);
+		} else {
+			batch[target].rows.push_back(batch[target].data.length());
+			batch[target].data.append(record->data, record->length);
+		}
+
+		record->sequence.store(pos + log_writer.mask + 1, std::memory_order_release);
+		log_writer.dequeue_pos.store(++pos, std::memory_order_relaxed);
+	}
+
+	log_writer.space.notify_all();
+
+	for( int i = 0; i < LOG_TARGET_MAX; i++ ) {
+		if( log_config.sql_logs )
+			log_writer_execute((e_log_target)i, batch[i]);
+		else if( !batch[i].rows.empty() ) {
+			log_file_append(log_target_name((e_log_target)i), batch[i].data.c_str(), batch[i].data.length());
+			log_writer.written += batch[i].rows.size();
+		}
+	}
+}
+
+/// Writer thread
+static void log_writer_main(void)
+{
+	auto idle_since = std::chrono::steady_clock::now();
+
+	Sql_ThreadInit();
+	for( ;; ) {
+		bool stop;
+
+		{
+			std::unique_lock<std::mutex> lock(log_writer.mutex);
+
+			log_writer.wakeup.wait_for(lock, std::chrono::milliseconds(log_config.async_interval), [] { return log_writer.wake || log_writer.stopping; });
+			log_writer.wake = false;
+			stop = log_writer.stopping;
+		}
+
+		size_t pending = log_writer.enqueue_pos.load(std::memory_order_relaxed) - log_writer.dequeue_pos.load(std::memory_order_relaxed);
+
+		if( pending > 0 ) {
+			log_writer_flush();
+			idle_since = std::chrono::steady_clock::now();
+		} else if( log_writer.sql_handle != nullptr && std::chrono::steady_clock::now() - idle_since > std::chrono::hours(1) ) {
+			// The connection is not pinged by the main timer, keep it alive here
+			Sql_Ping(log_writer.sql_handle);
+			idle_since = std::chrono::steady_clock::now();
+		}
+
+		if( stop )
+			break;
+	}
+
+	// Drain whatever was queued while stopping
+	log_writer_flush();
+	Sql_ThreadEnd();
+}
+
+/// Reports the failed flushes of the writer, runs on the main thread
+static void log_writer_report(void)
+{
+	std::vector<s_log_error> errors;
+
+	{
+		std::lock_guard<std::mutex> lock(log_writer.mutex);
+
+		errors.swap(log_writer.errors);
+	}
+
+	for( const s_log_error& error : errors ) {
+		ShowSQL("DB error - %s\n", error.message.c_str());
+		ShowDebug("Log writer: %d rows of `%s` were not written.\n", error.rows, log_target_name(error.target));
+		ra_mysql_error_handler(error.code);
+	}
+}
+
+static TIMER_FUNC(log_writer_report_timer)
+{
+	log_writer_report();
+	return 0;
+}
+
+
 /// logs items, that summon monsters
 void log_branch(struct map_session_data* sd)
 {
+	StringBuf buf;
+
 	nullpo_retv(sd);
 
 	if( !log_config.branch )
 		return;
 
+	StringBuf_Init(&buf);
 	if( log_config.sql_logs ) {
-		SqlStmt* stmt;
-		stmt = SqlStmt_Malloc(logmysql_handle);
-		if( SQL_SUCCESS != SqlStmt_Prepare(stmt, LOG_QUERY " INTO `%s` (`branch_date`, `account_id`, `char_id`, `char_name`, `map`) VALUES (NOW(), '%d', '%d', ?, '%s')", log_config.log_branch, sd->status.account_id, sd->status.char_id, mapindex_id2name(sd->mapindex) )
-		||  SQL_SUCCESS != SqlStmt_BindParam(stmt, 0, SQLDT_STRING, sd->status.name, strnlen(sd->status.name, NAME_LENGTH))
-		||  SQL_SUCCESS != SqlStmt_Execute(stmt) )
-		{
-			SqlStmt_ShowDebug(stmt);
-			SqlStmt_Free(stmt);
-			return;
-		}
-		SqlStmt_Free(stmt);
+		log_sql_row(&buf);
+		StringBuf_Printf(&buf, ", '%d', '%d', ", sd->status.account_id, sd->status.char_id);
+		log_sql_string(&buf, sd->status.name, NAME_LENGTH);
+		StringBuf_Printf(&buf, ", '%s')", mapindex_id2name(sd->mapindex));
 	}
 	else
 	{
-		char timestring[255];
-		time_t curtime;
-		FILE* logfp;
-
-		if( ( logfp = fopen(log_config.log_branch, "a") ) == NULL )
-			return;
-		time(&curtime);
-		strftime(timestring, sizeof(timestring), log_timestamp_format, localtime(&curtime));
-		fprintf(logfp,"%s - %s[%d:%d]\t%s\n", timestring, sd->status.name, sd->status.account_id, sd->status.char_id, mapindex_id2name(sd->mapindex));
-		fclose(logfp);
+		log_file_line(&buf);
+		StringBuf_Printf(&buf, "%s[%d:%d]\t%s\n", sd->status.name, sd->status.account_id, sd->status.char_id, mapindex_id2name(sd->mapindex));
 	}
+	log_write(LOG_TARGET_BRANCH, &buf);
+	StringBuf_Destroy(&buf);
 }
 
 /// logs item transactions (generic)
 void log_pick(int id, int16 m, e_log_pick_type type, int amount, struct item* itm)
 {
+	StringBuf buf;
+	int i;
+
 	nullpo_retv(itm);
 	if( ( log_config.enable_logs&type ) == 0 )
 	{// disabled
@@ -213,22 +605,11 @@ void log_pick(int id, int16 m, e_log_pick_type type, int amount, struct item* it
 	if( !should_log_item(itm->nameid, amount, itm->refine) )
 		return; //we skip logging this item set - it doesn't meet our logging conditions [Lupus]
 
+	StringBuf_Init(&buf);
 	if( log_config.sql_logs )
 	{
-		int i;
-		SqlStmt* stmt = SqlStmt_Malloc(logmysql_handle);
-		StringBuf buf;
-		StringBuf_Init(&buf);
-
-		StringBuf_Printf(&buf, "%s INTO `%s` (`time`, `char_id`, `type`, `nameid`, `amount`, `refine`, `map`, `unique_id`, `bound`, `enchantgrade`", LOG_QUERY, log_config.log_pick);
-		for (i = 0; i < MAX_SLOTS; ++i)
-			StringBuf_Printf(&buf, ", `card%d`", i);
-		for (i = 0; i < MAX_ITEM_RDM_OPT; ++i) {
-			StringBuf_Printf(&buf, ", `option_id%d`", i);
-			StringBuf_Printf(&buf, ", `option_val%d`", i);
-			StringBuf_Printf(&buf, ", `option_parm%d`", i);
-		}
-		StringBuf_Printf(&buf, ") VALUES(NOW(),'%u','%c','%u','%d','%d','%s','%" PRIu64 "','%d','%d'",
+		log_sql_row(&buf);
+		StringBuf_Printf(&buf, ",'%u','%c','%u','%d','%d','%s','%" PRIu64 "','%d','%d'",
 			id, log_picktype2char(type), itm->nameid, amount, itm->refine, map_getmapdata(m)->name[0] ? map_getmapdata(m)->name : "", itm->unique_id, itm->bound, itm->enchantgrade);
 
 		for (i = 0; i < MAX_SLOTS; i++)
@@ -236,26 +617,14 @@ void log_pick(int id, int16 m, e_log_pick_type type, int amount, struct item* it
 		for (i = 0; i < MAX_ITEM_RDM_OPT; i++)
 			StringBuf_Printf(&buf, ",'%d','%d','%d'", itm->option[i].id, itm->option[i].value, itm->option[i].param);
 		StringBuf_Printf(&buf, ")");
-
-		if (SQL_SUCCESS != SqlStmt_PrepareStr(stmt, StringBuf_Value(&buf)) || SQL_SUCCESS != SqlStmt_Execute(stmt))
-			SqlStmt_ShowDebug(stmt);
-
-		SqlStmt_Free(stmt);
-		StringBuf_Destroy(&buf);
 	}
 	else
 	{
-		char timestring[255];
-		time_t curtime;
-		FILE* logfp;
-
-		if( ( logfp = fopen(log_config.log_pick, "a") ) == NULL )
-			return;
-		time(&curtime);
-		strftime(timestring, sizeof(timestring), log_timestamp_format, localtime(&curtime));
-		fprintf(logfp,"%s - %d\t%c\t%u,%d,%d,%u,%u,%u,%u,%s,'%" PRIu64 "',%d,%d\n", timestring, id, log_picktype2char(type), itm->nameid, amount, itm->refine, itm->card[0], itm->card[1], itm->card[2], itm->card[3], map_getmapdata(m)->name[0]?map_getmapdata(m)->name:"", itm->unique_id, itm->bound, itm->enchantgrade);
-		fclose(logfp);
+		log_file_line(&buf);
+		StringBuf_Printf(&buf, "%d\t%c\t%u,%d,%d,%u,%u,%u,%u,%s,'%" PRIu64 "',%d,%d\n", id, log_picktype2char(type), itm->nameid, amount, itm->refine, itm->card[0], itm->card[1], itm->card[2], itm->card[3], map_getmapdata(m)->name[0]?map_getmapdata(m)->name:"", itm->unique_id, itm->bound, itm->enchantgrade);
 	}
+	log_write(LOG_TARGET_PICK, &buf);
+	StringBuf_Destroy(&buf);
 }
 
 /// logs item transactions (players)
@@ -276,188 +645,148 @@ void log_pick_mob(struct mob_data* md, e_log_pick_type type, int amount, struct
 /// logs zeny transactions
 void log_zeny(struct map_session_data* sd, e_log_pick_type type, struct map_session_data* src_sd, int amount)
 {
+	StringBuf buf;
+
 	nullpo_retv(sd);
 
 	if( !log_config.zeny || ( log_config.zeny != 1 && abs(amount) < log_config.zeny ) )
 		return;
 
+	StringBuf_Init(&buf);
 	if( log_config.sql_logs )
 	{
-		if( SQL_ERROR == Sql_Query(logmysql_handle, LOG_QUERY " INTO `%s` (`time`, `char_id`, `src_id`, `type`, `amount`, `map`) VALUES (NOW(), '%d', '%d', '%c', '%d', '%s')",
-			log_config.log_zeny, sd->status.char_id, src_sd->status.char_id, log_picktype2char(type), amount, mapindex_id2name(sd->mapindex)) )
-		{
-			Sql_ShowDebug(logmysql_handle);
-			return;
-		}
+		log_sql_row(&buf);
+		StringBuf_Printf(&buf, ", '%d', '%d', '%c', '%d', '%s')", sd->status.char_id, src_sd->status.char_id, log_picktype2char(type), amount, mapindex_id2name(sd->mapindex));
 	}
 	else
 	{
-		char timestring[255];
-		time_t curtime;
-		FILE* logfp;
-
-		if( ( logfp = fopen(log_config.log_zeny, "a") ) == NULL )
-			return;
-		time(&curtime);
-		strftime(timestring, sizeof(timestring), log_timestamp_format, localtime(&curtime));
-		fprintf(logfp, "%s - %s[%d]\t%s[%d]\t%d\t\n", timestring, src_sd->status.name, src_sd->status.account_id, sd->status.name, sd->status.account_id, amount);
-		fclose(logfp);
+		log_file_line(&buf);
+		StringBuf_Printf(&buf, "%s[%d]\t%s[%d]\t%d\t\n", src_sd->status.name, src_sd->status.account_id, sd->status.name, sd->status.account_id, amount);
 	}
+	log_write(LOG_TARGET_ZENY, &buf);
+	StringBuf_Destroy(&buf);
 }
 
 
 /// logs MVP monster rewards
 void log_mvpdrop(struct map_session_data* sd, int monster_id, t_itemid nameid, t_exp exp )
 {
+	StringBuf buf;
+
 	nullpo_retv(sd);
 
 	if( !log_config.mvpdrop )
 		return;
 
+	StringBuf_Init(&buf);
 	if( log_config.sql_logs )
 	{
-		if( SQL_ERROR == Sql_Query(logmysql_handle, LOG_QUERY " INTO `%s` (`mvp_date`, `kill_char_id`, `monster_id`, `prize`, `mvpexp`, `map`) VALUES (NOW(), '%d', '%d', '%u', '%" PRIu64 "', '%s') ",
-			log_config.log_mvpdrop, sd->status.char_id, monster_id, nameid, exp, mapindex_id2name(sd->mapindex)) )
-		{
-			Sql_ShowDebug(logmysql_handle);
-			return;
-		}
+		log_sql_row(&buf);
+		StringBuf_Printf(&buf, ", '%d', '%d', '%u', '%" PRIu64 "', '%s')", sd->status.char_id, monster_id, nameid, exp, mapindex_id2name(sd->mapindex));
 	}
 	else
 	{
-		char timestring[255];
-		time_t curtime;
-		FILE* logfp;
-
-		if( ( logfp = fopen(log_config.log_mvpdrop,"a") ) == NULL )
-			return;
-		time(&curtime);
-		strftime(timestring, sizeof(timestring), log_timestamp_format, localtime(&curtime));
-		fprintf(logfp,"%s - %s[%d:%d]\t%d\t%u,%" PRIu64 "\n", timestring, sd->status.name, sd->status.account_id, sd->status.char_id, monster_id, nameid, exp);
-		fclose(logfp);
+		log_file_line(&buf);
+		StringBuf_Printf(&buf, "%s[%d:%d]\t%d\t%u,%" PRIu64 "\n", sd->status.name, sd->status.account_id, sd->status.char_id, monster_id, nameid, exp);
 	}
+	log_write(LOG_TARGET_MVPDROP, &buf);
+	StringBuf_Destroy(&buf);
 }
 
 
 /// logs used atcommands
 void log_atcommand(struct map_session_data* sd, const char* message)
 {
+	StringBuf buf;
+
 	nullpo_retv(sd);
 
 	if( !log_config.commands ||
 	    !pc_should_log_commands(sd) )
 		return;
 
+	StringBuf_Init(&buf);
 	if( log_config.sql_logs )
 	{
-		SqlStmt* stmt;
-
-		stmt = SqlStmt_Malloc(logmysql_handle);
-		if( SQL_SUCCESS != SqlStmt_Prepare(stmt, LOG_QUERY " INTO `%s` (`atcommand_date`, `account_id`, `char_id`, `char_name`, `map`, `command`) VALUES (NOW(), '%d', '%d', ?, '%s', ?)", log_config.log_gm, sd->status.account_id, sd->status.char_id, mapindex_id2name(sd->mapindex) )
-		||  SQL_SUCCESS != SqlStmt_BindParam(stmt, 0, SQLDT_STRING, sd->status.name, strnlen(sd->status.name, NAME_LENGTH))
-		||  SQL_SUCCESS != SqlStmt_BindParam(stmt, 1, SQLDT_STRING, (char*)message, safestrnlen(message, 255))
-		||  SQL_SUCCESS != SqlStmt_Execute(stmt) )
-		{
-			SqlStmt_ShowDebug(stmt);
-			SqlStmt_Free(stmt);
-			return;
-		}
-		SqlStmt_Free(stmt);
+		log_sql_row(&buf);
+		StringBuf_Printf(&buf, ", '%d', '%d', ", sd->status.account_id, sd->status.char_id);
+		log_sql_string(&buf, sd->status.name, NAME_LENGTH);
+		StringBuf_Printf(&buf, ", '%s', ", mapindex_id2name(sd->mapindex));
+		log_sql_string(&buf, message, 255);
+		StringBuf_AppendStr(&buf, ")");
 	}
 	else
 	{
-		char timestring[255];
-		time_t curtime;
-		FILE* logfp;
-
-		if( ( logfp = fopen(log_config.log_gm, "a") ) == NULL )
-			return;
-		time(&curtime);
-		strftime(timestring, sizeof(timestring), log_timestamp_format, localtime(&curtime));
-		fprintf(logfp, "%s - %s[%d]: %s\n", timestring, sd->status.name, sd->status.account_id, message);
-		fclose(logfp);
+		log_file_line(&buf);
+		StringBuf_Printf(&buf, "%s[%d]: %s\n", sd->status.name, sd->status.account_id, message);
 	}
+	log_write(LOG_TARGET_ATCOMMAND, &buf);
+	StringBuf_Destroy(&buf);
 }
 
 /// logs messages passed to script command 'logmes'
 void log_npc( struct npc_data* nd, const char* message ){
+	StringBuf buf;
+
 	nullpo_retv(nd);
 
 	if( !log_config.npc )
 		return;
 
+	StringBuf_Init(&buf);
 	if( log_config.sql_logs )
 	{
-		SqlStmt* stmt;
-		stmt = SqlStmt_Malloc(logmysql_handle);
-		if( SQL_SUCCESS != SqlStmt_Prepare(stmt, LOG_QUERY " INTO `%s` (`npc_date`, `char_name`, `map`, `mes`) VALUES (NOW(), ?, '%s', ?)", log_config.log_npc, map_mapid2mapname(nd->bl.m) )
-		||  SQL_SUCCESS != SqlStmt_BindParam(stmt, 0, SQLDT_STRING, nd->name, strnlen(nd->name, NAME_LENGTH))
-		||  SQL_SUCCESS != SqlStmt_BindParam(stmt, 1, SQLDT_STRING, (char*)message, safestrnlen(message, 255))
-		||  SQL_SUCCESS != SqlStmt_Execute(stmt) )
-		{
-			SqlStmt_ShowDebug(stmt);
-			SqlStmt_Free(stmt);
-			return;
-		}
-		SqlStmt_Free(stmt);
+		log_sql_row(&buf);
+		StringBuf_AppendStr(&buf, ", ");
+		log_sql_string(&buf, nd->name, NAME_LENGTH);
+		StringBuf_Printf(&buf, ", '%s', ", map_mapid2mapname(nd->bl.m));
+		log_sql_string(&buf, message, 255);
+		StringBuf_AppendStr(&buf, ")");
 	}
 	else
 	{
-		char timestring[255];
-		time_t curtime;
-		FILE* logfp;
-
-		if( ( logfp = fopen(log_config.log_npc, "a") ) == NULL )
-			return;
-		time(&curtime);
-		strftime(timestring, sizeof(timestring), log_timestamp_format, localtime(&curtime));
-		fprintf(logfp, "%s - %s: %s\n", timestring, nd->name, message);
-		fclose(logfp);
+		log_file_line(&buf);
+		StringBuf_Printf(&buf, "%s: %s\n", nd->name, message);
 	}
+	log_write(LOG_TARGET_NPC, &buf);
+	StringBuf_Destroy(&buf);
 }
 
 /// logs messages passed to script command 'logmes'
 void log_npc(struct map_session_data* sd, const char* message)
 {
+	StringBuf buf;
+
 	nullpo_retv(sd);
 
 	if( !log_config.npc )
 		return;
 
+	StringBuf_Init(&buf);
 	if( log_config.sql_logs )
 	{
-		SqlStmt* stmt;
-		stmt = SqlStmt_Malloc(logmysql_handle);
-		if( SQL_SUCCESS != SqlStmt_Prepare(stmt, LOG_QUERY " INTO `%s` (`npc_date`, `account_id`, `char_id`, `char_name`, `map`, `mes`) VALUES (NOW(), '%d', '%d', ?, '%s', ?)", log_config.log_npc, sd->status.account_id, sd->status.char_id, mapindex_id2name(sd->mapindex) )
-		||  SQL_SUCCESS != SqlStmt_BindParam(stmt, 0, SQLDT_STRING, sd->status.name, strnlen(sd->status.name, NAME_LENGTH))
-		||  SQL_SUCCESS != SqlStmt_BindParam(stmt, 1, SQLDT_STRING, (char*)message, safestrnlen(message, 255))
-		||  SQL_SUCCESS != SqlStmt_Execute(stmt) )
-		{
-			SqlStmt_ShowDebug(stmt);
-			SqlStmt_Free(stmt);
-			return;
-		}
-		SqlStmt_Free(stmt);
+		log_sql_row(&buf);
+		StringBuf_Printf(&buf, ", '%d', '%d', ", sd->status.account_id, sd->status.char_id);
+		log_sql_string(&buf, sd->status.name, NAME_LENGTH);
+		StringBuf_Printf(&buf, ", '%s', ", mapindex_id2name(sd->mapindex));
+		log_sql_string(&buf, message, 255);
+		StringBuf_AppendStr(&buf, ")");
 	}
 	else
 	{
-		char timestring[255];
-		time_t curtime;
-		FILE* logfp;
-
-		if( ( logfp = fopen(log_config.log_npc, "a") ) == NULL )
-			return;
-		time(&curtime);
-		strftime(timestring, sizeof(timestring), log_timestamp_format, localtime(&curtime));
-		fprintf(logfp, "%s - %s[%d]: %s\n", timestring, sd->status.name, sd->status.account_id, message);
-		fclose(logfp);
+		log_file_line(&buf);
+		StringBuf_Printf(&buf, "%s[%d]: %s\n", sd->status.name, sd->status.account_id, message);
 	}
+	log_write(LOG_TARGET_NPC_PC, &buf);
+	StringBuf_Destroy(&buf);
 }
 
 
 /// logs chat
 void log_chat(e_log_chat_type type, int type_id, int src_charid, int src_accid, const char* mapname, int x, int y, const char* dst_charname, const char* message)
 {
+	StringBuf buf;
+
 	if( ( log_config.chat&type ) == 0 )
 	{// disabled
 		return;
@@ -472,62 +801,43 @@ void log_chat(e_log_chat_type type, int type_id, int src_charid, int src_accid,
 		dst_charname = "";
 	}
 
+	StringBuf_Init(&buf);
 	if( log_config.sql_logs ) {
-		SqlStmt* stmt;
-
-		stmt = SqlStmt_Malloc(logmysql_handle);
-		if( SQL_SUCCESS != SqlStmt_Prepare(stmt, LOG_QUERY " INTO `%s` (`time`, `type`, `type_id`, `src_charid`, `src_accountid`, `src_map`, `src_map_x`, `src_map_y`, `dst_charname`, `message`) VALUES (NOW(), '%c', '%d', '%d', '%d', '%s', '%d', '%d', ?, ?)", log_config.log_chat, log_chattype2char(type), type_id, src_charid, src_accid, mapname, x, y)
-		||  SQL_SUCCESS != SqlStmt_BindParam(stmt, 0, SQLDT_STRING, (char*)dst_charname, safestrnlen(dst_charname, NAME_LENGTH))
-		||  SQL_SUCCESS != SqlStmt_BindParam(stmt, 1, SQLDT_STRING, (char*)message, safestrnlen(message, CHAT_SIZE_MAX))
-		||  SQL_SUCCESS != SqlStmt_Execute(stmt) )
-		{
-			SqlStmt_ShowDebug(stmt);
-			SqlStmt_Free(stmt);
-			return;
-		}
-		SqlStmt_Free(stmt);
+		log_sql_row(&buf);
+		StringBuf_Printf(&buf, ", '%c', '%d', '%d', '%d', '%s', '%d', '%d', ", log_chattype2char(type), type_id, src_charid, src_accid, mapname, x, y);
+		log_sql_string(&buf, dst_charname, NAME_LENGTH);
+		StringBuf_AppendStr(&buf, ", ");
+		log_sql_string(&buf, message, CHAT_SIZE_MAX);
+		StringBuf_AppendStr(&buf, ")");
 	}
 	else
 	{
-		char timestring[255];
-		time_t curtime;
-		FILE* logfp;
-
-		if( ( logfp = fopen(log_config.log_chat, "a") ) == NULL )
-			return;
-		time(&curtime);
-		strftime(timestring, sizeof(timestring), log_timestamp_format, localtime(&curtime));
-		fprintf(logfp, "%s - %c,%d,%d,%d,%s,%d,%d,%s,%s\n", timestring, log_chattype2char(type), type_id, src_charid, src_accid, mapname, x, y, dst_charname, message);
-		fclose(logfp);
+		log_file_line(&buf);
+		StringBuf_Printf(&buf, "%c,%d,%d,%d,%s,%d,%d,%s,%s\n", log_chattype2char(type), type_id, src_charid, src_accid, mapname, x, y, dst_charname, message);
 	}
+	log_write(LOG_TARGET_CHAT, &buf);
+	StringBuf_Destroy(&buf);
 }
 
 /// logs cash transactions
 void log_cash( struct map_session_data* sd, e_log_pick_type type, e_log_cash_type cash_type, int amount ){
+	StringBuf buf;
+
 	nullpo_retv( sd );
 
 	if( !log_config.cash )
 		return;
 
+	StringBuf_Init( &buf );
 	if( log_config.sql_logs ){
-		if( SQL_ERROR == Sql_Query( logmysql_handle, LOG_QUERY " INTO `%s` ( `time`, `char_id`, `type`, `cash_type`, `amount`, `map` ) VALUES ( NOW(), '%d', '%c', '%c', '%d', '%s' )",
-			log_config.log_cash, sd->status.char_id, log_picktype2char( type ), log_cashtype2char( cash_type ), amount, mapindex_id2name( sd->mapindex ) ) )
-		{
-			Sql_ShowDebug( logmysql_handle );
-			return;
-		}
+		log_sql_row( &buf );
+		StringBuf_Printf( &buf, ", '%d', '%c', '%c', '%d', '%s' )", sd->status.char_id, log_picktype2char( type ), log_cashtype2char( cash_type ), amount, mapindex_id2name( sd->mapindex ) );
 	}else{
-		char timestring[255];
-		time_t curtime;
-		FILE* logfp;
-
-		if( ( logfp = fopen( log_config.log_cash, "a" ) ) == NULL )
-			return;
-		time( &curtime );
-		strftime( timestring, sizeof( timestring ), log_timestamp_format, localtime( &curtime ) );
-		fprintf( logfp, "%s - %s[%d]\t%d(%c)\t\n", timestring, sd->status.name, sd->status.account_id, amount, log_cashtype2char( cash_type ) );
-		fclose( logfp );
+		log_file_line( &buf );
+		StringBuf_Printf( &buf, "%s[%d]\t%d(%c)\t\n", sd->status.name, sd->status.account_id, amount, log_cashtype2char( cash_type ) );
 	}
+	log_write( LOG_TARGET_CASH, &buf );
+	StringBuf_Destroy( &buf );
 }
 
 /**
@@ -539,6 +849,7 @@ void log_cash( struct map_session_data* sd, e_log_pick_type type, e_log_cash_typ
 void log_feeding(struct map_session_data *sd, e_log_feeding_type type, t_itemid nameid) {
 	unsigned int target_id = 0, intimacy = 0;
 	unsigned short target_class = 0;
+	StringBuf buf;
 
 	nullpo_retv( sd );
 
@@ -562,25 +873,83 @@ void log_feeding(struct map_session_data *sd, e_log_feeding_type type, t_itemid
 			break;
 	}
 
+	StringBuf_Init(&buf);
 	if (log_config.sql_logs) {
-		if (SQL_ERROR == Sql_Query(logmysql_handle, LOG_QUERY " INTO `%s` (`time`, `char_id`, `target_id`, `target_class`, `type`, `intimacy`, `item_id`, `map`, `x`, `y`) VALUES ( NOW(), '%" PRIu32 "', '%" PRIu32 "', '%hu', '%c', '%" PRIu32 "', '%u', '%s', '%hu', '%hu' )",
-			log_config.log_feeding, sd->status.char_id, target_id, target_class, log_feedingtype2char(type), intimacy, nameid, mapindex_id2name(sd->mapindex), sd->bl.x, sd->bl.y))
-		{
-			Sql_ShowDebug(logmysql_handle);
-			return;
-		}
+		log_sql_row(&buf);
+		StringBuf_Printf(&buf, ", '%" PRIu32 "', '%" PRIu32 "', '%hu', '%c', '%" PRIu32 "', '%u', '%s', '%hu', '%hu' )",
+			sd->status.char_id, target_id, target_class, log_feedingtype2char(type), intimacy, nameid, mapindex_id2name(sd->mapindex), sd->bl.x, sd->bl.y);
 	} else {
-		char timestring[255];
-		time_t curtime;
-		FILE* logfp;
+		log_file_line(&buf);
+		StringBuf_Printf(&buf, "%s[%d]\t%d\t%d(%c)\t%d\t%u\t%s\t%hu,%hu\n", sd->status.name, sd->status.char_id, target_id, target_class, log_feedingtype2char(type), intimacy, nameid, mapindex_id2name(sd->mapindex), sd->bl.x, sd->bl.y);
+	}
+	log_write(LOG_TARGET_FEEDING, &buf);
+	StringBuf_Destroy(&buf);
+}
+
+/// Starts the background writer if enabled
+void do_init_log(void)
+{
+	size_t capacity = 1;
+
+	if( !log_config.async )
+		return;
 
-		if ((logfp = fopen(log_config.log_feeding, "a")) == NULL)
-			return;
-		time(&curtime);
-		strftime(timestring, sizeof(timestring), log_timestamp_format, localtime(&curtime));
-		fprintf(logfp, "%s - %s[%d]\t%d\t%d(%c)\t%d\t%u\t%s\t%hu,%hu\n", timestring, sd->status.name, sd->status.char_id, target_id, target_class, log_feedingtype2char(type), intimacy, nameid, mapindex_id2name(sd->mapindex), sd->bl.x, sd->bl.y);
-		fclose(logfp);
+	while( capacity < (size_t)log_config.async_queue )
+		capacity <<= 1;
+
+	log_writer.queue.reset(new s_log_record[capacity]);
+	log_writer.mask = capacity - 1;
+	for( size_t i = 0; i < capacity; i++ )
+		log_writer.queue[i].sequence.store(i, std::memory_order_relaxed);
+	log_writer.enqueue_pos = 0;
+	log_writer.dequeue_pos = 0;
+	log_writer.wake = false;
+	log_writer.stopping = false;
+	log_writer.written = 0;
+	log_writer.stalls = 0;
+	log_writer.failed = 0;
+
+	if( log_config.sql_logs ) {
+		log_writer.sql_handle = log_sql_connect();
+		Sql_DisableKeepalive(log_writer.sql_handle);
+		for( int i = 0; i < LOG_TARGET_MAX; i++ )
+			log_writer.insert[i] = std::string(LOG_QUERY " INTO `") + log_target_name((e_log_target)i) + "` (" + log_target_columns((e_log_target)i) + ") VALUES ";
 	}
+
+	log_writer.thread = std::thread(log_writer_main);
+	log_writer.running = true;
+
+	add_timer_func_list(log_writer_report_timer, "log_writer_report_timer");
+	log_writer.report_timer = add_timer_interval(gettick() + LOG_ERROR_REPORT_INTERVAL, log_writer_report_timer, 0, 0, LOG_ERROR_REPORT_INTERVAL);
+}
+
+/// Stops the background writer, once everything it queued is written
+void do_final_log(void)
+{
+	if( !log_writer.running )
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(log_writer.mutex);
+
+		log_writer.stopping = true;
+		log_writer.wakeup.notify_one();
+	}
+	log_writer.thread.join();
+	log_writer.running = false;
+
+	delete_timer(log_writer.report_timer, log_writer_report_timer);
+	log_writer_report();
+
+	if( log_writer.stalls > 0 || log_writer.failed > 0 )
+		ShowWarning("Log writer: %" PRIu64 " lines written, %" PRIu64 " failed, log calls waited for a full queue %" PRIu64 " times (raise log_async_queue).\n",
+			(uint64)log_writer.written, (uint64)log_writer.failed, (uint64)log_writer.stalls);
+
+	if( log_writer.sql_handle != nullptr ) {
+		Sql_Free(log_writer.sql_handle);
+		log_writer.sql_handle = nullptr;
+	}
+	log_writer.queue.reset();
 }
 
 void log_set_defaults(void)
@@ -593,6 +962,11 @@ void log_set_defaults(void)
 	log_config.price_items_log  = 1000; // 1000z
 	log_config.amount_items_log = 100;
 
+	log_config.async = false;
+	log_config.async_interval = 1000;
+	log_config.async_rows = 500;
+	log_config.async_queue = 8192;
+
 	safestrncpy(log_timestamp_format, "%m/%d/%Y %H:%M:%S", sizeof(log_timestamp_format));
 }
 
@@ -623,6 +997,14 @@ int log_config_read(const char* cfgName)
 				log_config.enable_logs = (e_log_pick_type)config_switch(w2);
 			else if( strcmpi(w1, "sql_logs") == 0 )
 				log_config.sql_logs = config_switch(w2) > 0;
+			else if( strcmpi(w1, "log_async") == 0 )
+				log_config.async = config_switch(w2) > 0;
+			else if( strcmpi(w1, "log_async_interval") == 0 )
+				log_config.async_interval = cap_value(atoi(w2), 10, 60000);
+			else if( strcmpi(w1, "log_async_rows") == 0 )
+				log_config.async_rows = cap_value(atoi(w2), 1, 10000);
+			else if( strcmpi(w1, "log_async_queue") == 0 )
+				log_config.async_queue = cap_value(atoi(w2), 64, 1048576);
 //start of common filter settings
 			else if( strcmpi(w1, "rare_items_log") == 0 )
 				log_config.rare_items_log = atoi(w2);
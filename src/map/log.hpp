@@ -87,12 +87,16 @@ void log_branch(struct map_session_data* sd);
 void log_mvpdrop(struct map_session_data* sd, int monster_id, t_itemid nameid, t_exp exp);
 
 int log_config_read(const char* cfgName);
+void do_init_log(void);
+void do_final_log(void);
 
 extern struct Log_Config
 {
 	e_log_pick_type enable_logs;
 	int filter;
 	bool sql_logs;
+	bool async; ///< Write from a background thread
+	int async_interval, async_rows, async_queue; ///< Flush interval (ms), rows per flush/INSERT, queue capacity
 	bool log_chat_woe_disable;
 	bool cash;
 	int rare_items_log,refine_items_log,price_items_log,amount_items_log; //for filter
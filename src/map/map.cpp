@@ -5,6 +5,18 @@
 
 #include <stdlib.h>
 #include <math.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#ifdef WIN32
+#include "../common/winapi.hpp"
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "../common/cbasetypes.hpp"
 #include "../common/cli.hpp"
@@ -12,11 +24,13 @@
 #include "../common/ers.hpp"
 #include "../common/grfio.hpp"
 #include "../common/malloc.hpp"
+#include "../common/mapcache.hpp"
 #include "../common/nullpo.hpp"
 #include "../common/random.hpp"
 #include "../common/showmsg.hpp"
 #include "../common/socket.hpp" // WFIFO*()
 #include "../common/strlib.hpp"
+#include "../common/thread_pool.hpp"
 #include "../common/timer.hpp"
 #include "../common/utilities.hpp"
 #include "../common/utils.hpp"
@@ -113,11 +127,18 @@ static DBMap* map_msg_db=NULL;
 
 static int map_users=0;
 
-#define BLOCK_SIZE 8
 #define block_free_max 1048576
 struct block_list *block_free[block_free_max];
 static int block_free_count = 0, block_free_lock = 0;
 
+/// Pools of the block objects that are spawned and removed the most, see map_allocblock
+static ERS* block_pool_mob = nullptr;
+static ERS* block_pool_npc = nullptr;
+static ERS* block_pool_item = nullptr;
+/// Skill unit arrays, pool i holds arrays of up to 2^i units
+#define BLOCK_POOL_SKILL_CLASSES 8
+static ERS* block_pool_skill[BLOCK_POOL_SKILL_CLASSES];
+
 #define BL_LIST_MAX 1048576
 static struct block_list *bl_list[BL_LIST_MAX];
 static int bl_list_count = 0;
@@ -149,18 +170,26 @@ struct charid2nick {
 	struct charid_request* requests;// requests of notification on this nick
 };
 
-// This is the main header found at the very beginning of the map cache
-struct map_cache_main_header {
-	uint32 file_size;
-	uint16 map_count;
+// A map cache file, memory-mapped when the system allows it
+struct s_map_cache {
+	const char* buffer = nullptr;
+	size_t size = 0;
+	bool mapped = false;
+#ifdef WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#endif
+	const struct map_cache_header* header = nullptr; // version 2 files only
+	std::unordered_map<std::string, const struct map_cache_map_info*> legacy_index; // version 1 files only, they have no index of their own
 };
 
-// This is the header appended before every compressed map cells info in the map cache
-struct map_cache_map_info {
-	char name[MAP_NAME_LENGTH];
-	int16 xs;
-	int16 ys;
-	int32 len;
+// A map whose compressed cells are decoded by the map loading threads
+struct s_map_cache_job {
+	struct map_data* mapdata;
+	const char* data;
+	uint32 len;
+	uint32 invalid; // cells with an unrecognized gat type
+	bool failed;
 };
 
 char motd_txt[256] = "conf/motd.txt";
@@ -184,6 +213,7 @@ struct s_map_default map_default;
 int console = 0;
 int enable_spy = 0; //To enable/disable @spy commands, which consume too much cpu time when sending packets. [Skotlex]
 int enable_grf = 0;	//To enable/disable reading maps from GRF files, bypassing mapcache [blackhole89]
+int map_load_threads = 0; // Threads decoding the map cache at startup (0 = one per core)
 
 /**
  * Get the map data
@@ -220,6 +250,110 @@ int map_usercount(void)
 }
 
 
+/**
+ * Creates a pool for block objects of the given size.
+ * Chunks are kept around 256KB, so the large mob and npc objects don't reserve megabytes at once.
+ */
+static ERS* map_block_pool_create(size_t size, const char* name)
+{
+	ERS* pool = ers_new((uint32)size, name, (enum ERSOptions)(ERS_CLEAN_OPTIONS|ERS_OPT_FLEX_CHUNK|ERS_OPT_CACHE_LINE));
+
+	ers_chunk_size(pool, (unsigned int)cap_value(262144 / size, 16, 2048));
+	return pool;
+}
+
+static inline struct block_list* map_block_pool_alloc(ERS* pool, size_t size)
+{
+#ifdef DISABLE_ERS
+	return (struct block_list*)aCalloc(1, size);
+#else
+	return (struct block_list*)pool->alloc(pool);
+#endif
+}
+
+static void map_block_pool_init(void)
+{
+	static char skill_names[BLOCK_POOL_SKILL_CLASSES][48];
+
+	block_pool_mob = map_block_pool_create(sizeof(struct mob_data), "map.cpp::block_pool_mob");
+	block_pool_npc = map_block_pool_create(sizeof(struct npc_data), "map.cpp::block_pool_npc");
+	block_pool_item = map_block_pool_create(sizeof(struct flooritem_data), "map.cpp::block_pool_item");
+	for (int i = 0; i < BLOCK_POOL_SKILL_CLASSES; i++) {
+		safesnprintf(skill_names[i], sizeof(skill_names[i]), "map.cpp::block_pool_skill[%d]", 1 << i);
+		block_pool_skill[i] = map_block_pool_create(sizeof(struct skill_unit) << i, skill_names[i]);
+	}
+}
+
+static void map_block_pool_final(void)
+{
+	ers_destroy(block_pool_mob);
+	ers_destroy(block_pool_npc);
+	ers_destroy(block_pool_item);
+	for (int i = 0; i < BLOCK_POOL_SKILL_CLASSES; i++)
+		ers_destroy(block_pool_skill[i]);
+}
+
+/**
+ * Allocates a zeroed block object from the pool of its type.
+ * The object must be released with map_freeblock.
+ * @param type: BL_MOB, BL_NPC, BL_ITEM or BL_SKILL
+ * @param count: Number of skill units in the array, only used with BL_SKILL
+ * @return Object with bl.type set (on the first unit for skill unit arrays)
+ */
+struct block_list* map_allocblock(enum bl_type type, int count)
+{
+	struct block_list* bl;
+
+	switch (type) {
+		case BL_MOB:  bl = map_block_pool_alloc(block_pool_mob, sizeof(struct mob_data)); break;
+		case BL_NPC:  bl = map_block_pool_alloc(block_pool_npc, sizeof(struct npc_data)); break;
+		case BL_ITEM: bl = map_block_pool_alloc(block_pool_item, sizeof(struct flooritem_data)); break;
+		case BL_SKILL: {
+			uint8 pool = 0;
+
+			while (pool < BLOCK_POOL_SKILL_CLASSES && (1 << pool) < count)
+				pool++;
+
+			if (pool < BLOCK_POOL_SKILL_CLASSES)
+				bl = map_block_pool_alloc(block_pool_skill[pool], sizeof(struct skill_unit) << pool);
+			else // Oversized layouts are rare enough to go through the memory manager
+				bl = (struct block_list*)aCalloc(count, sizeof(struct skill_unit));
+			((struct skill_unit*)bl)->pool = pool;
+			break;
+		}
+		default:
+			ShowError("map_allocblock: Unsupported block type %d.\n", type);
+			return nullptr;
+	}
+
+	bl->type = type;
+	return bl;
+}
+
+/**
+ * Releases a block object to its pool, or to the memory manager for the types that are not pooled.
+ */
+static void map_releaseblock(struct block_list* bl)
+{
+	switch (bl->type) {
+		case BL_MOB:  ers_free(block_pool_mob, bl); break;
+		case BL_NPC:  ers_free(block_pool_npc, bl); break;
+		case BL_ITEM: ers_free(block_pool_item, bl); break;
+		case BL_SKILL: {
+			uint8 pool = ((struct skill_unit*)bl)->pool;
+
+			if (pool < BLOCK_POOL_SKILL_CLASSES)
+				ers_free(block_pool_skill[pool], bl);
+			else
+				aFree(bl);
+			break;
+		}
+		default:
+			aFree(bl);
+			break;
+	}
+}
+
 /*==========================================
  * Attempt to free a map blocklist
  *------------------------------------------*/
@@ -228,7 +362,7 @@ int map_freeblock (struct block_list *bl)
 	nullpo_retr(block_free_lock, bl);
 	if (block_free_lock == 0 || block_free_count >= block_free_max)
 	{
-		aFree(bl);
+		map_releaseblock(bl);
 		bl = NULL;
 		if (block_free_count >= block_free_max)
 			ShowWarning("map_freeblock: too many free block! %d %d\n", block_free_count, block_free_lock);
@@ -254,7 +388,7 @@ int map_freeblock_unlock (void)
 		int i;
 		for (i = 0; i < block_free_count; i++)
 		{
-			aFree(block_free[i]);
+			map_releaseblock(block_free[i]);
 			block_free[i] = NULL;
 		}
 		block_free_count = 0;
@@ -312,6 +446,95 @@ static void map_delblcell(struct block_list *bl)
 }
 #endif
 
+/*==========================================
+ * Map block index.
+ * Every block keeps the coordinates and types of its objects in
+ * parallel arrays, so searches test a whole block without touching
+ * the objects themselves. Removal swaps the last entry into the hole.
+ * A block is allocated when the first object enters it and is kept
+ * afterwards, so objects crossing block borders don't reallocate it.
+ *------------------------------------------*/
+static inline struct s_map_block* map_getblock(struct map_data *mapdata, struct block_list *bl)
+{
+	int pos = bl->x/mapdata->block_size+(bl->y/mapdata->block_size)*mapdata->bxs;
+	struct s_map_block*& block = ( bl->type == BL_MOB ? mapdata->block_mob[pos] : mapdata->block[pos] );
+
+	if( block == nullptr )
+		block = new s_map_block();
+	return block;
+}
+
+static void map_block_insert(struct s_map_block *block, struct block_list *bl)
+{
+	bl->block_index = (int)block->bl.size();
+	block->version++;
+	block->x.push_back(bl->x);
+	block->y.push_back(bl->y);
+	block->type.push_back(bl->type);
+	block->bl.push_back(bl);
+}
+
+static void map_block_erase(struct s_map_block *block, struct block_list *bl)
+{
+	size_t i = bl->block_index, last = block->bl.size() - 1;
+
+	block->version++;
+	if( i != last ){
+		block->x[i] = block->x[last];
+		block->y[i] = block->y[last];
+		block->type[i] = block->type[last];
+		block->bl[i] = block->bl[last];
+		block->bl[i]->block_index = (int)i;
+	}
+
+	block->x.pop_back();
+	block->y.pop_back();
+	block->type.pop_back();
+	block->bl.pop_back();
+	bl->block_index = -1;
+}
+
+/// Allocates the empty block index of a map for its current block size.
+static void map_block_alloc(struct map_data *mapdata)
+{
+	mapdata->bxs = (mapdata->xs + mapdata->block_size - 1) / mapdata->block_size;
+	mapdata->bys = (mapdata->ys + mapdata->block_size - 1) / mapdata->block_size;
+	mapdata->block = new s_map_block*[mapdata->bxs * mapdata->bys]();
+	mapdata->block_mob = new s_map_block*[mapdata->bxs * mapdata->bys]();
+}
+
+static void map_block_free(struct map_data *mapdata)
+{
+	if( mapdata->block == nullptr )
+		return;
+
+	for( int b = 0; b < mapdata->bxs * mapdata->bys; b++ ){
+		delete mapdata->block[b];
+		delete mapdata->block_mob[b];
+	}
+
+	delete[] mapdata->block;
+	mapdata->block = nullptr;
+	delete[] mapdata->block_mob;
+	mapdata->block_mob = nullptr;
+}
+
+/// Adds all objects of the given type inside (x0,y0)-(x1,y1) to bl_list, as long as filter accepts them.
+/// The area must already be clipped to the map.
+template <typename F>
+static void map_block_collect(struct map_data *mapdata, int type, int16 x0, int16 y0, int16 x1, int16 y1, F filter)
+{
+	map_block_foreach(mapdata, type, x0, y0, x1, y1, [&](struct block_list *bl) {
+		if( bl_list_count < BL_LIST_MAX && filter(bl) )
+			bl_list[bl_list_count++] = bl;
+	});
+}
+
+static void map_block_collect(struct map_data *mapdata, int type, int16 x0, int16 y0, int16 x1, int16 y1)
+{
+	map_block_collect(mapdata, type, x0, y0, x1, y1, [](struct block_list *bl) { return true; });
+}
+
 /*==========================================
  * Adds a block to the map.
  * Returns 0 on success, 1 on failure (illegal coordinates).
@@ -319,7 +542,6 @@ static void map_delblcell(struct block_list *bl)
 int map_addblock(struct block_list* bl)
 {
 	int16 m, x, y;
-	int pos;
 
 	nullpo_ret(bl);
 
@@ -349,19 +571,8 @@ int map_addblock(struct block_list* bl)
 		return 1;
 	}
 
-	pos = x/BLOCK_SIZE+(y/BLOCK_SIZE)*mapdata->bxs;
-
-	if (bl->type == BL_MOB) {
-		bl->next = mapdata->block_mob[pos];
-		bl->prev = &bl_head;
-		if (bl->next) bl->next->prev = bl;
-		mapdata->block_mob[pos] = bl;
-	} else {
-		bl->next = mapdata->block[pos];
-		bl->prev = &bl_head;
-		if (bl->next) bl->next->prev = bl;
-		mapdata->block[pos] = bl;
-	}
+	map_block_insert(map_getblock(mapdata, bl), bl);
+	bl->prev = &bl_head;
 
 #ifdef CELL_NOSTACK
 	map_addblcell(bl);
@@ -375,42 +586,84 @@ int map_addblock(struct block_list* bl)
  *------------------------------------------*/
 int map_delblock(struct block_list* bl)
 {
-	int pos;
 	nullpo_ret(bl);
 
-	// blocklist (2ways chainlist)
-	if (bl->prev == NULL) {
-		if (bl->next != NULL) {
-			// can't delete block (already at the beginning of the chain)
-			ShowError("map_delblock error : bl->next!=NULL\n");
-		}
+	if (bl->prev == NULL)
 		return 0;
-	}
 
 #ifdef CELL_NOSTACK
 	map_delblcell(bl);
 #endif
 
-	struct map_data *mapdata = map_getmapdata(bl->m);
+	map_block_erase(map_getblock(map_getmapdata(bl->m), bl), bl);
+	bl->prev = NULL;
+
+	return 0;
+}
 
-	pos = bl->x/BLOCK_SIZE+(bl->y/BLOCK_SIZE)*mapdata->bxs;
+/**
+ * Changes the block size of a map and rebuilds its block index.
+ * @param m : map id
+ * @param block_size : new block size in cells
+ * @return true on success, false on invalid map or size
+ */
+bool map_setblocksize(int16 m, int16 block_size)
+{
+	struct map_data *mapdata = map_getmapdata(m);
 
-	if (bl->next)
-		bl->next->prev = bl->prev;
-	if (bl->prev == &bl_head) {
-	//Since the head of the list, update the block_list map of []
-		if (bl->type == BL_MOB) {
-			mapdata->block_mob[pos] = bl->next;
-		} else {
-			mapdata->block[pos] = bl->next;
+	if( mapdata == nullptr || mapdata->block == nullptr )
+		return false;
+
+	if( block_size < BLOCK_SIZE_MIN || block_size > BLOCK_SIZE_MAX ){
+		ShowWarning("map_setblocksize: Invalid block size %d for map %s, must be between %d and %d.\n", block_size, mapdata->name, BLOCK_SIZE_MIN, BLOCK_SIZE_MAX);
+		return false;
+	}
+
+	if( block_size == mapdata->block_size )
+		return true;
+
+	std::vector<struct block_list*> list;
+	int bsize = mapdata->bxs * mapdata->bys;
+
+	for( int b = 0; b < bsize; b++ ){
+		if( mapdata->block[b] != nullptr )
+			list.insert(list.end(), mapdata->block[b]->bl.begin(), mapdata->block[b]->bl.end());
+		if( mapdata->block_mob[b] != nullptr )
+			list.insert(list.end(), mapdata->block_mob[b]->bl.begin(), mapdata->block_mob[b]->bl.end());
+	}
+
+	map_block_free(mapdata);
+	mapdata->block_size = block_size;
+	map_block_alloc(mapdata);
+
+	for( struct block_list *bl : list )
+		map_block_insert(map_getblock(mapdata, bl), bl);
+
+	return true;
+}
+
+/**
+ * Sums up the versions of the blocks that cover (x0,y0)-(x1,y1), see s_map_block::version.
+ * The sum only stays the same as long as no object of the given type entered,
+ * left or moved inside the area. The area must already be clipped to the map.
+ */
+uint32 map_block_version(struct map_data* mapdata, int type, int16 x0, int16 y0, int16 x1, int16 y1)
+{
+	int16 bsize = mapdata->block_size;
+	uint32 version = 0;
+
+	for( int by = y0 / bsize; by <= y1 / bsize; by++ ){
+		for( int bx = x0 / bsize; bx <= x1 / bsize; bx++ ){
+			int pos = bx + by * mapdata->bxs;
+
+			if( type&~BL_MOB && mapdata->block[pos] != nullptr )
+				version += mapdata->block[pos]->version;
+			if( type&BL_MOB && mapdata->block_mob[pos] != nullptr )
+				version += mapdata->block_mob[pos]->version;
 		}
-	} else {
-		bl->prev->next = bl->next;
 	}
-	bl->next = NULL;
-	bl->prev = NULL;
 
-	return 0;
+	return version;
 }
 
 /**
@@ -427,7 +680,6 @@ int map_moveblock(struct block_list *bl, int x1, int y1, t_tick tick)
 {
 	int x0 = bl->x, y0 = bl->y;
 	struct status_change *sc = NULL;
-	int moveblock = ( x0/BLOCK_SIZE != x1/BLOCK_SIZE || y0/BLOCK_SIZE != y1/BLOCK_SIZE);
 
 	if (!bl->prev) {
 		//Block not in map, just update coordinates, but do naught else.
@@ -459,6 +711,9 @@ int map_moveblock(struct block_list *bl, int x1, int y1, t_tick tick)
 	if (bl->type == BL_NPC)
 		npc_unsetcells((TBL_NPC*)bl);
 
+	int16 bsize = map_getmapdata(bl->m)->block_size;
+	int moveblock = ( x0/bsize != x1/bsize || y0/bsize != y1/bsize);
+
 	if (moveblock) map_delblock(bl);
 #ifdef CELL_NOSTACK
 	else map_delblcell(bl);
@@ -468,10 +723,17 @@ int map_moveblock(struct block_list *bl, int x1, int y1, t_tick tick)
 	if (moveblock) {
 		if(map_addblock(bl))
 			return 1;
-	}
+	} else {
+		// Same block, only refresh the indexed coordinates
+		struct s_map_block *block = map_getblock(map_getmapdata(bl->m), bl);
+
+		block->x[bl->block_index] = x1;
+		block->y[bl->block_index] = y1;
+		block->version++;
 #ifdef CELL_NOSTACK
-	else map_addblcell(bl);
+		map_addblcell(bl);
 #endif
+	}
 
 	if (bl->type&BL_CHAR) {
 
@@ -546,40 +808,32 @@ int map_moveblock(struct block_list *bl, int x1, int y1, t_tick tick)
  *------------------------------------------*/
 int map_count_oncell(int16 m, int16 x, int16 y, int type, int flag)
 {
-	int bx,by;
-	struct block_list *bl;
 	int count = 0;
 	struct map_data *mapdata = map_getmapdata(m);
 
 	if (x < 0 || y < 0 || (x >= mapdata->xs) || (y >= mapdata->ys))
 		return 0;
 
-	bx = x/BLOCK_SIZE;
-	by = y/BLOCK_SIZE;
+	int pos = x/mapdata->block_size+(y/mapdata->block_size)*mapdata->bxs;
 
-	if (type&~BL_MOB)
-		for( bl = mapdata->block[bx+by*mapdata->bxs] ; bl != NULL ; bl = bl->next )
-			if(bl->x == x && bl->y == y && bl->type&type) {
-				if(flag&1) {
-					struct unit_data *ud = unit_bl2ud(bl);
-					if(!ud || ud->walktimer == INVALID_TIMER)
-						count++;
-				} else {
-					count++;
-				}
-			}
+	for (int i = 0; i < 2; i++) {
+		struct s_map_block *block = ( i == 0 ? mapdata->block[pos] : mapdata->block_mob[pos] );
 
-	if (type&BL_MOB)
-		for( bl = mapdata->block_mob[bx+by*mapdata->bxs] ; bl != NULL ; bl = bl->next )
-			if(bl->x == x && bl->y == y) {
-				if(flag&1) {
-					struct unit_data *ud = unit_bl2ud(bl);
-					if(!ud || ud->walktimer == INVALID_TIMER)
-						count++;
-				} else {
+		if (block == nullptr || !(type&(i == 0 ? ~BL_MOB : BL_MOB)))
+			continue;
+
+		for (size_t j = 0; j < block->bl.size(); j++) {
+			if (block->x[j] != x || block->y[j] != y || !(block->type[j]&type))
+				continue;
+			if(flag&1) {
+				struct unit_data *ud = unit_bl2ud(block->bl[j]);
+				if(!ud || ud->walktimer == INVALID_TIMER)
 					count++;
-				}
+			} else {
+				count++;
 			}
+		}
+	}
 
 	return count;
 }
@@ -589,23 +843,23 @@ int map_count_oncell(int16 m, int16 x, int16 y, int type, int flag)
  * flag&1: runs battle_check_target check based on unit->group->target_flag
  */
 struct skill_unit* map_find_skill_unit_oncell(struct block_list* target,int16 x,int16 y,uint16 skill_id,struct skill_unit* out_unit, int flag) {
-	int16 bx,by;
-	struct block_list *bl;
 	struct skill_unit *unit;
 	struct map_data *mapdata = map_getmapdata(target->m);
 
 	if (x < 0 || y < 0 || (x >= mapdata->xs) || (y >= mapdata->ys))
 		return NULL;
 
-	bx = x/BLOCK_SIZE;
-	by = y/BLOCK_SIZE;
+	struct s_map_block *block = mapdata->block[x/mapdata->block_size+(y/mapdata->block_size)*mapdata->bxs];
+
+	if( block == nullptr )
+		return NULL;
 
-	for( bl = mapdata->block[bx+by*mapdata->bxs] ; bl != NULL ; bl = bl->next )
+	for( size_t i = 0; i < block->bl.size(); i++ )
 	{
-		if (bl->x != x || bl->y != y || bl->type != BL_SKILL)
+		if (block->x[i] != x || block->y[i] != y || block->type[i] != BL_SKILL)
 			continue;
 
-		unit = (struct skill_unit *) bl;
+		unit = (struct skill_unit *)block->bl[i];
 		if( unit == out_unit || !unit->alive || !unit->group || unit->group->skill_id != skill_id )
 			continue;
 		if( !(flag&1) || battle_check_target(&unit->bl,target,unit->group->target_flag) > 0 )
@@ -619,9 +873,8 @@ struct skill_unit* map_find_skill_unit_oncell(struct block_list* target,int16 x,
  *------------------------------------------*/
 int map_foreachinrangeV(int (*func)(struct block_list*,va_list),struct block_list* center, int16 range, int type, va_list ap, bool wall_check)
 {
-	int bx, by, m;
+	int m;
 	int returnCount = 0;	//total sum of returned values of func() [Skotlex]
-	struct block_list *bl;
 	int blockcount = bl_list_count, i;
 	int x0, x1, y0, y1;
 	va_list ap_copy;
@@ -641,38 +894,17 @@ int map_foreachinrangeV(int (*func)(struct block_list*,va_list),struct block_lis
 	x1 = i16min(center->x + range, mapdata->xs - 1);
 	y1 = i16min(center->y + range, mapdata->ys - 1);
 
-	if ( type&~BL_MOB ) {
-		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ ) {
-			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ ) {
-				for(bl = mapdata->block[ bx + by * mapdata->bxs ]; bl != NULL; bl = bl->next ) {
-					if( bl->type&type
-						&& bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1
-#ifdef CIRCULAR_AREA
-						&& check_distance_bl(center, bl, range)
-#endif
-						&& ( !wall_check || path_search_long(NULL, center->m, center->x, center->y, bl->x, bl->y, CELL_CHKWALL) )
-					  	&& bl_list_count < BL_LIST_MAX )
-						bl_list[ bl_list_count++ ] = bl;
-				}
-			}
-		}
-	}
+	// Lines between cells of the area never leave it, without any wall there is nothing to check
+	if( wall_check && !map_getcellarea(mapdata, x0, y0, x1, y1, CELL_CHKWALL) )
+		wall_check = false;
 
-	if ( type&BL_MOB ) {
-		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ ) {
-			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ ) {
-				for(bl = mapdata->block_mob[ bx + by * mapdata->bxs ]; bl != NULL; bl = bl->next ) {
-					if( bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1
+	map_block_collect(mapdata, type, x0, y0, x1, y1, [&](struct block_list *bl) {
 #ifdef CIRCULAR_AREA
-						&& check_distance_bl(center, bl, range)
+		if( !check_distance_bl(center, bl, range) )
+			return false;
 #endif
-						&& ( !wall_check || path_search_long(NULL, center->m, center->x, center->y, bl->x, bl->y, CELL_CHKWALL) )
-					  	&& bl_list_count < BL_LIST_MAX )
-						bl_list[ bl_list_count++ ] = bl;
-				}
-			}
-		}
-	}
+		return !wall_check || path_search_long(NULL, center->m, center->x, center->y, bl->x, bl->y, CELL_CHKWALL);
+	});
 
 	if( bl_list_count >= BL_LIST_MAX )
 		ShowWarning("map_foreachinrange: block count too many!\n");
@@ -727,6 +959,12 @@ int map_foreachinshootrange(int (*func)(struct block_list*,va_list),struct block
 }
 
 
+/// Whether the callable area queries without explicit wall check honor skill_wall_check.
+bool map_query_wall_check(void)
+{
+	return battle_config.skill_wall_check > 0;
+}
+
 /*========================================== [Playtester]
  * range = map m (x0,y0)-(x1,y1)
  * Apply *func with ... arguments for the range.
@@ -739,9 +977,8 @@ int map_foreachinshootrange(int (*func)(struct block_list*,va_list),struct block
 *------------------------------------------*/
 int map_foreachinareaV(int(*func)(struct block_list*, va_list), int16 m, int16 x0, int16 y0, int16 x1, int16 y1, int type, va_list ap, bool wall_check)
 {
-	int bx, by, cx, cy;
+	int cx = 0, cy = 0;
 	int returnCount = 0;	//total sum of returned values of func()
-	struct block_list *bl;
 	int blockcount = bl_list_count, i;
 	va_list ap_copy;
 
@@ -764,37 +1001,18 @@ int map_foreachinareaV(int(*func)(struct block_list*, va_list), int16 m, int16 x
 	x1 = i16min(x1, mapdata->xs - 1);
 	y1 = i16min(y1, mapdata->ys - 1);
 
+	// Lines between cells of the area never leave it, without any wall there is nothing to check
+	if( wall_check && !map_getcellarea(mapdata, x0, y0, x1, y1, CELL_CHKWALL) )
+		wall_check = false;
+
 	if( wall_check ) {
 		cx = x0 + (x1 - x0) / 2;
 		cy = y0 + (y1 - y0) / 2;
 	}
 
-	if( type&~BL_MOB ) {
-		for (by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++) {
-			for (bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++) {
-				for(bl = mapdata->block[bx + by * mapdata->bxs]; bl != NULL; bl = bl->next) {
-					if ( bl->type&type
-						&& bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1
-						&& ( !wall_check || path_search_long(NULL, m, cx, cy, bl->x, bl->y, CELL_CHKWALL) )
-						&& bl_list_count < BL_LIST_MAX )
-						bl_list[bl_list_count++] = bl;
-				}
-			}
-		}
-	}
-
-	if( type&BL_MOB ) {
-		for (by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++) {
-			for (bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++) {
-				for(bl = mapdata->block_mob[bx + by * mapdata->bxs]; bl != NULL; bl = bl->next) {
-					if ( bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1
-						&& ( !wall_check || path_search_long(NULL, m, cx, cy, bl->x, bl->y, CELL_CHKWALL) )
-						&& bl_list_count < BL_LIST_MAX )
-						bl_list[bl_list_count++] = bl;
-				}
-			}
-		}
-	}
+	map_block_collect(mapdata, type, x0, y0, x1, y1, [&](struct block_list *bl) {
+		return !wall_check || path_search_long(NULL, m, cx, cy, bl->x, bl->y, CELL_CHKWALL);
+	});
 
 	if (bl_list_count >= BL_LIST_MAX)
 		ShowWarning("map_foreachinarea: block count too many!\n");
@@ -849,9 +1067,8 @@ int map_foreachinarea(int(*func)(struct block_list*, va_list), int16 m, int16 x0
  *------------------------------------------*/
 int map_forcountinrange(int (*func)(struct block_list*,va_list), struct block_list* center, int16 range, int count, int type, ...)
 {
-	int bx, by, m;
+	int m;
 	int returnCount = 0;	//total sum of returned values of func() [Skotlex]
-	struct block_list *bl;
 	int blockcount = bl_list_count, i;
 	int x0, x1, y0, y1;
 	struct map_data *mapdata;
@@ -869,33 +1086,13 @@ int map_forcountinrange(int (*func)(struct block_list*,va_list), struct block_li
 	x1 = i16min(center->x + range, mapdata->xs - 1);
 	y1 = i16min(center->y + range, mapdata->ys - 1);
 
-	if ( type&~BL_MOB )
-		for ( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ ) {
-			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ ) {
-				for( bl = mapdata->block[ bx + by * mapdata->bxs ]; bl != NULL; bl = bl->next ) {
-					if( bl->type&type
-						&& bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1
-#ifdef CIRCULAR_AREA
-						&& check_distance_bl(center, bl, range)
-#endif
-					  	&& bl_list_count < BL_LIST_MAX )
-						bl_list[ bl_list_count++ ] = bl;
-				}
-			}
-		}
-	if( type&BL_MOB )
-		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ ) {
-			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ ){
-				for( bl = mapdata->block_mob[ bx + by * mapdata->bxs ]; bl != NULL; bl = bl->next ) {
-					if( bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1
 #ifdef CIRCULAR_AREA
-						&& check_distance_bl(center, bl, range)
+	map_block_collect(mapdata, type, x0, y0, x1, y1, [&](struct block_list *bl) {
+		return check_distance_bl(center, bl, range);
+	});
+#else
+	map_block_collect(mapdata, type, x0, y0, x1, y1);
 #endif
-						&& bl_list_count < BL_LIST_MAX )
-						bl_list[ bl_list_count++ ] = bl;
-				}
-			}
-		}
 
 	if( bl_list_count >= BL_LIST_MAX )
 		ShowWarning("map_forcountinrange: block count too many!\n");
@@ -918,9 +1115,7 @@ int map_forcountinrange(int (*func)(struct block_list*,va_list), struct block_li
 }
 int map_forcountinarea(int (*func)(struct block_list*,va_list), int16 m, int16 x0, int16 y0, int16 x1, int16 y1, int count, int type, ...)
 {
-	int bx, by;
 	int returnCount = 0;	//total sum of returned values of func() [Skotlex]
-	struct block_list *bl;
 	int blockcount = bl_list_count, i;
 	va_list ap;
 
@@ -943,19 +1138,7 @@ int map_forcountinarea(int (*func)(struct block_list*,va_list), int16 m, int16 x
 	x1 = i16min(x1, mapdata->xs - 1);
 	y1 = i16min(y1, mapdata->ys - 1);
 
-	if ( type&~BL_MOB )
-		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ )
-			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ )
-				for( bl = mapdata->block[ bx + by * mapdata->bxs ]; bl != NULL; bl = bl->next )
-					if( bl->type&type && bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1 && bl_list_count < BL_LIST_MAX )
-						bl_list[ bl_list_count++ ] = bl;
-
-	if( type&BL_MOB )
-		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ )
-			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ )
-				for( bl = mapdata->block_mob[ bx + by * mapdata->bxs ]; bl != NULL; bl = bl->next )
-					if( bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1 && bl_list_count < BL_LIST_MAX )
-						bl_list[ bl_list_count++ ] = bl;
+	map_block_collect(mapdata, type, x0, y0, x1, y1);
 
 	if( bl_list_count >= BL_LIST_MAX )
 		ShowWarning("map_forcountinarea: block count too many!\n");
@@ -983,9 +1166,8 @@ int map_forcountinarea(int (*func)(struct block_list*,va_list), int16 m, int16 x
  *------------------------------------------*/
 int map_foreachinmovearea(int (*func)(struct block_list*,va_list), struct block_list* center, int16 range, int16 dx, int16 dy, int type, ...)
 {
-	int bx, by, m;
+	int m;
 	int returnCount = 0;  //total sum of returned values of func() [Skotlex]
-	struct block_list *bl;
 	int blockcount = bl_list_count, i;
 	int16 x0, x1, y0, y1;
 	va_list ap;
@@ -1030,63 +1212,19 @@ int map_foreachinmovearea(int (*func)(struct block_list*,va_list), struct block_
 		x1 = i16min(x1, mapdata->xs - 1);
 		y1 = i16min(y1, mapdata->ys - 1);
 
-		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ ) {
-			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ ) {
-				if ( type&~BL_MOB ) {
-					for( bl = mapdata->block[ bx + by * mapdata->bxs ]; bl != NULL; bl = bl->next ) {
-						if( bl->type&type &&
-							bl->x >= x0 && bl->x <= x1 &&
-							bl->y >= y0 && bl->y <= y1 &&
-							bl_list_count < BL_LIST_MAX )
-							bl_list[ bl_list_count++ ] = bl;
-					}
-				}
-				if ( type&BL_MOB ) {
-					for( bl = mapdata->block_mob[ bx + by * mapdata->bxs ]; bl != NULL; bl = bl->next ) {
-						if( bl->x >= x0 && bl->x <= x1 &&
-							bl->y >= y0 && bl->y <= y1 &&
-							bl_list_count < BL_LIST_MAX )
-							bl_list[ bl_list_count++ ] = bl;
-					}
-				}
-			}
-		}
+		map_block_collect(mapdata, type, x0, y0, x1, y1);
 	} else { // Diagonal movement
 		x0 = i16max(x0, 0);
 		y0 = i16max(y0, 0);
 		x1 = i16min(x1, mapdata->xs - 1);
 		y1 = i16min(y1, mapdata->ys - 1);
 
-		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ ) {
-			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ ) {
-				if ( type & ~BL_MOB ) {
-					for( bl = mapdata->block[ bx + by * mapdata->bxs ]; bl != NULL; bl = bl->next ) {
-						if( bl->type&type &&
-							bl->x >= x0 && bl->x <= x1 &&
-							bl->y >= y0 && bl->y <= y1 &&
-							bl_list_count < BL_LIST_MAX )
-						if( ( dx > 0 && bl->x < x0 + dx) ||
-							( dx < 0 && bl->x > x1 + dx) ||
-							( dy > 0 && bl->y < y0 + dy) ||
-							( dy < 0 && bl->y > y1 + dy) )
-							bl_list[ bl_list_count++ ] = bl;
-					}
-				}
-				if ( type&BL_MOB ) {
-					for( bl = mapdata->block_mob[ bx + by * mapdata->bxs ]; bl != NULL; bl = bl->next ) {
-						if( bl->x >= x0 && bl->x <= x1 &&
-							bl->y >= y0 && bl->y <= y1 &&
-							bl_list_count < BL_LIST_MAX)
-						if( ( dx > 0 && bl->x < x0 + dx) ||
-							( dx < 0 && bl->x > x1 + dx) ||
-							( dy > 0 && bl->y < y0 + dy) ||
-							( dy < 0 && bl->y > y1 + dy) )
-							bl_list[ bl_list_count++ ] = bl;
-					}
-				}
-			}
-		}
-
+		map_block_collect(mapdata, type, x0, y0, x1, y1, [&](struct block_list *bl) {
+			return ( dx > 0 && bl->x < x0 + dx ) ||
+				( dx < 0 && bl->x > x1 + dx ) ||
+				( dy > 0 && bl->y < y0 + dy ) ||
+				( dy < 0 && bl->y > y1 + dy );
+		});
 	}
 
 	if( bl_list_count >= BL_LIST_MAX )
@@ -1113,9 +1251,7 @@ int map_foreachinmovearea(int (*func)(struct block_list*,va_list), struct block_
 //
 int map_foreachincell(int (*func)(struct block_list*,va_list), int16 m, int16 x, int16 y, int type, ...)
 {
-	int bx, by;
 	int returnCount = 0;  //total sum of returned values of func() [Skotlex]
-	struct block_list *bl;
 	int blockcount = bl_list_count, i;
 	struct map_data *mapdata = map_getmapdata(m);
 	va_list ap;
@@ -1126,17 +1262,7 @@ int map_foreachincell(int (*func)(struct block_list*,va_list), int16 m, int16 x,
 
 	if ( x < 0 || y < 0 || x >= mapdata->xs || y >= mapdata->ys ) return 0;
 
-	by = y / BLOCK_SIZE;
-	bx = x / BLOCK_SIZE;
-
-	if( type&~BL_MOB )
-		for( bl = mapdata->block[ bx + by * mapdata->bxs ]; bl != NULL; bl = bl->next )
-			if( bl->type&type && bl->x == x && bl->y == y && bl_list_count < BL_LIST_MAX )
-				bl_list[ bl_list_count++ ] = bl;
-	if( type&BL_MOB )
-		for( bl = mapdata->block_mob[ bx + by * mapdata->bxs]; bl != NULL; bl = bl->next )
-			if( bl->x == x && bl->y == y && bl_list_count < BL_LIST_MAX)
-				bl_list[ bl_list_count++ ] = bl;
+	map_block_collect(mapdata, type, x, y, x, y);
 
 	if( bl_list_count >= BL_LIST_MAX )
 		ShowWarning("map_foreachincell: block count too many!\n");
@@ -1197,11 +1323,9 @@ int map_foreachinpath(int (*func)(struct block_list*,va_list),int16 m,int16 x0,i
 
 	//Generic map_foreach* variables.
 	int i, blockcount = bl_list_count;
-	struct block_list *bl;
-	int bx, by;
 	//method specific variables
 	int magnitude2, len_limit; //The square of the magnitude
-	int k, xi, yi, xu, yu;
+	int k;
 	int mx0 = x0, mx1 = x1, my0 = y0, my1 = y1;
 	va_list ap;
 
@@ -1257,71 +1381,28 @@ int map_foreachinpath(int (*func)(struct block_list*,va_list),int16 m,int16 x0,i
 
 	range *= range << 8; //Values are shifted later on for higher precision using int math.
 
-	if ( type&~BL_MOB )
-		for ( by = my0 / BLOCK_SIZE; by <= my1 / BLOCK_SIZE; by++ ) {
-			for( bx = mx0 / BLOCK_SIZE; bx <= mx1 / BLOCK_SIZE; bx++ ) {
-				for( bl = mapdata->block[ bx + by * mapdata->bxs ]; bl != NULL; bl = bl->next ) {
-					if( bl->prev && bl->type&type && bl_list_count < BL_LIST_MAX ) {
-						xi = bl->x;
-						yi = bl->y;
+	map_block_collect(mapdata, type, mx0, my0, mx1, my1, [&](struct block_list *bl) {
+		int xi = bl->x, yi = bl->y, xu, yu;
+		int dot = ( xi - x0 ) * ( x1 - x0 ) + ( yi - y0 ) * ( y1 - y0 );
 
-						k = ( xi - x0 ) * ( x1 - x0 ) + ( yi - y0 ) * ( y1 - y0 );
+		if ( dot < 0 || dot > len_limit ) //Since more skills use this, check for ending point as well.
+			return false;
 
-						if ( k < 0 || k > len_limit ) //Since more skills use this, check for ending point as well.
-							continue;
+		if ( dot > magnitude2 && !path_search_long(NULL, m, x0, y0, xi, yi, CELL_CHKWALL) )
+			return false; //Targets beyond the initial ending point need the wall check.
 
-						if ( k > magnitude2 && !path_search_long(NULL, m, x0, y0, xi, yi, CELL_CHKWALL) )
-							continue; //Targets beyond the initial ending point need the wall check.
+		//All these shifts are to increase the precision of the intersection point and distance considering how it's
+		//int math.
+		dot = ( dot << 4 ) / magnitude2; //dot will be between 1~16 instead of 0~1
+		xi <<= 4;
+		yi <<= 4;
+		xu = ( x0 << 4 ) + dot * ( x1 - x0 );
+		yu = ( y0 << 4 ) + dot * ( y1 - y0 );
+		dot = MAGNITUDE2(xi, yi, xu, yu);
 
-						//All these shifts are to increase the precision of the intersection point and distance considering how it's
-						//int math.
-						k  = ( k << 4 ) / magnitude2; //k will be between 1~16 instead of 0~1
-						xi <<= 4;
-						yi <<= 4;
-						xu = ( x0 << 4 ) + k * ( x1 - x0 );
-						yu = ( y0 << 4 ) + k * ( y1 - y0 );
-						k  = MAGNITUDE2(xi, yi, xu, yu);
-
-						//If all dot coordinates were <<4 the square of the magnitude is <<8
-						if ( k > range )
-							continue;
-
-						bl_list[ bl_list_count++ ] = bl;
-					}
-				}
-			}
-		}
-	 if( type&BL_MOB )
-		for( by = my0 / BLOCK_SIZE; by <= my1 / BLOCK_SIZE; by++ ) {
-			for( bx = mx0 / BLOCK_SIZE; bx <= mx1 / BLOCK_SIZE; bx++ ) {
-				for( bl = mapdata->block_mob[ bx + by * mapdata->bxs ]; bl != NULL; bl = bl->next ) {
-					if( bl->prev && bl_list_count < BL_LIST_MAX ) {
-						xi = bl->x;
-						yi = bl->y;
-						k = ( xi - x0 ) * ( x1 - x0 ) + ( yi - y0 ) * ( y1 - y0 );
-
-						if ( k < 0 || k > len_limit )
-							continue;
-
-						if ( k > magnitude2 && !path_search_long(NULL, m, x0, y0, xi, yi, CELL_CHKWALL) )
-							continue; //Targets beyond the initial ending point need the wall check.
-
-						k  = ( k << 4 ) / magnitude2; //k will be between 1~16 instead of 0~1
-						xi <<= 4;
-						yi <<= 4;
-						xu = ( x0 << 4 ) + k * ( x1 - x0 );
-						yu = ( y0 << 4 ) + k * ( y1 - y0 );
-						k  = MAGNITUDE2(xi, yi, xu, yu);
-
-						//If all dot coordinates were <<4 the square of the magnitude is <<8
-						if ( k > range )
-							continue;
-
-						bl_list[ bl_list_count++ ] = bl;
-					}
-				}
-			}
-		}
+		//If all dot coordinates were <<4 the square of the magnitude is <<8
+		return dot <= range;
+	});
 
 	if( bl_list_count >= BL_LIST_MAX )
 		ShowWarning("map_foreachinpath: block count too many!\n");
@@ -1362,9 +1443,7 @@ int map_foreachindir(int(*func)(struct block_list*, va_list), int16 m, int16 x0,
 	int returnCount = 0;  //Total sum of returned values of func()
 
 	int i, blockcount = bl_list_count;
-	struct block_list *bl;
-	int bx, by;
-	int mx0, mx1, my0, my1, rx, ry;
+	int mx0, mx1, my0, my1;
 	uint8 dir = map_calc_dir_xy(x0, y0, x1, y1, 6);
 	short dx = dirx[dir];
 	short dy = diry[dir];
@@ -1417,78 +1496,28 @@ int map_foreachindir(int(*func)(struct block_list*, va_list), int16 m, int16 x0,
 	mx1 = min(mx1, mapdata->xs - 1);
 	my1 = min(my1, mapdata->ys - 1);
 
-	if (type&~BL_MOB) {
-		for (by = my0 / BLOCK_SIZE; by <= my1 / BLOCK_SIZE; by++) {
-			for (bx = mx0 / BLOCK_SIZE; bx <= mx1 / BLOCK_SIZE; bx++) {
-				for (bl = mapdata->block[bx + by * mapdata->bxs]; bl != NULL; bl = bl->next) {
-					if (bl->prev && bl->type&type && bl_list_count < BL_LIST_MAX) {
-						//Check if inside search area
-						if (bl->x < mx0 || bl->x > mx1 || bl->y < my0 || bl->y > my1)
-							continue;
-						//What matters now is the relative x and y from the start point
-						rx = (bl->x - x0);
-						ry = (bl->y - y0);
-						//Do not hit source cell
-						if (battle_config.skill_eightpath_same_cell == 0 && rx == 0 && ry == 0)
-							continue;
-						//This turns it so that the area that is hit is always with positive rx and ry
-						rx *= dx;
-						ry *= dy;
-						//These checks only need to be done for diagonal paths
-						if (dir % 2) {
-							//Check for length
-							if ((rx + ry < offset) || (rx + ry > 2 * (length + (offset/2) - 1)))
-								continue;
-							//Check for width
-							if (abs(rx - ry) > 2 * range)
-								continue;
-						}
-						//Everything else ok, check for line of sight from source
-						if (!path_search_long(NULL, m, x0, y0, bl->x, bl->y, CELL_CHKWALL))
-							continue;
-						//All checks passed, add to list
-						bl_list[bl_list_count++] = bl;
-					}
-				}
-			}
+	map_block_collect(mapdata, type, mx0, my0, mx1, my1, [&](struct block_list *bl) {
+		//What matters now is the relative x and y from the start point
+		int rx = (bl->x - x0);
+		int ry = (bl->y - y0);
+		//Do not hit source cell
+		if (battle_config.skill_eightpath_same_cell == 0 && rx == 0 && ry == 0)
+			return false;
+		//This turns it so that the area that is hit is always with positive rx and ry
+		rx *= dx;
+		ry *= dy;
+		//These checks only need to be done for diagonal paths
+		if (dir % 2) {
+			//Check for length
+			if ((rx + ry < offset) || (rx + ry > 2 * (length + (offset/2) - 1)))
+				return false;
+			//Check for width
+			if (abs(rx - ry) > 2 * range)
+				return false;
 		}
-	}
-	if (type&BL_MOB) {
-		for (by = my0 / BLOCK_SIZE; by <= my1 / BLOCK_SIZE; by++) {
-			for (bx = mx0 / BLOCK_SIZE; bx <= mx1 / BLOCK_SIZE; bx++) {
-				for (bl = mapdata->block_mob[bx + by * mapdata->bxs]; bl != NULL; bl = bl->next) {
-					if (bl->prev && bl_list_count < BL_LIST_MAX) {
-						//Check if inside search area
-						if (bl->x < mx0 || bl->x > mx1 || bl->y < my0 || bl->y > my1)
-							continue;
-						//What matters now is the relative x and y from the start point
-						rx = (bl->x - x0);
-						ry = (bl->y - y0);
-						//Do not hit source cell
-						if (battle_config.skill_eightpath_same_cell == 0 && rx == 0 && ry == 0)
-							continue;
-						//This turns it so that the area that is hit is always with positive rx and ry
-						rx *= dx;
-						ry *= dy;
-						//These checks only need to be done for diagonal paths
-						if (dir % 2) {
-							//Check for length
-							if ((rx + ry < offset) || (rx + ry > 2 * (length + (offset / 2) - 1)))
-								continue;
-							//Check for width
-							if (abs(rx - ry) > 2 * range)
-								continue;
-						}
-						//Everything else ok, check for line of sight from source
-						if (!path_search_long(NULL, m, x0, y0, bl->x, bl->y, CELL_CHKWALL))
-							continue;
-						//All checks passed, add to list
-						bl_list[bl_list_count++] = bl;
-					}
-				}
-			}
-		}
-	}
+		//Everything else ok, check for line of sight from source
+		return path_search_long(NULL, m, x0, y0, bl->x, bl->y, CELL_CHKWALL);
+	});
 
 	if( bl_list_count >= BL_LIST_MAX )
 		ShowWarning("map_foreachindir: block count too many!\n");
@@ -1511,9 +1540,7 @@ int map_foreachindir(int(*func)(struct block_list*, va_list), int16 m, int16 x0,
 // Copy of map_foreachincell, but applied to the whole map. [Skotlex]
 int map_foreachinmap(int (*func)(struct block_list*,va_list), int16 m, int type,...)
 {
-	int b, bsize;
 	int returnCount = 0;  //total sum of returned values of func() [Skotlex]
-	struct block_list *bl;
 	int blockcount = bl_list_count, i;
 	struct map_data *mapdata = map_getmapdata(m);
 	va_list ap;
@@ -1522,19 +1549,7 @@ int map_foreachinmap(int (*func)(struct block_list*,va_list), int16 m, int type,
 		return 0;
 	}
 
-	bsize = mapdata->bxs * mapdata->bys;
-
-	if( type&~BL_MOB )
-		for( b = 0; b < bsize; b++ )
-			for( bl = mapdata->block[ b ]; bl != NULL; bl = bl->next )
-				if( bl->type&type && bl_list_count < BL_LIST_MAX )
-					bl_list[ bl_list_count++ ] = bl;
-
-	if( type&BL_MOB )
-		for( b = 0; b < bsize; b++ )
-			for( bl = mapdata->block_mob[ b ]; bl != NULL; bl = bl->next )
-				if( bl_list_count < BL_LIST_MAX )
-					bl_list[ bl_list_count++ ] = bl;
+	map_block_collect(mapdata, type, 0, 0, mapdata->xs - 1, mapdata->ys - 1);
 
 	if( bl_list_count >= BL_LIST_MAX )
 		ShowWarning("map_foreachinmap: block count too many!\n");
@@ -1858,15 +1873,15 @@ int map_addflooritem(struct item *item, int amount, int16 m, int16 x, int16 y, i
 		return 0;
 	r = rnd();
 
-	CREATE(fitem, struct flooritem_data, 1);
+	fitem = (struct flooritem_data*)map_allocblock(BL_ITEM);
 	fitem->bl.type=BL_ITEM;
-	fitem->bl.prev = fitem->bl.next = NULL;
+	fitem->bl.prev = NULL;
 	fitem->bl.m=m;
 	fitem->bl.x=x;
 	fitem->bl.y=y;
 	fitem->bl.id = map_get_new_object_id();
 	if (fitem->bl.id==0) {
-		aFree(fitem);
+		map_freeblock(&fitem->bl);
 		return 0;
 	}
 
@@ -2097,25 +2112,30 @@ int map_quit(struct map_session_data *sd) {
 	//map_quit handles extra specific data which is related to quitting normally
 	//(changing map-servers invokes unit_free but bypasses map_quit)
 	if( sd->sc.count ) {
-		for (const auto &it : status_db) {
-			std::bitset<SCF_MAX> &flag = it.second->flag;
+		for (sc_type type = static_cast<sc_type>(sd->sc.data.next(SC_NONE)); type < SC_MAX; type = static_cast<sc_type>(sd->sc.data.next(type))) {
+			std::shared_ptr<s_status_change_db> scdb = status_db.find(type);
+
+			if (scdb == nullptr)
+				continue;
+
+			std::bitset<SCF_MAX> &flag = scdb->flag;
 
 			//No need to save infinite status
-			if (flag[SCF_NOSAVEINFINITE] && sd->sc.data[it.first] && sd->sc.data[it.first]->val4 > 0) {
-				status_change_end(&sd->bl, static_cast<sc_type>(it.first), INVALID_TIMER);
+			if (flag[SCF_NOSAVEINFINITE] && sd->sc.data[type]->val4 > 0) {
+				status_change_end(&sd->bl, type, INVALID_TIMER);
 				continue;
 			}
 
 			//Status that are not saved
 			if (flag[SCF_NOSAVE]) {
-				status_change_end(&sd->bl, static_cast<sc_type>(it.first), INVALID_TIMER);
+				status_change_end(&sd->bl, type, INVALID_TIMER);
 				continue;
 			}
 			//Removes status by config
 			if (battle_config.debuff_on_logout&1 && flag[SCF_DEBUFF] || //Removes debuffs
 				(battle_config.debuff_on_logout&2 && !(flag[SCF_DEBUFF]))) //Removes buffs
 			{
-				status_change_end(&sd->bl, static_cast<sc_type>(it.first), INVALID_TIMER);
+				status_change_end(&sd->bl, type, INVALID_TIMER);
 				continue;
 			}
 		}
@@ -2657,6 +2677,78 @@ bool map_addnpc(int16 m,struct npc_data *nd)
 	return true;
 }
 
+/// Sets the bit of a cell in a cell plane, keeping it in sync with the cells
+static inline void map_cellplane_set(struct map_data* m, enum e_cell_plane plane, int16 x, int16 y, bool flag)
+{
+	if( m->cell_planes == nullptr )
+		return;
+
+	uint64& word = map_cellplane_word(m, plane, y, x >> 6);
+	uint64 bit = UINT64_C(1) << (x & 63);
+
+	if( flag )
+		word |= bit;
+	else
+		word &= ~bit;
+}
+
+static uint32 map_cell_version = 0;
+
+/// Marks the cells of a map as changed, see map_data::cell_version
+static inline void map_cells_changed(struct map_data* m)
+{
+	// 0 is never used, cached paths with it are unused
+	if( ++map_cell_version == 0 )
+		map_cell_version = 1;
+	m->cell_version = map_cell_version;
+}
+
+/// Allocates the cell planes of a map, they are filled by map_cellplanes_fill
+static void map_cellplanes_alloc(struct map_data* m)
+{
+	map_cells_changed(m);
+	m->cell_plane_words = (m->xs + 63) / 64;
+	CREATE(m->cell_planes, uint64, (size_t)CELL_PLANE_MAX * m->ys * m->cell_plane_words);
+}
+
+/// Builds the cell planes from the cells of a map, called from the map loading threads
+static void map_cellplanes_fill(struct map_data* m)
+{
+	for( int16 y = 0; y < m->ys; y++ ){
+		const struct mapcell* row = &m->cell[y * m->xs];
+
+		for( int w = 0; w < m->cell_plane_words; w++ ){
+			uint64 bits[CELL_PLANE_MAX] = {};
+			int16 end = i16min(m->xs, (w + 1) * 64);
+
+			for( int16 x = w * 64; x < end; x++ ){
+				uint64 bit = UINT64_C(1) << (x & 63);
+
+				if( row[x].walkable ) bits[CELL_PLANE_WALKABLE] |= bit;
+				if( row[x].shootable ) bits[CELL_PLANE_SHOOTABLE] |= bit;
+				if( row[x].water ) bits[CELL_PLANE_WATER] |= bit;
+				if( row[x].icewall ) bits[CELL_PLANE_ICEWALL] |= bit;
+				if( row[x].landprotector ) bits[CELL_PLANE_LANDPROTECTOR] |= bit;
+			}
+
+			for( int p = 0; p < CELL_PLANE_MAX; p++ )
+				map_cellplane_word(m, (enum e_cell_plane)p, y, w) = bits[p];
+		}
+	}
+}
+
+/// Frees the cells, cell planes and walkable regions of a map
+static void map_cells_free(struct map_data* m)
+{
+	path_regions_free(m);
+	if( m->cell )
+		aFree(m->cell);
+	m->cell = nullptr;
+	if( m->cell_planes )
+		aFree(m->cell_planes);
+	m->cell_planes = nullptr;
+}
+
 /*==========================================
  * Add an instance map
  *------------------------------------------*/
@@ -2702,8 +2794,7 @@ int map_addinstancemap(int src_m, int instance_id, bool no_mapflag)
 	dst_map->users = 0;
 	dst_map->xs = src_map->xs;
 	dst_map->ys = src_map->ys;
-	dst_map->bxs = src_map->bxs;
-	dst_map->bys = src_map->bys;
+	dst_map->block_size = src_map->block_size;
 	dst_map->iwall_num = src_map->iwall_num;
 
 	memset(dst_map->npc, 0, sizeof(dst_map->npc));
@@ -2716,11 +2807,12 @@ int map_addinstancemap(int src_m, int instance_id, bool no_mapflag)
 
 	CREATE( dst_map->cell, struct mapcell, num_cell );
 	memcpy( dst_map->cell, src_map->cell, num_cell * sizeof(struct mapcell) );
+	map_cellplanes_alloc( dst_map );
+	memcpy( dst_map->cell_planes, src_map->cell_planes, (size_t)CELL_PLANE_MAX * dst_map->ys * dst_map->cell_plane_words * sizeof(uint64) );
+	dst_map->path_regions = nullptr;
+	path_regions_copy( dst_map, src_map );
 
-	size_t size = dst_map->bxs * dst_map->bys * sizeof(struct block_list*);
-
-	dst_map->block = (struct block_list **)aCalloc(1,size);
-	dst_map->block_mob = (struct block_list **)aCalloc(1,size);
+	map_block_alloc(dst_map);
 
 	dst_map->index = mapindex_addmap(-1, dst_map->name);
 	dst_map->channel = nullptr;
@@ -2802,15 +2894,8 @@ int map_delinstancemap(int m)
 	mapdata->mob_delete_timer = INVALID_TIMER;
 
 	// Free memory
-	if (mapdata->cell)
-		aFree(mapdata->cell);
-	mapdata->cell = nullptr;
-	if (mapdata->block)
-		aFree(mapdata->block);
-	mapdata->block = nullptr;
-	if (mapdata->block_mob)
-		aFree(mapdata->block_mob);
-	mapdata->block_mob = nullptr;
+	map_cells_free(mapdata);
+	map_block_free(mapdata);
 
 	map_free_questinfo(mapdata);
 	mapdata->damage_adjust = {};
@@ -3238,6 +3323,76 @@ int map_getcellp(struct map_data* m,int16 x,int16 y,cell_chk cellchk)
 	}
 }
 
+/*==========================================
+ * Whether any cell of row y from x0 to x1 matches cellchk.
+ * Cells outside of the map are treated like map_getcellp does.
+ * Checks supported by the cell planes test 64 cells at once.
+ *------------------------------------------*/
+bool map_getcellrow(struct map_data* m, int16 y, int16 x0, int16 x1, cell_chk cellchk)
+{
+	nullpo_retr(false, m);
+
+	if( x1 < x0 )
+		SWAP(x0, x1);
+
+	//NOTE: map_getcellp intentionally overrides the last row and column
+	if( y < 0 || y >= m->ys - 1 || x0 < 0 || x1 >= m->xs - 1 ){
+		if( cellchk == CELL_CHKNOPASS )
+			return true;
+		if( y < 0 || y >= m->ys - 1 )
+			return false;
+
+		x0 = i16max(x0, 0);
+		x1 = i16min(x1, m->xs - 2);
+
+		if( x0 > x1 )
+			return false;
+	}
+
+	struct s_cellplane_query query;
+
+	if( map_cellplane_query(m, cellchk, query) )
+		return map_cellplane_row(query, y, x0, x1);
+
+	for( int16 x = x0; x <= x1; x++ ){
+		if( map_getcellp(m, x, y, cellchk) )
+			return true;
+	}
+
+	return false;
+}
+
+/*==========================================
+ * Whether any cell of the area (x0,y0)-(x1,y1) matches cellchk.
+ *------------------------------------------*/
+bool map_getcellarea(struct map_data* m, int16 x0, int16 y0, int16 x1, int16 y1, cell_chk cellchk)
+{
+	struct s_cellplane_query query;
+
+	nullpo_retr(false, m);
+
+	if( x1 < x0 )
+		SWAP(x0, x1);
+	if( y1 < y0 )
+		SWAP(y0, y1);
+
+	if( x0 < 0 || y0 < 0 || x1 >= m->xs - 1 || y1 >= m->ys - 1 || !map_cellplane_query(m, cellchk, query) ){
+		for( int16 y = y0; y <= y1; y++ ){
+			if( map_getcellrow(m, y, x0, x1, cellchk) )
+				return true;
+		}
+
+		return false;
+	}
+
+	for( int16 y = y0; y <= y1; y++ ){
+		if( map_cellplane_row(query, y, x0, x1) )
+			return true;
+	}
+
+	return false;
+}
+
 /*==========================================
  * Change the type/flags of a map cell
  * 'cell' - which flag to modify
@@ -3252,19 +3407,20 @@ void map_setcell(int16 m, int16 x, int16 y, cell_t cell, bool flag)
 		return;
 
 	j = x + y*mapdata->xs;
+	map_cells_changed(mapdata);
 
 	switch( cell ) {
-		case CELL_WALKABLE:      mapdata->cell[j].walkable = flag;      break;
-		case CELL_SHOOTABLE:     mapdata->cell[j].shootable = flag;     break;
-		case CELL_WATER:         mapdata->cell[j].water = flag;         break;
+		case CELL_WALKABLE:      mapdata->cell[j].walkable = flag;      map_cellplane_set(mapdata, CELL_PLANE_WALKABLE, x, y, flag);      path_regions_changed(mapdata, x, y); break;
+		case CELL_SHOOTABLE:     mapdata->cell[j].shootable = flag;     map_cellplane_set(mapdata, CELL_PLANE_SHOOTABLE, x, y, flag);     break;
+		case CELL_WATER:         mapdata->cell[j].water = flag;         map_cellplane_set(mapdata, CELL_PLANE_WATER, x, y, flag);         break;
 
 		case CELL_NPC:           mapdata->cell[j].npc = flag;           break;
 		case CELL_BASILICA:      mapdata->cell[j].basilica = flag;      break;
-		case CELL_LANDPROTECTOR: mapdata->cell[j].landprotector = flag; break;
+		case CELL_LANDPROTECTOR: mapdata->cell[j].landprotector = flag; map_cellplane_set(mapdata, CELL_PLANE_LANDPROTECTOR, x, y, flag); break;
 		case CELL_NOVENDING:     mapdata->cell[j].novending = flag;     break;
 		case CELL_NOCHAT:        mapdata->cell[j].nochat = flag;        break;
 		case CELL_MAELSTROM:	 mapdata->cell[j].maelstrom = flag;	  break;
-		case CELL_ICEWALL:		 mapdata->cell[j].icewall = flag;		  break;
+		case CELL_ICEWALL:		 mapdata->cell[j].icewall = flag;		  map_cellplane_set(mapdata, CELL_PLANE_ICEWALL, x, y, flag); break;
 		case CELL_NOBUYINGSTORE: mapdata->cell[j].nobuyingstore = flag; break;
 		default:
 			ShowWarning("map_setcell: invalid cell type '%d'\n", (int)cell);
@@ -3284,9 +3440,14 @@ void map_setgatcell(int16 m, int16 x, int16 y, int gat)
 	j = x + y*mapdata->xs;
 
 	cell = map_gat2cell(gat);
+	map_cells_changed(mapdata);
 	mapdata->cell[j].walkable = cell.walkable;
 	mapdata->cell[j].shootable = cell.shootable;
 	mapdata->cell[j].water = cell.water;
+	map_cellplane_set(mapdata, CELL_PLANE_WALKABLE, x, y, cell.walkable);
+	map_cellplane_set(mapdata, CELL_PLANE_SHOOTABLE, x, y, cell.shootable);
+	map_cellplane_set(mapdata, CELL_PLANE_WATER, x, y, cell.water);
+	path_regions_changed(mapdata, x, y);
 }
 
 /*==========================================
@@ -3479,85 +3640,314 @@ int map_eraseipport(unsigned short mapindex, uint32 ip, uint16 port)
 }
 
 /*==========================================
- * [Shinryo]: Init the mapcache
+ * Map cache
  *------------------------------------------*/
-static char *map_init_mapcache(FILE *fp)
+/// Releases a map cache file
+static void map_cache_close(struct s_map_cache& cache)
 {
-	size_t size = 0;
-	char *buffer;
+	if( cache.mapped ){
+#ifdef WIN32
+		UnmapViewOfFile(cache.buffer);
+#else
+		munmap((void*)cache.buffer, cache.size);
+#endif
+	}else if( cache.buffer != nullptr ){
+		aFree((void*)cache.buffer);
+	}
+#ifdef WIN32
+	if( cache.mapping != NULL )
+		CloseHandle(cache.mapping);
+	if( cache.file != INVALID_HANDLE_VALUE )
+		CloseHandle(cache.file);
+	cache.mapping = NULL;
+	cache.file = INVALID_HANDLE_VALUE;
+#endif
+	cache.buffer = nullptr;
+	cache.size = 0;
+	cache.mapped = false;
+	cache.header = nullptr;
+	cache.legacy_index.clear();
+}
 
-	// No file open? Return..
-	nullpo_ret(fp);
+/// Checks the header of a version 2 map cache and the bounds of its tables
+static bool map_cache_check_v2(struct s_map_cache& cache, const char* path)
+{
+	const struct map_cache_header* header = (const struct map_cache_header*)cache.buffer;
 
-	// Get file size
-	fseek(fp, 0, SEEK_END);
-	size = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
+	if( header->version != MAP_CACHE_VERSION ){
+		ShowError("map_cache_open: Unsupported map cache version %u in %s\n", header->version, path);
+		return false;
+	}
 
-	// Allocate enough space
-	CREATE(buffer, char, size);
+	if( header->file_size != cache.size || header->index_size == 0 || ( header->index_size & ( header->index_size - 1 ) ) != 0 ||
+		sizeof(struct map_cache_header) + (uint64)header->index_size * sizeof(uint32) + (uint64)header->map_count * sizeof(struct map_cache_entry) > cache.size ){
+		ShowError("map_cache_open: Corrupted header in %s\n", path);
+		return false;
+	}
 
-	// No memory? Return..
-	nullpo_ret(buffer);
+	const struct map_cache_entry* maps = (const struct map_cache_entry*)( cache.buffer + sizeof(struct map_cache_header) + header->index_size * sizeof(uint32) );
 
-	// Read file into buffer..
-	if(fread(buffer, 1, size, fp) != size) {
-		ShowError("map_init_mapcache: Could not read entire mapcache file\n");
-		return NULL;
+	for( uint32 i = 0; i < header->map_count; i++ ){
+		if( (uint64)maps[i].offset + maps[i].len > cache.size ){
+			ShowError("map_cache_open: Map %.*s exceeds the size of %s\n", MAP_NAME_LENGTH, maps[i].name, path);
+			return false;
+		}
 	}
 
-	return buffer;
+	cache.header = header;
+	return true;
 }
 
-/*==========================================
- * Map cache reading
- * [Shinryo]: Optimized some behaviour to speed this up
- *==========================================*/
-int map_readfromcache(struct map_data *m, char *buffer, char *decode_buffer)
+/// Builds the name index of a version 1 map cache
+static bool map_cache_index_v1(struct s_map_cache& cache, const char* path)
 {
-	int i;
-	struct map_cache_main_header *header = (struct map_cache_main_header *)buffer;
-	struct map_cache_map_info *info = NULL;
-	char *p = buffer + sizeof(struct map_cache_main_header);
+	const struct map_cache_main_header* header = (const struct map_cache_main_header*)cache.buffer;
+	size_t pos = sizeof(struct map_cache_main_header);
+
+	if( cache.size < sizeof(struct map_cache_main_header) ){
+		ShowError("map_cache_open: Corrupted header in %s\n", path);
+		return false;
+	}
+
+	cache.legacy_index.reserve(header->map_count);
 
-	for(i = 0; i < header->map_count; i++) {
-		info = (struct map_cache_map_info *)p;
+	for( int i = 0; i < header->map_count; i++ ){
+		const struct map_cache_map_info* info = (const struct map_cache_map_info*)( cache.buffer + pos );
+
+		if( pos + sizeof(struct map_cache_map_info) > cache.size || info->len < 0 || pos + sizeof(struct map_cache_map_info) + info->len > cache.size ){
+			ShowError("map_cache_open: Map %d exceeds the size of %s\n", i, path);
+			return false;
+		}
 
-		if( strcmp(m->name, info->name) == 0 )
-			break; // Map found
+		// The first map with a name wins, like when searching the file linearly
+		cache.legacy_index.emplace(std::string(info->name, strnlen(info->name, MAP_NAME_LENGTH)), info);
 
 		// Jump to next entry..
-		p += sizeof(struct map_cache_map_info) + info->len;
+		pos += sizeof(struct map_cache_map_info) + info->len;
 	}
 
-	if( info && i < header->map_count ) {
-		unsigned long size, xy;
+	return true;
+}
+
+/// Opens a map cache file, version 1 and 2 are supported
+static bool map_cache_open(struct s_map_cache& cache, const char* path)
+{
+#ifdef WIN32
+	cache.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if( cache.file == INVALID_HANDLE_VALUE )
+		return false;
 
-		if( info->xs <= 0 || info->ys <= 0 )
-			return 0;// Invalid
+	LARGE_INTEGER size;
 
-		m->xs = info->xs;
-		m->ys = info->ys;
-		size = (unsigned long)info->xs*(unsigned long)info->ys;
+	if( GetFileSizeEx(cache.file, &size) && size.QuadPart > 0 ){
+		cache.size = (size_t)size.QuadPart;
+		cache.mapping = CreateFileMapping(cache.file, NULL, PAGE_READONLY, 0, 0, NULL);
 
-		if(size > MAX_MAP_SIZE) {
-			ShowWarning("map_readfromcache: %s exceeded MAX_MAP_SIZE of %d\n", info->name, MAX_MAP_SIZE);
-			return 0; // Say not found to remove it from list.. [Shinryo]
+		if( cache.mapping != NULL )
+			cache.buffer = (const char*)MapViewOfFile(cache.mapping, FILE_MAP_READ, 0, 0, 0);
+	}
+#else
+	int fd = open(path, O_RDONLY);
+
+	if( fd < 0 )
+		return false;
+
+	struct stat st;
+
+	if( fstat(fd, &st) == 0 && st.st_size > 0 ){
+		cache.size = (size_t)st.st_size;
+
+		void* buffer = mmap(NULL, cache.size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if( buffer != MAP_FAILED )
+			cache.buffer = (const char*)buffer;
+	}
+
+	close(fd);
+#endif
+
+	if( cache.buffer != nullptr ){
+		cache.mapped = true;
+	}else{
+		// Mapping the file failed, read it into memory instead
+		FILE* fp = fopen(path, "rb");
+		char* buffer;
+
+		if( fp == NULL ){
+			map_cache_close(cache);
+			return false;
 		}
 
-		// TO-DO: Maybe handle the scenario, if the decoded buffer isn't the same size as expected? [Shinryo]
-		decode_zip(decode_buffer, &size, p+sizeof(struct map_cache_map_info), info->len);
+		fseek(fp, 0, SEEK_END);
+		cache.size = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
 
-		CREATE(m->cell, struct mapcell, size);
+		CREATE(buffer, char, cache.size + 1);
+		cache.buffer = buffer;
 
+		if( fread(buffer, 1, cache.size, fp) != cache.size ){
+			ShowError("map_cache_open: Could not read entire mapcache file %s\n", path);
+			fclose(fp);
+			map_cache_close(cache);
+			return false;
+		}
 
-		for( xy = 0; xy < size; ++xy )
-			m->cell[xy] = map_gat2cell(decode_buffer[xy]);
+		fclose(fp);
+	}
 
-		return 1;
+	bool valid;
+
+	if( cache.size >= sizeof(struct map_cache_header) && memcmp(cache.buffer, MAP_CACHE_MAGIC, 4) == 0 )
+		valid = map_cache_check_v2(cache, path);
+	else
+		valid = map_cache_index_v1(cache, path);
+
+	if( !valid ){
+		map_cache_close(cache);
+		return false;
+	}
+
+	return true;
+}
+
+/// Finds the compressed cells of a map in a map cache
+static bool map_cache_find(const struct s_map_cache& cache, const char* name, int16& xs, int16& ys, const char*& data, uint32& len)
+{
+	if( cache.header != nullptr ){
+		const uint32* index = (const uint32*)( cache.buffer + sizeof(struct map_cache_header) );
+		const struct map_cache_entry* maps = (const struct map_cache_entry*)( index + cache.header->index_size );
+		uint32 mask = cache.header->index_size - 1;
+		uint32 slot = map_cache_hash(name) & mask;
+
+		for( uint32 probes = 0; probes <= mask; probes++, slot = ( slot + 1 ) & mask ){
+			uint32 id = index[slot];
+
+			if( id == MAP_CACHE_INDEX_EMPTY || id >= cache.header->map_count )
+				return false;
+
+			if( strncmp(maps[id].name, name, MAP_NAME_LENGTH) == 0 ){
+				xs = maps[id].xs;
+				ys = maps[id].ys;
+				data = cache.buffer + maps[id].offset;
+				len = maps[id].len;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	auto it = cache.legacy_index.find(name);
+
+	if( it == cache.legacy_index.end() )
+		return false;
+
+	xs = it->second->xs;
+	ys = it->second->ys;
+	data = (const char*)( it->second + 1 );
+	len = it->second->len;
+	return true;
+}
+
+/// Inflates the cells of a map and converts them, called from the map loading threads
+static void map_cache_decode(struct s_map_cache_job& job, std::vector<unsigned char>& decode_buffer, const struct mapcell* gat2cell)
+{
+	struct map_data* mapdata = job.mapdata;
+	unsigned long size = (unsigned long)mapdata->xs * (unsigned long)mapdata->ys;
+	unsigned long decoded = size;
+
+	if( decode_zip(decode_buffer.data(), &decoded, job.data, job.len) != 0 || decoded != size ){
+		job.failed = true;
+		return;
+	}
+
+	for( unsigned long xy = 0; xy < size; ++xy ){
+		unsigned char gat = decode_buffer[xy];
+
+		if( gat > 6 )
+			job.invalid++;
+		mapdata->cell[xy] = gat2cell[gat];
 	}
 
-	return 0; // Not found
+	map_cellplanes_fill(mapdata);
+	if( battle_config.path_regions )
+		path_regions_build(mapdata);
+}
+
+/*==========================================
+ * Map cache reading
+ * Maps are looked up in the import cache first, in case of override.
+ * The cells are allocated here and decoded on the map loading threads.
+ *==========================================*/
+static void map_readallfromcache(struct s_map_cache* caches)
+{
+	std::vector<struct s_map_cache_job> jobs;
+
+	for( int i = 0; i < map_num; i++ ){
+		struct map_data* mapdata = &map[i];
+
+		mapdata->cell = nullptr;
+		mapdata->cell_planes = nullptr;
+		mapdata->path_regions = nullptr;
+
+		for( int c = 1; c >= 0; c-- ){
+			int16 xs, ys;
+			const char* data;
+			uint32 len;
+
+			if( caches[c].buffer == nullptr || !map_cache_find(caches[c], mapdata->name, xs, ys, data, len) )
+				continue;
+
+			if( xs <= 0 || ys <= 0 )
+				continue; // Invalid
+
+			if( (unsigned long)xs * (unsigned long)ys > MAX_MAP_SIZE ){
+				ShowWarning("map_readfromcache: %s exceeded MAX_MAP_SIZE of %d\n", mapdata->name, MAX_MAP_SIZE);
+				continue; // Say not found to remove it from list.. [Shinryo]
+			}
+
+			mapdata->xs = xs;
+			mapdata->ys = ys;
+			CREATE(mapdata->cell, struct mapcell, (size_t)xs * ys);
+			map_cellplanes_alloc(mapdata);
+			jobs.push_back({ mapdata, data, len, 0, false });
+			break;
+		}
+	}
+
+	// Every gat type converted once, so the threads don't need to warn
+	struct mapcell gat2cell[UINT8_MAX + 1];
+
+	for( int gat = 0; gat <= UINT8_MAX; gat++ ){
+		if( gat <= 6 )
+			gat2cell[gat] = map_gat2cell(gat);
+		else
+			memset(&gat2cell[gat], 0, sizeof(struct mapcell));
+	}
+
+	size_t threads = map_load_threads > 0 ? map_load_threads : std::thread::hardware_concurrency();
+	ThreadPool pool;
+
+	pool.start(min(threads, jobs.size()) > 1 ? min(threads, jobs.size()) - 1 : 0);
+
+	std::vector<std::vector<unsigned char>> decode_buffers(pool.size(), std::vector<unsigned char>(MAX_MAP_SIZE));
+
+	ShowStatus("Decoding %" PRIuPTR " maps on %" PRIuPTR " threads..." CL_CLL "\r", jobs.size(), pool.size());
+
+	pool.run(jobs.size(), [&]( size_t index, size_t worker ){
+		map_cache_decode(jobs[index], decode_buffers[worker], gat2cell);
+	});
+	pool.stop();
+
+	for( struct s_map_cache_job& job : jobs ){
+		if( job.failed ){
+			ShowError("map_readfromcache: Could not decode the cells of %s\n", job.mapdata->name);
+			map_cells_free(job.mapdata);
+		}else if( job.invalid > 0 ){
+			ShowWarning("map_gat2cell: %s has %u cells with an unrecognized gat type\n", job.mapdata->name, job.invalid);
+		}
+	}
 }
 
 int map_addmap(char* mapname)
@@ -3612,6 +4002,8 @@ void map_flags_init(void){
 		struct map_data *mapdata = &map[i];
 		union u_mapflag_args args = {};
 
+		if (mapdata->flag.size() > MF_BLOCKSIZE && mapdata->flag[MF_BLOCKSIZE])
+			map_setblocksize(i, BLOCK_SIZE);
 		mapdata->flag.clear();
 		mapdata->flag.resize(MF_MAX, 0); // Resize and define default values
 		mapdata->drop_list.clear();
@@ -3734,6 +4126,11 @@ int map_readgat (struct map_data* m)
 
 	aFree(gat);
 
+	map_cellplanes_alloc(m);
+	map_cellplanes_fill(m);
+	if( battle_config.path_regions )
+		path_regions_build(m);
+
 	return 1;
 }
 
@@ -3755,13 +4152,8 @@ void map_removemapdb(struct map_data *m)
  *--------------------------------------*/
 int map_readallmaps (void)
 {
-	FILE* fp=NULL;
-	// Has the uncompressed gat data of all maps, so just one allocation has to be made
-	char *map_cache_buffer[2] = {
-		NULL,
-		NULL
-	};
-	char map_cache_decode_buffer[MAX_MAP_SIZE];
+	// Main and import map cache
+	struct s_map_cache map_cache[2];
 
 	if( enable_grf )
 		ShowStatus("Loading maps (using GRF files)...\n");
@@ -3774,7 +4166,7 @@ int map_readallmaps (void)
 		for( int i = 0; i < 2; i++ ){
 			ShowStatus( "Loading maps (using %s as map cache)...\n", mapcachefilepath[i] );
 
-			if( ( fp = fopen(mapcachefilepath[i], "rb") ) == NULL ){
+			if( !map_cache_open(map_cache[i], mapcachefilepath[i]) ){
 				if( i == 0 ){
 					ShowFatalError( "Unable to open map cache file " CL_WHITE "%s" CL_RESET "\n", mapcachefilepath[i] );
 					exit(EXIT_FAILURE); //No use launching server if maps can't be read.
@@ -3783,23 +4175,14 @@ int map_readallmaps (void)
 					break;
 				}
 			}
-
-			// Init mapcache data. [Shinryo]
-			map_cache_buffer[i] = map_init_mapcache(fp);
-
-			if( !map_cache_buffer[i] ) {
-				ShowFatalError( "Failed to initialize mapcache data (%s)..\n", mapcachefilepath[i] );
-				exit(EXIT_FAILURE);
-			}
-
-			fclose(fp);
 		}
+
+		map_readallfromcache(map_cache);
 	}
 
 	int maps_removed = 0;
 
 	for (int i = 0; i < map_num; i++) {
-		size_t size;
 		bool success = false;
 		unsigned short idx = 0;
 		struct map_data *mapdata = &map[i];
@@ -3811,20 +4194,13 @@ int map_readallmaps (void)
 			// try to load the map
 			success = map_readgat(mapdata) != 0;
 		}else{
-			// try to load the map
-			// Read from import first, in case of override
-			if( map_cache_buffer[1] != NULL ){
-				success = map_readfromcache( mapdata, map_cache_buffer[1], map_cache_decode_buffer ) != 0;
-			}
-
-			// Nothing was found in import - try to find it in the main file
-			if( !success ){
-				success = map_readfromcache( mapdata, map_cache_buffer[0], map_cache_decode_buffer ) != 0;
-			}
+			// the map was read from the cache already
+			success = mapdata->cell != NULL;
 		}
 
 		// The map was not found - remove it
 		if (!(idx = mapindex_name2id(mapdata->name)) || !success) {
+			map_cells_free(mapdata);
 			map_delmapid(i);
 			maps_removed++;
 			i--;
@@ -3835,10 +4211,7 @@ int map_readallmaps (void)
 
 		if (uidb_get(map_db,(unsigned int)mapdata->index) != NULL) {
 			ShowWarning("Map %s already loaded!" CL_CLL "\n", mapdata->name);
-			if (mapdata->cell) {
-				aFree(mapdata->cell);
-				mapdata->cell = NULL;
-			}
+			map_cells_free(mapdata);
 			map_delmapid(i);
 			maps_removed++;
 			i--;
@@ -3851,12 +4224,8 @@ int map_readallmaps (void)
 		memset(mapdata->moblist, 0, sizeof(mapdata->moblist));	//Initialize moblist [Skotlex]
 		mapdata->mob_delete_timer = INVALID_TIMER;	//Initialize timer [Skotlex]
 
-		mapdata->bxs = (mapdata->xs + BLOCK_SIZE - 1) / BLOCK_SIZE;
-		mapdata->bys = (mapdata->ys + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
-		size = mapdata->bxs * mapdata->bys * sizeof(struct block_list*);
-		mapdata->block = (struct block_list**)aCalloc(size, 1);
-		mapdata->block_mob = (struct block_list**)aCalloc(size, 1);
+		mapdata->block_size = BLOCK_SIZE;
+		map_block_alloc(mapdata);
 
 		memset(&mapdata->save, 0, sizeof(struct point));
 		mapdata->damage_adjust = {};
@@ -3868,10 +4237,8 @@ int map_readallmaps (void)
 
 	if( !enable_grf ) {
 		// The cache isn't needed anymore, so free it. [Shinryo]
-		if( map_cache_buffer[1] != NULL ){
-			aFree(map_cache_buffer[1]);
-		}
-		aFree(map_cache_buffer[0]);
+		map_cache_close(map_cache[1]);
+		map_cache_close(map_cache[0]);
 	}
 
 	if (maps_removed)
@@ -3948,12 +4315,36 @@ int parse_console(const char* buf){
 	else if( strcmpi("ers_report", type) == 0 ){
 		ers_report();
 	}
+	else if( strcmpi("timer_stats", type) == 0 ){
+		if( n < 2 || strcmpi("show", command) == 0 )
+			timer_stats_report(30);
+		else if( strcmpi("all", command) == 0 )
+			timer_stats_report(0);
+		else if( strcmpi("on", command) == 0 ){
+			timer_stats_enable(true);
+			ShowInfo("Timer statistics enabled.\n");
+		}
+		else if( strcmpi("off", command) == 0 ){
+			timer_stats_enable(false);
+			ShowInfo("Timer statistics disabled.\n");
+		}
+		else if( strcmpi("reset", command) == 0 ){
+			timer_stats_reset();
+			ShowInfo("Timer statistics reset.\n");
+		}
+		else if( strcmpi("dump", command) == 0 ){
+			if( timer_stats_dump() )
+				ShowInfo("Timer statistics dumped.\n");
+		}
+	}
 	else if( strcmpi("help", type) == 0 ) {
 		ShowInfo("Available commands:\n");
 		ShowInfo("\t admin:@<atcommand> => Uses an atcommand. Do NOT use commands requiring an attached player.\n");
 		ShowInfo("\t admin:map:<map> <x> <y> => Changes the map from which console commands are executed.\n");
 		ShowInfo("\t server:shutdown => Stops the server.\n");
 		ShowInfo("\t ers_report => Displays database usage.\n");
+		ShowInfo("\t timer_stats[:show|all] => Displays the timer functions taking the most time.\n");
+		ShowInfo("\t timer_stats:<on|off|reset|dump> => Controls the timer statistics, dump appends them to the dump file.\n");
 	}
 
 	return 0;
@@ -4050,10 +4441,20 @@ int map_config_read(const char *cfgName)
 			enable_spy = config_switch(w2);
 		else if (strcmpi(w1, "use_grf") == 0)
 			enable_grf = config_switch(w2);
+		else if (strcmpi(w1, "map_load_threads") == 0)
+			map_load_threads = cap_value(atoi(w2), 0, 64);
 		else if (strcmpi(w1, "console_msg_log") == 0)
 			console_msg_log = atoi(w2);//[Ind]
 		else if (strcmpi(w1, "console_log_filepath") == 0)
 			safestrncpy(console_log_filepath, w2, sizeof(console_log_filepath));
+		else if (strcmpi(w1, "timer_stats") == 0)
+			timer_stats_enable(config_switch(w2) != 0);
+		else if (strcmpi(w1, "timer_stats_overdue") == 0)
+			timer_stats_set_overdue(atoi(w2));
+		else if (strcmpi(w1, "timer_stats_dump_interval") == 0)
+			timer_stats_set_dump_interval(atoi(w2));
+		else if (strcmpi(w1, "timer_stats_dump_file") == 0)
+			timer_stats_set_dump_file(w2);
 		else if (strcmpi(w1, "import") == 0)
 			map_config_read(w2);
 		else
@@ -4285,24 +4686,54 @@ int map_sql_close(void)
 	return 0;
 }
 
-int log_sql_init(void)
+/**
+ * Opens a pool of background connections to the map database
+ * @param connections: Number of connections, each served by its own thread
+ * @return Connected pool or NULL on failure
+ */
+SqlAsync* map_sql_async_connect(size_t connections)
 {
-	// log db connection
-	logmysql_handle = Sql_Malloc();
+	SqlAsync* pool = SqlAsync_Malloc();
+
+	if( SQL_ERROR == SqlAsync_Connect(pool, connections, map_server_id, map_server_pw, map_server_ip, map_server_port, map_server_db, default_codepage) ){
+		ShowError("Couldn't open background connections with uname='%s',passwd='%s',host='%s',port='%d',database='%s'\n",
+			map_server_id, map_server_pw, map_server_ip, map_server_port, map_server_db);
+		SqlAsync_Free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/**
+ * Opens a new connection to the log database, exits on failure
+ * @return Connected handle
+ */
+Sql* log_sql_connect(void)
+{
+	Sql* handle = Sql_Malloc();
 
 	ShowInfo("" CL_WHITE "[SQL]" CL_RESET ": Connecting to the Log Database " CL_WHITE "%s" CL_RESET " At " CL_WHITE "%s" CL_RESET "...\n",log_db_db,log_db_ip);
-	if ( SQL_ERROR == Sql_Connect(logmysql_handle, log_db_id, log_db_pw, log_db_ip, log_db_port, log_db_db) ){
+	if ( SQL_ERROR == Sql_Connect(handle, log_db_id, log_db_pw, log_db_ip, log_db_port, log_db_db) ){
 		ShowError("Couldn't connect with uname='%s',passwd='%s',host='%s',port='%d',database='%s'\n",
 			log_db_id, log_db_pw, log_db_ip, log_db_port, log_db_db);
-		Sql_ShowDebug(logmysql_handle);
-		Sql_Free(logmysql_handle);
+		Sql_ShowDebug(handle);
+		Sql_Free(handle);
 		exit(EXIT_FAILURE);
 	}
 	ShowStatus("" CL_WHITE "[SQL]" CL_RESET ": Successfully '" CL_GREEN "connected" CL_RESET "' to Database '" CL_WHITE "%s" CL_RESET "'.\n", log_db_db);
 
 	if( strlen(default_codepage) > 0 )
-		if ( SQL_ERROR == Sql_SetEncoding(logmysql_handle, default_codepage) )
-			Sql_ShowDebug(logmysql_handle);
+		if ( SQL_ERROR == Sql_SetEncoding(handle, default_codepage) )
+			Sql_ShowDebug(handle);
+
+	return handle;
+}
+
+int log_sql_init(void)
+{
+	// log db connection
+	logmysql_handle = log_sql_connect();
 
 	return 0;
 }
@@ -4738,6 +5169,18 @@ bool map_setmapflag_sub(int16 m, enum e_mapflag mapflag, bool status, union u_ma
 			} else
 				mapdata->flag[mapflag] = false;
 			break;
+		case MF_BLOCKSIZE:
+			if (status) {
+				nullpo_retr(false, args);
+
+				if (!map_setblocksize(m, args->flag_val))
+					return false;
+				mapdata->flag[mapflag] = args->flag_val;
+			} else {
+				map_setblocksize(m, BLOCK_SIZE);
+				mapdata->flag[mapflag] = false;
+			}
+			break;
 		case MF_JEXP:
 		case MF_BEXP:
 			if (status) {
@@ -4908,9 +5351,8 @@ void do_final(void){
 	for (int i = 0; i < map_num; i++) {
 		struct map_data *mapdata = map_getmapdata(i);
 
-		if(mapdata->cell) aFree(mapdata->cell);
-		if(mapdata->block) aFree(mapdata->block);
-		if(mapdata->block_mob) aFree(mapdata->block_mob);
+		map_cells_free(mapdata);
+		map_block_free(mapdata);
 		if(battle_config.dynamic_mobs) { //Dynamic mobs flag by [random]
 			if(mapdata->mob_delete_timer != INVALID_TIMER)
 				delete_timer(mapdata->mob_delete_timer, map_removemobs_timer);
@@ -4932,7 +5374,9 @@ void do_final(void){
 	charid_db->destroy(charid_db, NULL);
 	iwall_db->destroy(iwall_db, NULL);
 	regen_db->destroy(regen_db, NULL);
+	map_block_pool_final();
 
+	do_final_log();
 	map_sql_close();
 
 	ShowStatus("Finished.\n");
@@ -5173,19 +5617,21 @@ int do_init(int argc, char *argv[])
 	inter_config_read(INTER_CONF_NAME);
 	log_config_read(LOG_CONF_NAME);
 
-	id_db = idb_alloc(DB_OPT_BASE);
-	pc_db = idb_alloc(DB_OPT_BASE);	//Added for reliable map_id2sd() use. [Skotlex]
-	mobid_db = idb_alloc(DB_OPT_BASE);	//Added to lower the load of the lazy mob ai. [Skotlex]
+	id_db = idb_alloc(DB_OPT_OPEN_HASH);
+	pc_db = idb_alloc(DB_OPT_OPEN_HASH);	//Added for reliable map_id2sd() use. [Skotlex]
+	mobid_db = idb_alloc(DB_OPT_OPEN_HASH);	//Added to lower the load of the lazy mob ai. [Skotlex]
 	bossid_db = idb_alloc(DB_OPT_BASE); // Used for Convex Mirror quick MVP search
 	map_db = uidb_alloc(DB_OPT_BASE);
 	nick_db = idb_alloc(DB_OPT_BASE);
-	charid_db = uidb_alloc(DB_OPT_BASE);
-	regen_db = idb_alloc(DB_OPT_BASE); // efficient status_natural_heal processing
+	charid_db = uidb_alloc(DB_OPT_OPEN_HASH);
+	regen_db = idb_alloc(DB_OPT_OPEN_HASH); // efficient status_natural_heal processing
 	iwall_db = strdb_alloc(DB_OPT_RELEASE_DATA,2*NAME_LENGTH+2+1); // [Zephyrus] Invisible Walls
+	map_block_pool_init();
 
 	map_sql_init();
 	if (log_config.sql_logs)
 		log_sql_init();
+	do_init_log();
 
 	mapindex_init();
 	if(enable_grf)
@@ -10,6 +10,11 @@
 #include <unordered_map>
 #include <vector>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define MAP_BLOCK_SSE2
+#endif
+
 #include "../common/cbasetypes.hpp"
 #include "../common/core.hpp" // CORE_ST_LAST
 #include "../common/db.hpp"
@@ -19,6 +24,7 @@
 #include "../common/timer.hpp"
 #include "../config/core.hpp"
 
+#include "path.hpp"
 #include "script.hpp"
 
 struct npc_data;
@@ -43,6 +49,9 @@ void map_msg_reload(void);
 
 #define MAX_NPC_PER_MAP 512
 #define AREA_SIZE battle_config.area_size
+#define BLOCK_SIZE 8 // default size of a map block in cells
+#define BLOCK_SIZE_MIN 4 // smallest map block size allowed by the blocksize mapflag
+#define BLOCK_SIZE_MAX 64 // largest map block size allowed by the blocksize mapflag
 #define DAMAGELOG_SIZE 30
 #define LOOTITEM_SIZE 10
 #define MAX_MOBSKILL 50		//Max 128, see mob skill_idx type if need this higher
@@ -422,7 +431,8 @@ enum auto_trigger_flag {
 };
 
 struct block_list {
-	struct block_list *next,*prev;
+	struct block_list *prev; // non-NULL while the object is on a map
+	int block_index; // position inside its map block (see s_map_block)
 	int id;
 	int16 m,x,y;
 	enum bl_type type;
@@ -653,6 +663,7 @@ enum e_mapflag : int16 {
 	MF_NORENEWALDROPPENALTY,
 	MF_NOPETCAPTURE,
 	MF_NOBUYINGSTORE,
+	MF_BLOCKSIZE,
 	MF_MAX
 };
 
@@ -767,6 +778,17 @@ struct mapcell
 #endif
 };
 
+/// Cell flags that are also kept as bit planes, one bit per cell.
+/// Rows of a plane are padded to whole 64 bit words, so a row segment is tested 64 cells at a time.
+enum e_cell_plane : uint8 {
+	CELL_PLANE_WALKABLE = 0,
+	CELL_PLANE_SHOOTABLE,
+	CELL_PLANE_WATER,
+	CELL_PLANE_ICEWALL,
+	CELL_PLANE_LANDPROTECTOR,
+	CELL_PLANE_MAX
+};
+
 struct iwall_data {
 	char wall_name[50];
 	short m, x, y, size;
@@ -774,15 +796,30 @@ struct iwall_data {
 	bool shootable;
 };
 
+/// Objects of a map block, kept as parallel arrays so that area searches
+/// test the coordinates of a whole block from contiguous memory.
+/// Blocks are only allocated once an object enters them.
+struct s_map_block {
+	uint32 version; // changes whenever an object enters, leaves or moves inside the block
+	std::vector<int16> x, y;
+	std::vector<int> type;
+	std::vector<struct block_list*> bl;
+};
+
 struct map_data {
 	char name[MAP_NAME_LENGTH];
 	uint16 index; // The map index used by the mapindex* functions.
 	struct mapcell* cell; // Holds the information of each map cell (NULL if the map is not on this map-server).
-	struct block_list **block;
-	struct block_list **block_mob;
+	uint64* cell_planes; // Bit planes of the cells, see e_cell_plane (NULL if cell is NULL)
+	int16 cell_plane_words; // Number of 64 bit words in a row of a cell plane
+	uint32 cell_version; // Changes with every change of the cells, invalidates the cached paths of the map
+	struct s_path_regions* path_regions; // Walkable regions of the cells, see path_regions_build (NULL if not built yet)
+	struct s_map_block **block; // NULL entries are blocks that never held an object
+	struct s_map_block **block_mob;
 	int16 m;
 	int16 xs,ys; // map dimensions (in cells)
 	int16 bxs,bys; // map dimensions (in blocks)
+	int16 block_size; // size of a map block (in cells)
 	int16 bgscore_lion, bgscore_eagle; // Battleground ScoreBoard
 	int npc_num; // number total of npc on the map
 	int npc_num_area; // number of npc with a trigger area on the map
@@ -829,9 +866,84 @@ struct map_data_other_server {
 
 int map_getcell(int16 m,int16 x,int16 y,cell_chk cellchk);
 int map_getcellp(struct map_data* m,int16 x,int16 y,cell_chk cellchk);
+bool map_getcellrow(struct map_data* m, int16 y, int16 x0, int16 x1, cell_chk cellchk);
+bool map_getcellarea(struct map_data* m, int16 x0, int16 y0, int16 x1, int16 y1, cell_chk cellchk);
+
 void map_setcell(int16 m, int16 x, int16 y, cell_t cell, bool flag);
 void map_setgatcell(int16 m, int16 x, int16 y, int gat);
 
+/// Returns the word of a cell plane holding the cells x = w*64 to w*64+63 of row y
+inline uint64& map_cellplane_word(struct map_data* m, enum e_cell_plane plane, int16 y, int w) {
+	return m->cell_planes[((size_t)plane * m->ys + y) * m->cell_plane_words + w];
+}
+
+/// Cell planes answering a cell check: a cell matches if its bit in (a ^ a_mask) & (b ^ b_mask) is set
+struct s_cellplane_query {
+	const uint64* a;
+	const uint64* b;
+	uint64 a_mask;
+	uint64 b_mask;
+	int16 words; // words per row
+};
+
+/// Prepares a query of the cell planes for cellchk.
+/// Returns false if the map has no cell planes or cellchk can't be answered from them.
+inline bool map_cellplane_query(struct map_data* m, cell_chk cellchk, struct s_cellplane_query& query) {
+	enum e_cell_plane a, b;
+	bool a_inverted, b_inverted;
+
+	switch( cellchk ){
+		case CELL_CHKWALL:         a = CELL_PLANE_WALKABLE; a_inverted = true; b = CELL_PLANE_SHOOTABLE; b_inverted = true; break;
+		case CELL_CHKCLIFF:        a = CELL_PLANE_WALKABLE; a_inverted = true; b = CELL_PLANE_SHOOTABLE; b_inverted = false; break;
+		case CELL_CHKWATER:        a = b = CELL_PLANE_WATER; a_inverted = b_inverted = false; break;
+		case CELL_CHKICEWALL:      a = b = CELL_PLANE_ICEWALL; a_inverted = b_inverted = false; break;
+		case CELL_CHKLANDPROTECTOR: a = b = CELL_PLANE_LANDPROTECTOR; a_inverted = b_inverted = false; break;
+#ifndef CELL_NOSTACK
+		case CELL_CHKPASS:
+#endif
+		case CELL_CHKREACH:        a = b = CELL_PLANE_WALKABLE; a_inverted = b_inverted = false; break;
+#ifndef CELL_NOSTACK
+		case CELL_CHKNOPASS:
+#endif
+		case CELL_CHKNOREACH:      a = b = CELL_PLANE_WALKABLE; a_inverted = b_inverted = true; break;
+		default:
+			return false;
+	}
+
+	if( m->cell_planes == nullptr )
+		return false;
+
+	query.a = &map_cellplane_word(m, a, 0, 0);
+	query.b = &map_cellplane_word(m, b, 0, 0);
+	query.a_mask = a_inverted ? ~UINT64_C(0) : 0;
+	query.b_mask = b_inverted ? ~UINT64_C(0) : 0;
+	query.words = m->cell_plane_words;
+
+	return true;
+}
+
+/// Whether any cell of row y from x0 to x1 matches the query, see map_getcellrow.
+/// Does no bounds checks: x0 <= x1 and y have to be inside the map without its last row and column.
+inline bool map_cellplane_row(const struct s_cellplane_query& query, int16 y, int16 x0, int16 x1) {
+	size_t row = (size_t)y * query.words;
+	int w0 = x0 >> 6, w1 = x1 >> 6;
+	uint64 first = ~UINT64_C(0) << (x0 & 63);
+	uint64 last = ~UINT64_C(0) >> (63 - (x1 & 63));
+
+	if( w0 == w1 )
+		return ( ( query.a[row + w0] ^ query.a_mask ) & ( query.b[row + w0] ^ query.b_mask ) & first & last ) != 0;
+
+	if( ( query.a[row + w0] ^ query.a_mask ) & ( query.b[row + w0] ^ query.b_mask ) & first )
+		return true;
+
+	for( int w = w0 + 1; w < w1; w++ ){
+		if( ( query.a[row + w] ^ query.a_mask ) & ( query.b[row + w] ^ query.b_mask ) )
+			return true;
+	}
+
+	return ( ( query.a[row + w1] ^ query.a_mask ) & ( query.b[row + w1] ^ query.b_mask ) & last ) != 0;
+}
+
 extern struct map_data map[];
 extern int map_num;
 
@@ -1093,6 +1205,7 @@ int map_getusers(void);
 int map_usercount(void);
 
 // blocklist lock
+struct block_list* map_allocblock(enum bl_type type, int count = 1);
 int map_freeblock(struct block_list *bl);
 int map_freeblock_lock(void);
 int map_freeblock_unlock(void);
@@ -1100,6 +1213,8 @@ int map_freeblock_unlock(void);
 int map_addblock(struct block_list* bl);
 int map_delblock(struct block_list* bl);
 int map_moveblock(struct block_list *, int, int, t_tick);
+bool map_setblocksize(int16 m, int16 block_size);
+uint32 map_block_version(struct map_data* mapdata, int type, int16 x0, int16 y0, int16 x1, int16 y1);
 int map_foreachinrange(int (*func)(struct block_list*,va_list), struct block_list* center, int16 range, int type, ...);
 int map_foreachinallrange(int (*func)(struct block_list*,va_list), struct block_list* center, int16 range, int type, ...);
 int map_foreachinshootrange(int (*func)(struct block_list*,va_list), struct block_list* center, int16 range, int type, ...);
@@ -1116,6 +1231,228 @@ int map_foreachinmap(int (*func)(struct block_list*,va_list), int16 m, int type,
 //blocklist nb in one cell
 int map_count_oncell(int16 m,int16 x,int16 y,int type,int flag);
 struct skill_unit *map_find_skill_unit_oncell(struct block_list *,int16 x,int16 y,uint16 skill_id,struct skill_unit *, int flag);
+
+// Callable based area queries.
+// Unlike the va_list versions above they don't use the shared bl_list, so they are reentrant
+// and the filter and callback are inlined into the search.
+bool map_query_wall_check(void);
+
+/// Objects found by an area query.
+/// The first entries are kept on the stack, larger results spill to the heap.
+class MapQueryResult {
+private:
+	static const size_t INLINE_SIZE = 128;
+	struct block_list* inline_list[INLINE_SIZE];
+	std::vector<struct block_list*> heap_list;
+	size_t count = 0;
+
+public:
+	void push( struct block_list* bl ){
+		if( count < INLINE_SIZE ){
+			this->inline_list[count] = bl;
+		}else{
+			if( this->heap_list.empty() ){
+				this->heap_list.reserve( INLINE_SIZE * 2 );
+				this->heap_list.assign( this->inline_list, this->inline_list + INLINE_SIZE );
+			}
+			this->heap_list.push_back( bl );
+		}
+		this->count++;
+	}
+
+	size_t size() const{
+		return this->count;
+	}
+
+	struct block_list* operator[]( size_t i ) const{
+		return ( this->count > INLINE_SIZE ? this->heap_list[i] : this->inline_list[i] );
+	}
+};
+
+/// Calls add for every object of a block that lies inside (x0,y0)-(x1,y1) and matches type.
+template <typename F>
+void map_block_scan( const struct s_map_block& block, int type, int16 x0, int16 y0, int16 x1, int16 y1, F&& add ){
+	size_t count = block.bl.size(), i = 0;
+
+#ifdef MAP_BLOCK_SSE2
+	// Bounds are within the map, so widening them by one can't overflow
+	const __m128i lx = _mm_set1_epi16( x0 - 1 ), hx = _mm_set1_epi16( x1 + 1 );
+	const __m128i ly = _mm_set1_epi16( y0 - 1 ), hy = _mm_set1_epi16( y1 + 1 );
+
+	for( ; i + 8 <= count; i += 8 ){
+		__m128i vx = _mm_loadu_si128( (const __m128i*)&block.x[i] );
+		__m128i vy = _mm_loadu_si128( (const __m128i*)&block.y[i] );
+		__m128i in = _mm_and_si128( _mm_and_si128( _mm_cmpgt_epi16( vx, lx ), _mm_cmplt_epi16( vx, hx ) ),
+		                            _mm_and_si128( _mm_cmpgt_epi16( vy, ly ), _mm_cmplt_epi16( vy, hy ) ) );
+		int mask = _mm_movemask_epi8( in );
+
+		if( mask == 0 )
+			continue;
+		for( size_t j = 0; j < 8; j++ ){
+			if( mask&( 1 << ( j * 2 ) ) && block.type[i + j]&type )
+				add( block.bl[i + j] );
+		}
+	}
+#endif
+
+	for( ; i < count; i++ ){
+		if( block.x[i] >= x0 && block.x[i] <= x1 && block.y[i] >= y0 && block.y[i] <= y1 && block.type[i]&type )
+			add( block.bl[i] );
+	}
+}
+
+/// Calls add for every object of the given type inside (x0,y0)-(x1,y1).
+/// The area must already be clipped to the map.
+template <typename F>
+void map_block_foreach( struct map_data* mapdata, int type, int16 x0, int16 y0, int16 x1, int16 y1, F&& add ){
+	int16 bsize = mapdata->block_size;
+
+	if( type&~BL_MOB ){
+		for( int by = y0 / bsize; by <= y1 / bsize; by++ ){
+			for( int bx = x0 / bsize; bx <= x1 / bsize; bx++ ){
+				const struct s_map_block* block = mapdata->block[bx + by * mapdata->bxs];
+
+				if( block != nullptr )
+					map_block_scan( *block, type, x0, y0, x1, y1, add );
+			}
+		}
+	}
+
+	if( type&BL_MOB ){
+		for( int by = y0 / bsize; by <= y1 / bsize; by++ ){
+			for( int bx = x0 / bsize; bx <= x1 / bsize; bx++ ){
+				const struct s_map_block* block = mapdata->block_mob[bx + by * mapdata->bxs];
+
+				if( block != nullptr )
+					map_block_scan( *block, type, x0, y0, x1, y1, add );
+			}
+		}
+	}
+}
+
+/// Calls func for every collected object that is still on the map and sums up the results.
+template <typename F>
+int map_query_call( const MapQueryResult& result, F&& func ){
+	int returnCount = 0;
+
+	map_freeblock_lock();
+
+	for( size_t i = 0; i < result.size(); i++ ){
+		// func() may delete this object, checking for prev ensures it wasn't queued for deletion.
+		if( result[i]->prev )
+			returnCount += func( result[i] );
+	}
+
+	map_freeblock_unlock();
+
+	return returnCount;
+}
+
+/// Calls func for every object of the given type in range of center.
+/// @param wall_check: only objects in line of sight of center
+template <typename F>
+int map_query_range( struct block_list* center, int16 range, int type, bool wall_check, F&& func ){
+	if( center->m < 0 )
+		return 0;
+
+	struct map_data* mapdata = map_getmapdata( center->m );
+
+	if( mapdata == nullptr || mapdata->block == nullptr )
+		return 0;
+
+	int16 x0 = i16max( center->x - range, 0 );
+	int16 y0 = i16max( center->y - range, 0 );
+	int16 x1 = i16min( center->x + range, mapdata->xs - 1 );
+	int16 y1 = i16min( center->y + range, mapdata->ys - 1 );
+	MapQueryResult result;
+
+	// Lines between cells of the area never leave it, without any wall there is nothing to check
+	if( wall_check && !map_getcellarea( mapdata, x0, y0, x1, y1, CELL_CHKWALL ) )
+		wall_check = false;
+
+	map_block_foreach( mapdata, type, x0, y0, x1, y1, [&]( struct block_list* bl ){
+#ifdef CIRCULAR_AREA
+		if( !check_distance_bl( center, bl, range ) )
+			return;
+#endif
+		if( !wall_check || path_search_long( nullptr, center->m, center->x, center->y, bl->x, bl->y, CELL_CHKWALL ) )
+			result.push( bl );
+	} );
+
+	return map_query_call( result, func );
+}
+
+/// Calls func for every object of the given type inside (x0,y0)-(x1,y1) of map m.
+/// @param wall_check: only objects in line of sight of the center of the area
+template <typename F>
+int map_query_area( int16 m, int16 x0, int16 y0, int16 x1, int16 y1, int type, bool wall_check, F&& func ){
+	if( m < 0 )
+		return 0;
+
+	struct map_data* mapdata = map_getmapdata( m );
+
+	if( mapdata == nullptr || mapdata->block == nullptr )
+		return 0;
+
+	if( x1 < x0 )
+		std::swap( x0, x1 );
+	if( y1 < y0 )
+		std::swap( y0, y1 );
+
+	x0 = i16max( x0, 0 );
+	y0 = i16max( y0, 0 );
+	x1 = i16min( x1, mapdata->xs - 1 );
+	y1 = i16min( y1, mapdata->ys - 1 );
+
+	int16 cx = x0 + ( x1 - x0 ) / 2;
+	int16 cy = y0 + ( y1 - y0 ) / 2;
+	MapQueryResult result;
+
+	if( wall_check && !map_getcellarea( mapdata, x0, y0, x1, y1, CELL_CHKWALL ) )
+		wall_check = false;
+
+	map_block_foreach( mapdata, type, x0, y0, x1, y1, [&]( struct block_list* bl ){
+		if( !wall_check || path_search_long( nullptr, m, cx, cy, bl->x, bl->y, CELL_CHKWALL ) )
+			result.push( bl );
+	} );
+
+	return map_query_call( result, func );
+}
+
+template <typename F>
+int map_foreachinrange( struct block_list* center, int16 range, int type, F&& func ){
+	return map_query_range( center, range, type, map_query_wall_check(), func );
+}
+
+template <typename F>
+int map_foreachinallrange( struct block_list* center, int16 range, int type, F&& func ){
+	return map_query_range( center, range, type, false, func );
+}
+
+template <typename F>
+int map_foreachinshootrange( struct block_list* center, int16 range, int type, F&& func ){
+	return map_query_range( center, range, type, true, func );
+}
+
+template <typename F>
+int map_foreachinarea( int16 m, int16 x0, int16 y0, int16 x1, int16 y1, int type, F&& func ){
+	return map_query_area( m, x0, y0, x1, y1, type, map_query_wall_check(), func );
+}
+
+template <typename F>
+int map_foreachinallarea( int16 m, int16 x0, int16 y0, int16 x1, int16 y1, int type, F&& func ){
+	return map_query_area( m, x0, y0, x1, y1, type, false, func );
+}
+
+template <typename F>
+int map_foreachinshootarea( int16 m, int16 x0, int16 y0, int16 x1, int16 y1, int type, F&& func ){
+	return map_query_area( m, x0, y0, x1, y1, type, true, func );
+}
+
+template <typename F>
+int map_foreachincell( int16 m, int16 x, int16 y, int type, F&& func ){
+	return map_query_area( m, x, y, x, y, type, false, func );
+}
 // search and creation
 int map_get_new_object_id(void);
 int map_search_freecell(struct block_list *src, int16 m, int16 *x, int16 *y, int16 rx, int16 ry, int flag);
@@ -1270,6 +1607,9 @@ extern Sql* mmysql_handle;
 extern Sql* qsmysql_handle;
 extern Sql* logmysql_handle;
 
+SqlAsync* map_sql_async_connect(size_t connections);
+Sql* log_sql_connect(void);
+
 extern char barter_table[32];
 extern char buyingstores_table[32];
 extern char buyingstore_items_table[32];
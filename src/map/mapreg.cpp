@@ -3,7 +3,10 @@
 
 #include "mapreg.hpp"
 
+#include <algorithm>
 #include <stdlib.h>
+#include <unordered_set>
+#include <vector>
 
 #include "../common/cbasetypes.hpp"
 #include "../common/db.hpp"
@@ -22,11 +25,39 @@ static struct eri *mapreg_ers;
 bool skip_insert = false;
 
 static char mapreg_table[32] = "mapreg";
-static bool mapreg_dirty = false; // Whether there are modified regs to be saved
+static std::unordered_set<int64> mapreg_dirty; // Permanent regs modified or removed since the last flush
 struct reg_db regs;
+struct s_mapreg_stats mapreg_stats;
 
-#define MAPREG_AUTOSAVE_INTERVAL (300*1000)
+static int mapreg_flush_interval = 1000; // Milliseconds between flushes of the modified regs
+static bool mapreg_flush_async = true; // Whether to flush on a background connection
+static SqlAsync* mapreg_async = NULL;
 
+/// Maximum number of rows written by a single statement
+#define MAPREG_FLUSH_ROWS 500
+
+/// Statement sent by a flush
+struct s_mapreg_batch {
+	t_tick start;
+	uint32 rows;
+	bool remove;
+	std::vector<int64> uids; ///< Variables written by the statement
+};
+
+
+/**
+ * Marks a permanent variable to be written by the next flush.
+ *
+ * @param uid: variable's unique identifier
+ * @param name: variable's name
+ */
+static void mapreg_setdirty(int64 uid, const char* name)
+{
+	if (name[1] == '@' || skip_insert)
+		return; // temporary variable, or loaded from the database
+
+	mapreg_dirty.insert(uid);
+}
 
 /**
  * Looks up the value of an integer variable using its uid.
@@ -69,10 +100,6 @@ bool mapreg_setreg(int64 uid, int64 val)
 	if (val != 0) {
 		if ((m = static_cast<mapreg_save *>(i64db_get(regs.vars, uid)))) {
 			m->u.i = val;
-			if (name[1] != '@') {
-				m->save = true;
-				mapreg_dirty = true;
-			}
 		} else {
 			if (i)
 				script_array_update(&regs, uid, false);
@@ -81,15 +108,8 @@ bool mapreg_setreg(int64 uid, int64 val)
 
 			m->u.i = val;
 			m->uid = uid;
-			m->save = false;
 			m->is_string = false;
 
-			if (name[1] != '@' && !skip_insert) {// write new variable to database
-				char esc_name[32 * 2 + 1];
-				Sql_EscapeStringLen(mmysql_handle, esc_name, name, strnlen(name, 32));
-				if (SQL_ERROR == Sql_Query(mmysql_handle, "INSERT INTO `%s`(`varname`,`index`,`value`) VALUES ('%s','%" PRIu32 "','%" PRId64 "')", mapreg_table, esc_name, i, val))
-					Sql_ShowDebug(mmysql_handle);
-			}
 			i64db_put(regs.vars, uid, m);
 		}
 	} else { // val == 0
@@ -99,15 +119,10 @@ bool mapreg_setreg(int64 uid, int64 val)
 			ers_free(mapreg_ers, m);
 		}
 		i64db_remove(regs.vars, uid);
-
-		if (name[1] != '@') {// Remove from database because it is unused.
-			char esc_name[32 * 2 + 1];
-			Sql_EscapeStringLen(mmysql_handle, esc_name, name, strnlen(name, 32));
-			if (SQL_ERROR == Sql_Query(mmysql_handle, "DELETE FROM `%s` WHERE `varname`='%s' AND `index`='%" PRIu32 "'", mapreg_table, esc_name, i))
-				Sql_ShowDebug(mmysql_handle);
-		}
 	}
 
+	mapreg_setdirty(uid, name);
+
 	return true;
 }
 
@@ -128,12 +143,6 @@ bool mapreg_setregstr(int64 uid, const char* str)
 	if (str == NULL || *str == 0) {
 		if (i)
 			script_array_update(&regs, uid, true);
-		if (name[1] != '@') {
-			char esc_name[32 * 2 + 1];
-			Sql_EscapeStringLen(mmysql_handle, esc_name, name, strnlen(name, 32));
-			if (SQL_ERROR == Sql_Query(mmysql_handle, "DELETE FROM `%s` WHERE `varname`='%s' AND `index`='%" PRIu32 "'", mapreg_table, esc_name, i))
-				Sql_ShowDebug(mmysql_handle);
-		}
 		if ((m = static_cast<mapreg_save *>(i64db_get(regs.vars, uid)))) {
 			if (m->u.str != NULL)
 				aFree(m->u.str);
@@ -145,10 +154,6 @@ bool mapreg_setregstr(int64 uid, const char* str)
 			if (m->u.str != NULL)
 				aFree(m->u.str);
 			m->u.str = aStrdup(str);
-			if (name[1] != '@') {
-				mapreg_dirty = true;
-				m->save = true;
-			}
 		} else {
 			if (i)
 				script_array_update(&regs, uid, false);
@@ -157,21 +162,14 @@ bool mapreg_setregstr(int64 uid, const char* str)
 
 			m->uid = uid;
 			m->u.str = aStrdup(str);
-			m->save = false;
 			m->is_string = true;
 
-			if (name[1] != '@' && !skip_insert) { //put returned null, so we must insert.
-				char esc_name[32 * 2 + 1];
-				char esc_str[255 * 2 + 1];
-				Sql_EscapeStringLen(mmysql_handle, esc_name, name, strnlen(name, 32));
-				Sql_EscapeStringLen(mmysql_handle, esc_str, str, strnlen(str, 255));
-				if (SQL_ERROR == Sql_Query(mmysql_handle, "INSERT INTO `%s`(`varname`,`index`,`value`) VALUES ('%s','%" PRIu32 "','%s')", mapreg_table, esc_name, i, esc_str))
-					Sql_ShowDebug(mmysql_handle);
-			}
 			i64db_put(regs.vars, uid, m);
 		}
 	}
 
+	mapreg_setdirty(uid, name);
+
 	return true;
 }
 
@@ -224,41 +222,182 @@ static void script_load_mapreg(void)
 	SqlStmt_Free(stmt);
 
 	skip_insert = false;
-	mapreg_dirty = false;
 }
 
 /**
- * Saves permanent variables to database.
+ * Accounts a statement sent by a flush once it has completed.
+ *
+ * @param batch: statement that was sent
+ * @param success: whether the statement succeeded
+ */
+static void mapreg_flush_complete(struct s_mapreg_batch* batch, bool success)
+{
+	t_tick latency = DIFF_TICK(gettick(), batch->start);
+
+	if (success) {
+		if (batch->remove)
+			mapreg_stats.deleted += batch->rows;
+		else
+			mapreg_stats.upserted += batch->rows;
+	} else {
+		mapreg_stats.failed += batch->rows;
+
+		// Written again by the next flush, with their current value.
+		// Variables that were modified meanwhile are already marked.
+		mapreg_dirty.insert(batch->uids.begin(), batch->uids.end());
+	}
+
+	mapreg_stats.statements++;
+	mapreg_stats.latency_total += latency;
+	mapreg_stats.latency_max = i64max(mapreg_stats.latency_max, latency);
+
+	delete batch;
+}
+
+/**
+ * Completion callback of a statement sent on the background connection.
+ */
+static void mapreg_flush_callback(SqlAsyncResult* result, intptr_t data)
+{
+	if (SQL_ERROR == SqlAsyncResult_Status(result))
+		SqlAsyncResult_ShowDebug(result);
+
+	mapreg_flush_complete(reinterpret_cast<s_mapreg_batch*>(data), SQL_SUCCESS == SqlAsyncResult_Status(result));
+}
+
+/**
+ * Sends a statement built by a flush and empties the buffer and the uid list.
+ *
+ * @param buf: statement
+ * @param uids: variables written by the statement
+ * @param remove: whether the rows are deleted
+ */
+static void mapreg_flush_send(StringBuf* buf, std::vector<int64>& uids, bool remove)
+{
+	struct s_mapreg_batch* batch = new s_mapreg_batch();
+
+	batch->start = gettick();
+	batch->rows = (uint32)uids.size();
+	batch->remove = remove;
+	batch->uids.swap(uids);
+
+	if (mapreg_async != NULL) {
+		SqlAsyncQuery* query = SqlAsyncQuery_Malloc();
+
+		// A single key keeps the statements in order
+		if (SQL_SUCCESS == SqlAsyncQuery_Prepare(query, "%s", StringBuf_Value(buf))
+		 && SQL_SUCCESS == SqlAsync_Execute(mapreg_async, query, 1, mapreg_flush_callback, reinterpret_cast<intptr_t>(batch))) {
+			StringBuf_Clear(buf);
+			return;
+		}
+		mapreg_flush_complete(batch, false);
+	} else {
+		bool success = (SQL_SUCCESS == Sql_QueryStr(mmysql_handle, StringBuf_Value(buf)));
+
+		if (!success)
+			Sql_ShowDebug(mmysql_handle);
+		mapreg_flush_complete(batch, success);
+	}
+
+	StringBuf_Clear(buf);
+}
+
+/**
+ * Saves the modified permanent variables to database.
+ *
+ * Existing variables are written with multi-row upserts, removed ones with
+ * a DELETE per batch, grouped by name so that the primary key is used.
  */
 static void script_save_mapreg(void)
 {
-	if (mapreg_dirty) {
-		DBIterator *iter = db_iterator(regs.vars);
-		struct mapreg_save *m;
-		for (m = static_cast<mapreg_save *>(dbi_first(iter)); dbi_exists(iter); m = static_cast<mapreg_save *>(dbi_next(iter))) {
-			if (m->save) {
-				int num = script_getvarid(m->uid);
-				uint32 i = script_getvaridx(m->uid);
-				const char* name = get_str(num);
-				if (!m->is_string) {
-					char esc_name[32 * 2 + 1];
-					Sql_EscapeStringLen(mmysql_handle, esc_name, name, strnlen(name, 32));
-					if (SQL_ERROR == Sql_Query(mmysql_handle, "UPDATE `%s` SET `value`='%" PRId64 "' WHERE `varname`='%s' AND `index`='%" PRIu32 "' LIMIT 1", mapreg_table, m->u.i, esc_name, i))
-						Sql_ShowDebug(mmysql_handle);
-				} else {
-					char esc_str[2 * 255 + 1];
-					char esc_name[32 * 2 + 1];
-					Sql_EscapeStringLen(mmysql_handle, esc_name, name, strnlen(name, 32));
-					Sql_EscapeStringLen(mmysql_handle, esc_str, m->u.str, safestrnlen(m->u.str, 255));
-					if (SQL_ERROR == Sql_Query(mmysql_handle, "UPDATE `%s` SET `value`='%s' WHERE `varname`='%s' AND `index`='%" PRIu32 "' LIMIT 1", mapreg_table, esc_str, esc_name, i))
-						Sql_ShowDebug(mmysql_handle);
-				}
-				m->save = false;
+	if (mapreg_dirty.empty())
+		return;
+
+	std::vector<int64> uids(mapreg_dirty.begin(), mapreg_dirty.end());
+	StringBuf upsert, remove;
+	std::vector<int64> upsert_uids, remove_uids;
+	int remove_var = -1;
+
+	mapreg_dirty.clear();
+	mapreg_stats.flushes++;
+
+	// Order by variable, then by index
+	std::sort(uids.begin(), uids.end(), [](int64 a, int64 b) {
+		if (script_getvarid(a) != script_getvarid(b))
+			return script_getvarid(a) < script_getvarid(b);
+		return script_getvaridx(a) < script_getvaridx(b);
+	});
+
+	StringBuf_Init(&upsert);
+	StringBuf_Init(&remove);
+
+	for (int64 uid : uids) {
+		int num = script_getvarid(uid);
+		uint32 i = script_getvaridx(uid);
+		const char* name = get_str(num);
+		struct mapreg_save *m = static_cast<mapreg_save *>(i64db_get(regs.vars, uid));
+		char esc_name[32 * 2 + 1];
+
+		Sql_EscapeStringLen(mmysql_handle, esc_name, name, strnlen(name, 32));
+
+		if (m != NULL) {
+			if (upsert_uids.empty())
+				StringBuf_Printf(&upsert, "INSERT INTO `%s`(`varname`,`index`,`value`) VALUES ", mapreg_table);
+			else
+				StringBuf_AppendStr(&upsert, ",");
+
+			if (!m->is_string)
+				StringBuf_Printf(&upsert, "('%s','%" PRIu32 "','%" PRId64 "')", esc_name, i, m->u.i);
+			else {
+				char esc_str[2 * 255 + 1];
+
+				Sql_EscapeStringLen(mmysql_handle, esc_str, m->u.str, safestrnlen(m->u.str, 255));
+				StringBuf_Printf(&upsert, "('%s','%" PRIu32 "','%s')", esc_name, i, esc_str);
+			}
+
+			upsert_uids.push_back(uid);
+			if (upsert_uids.size() == MAPREG_FLUSH_ROWS) {
+				StringBuf_AppendStr(&upsert, " ON DUPLICATE KEY UPDATE `value`=VALUES(`value`)");
+				mapreg_flush_send(&upsert, upsert_uids, false);
+			}
+		} else {
+			if (remove_uids.empty()) {
+				StringBuf_Printf(&remove, "DELETE FROM `%s` WHERE (`varname`='%s' AND `index` IN ('%" PRIu32 "'", mapreg_table, esc_name, i);
+				remove_var = num;
+			} else if (remove_var != num) {
+				StringBuf_Printf(&remove, ")) OR (`varname`='%s' AND `index` IN ('%" PRIu32 "'", esc_name, i);
+				remove_var = num;
+			} else
+				StringBuf_Printf(&remove, ",'%" PRIu32 "'", i);
+
+			remove_uids.push_back(uid);
+			if (remove_uids.size() == MAPREG_FLUSH_ROWS) {
+				StringBuf_AppendStr(&remove, "))");
+				mapreg_flush_send(&remove, remove_uids, true);
 			}
 		}
-		dbi_destroy(iter);
-		mapreg_dirty = false;
 	}
+
+	if (!upsert_uids.empty()) {
+		StringBuf_AppendStr(&upsert, " ON DUPLICATE KEY UPDATE `value`=VALUES(`value`)");
+		mapreg_flush_send(&upsert, upsert_uids, false);
+	}
+	if (!remove_uids.empty()) {
+		StringBuf_AppendStr(&remove, "))");
+		mapreg_flush_send(&remove, remove_uids, true);
+	}
+
+	StringBuf_Destroy(&upsert);
+	StringBuf_Destroy(&remove);
+}
+
+/**
+ * Waits until the flushed variables have been written.
+ */
+static void mapreg_flush_wait(void)
+{
+	if (mapreg_async != NULL)
+		SqlAsync_Wait(mapreg_async);
 }
 
 /**
@@ -301,6 +440,7 @@ int mapreg_destroyreg(DBKey key, DBData *data, va_list ap)
 void mapreg_reload(void)
 {
 	script_save_mapreg();
+	mapreg_flush_wait();
 
 	regs.vars->clear(regs.vars, mapreg_destroyreg);
 
@@ -319,6 +459,19 @@ void mapreg_final(void)
 {
 	script_save_mapreg();
 
+	if (mapreg_async != NULL) {
+		SqlAsync_Free(mapreg_async); // waits for the pending statements
+		mapreg_async = NULL;
+
+		// Last attempt for the statements that failed, on the main connection
+		script_save_mapreg();
+	}
+
+	if (mapreg_stats.statements > 0)
+		ShowInfo("Mapreg: %" PRIu64 " rows written, %" PRIu64 " deleted, %" PRIu64 " failed in %" PRIu64 " flushes (%" PRIu64 " statements, %" PRId64 " ms average, %" PRId64 " ms max).\n",
+			mapreg_stats.upserted, mapreg_stats.deleted, mapreg_stats.failed, mapreg_stats.flushes, mapreg_stats.statements,
+			mapreg_stats.latency_total / static_cast<t_tick>(mapreg_stats.statements), mapreg_stats.latency_max);
+
 	regs.vars->destroy(regs.vars, mapreg_destroyreg);
 
 	ers_destroy(mapreg_ers);
@@ -340,8 +493,11 @@ void mapreg_init(void)
 
 	script_load_mapreg();
 
+	if (mapreg_flush_async && (mapreg_async = map_sql_async_connect(1)) == NULL)
+		ShowWarning("mapreg_init: Saving permanent global variables on the main connection instead.\n");
+
 	add_timer_func_list(script_autosave_mapreg, "script_autosave_mapreg");
-	add_timer_interval(gettick() + MAPREG_AUTOSAVE_INTERVAL, script_autosave_mapreg, 0, 0, MAPREG_AUTOSAVE_INTERVAL);
+	add_timer_interval(gettick() + mapreg_flush_interval, script_autosave_mapreg, 0, 0, mapreg_flush_interval);
 }
 
 /**
@@ -351,6 +507,10 @@ bool mapreg_config_read(const char* w1, const char* w2)
 {
 	if(!strcmpi(w1, "mapreg_table"))
 		safestrncpy(mapreg_table, w2, sizeof(mapreg_table));
+	else if(!strcmpi(w1, "mapreg_flush_interval"))
+		mapreg_flush_interval = i32max(atoi(w2), 100);
+	else if(!strcmpi(w1, "mapreg_flush_async"))
+		mapreg_flush_async = config_switch(w2) != 0;
 	else
 		return false;
 
@@ -6,6 +6,7 @@
 
 #include "../common/cbasetypes.hpp"
 #include "../common/db.hpp"
+#include "../common/timer.hpp" // t_tick
 
 struct mapreg_save {
 	int64 uid;         ///< Unique ID
@@ -14,11 +15,22 @@ struct mapreg_save {
 		char *str;     ///< String value
 	} u;
 	bool is_string;    ///< true if it's a string, false if it's a number
-	bool save;         ///< Whether a save operation is pending
+};
+
+/// Counters of the permanent variable flushes
+struct s_mapreg_stats {
+	uint64 upserted;      ///< Rows inserted or updated
+	uint64 deleted;       ///< Rows deleted
+	uint64 failed;        ///< Rows of statements that failed
+	uint64 flushes;       ///< Flushes that had modified variables
+	uint64 statements;    ///< Statements sent
+	t_tick latency_total; ///< Sum of the statement latencies, in milliseconds
+	t_tick latency_max;   ///< Highest statement latency, in milliseconds
 };
 
 extern struct reg_db regs;
 extern bool skip_insert;
+extern struct s_mapreg_stats mapreg_stats;
 
 void mapreg_reload(void);
 void mapreg_final(void);
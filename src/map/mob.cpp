@@ -8,6 +8,7 @@
 #include <math.h>
 #include <stdlib.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "../common/cbasetypes.hpp"
@@ -19,6 +20,7 @@
 #include "../common/showmsg.hpp"
 #include "../common/socket.hpp"
 #include "../common/strlib.hpp"
+#include "../common/thread_pool.hpp"
 #include "../common/timer.hpp"
 #include "../common/utilities.hpp"
 #include "../common/utils.hpp"
@@ -193,7 +195,7 @@ void mvptomb_create(struct mob_data *md, char *killer, time_t time)
 	if ( md->tomb_nid )
 		mvptomb_destroy(md);
 
-	CREATE(nd, struct npc_data, 1);
+	nd = (struct npc_data*)map_allocblock(BL_NPC);
 
 	nd->bl.id = md->tomb_nid = npc_get_new_npc_id();
 
@@ -249,7 +251,7 @@ void mvptomb_destroy(struct mob_data *md) {
 			mapdata->npc[mapdata->npc_num] = NULL;
 		}
 		map_deliddb(&nd->bl);
-		aFree(nd);
+		map_freeblock(&nd->bl);
 	}
 
 	md->tomb_nid = 0;
@@ -449,7 +451,7 @@ int mob_parse_dataset(struct spawn_data *data)
  *------------------------------------------*/
 struct mob_data* mob_spawn_dataset(struct spawn_data *data)
 {
-	struct mob_data *md = (struct mob_data*)aCalloc(1, sizeof(struct mob_data));
+	struct mob_data *md = (struct mob_data*)map_allocblock(BL_MOB);
 	md->bl.id= npc_get_new_npc_id();
 	md->bl.type = BL_MOB;
 	md->bl.m = data->m;
@@ -1259,17 +1261,11 @@ int mob_target(struct mob_data *md,struct block_list *bl,int dist)
 /*==========================================
  * The ?? routine of an active monster
  *------------------------------------------*/
-static int mob_ai_sub_hard_activesearch(struct block_list *bl,va_list ap)
+static int mob_ai_sub_hard_activesearch(struct block_list *bl, struct mob_data *md, struct block_list **target, enum e_mode mode)
 {
-	struct mob_data *md;
-	struct block_list **target;
-	enum e_mode mode;
 	int dist;
 
 	nullpo_ret(bl);
-	md=va_arg(ap,struct mob_data *);
-	target= va_arg(ap,struct block_list**);
-	mode= static_cast<enum e_mode>(va_arg(ap, int));
 
 	//If can't seek yet, not an enemy, or you can't attack it, skip.
 	if ((*target) == bl || !status_check_skilluse(&md->bl, bl, 0, 0))
@@ -1684,6 +1680,67 @@ int mob_warpchase(struct mob_data *md, struct block_list *target)
 /*==========================================
  * AI of MOB whose is near a Player
  *------------------------------------------*/
+/// Mob that thinks in the current parallel AI tick
+struct s_mob_ai_think {
+	struct mob_data* md;
+	uint32 char_id; // player that spotted the mob first
+	int view_range; // view range of the prefetched target search, 0 if there was none
+	size_t targets_begin, targets_end; // prefetched targets in s_mob_ai_map::targets
+	uint32 targets_version; // map_block_version of the searched area when it was prefetched
+};
+
+/// Mob AI work of one map, prepared by the AI threads and applied on the main thread
+struct s_mob_ai_map {
+	int16 m;
+	std::vector<struct map_session_data*> players; // players of the map, in map_foreachpc order
+	std::vector<s_mob_ai_think> mobs;
+	std::vector<struct block_list*> targets;
+};
+
+static ThreadPool mob_ai_pool;
+static std::vector<s_mob_ai_map> mob_ai_maps;
+static std::unordered_map<int16, size_t> mob_ai_map_index;
+static const s_mob_ai_think* mob_ai_prefetch = nullptr; // mob currently applied by mob_ai_parallel
+static const s_mob_ai_map* mob_ai_prefetch_map = nullptr;
+
+/**
+ * Runs the aggressive target search on the targets prefetched by the AI threads.
+ * Targets that left the view range or the map in the meantime are skipped.
+ */
+static void mob_ai_sub_hard_prefetched(struct mob_data *md, struct block_list **target, int view_range, enum e_mode mode)
+{
+	for( size_t i = mob_ai_prefetch->targets_begin; i < mob_ai_prefetch->targets_end; i++ ){
+		struct block_list* bl = mob_ai_prefetch_map->targets[i];
+
+		if( bl->prev == nullptr || bl->m != md->bl.m || abs(bl->x - md->bl.x) > view_range || abs(bl->y - md->bl.y) > view_range )
+			continue;
+#ifdef CIRCULAR_AREA
+		if( !check_distance_bl(&md->bl, bl, view_range) )
+			continue;
+#endif
+		mob_ai_sub_hard_activesearch(bl, md, target, mode);
+	}
+}
+
+/**
+ * Checks if the prefetched target search of a mob can still be used.
+ * Any unit that entered, left or moved in the searched area since, including the mob itself,
+ * makes the mob search the area again.
+ */
+static bool mob_ai_prefetch_isvalid(struct mob_data *md, int view_range)
+{
+	if( mob_ai_prefetch == nullptr || mob_ai_prefetch->md != md || mob_ai_prefetch->view_range != view_range || md->bl.m != mob_ai_prefetch_map->m )
+		return false;
+
+	struct map_data *mapdata = map_getmapdata(md->bl.m);
+	int16 x0 = i16max(md->bl.x - view_range, 0);
+	int16 y0 = i16max(md->bl.y - view_range, 0);
+	int16 x1 = i16min(md->bl.x + view_range, mapdata->xs - 1);
+	int16 y1 = i16min(md->bl.y + view_range, mapdata->ys - 1);
+
+	return map_block_version(mapdata, DEFAULT_ENEMY_TYPE(md), x0, y0, x1, y1) == mob_ai_prefetch->targets_version;
+}
+
 static bool mob_ai_sub_hard(struct mob_data *md, t_tick tick)
 {
 	struct block_list *tbl = nullptr, *abl = nullptr;
@@ -1826,7 +1883,12 @@ static bool mob_ai_sub_hard(struct mob_data *md, t_tick tick)
 
 	if ((mode&MD_AGGRESSIVE && (!tbl || slave_lost_target)) || md->state.skillstate == MSS_FOLLOW)
 	{
-		map_foreachinallrange (mob_ai_sub_hard_activesearch, &md->bl, view_range, DEFAULT_ENEMY_TYPE(md), md, &tbl, mode);
+		if( mob_ai_prefetch_isvalid(md, view_range) )
+			mob_ai_sub_hard_prefetched(md, &tbl, view_range, static_cast<enum e_mode>(mode));
+		else
+			map_foreachinallrange(&md->bl, view_range, DEFAULT_ENEMY_TYPE(md), [&](struct block_list *bl) {
+				return mob_ai_sub_hard_activesearch(bl, md, &tbl, static_cast<enum e_mode>(mode));
+			});
 	}
 	else
 	if (mode&MD_CHANGECHASE && (md->state.skillstate == MSS_RUSH || md->state.skillstate == MSS_FOLLOW))
@@ -2002,6 +2064,135 @@ static int mob_ai_sub_foreachclient(struct map_session_data *sd,va_list ap)
 	return 0;
 }
 
+/*==========================================
+ * Groups the players by map for mob_ai_parallel
+ *------------------------------------------*/
+static int mob_ai_parallel_collect(struct map_session_data *sd, va_list ap)
+{
+	if( sd->bl.prev == nullptr || sd->bl.m < 0 )
+		return 0;
+
+	auto it = mob_ai_map_index.find(sd->bl.m);
+	size_t index;
+
+	if( it == mob_ai_map_index.end() ){
+		index = mob_ai_map_index.size();
+		mob_ai_map_index[sd->bl.m] = index;
+
+		if( index == mob_ai_maps.size() )
+			mob_ai_maps.emplace_back();
+
+		s_mob_ai_map& ai = mob_ai_maps[index];
+
+		ai.m = sd->bl.m;
+		ai.players.clear();
+		ai.mobs.clear();
+		ai.targets.clear();
+	}else
+		index = it->second;
+
+	mob_ai_maps[index].players.push_back(sd);
+
+	return 0;
+}
+
+/*==========================================
+ * Prepares the mob AI of a map on an AI thread.
+ * Only reads the map, collects the mobs in the vicinity of its players
+ * (the same ones mob_ai_sub_foreachclient visits) and prefetches the area
+ * scan of their aggressive target search.
+ *------------------------------------------*/
+static void mob_ai_parallel_prepare(s_mob_ai_map& ai, t_tick tick)
+{
+	struct map_data *mapdata = map_getmapdata(ai.m);
+	std::unordered_set<struct mob_data*> seen;
+	int range = AREA_SIZE + ACTIVE_AI_RANGE;
+
+	if( mapdata == nullptr || mapdata->block == nullptr )
+		return;
+
+	for( struct map_session_data* sd : ai.players ){
+		int16 x0 = i16max(sd->bl.x - range, 0);
+		int16 y0 = i16max(sd->bl.y - range, 0);
+		int16 x1 = i16min(sd->bl.x + range, mapdata->xs - 1);
+		int16 y1 = i16min(sd->bl.y + range, mapdata->ys - 1);
+
+		map_block_foreach(mapdata, BL_MOB, x0, y0, x1, y1, [&](struct block_list *bl) {
+#ifdef CIRCULAR_AREA
+			if( !check_distance_bl(&sd->bl, bl, range) )
+				return;
+#endif
+			if( seen.insert((struct mob_data *)bl).second )
+				ai.mobs.push_back({ (struct mob_data *)bl, sd->status.char_id, 0, 0, 0, 0 });
+		});
+	}
+
+	for( s_mob_ai_think& think : ai.mobs ){
+		struct mob_data *md = think.md;
+
+		// Same early outs as mob_ai_sub_hard, mobs failing them won't search
+		if( md->status.hp == 0 || DIFF_TICK(tick, md->last_thinktime) < MIN_MOBTHINKTIME || md->ud.skilltimer != INVALID_TIMER )
+			continue;
+		if( !(status_get_mode(&md->bl)&MD_AGGRESSIVE) && md->state.skillstate != MSS_FOLLOW )
+			continue;
+
+		int view_range = ( md->sc.count && md->sc.data[SC_BLIND] ) ? 3 : md->db->range2;
+		int16 x0 = i16max(md->bl.x - view_range, 0);
+		int16 y0 = i16max(md->bl.y - view_range, 0);
+		int16 x1 = i16min(md->bl.x + view_range, mapdata->xs - 1);
+		int16 y1 = i16min(md->bl.y + view_range, mapdata->ys - 1);
+
+		think.view_range = view_range;
+		think.targets_begin = ai.targets.size();
+		map_block_foreach(mapdata, DEFAULT_ENEMY_TYPE(md), x0, y0, x1, y1, [&](struct block_list *bl) {
+			ai.targets.push_back(bl);
+		});
+		think.targets_end = ai.targets.size();
+		think.targets_version = map_block_version(mapdata, DEFAULT_ENEMY_TYPE(md), x0, y0, x1, y1);
+	}
+}
+
+
+/*==========================================
+ * Hard AI split by map: the AI threads prepare every map in parallel,
+ * then the mobs think on the main thread map by map, so all side effects
+ * (packets, damage, timers) happen in a deterministic order.
+ *------------------------------------------*/
+static void mob_ai_parallel(t_tick tick)
+{
+	mob_ai_pool.start(battle_config.mob_ai_threads);
+
+	mob_ai_map_index.clear();
+	map_foreachpc(mob_ai_parallel_collect);
+
+	size_t count = mob_ai_map_index.size();
+
+	mob_ai_pool.run(count, [&](size_t index, size_t worker) {
+		mob_ai_parallel_prepare(mob_ai_maps[index], tick);
+	});
+
+	// Keep all collected objects allocated until every map was processed
+	map_freeblock_lock();
+
+	for( size_t i = 0; i < count; i++ ){
+		mob_ai_prefetch_map = &mob_ai_maps[i];
+
+		for( const s_mob_ai_think& think : mob_ai_maps[i].mobs ){
+			mob_ai_prefetch = &think;
+
+			if( mob_ai_sub_hard(think.md, tick) ){ //Hard AI triggered.
+				mob_add_spotted(think.md, think.char_id);
+				think.md->last_pcneartime = tick;
+			}
+		}
+	}
+
+	mob_ai_prefetch = nullptr;
+	mob_ai_prefetch_map = nullptr;
+
+	map_freeblock_unlock();
+}
+
 /*==========================================
  * Negligent mode MOB AI (PC is not in near)
  *------------------------------------------*/
@@ -2099,6 +2290,8 @@ static TIMER_FUNC(mob_ai_hard){
 
 	if (battle_config.mob_ai&0x20)
 		map_foreachmob(mob_ai_sub_lazy,tick);
+	else if (battle_config.mob_ai_threads > 0)
+		mob_ai_parallel(tick);
 	else
 		map_foreachpc(mob_ai_sub_foreachclient,tick);
 
@@ -6551,5 +6744,7 @@ void do_final_mob(bool is_reload){
 	if( !is_reload ) {
 		ers_destroy(item_drop_ers);
 		ers_destroy(item_drop_list_ers);
+		mob_ai_pool.stop();
+		mob_ai_maps.clear();
 	}
 }
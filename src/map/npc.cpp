@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <map>
 #include <stdlib.h>
+#include <unordered_map>
 #include <vector>
 
 #include "../common/cbasetypes.hpp"
@@ -94,8 +95,14 @@ static DBMap* npcname_db; // const char* npc_name -> struct npc_data*
 struct event_data {
 	struct npc_data *nd;
 	int pos;
+	char label[NAME_LENGTH+1];
 };
 
+// Lowercase label name -> events exported under that label, so dispatching "::OnX" or "npc::OnX" only visits the matching events
+static std::unordered_map<std::string, std::vector<struct event_data*>> ev_label_db;
+// Number of events removed from ev_label_db so far, lets dispatching notice events unloaded by the scripts it runs
+static uint32 ev_label_removed = 0;
+
 static struct eri *timer_event_ers; //For the npc timer data. [Skotlex]
 
 /* hello */
@@ -1137,6 +1144,34 @@ int npc_event_dequeue(struct map_session_data* sd,bool free_script_stack)
 	return 1;
 }
 
+/// Removes an event from ev_label_db, has to be done before the event is removed from ev_db
+static void npc_event_unindex(struct event_data* ev)
+{
+	std::string key = ev->label;
+
+	util::tolower(key);
+
+	std::vector<struct event_data*>* events = util::umap_find(ev_label_db, key);
+
+	if( events == nullptr )
+		return;
+
+	util::vector_erase_if_exists(*events, ev);
+
+	if( events->empty() )
+		ev_label_db.erase(key);
+
+	ev_label_removed++;
+}
+
+/// Clears ev_db together with its label index
+static void npc_event_clear(void)
+{
+	ev_label_db.clear();
+	ev_label_removed++;
+	db_clear(ev_db);
+}
+
 /*==========================================
  * exports a npc event label
  * called from npc_parse_script
@@ -1172,6 +1207,18 @@ static int npc_event_export(struct npc_data *nd, int i)
 		CREATE(ev, struct event_data, 1);
 		ev->nd = nd;
 		ev->pos = pos;
+		safestrncpy(ev->label, lname, sizeof(ev->label));
+
+		struct event_data* old = (struct event_data*)strdb_get(ev_db, buf);
+
+		if (old != nullptr) // The old event is released by strdb_put
+			npc_event_unindex(old);
+
+		std::string key = ev->label;
+
+		util::tolower(key);
+		ev_label_db[key].push_back(ev);
+
 		if (strdb_put(ev_db, buf, ev)) // There was already another event of the same name?
 			return 1;
 	}
@@ -1181,69 +1228,61 @@ static int npc_event_export(struct npc_data *nd, int i)
 int npc_event_sub(struct map_session_data* sd, struct event_data* ev, const char* eventname); //[Lance]
 
 /**
- * Exec name (NPC events) on player or global
- * Do on all NPC when called with foreach
- * @see DBApply
+ * Runs the events exported under a label.
+ * @param label: Label name, case insensitive
+ * @param exname: Only run the event of the NPC with this unique name (case insensitive) or NULL for all NPCs
+ * @param exname_len: Length of exname
+ * @param rid: Player to run the events for (queued if the player is busy) or 0
+ * @param attach: Whether the player is attached to the scripts or only passed as rid
+ * @return Number of events run
  */
-int npc_event_doall_sub(DBKey key, DBData *data, va_list ap)
+static int npc_event_do_label(const char* label, const char* exname, size_t exname_len, int rid, bool attach)
 {
-	const char* p = key.str;
-	struct event_data* ev;
-	int* c;
-	const char* name;
-	int rid;
+	std::string key = label;
 
-	nullpo_ret(ev = (struct event_data*)db_data2ptr(data));
-	nullpo_ret(c = va_arg(ap, int *));
-	nullpo_ret(name = va_arg(ap, const char *));
-	rid = va_arg(ap, int);
+	util::tolower(key);
 
-	p = strchr(p, ':'); // match only the event name
-	if( p && strcmpi(name, p) == 0 /* && !ev->nd->src_id */ ) // Do not run on duplicates. [Paradox924X]
-	{
-		if(rid) // a player may only have 1 script running at the same time
-			npc_event_sub(map_id2sd(rid),ev,key.str);
-		else
-			run_script(ev->nd->u.scr.script,ev->pos,rid,ev->nd->bl.id);
-		(*c)++;
-	}
+	std::vector<struct event_data*>* events = util::umap_find(ev_label_db, key);
 
-	return 0;
-}
+	if( events == nullptr )
+		return 0;
 
-/**
- * @see DBApply
- */
-static int npc_event_do_sub(DBKey key, DBData *data, va_list ap)
-{
-	const char* p = key.str;
-	struct event_data* ev;
-	int* c, rid;
-	const char* name;
+	// The scripts may load or unload events while we're running them
+	std::vector<struct event_data*> list = *events;
+	uint32 removed = ev_label_removed;
+	int c = 0;
 
-	nullpo_ret(ev = (struct event_data*)db_data2ptr(data));
-	nullpo_ret(c = va_arg(ap, int *));
-	nullpo_ret(name = va_arg(ap, const char *));
-	rid = va_arg(ap, int);
+	for( struct event_data* ev : list ){
+		if( removed != ev_label_removed && ( ( events = util::umap_find(ev_label_db, key) ) == nullptr || !util::vector_exists(*events, ev) ) )
+			continue; // unloaded by one of the previous scripts
 
-	if( p && strcmpi(name, p) == 0 )
-	{
-		run_script(ev->nd->u.scr.script,ev->pos,rid,ev->nd->bl.id);
-		(*c)++;
+		if( exname != nullptr && ( strlen(ev->nd->exname) != exname_len || strncasecmp(ev->nd->exname, exname, exname_len) != 0 ) )
+			continue;
+
+		if( attach ){ // a player may only have 1 script running at the same time
+			char eventname[EVENT_NAME_LENGTH];
+
+			safesnprintf(eventname, sizeof(eventname), "%s::%s", ev->nd->exname, ev->label);
+			npc_event_sub(map_id2sd(rid),ev,eventname);
+		}else
+			run_script(ev->nd->u.scr.script,ev->pos,rid,ev->nd->bl.id);
+		c++;
 	}
 
-	return 0;
+	return c;
 }
 
 int npc_event_do_id(const char* name, int rid) {
-	int c = 0;
+	if( name[0] == ':' && name[1] == ':' ) // global events started this way never had the player attached
+		return npc_event_do_label(name + 2, nullptr, 0, 0, false);
 
-	if( name[0] == ':' && name[1] == ':' )
-		ev_db->foreach(ev_db,npc_event_doall_sub,&c,name,0,rid);
-	else
-		ev_db->foreach(ev_db,npc_event_do_sub,&c,name,rid);
+	// labels never contain ':', so the label starts after the last "::"
+	const char* label = strrchr(name, ':');
 
-	return c;
+	if( label == nullptr || label == name || label[-1] != ':' )
+		return 0;
+
+	return npc_event_do_label(label + 1, name, label - 1 - name, rid, false);
 }
 
 // runs the specified event (supports both single-npc and global events)
@@ -1265,11 +1304,7 @@ void npc_event_runall( const char* eventname ){
 // runs the specified event, with a RID attached (global only)
 int npc_event_doall_id(const char* name, int rid)
 {
-	int c = 0;
-	char buf[EVENT_NAME_LENGTH];
-	safesnprintf(buf, sizeof(buf), "::%s", name);
-	ev_db->foreach(ev_db,npc_event_doall_sub,&c,buf,rid);
-	return c;
+	return npc_event_do_label(name, nullptr, 0, rid, rid != 0);
 }
 
 // runs the specified event on all NPCs with the given path
@@ -3356,6 +3391,7 @@ static int npc_unload_ev(DBKey key, DBData *data, va_list ap)
 	char* npcname = va_arg(ap, char *);
 
 	if(strcmp(ev->nd->exname,npcname)==0){
+		npc_event_unindex(ev);
 		db_remove(ev_db, key);
 		return 1;
 	}
@@ -3481,7 +3517,7 @@ int npc_unload(struct npc_data* nd, bool single) {
 	nd->qi_data.clear();
 
 	script_stop_sleeptimers(nd->bl.id);
-	aFree(nd);
+	map_freeblock(&nd->bl);
 
 	return 0;
 }
@@ -3711,9 +3747,9 @@ int npc_parseview(const char* w4, const char* start, const char* buffer, const c
 struct npc_data *npc_create_npc(int16 m, int16 x, int16 y){
 	struct npc_data *nd = nullptr;
 
-	CREATE(nd, struct npc_data, 1);
+	nd = (struct npc_data*)map_allocblock(BL_NPC);
 	nd->bl.id = npc_get_new_npc_id();
-	nd->bl.prev = nd->bl.next = nullptr;
+	nd->bl.prev = nullptr;
 	nd->bl.m = m;
 	nd->bl.x = x;
 	nd->bl.y = y;
@@ -4071,7 +4107,7 @@ static const char* npc_parse_shop(char* w1, char* w2, char* w3, char* w4, const
 	}
 	if( nd->u.shop.count == 0 ) {
 		ShowWarning("npc_parse_shop: Ignoring empty shop in file '%s', line '%d'.\n", filepath, strline(buffer,start-buffer));
-		aFree(nd);
+		map_freeblock(&nd->bl);
 		return strchr(start,'\n');// continue
 	}
 
@@ -5312,6 +5348,18 @@ static const char* npc_parse_mapflag(char* w1, char* w2, char* w3, char* w4, con
 				map_setmapflag(m, MF_NOCOMMAND, false);
 			break;
 
+		case MF_BLOCKSIZE:
+			if (state) {
+				union u_mapflag_args args = {};
+
+				if (sscanf(w4, "%11d", &args.flag_val) < 1)
+					args.flag_val = BLOCK_SIZE;
+
+				map_setmapflag_sub(m, MF_BLOCKSIZE, true, &args);
+			} else
+				map_setmapflag(m, MF_BLOCKSIZE, false);
+			break;
+
 		case MF_RESTRICTED:
 			if (state) {
 				union u_mapflag_args args = {};
@@ -5715,7 +5763,7 @@ int npc_reload(void) {
 	db_clear(npc_path_db);
 
 	db_clear(npcname_db);
-	db_clear(ev_db);
+	npc_event_clear();
 
 	//Remove all npcs/mobs. [Skotlex]
 
@@ -5838,7 +5886,7 @@ bool npc_unloadfile( const char* path ) {
 
 void do_clear_npc(void) {
 	db_clear(npcname_db);
-	db_clear(ev_db);
+	npc_event_clear();
 }
 
 /*==========================================
@@ -5847,6 +5895,7 @@ void do_clear_npc(void) {
 void do_final_npc(void) {
 	npc_clear_pathlist();
 	script_event.clear();
+	ev_label_db.clear();
 	ev_db->destroy(ev_db, NULL);
 	npcname_db->destroy(npcname_db, NULL);
 	npc_path_db->destroy(npc_path_db, NULL);
@@ -5958,7 +6007,7 @@ void do_init_npc(void){
 	add_timer_func_list(npc_timerevent,"npc_timerevent");
 
 	// Init dummy NPC
-	fake_nd = (struct npc_data *)aCalloc(1,sizeof(struct npc_data));
+	fake_nd = (struct npc_data *)map_allocblock(BL_NPC);
 	fake_nd->bl.m = -1;
 	fake_nd->bl.id = npc_get_new_npc_id();
 	fake_nd->class_ = JT_FAKENPC;
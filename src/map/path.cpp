@@ -4,9 +4,12 @@
 #include "path.hpp"
 
 #include <math.h>
+#include <memory>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <thread>
+#include <vector>
 
 #include "../common/cbasetypes.hpp"
 #include "../common/db.hpp"
@@ -37,24 +40,310 @@ struct path_node {
 	short g_cost; ///< Actual cost from start to this node
 	short f_cost; ///< g_cost + heuristic(this, goal)
 	short flag; ///< SET_OPEN / SET_CLOSED
+	int heap_index; ///< position in the open set while the node is open
+	uint32 search; ///< search the node belongs to, nodes of older searches are unused
 };
 
 /// Binary heap of path nodes
 BHEAP_STRUCT_DECL(node_heap, struct path_node*);
-static BHEAP_STRUCT_VAR(node_heap, g_open_set);	// use static heap for all path calculations
-												// it get's initialized in do_init_path, freed in do_final_path.
 
+/// Width of the node table: a path of MAX_WALKPATH steps can't leave the cells
+/// MAX_WALKPATH cells around its start, so they are indexed by their offset to the start.
+#define PATH_WINDOW (MAX_WALKPATH * 2 + 1)
+
+/// State of a running A* search.
+/// Every node is at most once in the open set, so it never outgrows the node table.
+struct s_path_search {
+	struct path_node nodes[PATH_WINDOW * PATH_WINDOW];
+	struct path_node *open_set_data[PATH_WINDOW * PATH_WINDOW];
+	struct node_heap open_set;
+	uint32 search; ///< current search
+	int16 x0, y0; ///< start of the current search
+};
+
+/// Search states of the current thread.
+/// Every path_search takes its own state, so path_search is reentrant and can run on several threads.
+static thread_local std::vector<std::unique_ptr<struct s_path_search>> path_search_pool;
 
 /// Comparator for binary heap of path nodes (minimum cost at top)
 #define NODE_MINTOPCMP(i,j) ((i)->f_cost - (j)->f_cost)
 
-#define calc_index(x,y) (((x)+(y)*MAX_WALKPATH) & (MAX_WALKPATH*MAX_WALKPATH-1))
+/// Index of a node in the node table, or -1 if it is too far from the start
+static inline int calc_index(struct s_path_search *search, int16 x, int16 y)
+{
+	int dx = x - search->x0 + MAX_WALKPATH;
+	int dy = y - search->y0 + MAX_WALKPATH;
+
+	if (dx < 0 || dx >= PATH_WINDOW || dy < 0 || dy >= PATH_WINDOW)
+		return -1;
+
+	return dx + dy * PATH_WINDOW;
+}
 
 /// Estimates the cost from (x0,y0) to (x1,y1).
 /// This is inadmissible (overestimating) heuristic used by game client.
 #define heuristic(x0, y0, x1, y1)	(MOVE_COST * (abs((x1) - (x0)) + abs((y1) - (y0)))) // Manhattan distance
 /// @}
 
+/// @name Cache of recent A* results
+/// @{
+
+#define PATH_CACHE_SETS 256
+#define PATH_CACHE_WAYS 4
+
+/// Cached result of an A* search
+struct s_path_cache_entry {
+	uint32 version; ///< cell_version of the map at the time of the search, 0 if the entry is unused
+	uint32 used; ///< time of the last use, the least recently used entry of a set is replaced
+	int16 m, x0, y0, x1, y1;
+	cell_chk cell;
+	bool found;
+	struct walkpath_data wpd;
+};
+
+/// Results of the last searches of the current thread.
+/// Entries of a map become stale once its cells change, see map_data::cell_version.
+static thread_local struct s_path_cache_entry path_cache[PATH_CACHE_SETS][PATH_CACHE_WAYS];
+static thread_local uint32 path_cache_time;
+/// @}
+
+/// @name Walkable regions of the maps
+/// Answers whether a cell can be reached at all, so searches for unreachable cells fail without running A*.
+/// The map is split into clusters of PATH_CLUSTER_SIZE x PATH_CLUSTER_SIZE cells, the cells of a cluster
+/// are grouped into connected regions and regions touching across a cluster border form a component.
+/// A diagonal step needs both orthogonal cells to be walkable, so cells connected orthogonally are the reachable ones.
+/// The last row and column count as walkable, map_getcellp does not block them for CELL_CHKNOREACH.
+/// A change of the walkable cells only rebuilds its cluster and the components, on the next search of the main thread.
+/// @{
+
+#define PATH_CLUSTER_BITS 4
+#define PATH_CLUSTER_SIZE (1 << PATH_CLUSTER_BITS)
+#define PATH_REGION_NONE UINT8_MAX
+
+struct s_path_cluster {
+	std::vector<uint8> cells; ///< region of every cell, empty if the cluster has at most one region
+	uint32 first; ///< first region of the cluster in s_path_regions::component
+	uint8 count; ///< number of regions
+	bool dirty; ///< the walkable cells of the cluster changed
+};
+
+struct s_path_regions {
+	int16 cxs, cys; ///< number of clusters per row and column
+	std::vector<struct s_path_cluster> clusters;
+	std::vector<uint32> component; ///< component of every region
+	bool dirty; ///< a cluster changed, the components have to be joined again
+};
+
+/// Thread that owns the rebuilds of the walkable regions
+static std::thread::id path_main_thread;
+
+static inline bool path_region_walkable(struct map_data *mapdata, int16 x, int16 y)
+{
+	return x >= mapdata->xs - 1 || y >= mapdata->ys - 1 || mapdata->cell[x + y * mapdata->xs].walkable;
+}
+
+/// Groups the walkable cells of a cluster into regions
+static void path_cluster_build(struct map_data *mapdata, struct s_path_regions *regions, int16 cx, int16 cy)
+{
+	struct s_path_cluster &cluster = regions->clusters[cx + cy * regions->cxs];
+	int16 x0 = cx << PATH_CLUSTER_BITS, y0 = cy << PATH_CLUSTER_BITS;
+	int16 w = min(PATH_CLUSTER_SIZE, mapdata->xs - x0), h = min(PATH_CLUSTER_SIZE, mapdata->ys - y0);
+	uint8 cells[PATH_CLUSTER_SIZE * PATH_CLUSTER_SIZE];
+	uint8 queue[PATH_CLUSTER_SIZE * PATH_CLUSTER_SIZE];
+	uint8 count = 0;
+
+	memset(cells, PATH_REGION_NONE, sizeof(cells));
+
+	for (int16 y = 0; y < h; y++) {
+		for (int16 x = 0; x < w; x++) {
+			int start = x + (y << PATH_CLUSTER_BITS);
+
+			if (cells[start] != PATH_REGION_NONE || !path_region_walkable(mapdata, x0 + x, y0 + y))
+				continue;
+
+			// Flood fill a new region
+			int head = 0, tail = 0;
+
+			cells[start] = count;
+			queue[tail++] = start;
+			while (head < tail) {
+				int i = queue[head++];
+				int16 lx = i & (PATH_CLUSTER_SIZE - 1), ly = i >> PATH_CLUSTER_BITS;
+				const int16 nx[4] = { (int16)(lx - 1), (int16)(lx + 1), lx, lx };
+				const int16 ny[4] = { ly, ly, (int16)(ly - 1), (int16)(ly + 1) };
+
+				for (int k = 0; k < 4; k++) {
+					if (nx[k] < 0 || nx[k] >= w || ny[k] < 0 || ny[k] >= h)
+						continue;
+
+					int j = nx[k] + (ny[k] << PATH_CLUSTER_BITS);
+
+					if (cells[j] != PATH_REGION_NONE || !path_region_walkable(mapdata, x0 + nx[k], y0 + ny[k]))
+						continue;
+					cells[j] = count;
+					queue[tail++] = j;
+				}
+			}
+			count++;
+		}
+	}
+
+	cluster.count = count;
+	cluster.dirty = false;
+	if (count > 1)
+		cluster.cells.assign(cells, cells + sizeof(cells));
+	else
+		cluster.cells.clear();
+}
+
+/// Returns the region of a walkable cell
+static inline uint32 path_region_at(struct s_path_regions *regions, int16 x, int16 y)
+{
+	const struct s_path_cluster &cluster = regions->clusters[(x >> PATH_CLUSTER_BITS) + (y >> PATH_CLUSTER_BITS) * regions->cxs];
+
+	if (cluster.cells.empty())
+		return cluster.first;
+	return cluster.first + cluster.cells[(x & (PATH_CLUSTER_SIZE - 1)) + ((y & (PATH_CLUSTER_SIZE - 1)) << PATH_CLUSTER_BITS)];
+}
+
+static uint32 path_region_find(std::vector<uint32> &parent, uint32 region)
+{
+	while (parent[region] != region) {
+		parent[region] = parent[parent[region]];
+		region = parent[region];
+	}
+	return region;
+}
+
+static inline void path_region_union(struct map_data *mapdata, struct s_path_regions *regions, int16 x0, int16 y0, int16 x1, int16 y1)
+{
+	if (!path_region_walkable(mapdata, x0, y0) || !path_region_walkable(mapdata, x1, y1))
+		return;
+
+	uint32 a = path_region_find(regions->component, path_region_at(regions, x0, y0));
+	uint32 b = path_region_find(regions->component, path_region_at(regions, x1, y1));
+
+	if (a != b)
+		regions->component[max(a, b)] = min(a, b);
+}
+
+/// Rebuilds the changed clusters and joins the regions of neighbouring clusters into components
+static void path_regions_join(struct map_data *mapdata, struct s_path_regions *regions)
+{
+	uint32 total = 0;
+
+	for (int16 cy = 0; cy < regions->cys; cy++) {
+		for (int16 cx = 0; cx < regions->cxs; cx++) {
+			struct s_path_cluster &cluster = regions->clusters[cx + cy * regions->cxs];
+
+			if (cluster.dirty)
+				path_cluster_build(mapdata, regions, cx, cy);
+			cluster.first = total;
+			total += cluster.count;
+		}
+	}
+
+	regions->component.resize(total);
+	for (uint32 i = 0; i < total; i++)
+		regions->component[i] = i;
+
+	for (int16 cy = 0; cy < regions->cys; cy++) {
+		for (int16 cx = 0; cx < regions->cxs; cx++) {
+			int16 x0 = cx << PATH_CLUSTER_BITS, y0 = cy << PATH_CLUSTER_BITS;
+			int16 x1 = min(x0 + PATH_CLUSTER_SIZE, (int)mapdata->xs) - 1, y1 = min(y0 + PATH_CLUSTER_SIZE, (int)mapdata->ys) - 1;
+
+			if (cx + 1 < regions->cxs) {
+				for (int16 y = y0; y <= y1; y++)
+					path_region_union(mapdata, regions, x1, y, x1 + 1, y);
+			}
+			if (cy + 1 < regions->cys) {
+				for (int16 x = x0; x <= x1; x++)
+					path_region_union(mapdata, regions, x, y1, x, y1 + 1);
+			}
+		}
+	}
+
+	for (uint32 i = 0; i < total; i++)
+		regions->component[i] = path_region_find(regions->component, i);
+
+	regions->dirty = false;
+}
+
+/// Builds the walkable regions of a map.
+/// Only touches the map itself, so maps can be built on the map loading threads.
+void path_regions_build(struct map_data *mapdata)
+{
+	path_regions_free(mapdata);
+
+	if (mapdata->cell == nullptr)
+		return;
+
+	struct s_path_regions *regions = new struct s_path_regions;
+
+	regions->cxs = (mapdata->xs + PATH_CLUSTER_SIZE - 1) >> PATH_CLUSTER_BITS;
+	regions->cys = (mapdata->ys + PATH_CLUSTER_SIZE - 1) >> PATH_CLUSTER_BITS;
+	regions->clusters.resize((size_t)regions->cxs * regions->cys);
+	for (struct s_path_cluster &cluster : regions->clusters)
+		cluster.dirty = true;
+	path_regions_join(mapdata, regions);
+	mapdata->path_regions = regions;
+}
+
+/// Copies the walkable regions of a map to a map with the same cells (instances)
+void path_regions_copy(struct map_data *dst, struct map_data *src)
+{
+	path_regions_free(dst);
+
+	if (src->path_regions != nullptr)
+		dst->path_regions = new struct s_path_regions(*src->path_regions);
+}
+
+/// Marks the cluster of a cell as changed, called whenever the walkable flag of a cell changes
+void path_regions_changed(struct map_data *mapdata, int16 x, int16 y)
+{
+	struct s_path_regions *regions = mapdata->path_regions;
+
+	if (regions == nullptr)
+		return;
+
+	regions->clusters[(x >> PATH_CLUSTER_BITS) + (y >> PATH_CLUSTER_BITS) * regions->cxs].dirty = true;
+	regions->dirty = true;
+}
+
+void path_regions_free(struct map_data *mapdata)
+{
+	delete mapdata->path_regions;
+	mapdata->path_regions = nullptr;
+}
+
+/// Whether (x1,y1) may be reachable from (x0,y0).
+/// False means no walkpath exists, true means A* has to decide.
+static bool path_regions_reachable(struct map_data *mapdata, int16 x0, int16 y0, int16 x1, int16 y1)
+{
+	struct s_path_regions *regions = mapdata->path_regions;
+
+	if (!battle_config.path_regions)
+		return true;
+
+	if (regions == nullptr || regions->dirty) {
+		// Other threads only read the maps
+		if (std::this_thread::get_id() != path_main_thread)
+			return true;
+		if (regions == nullptr) {
+			path_regions_build(mapdata);
+			regions = mapdata->path_regions;
+		} else
+			path_regions_join(mapdata, regions);
+	}
+
+	// The starting cell is not checked by the search, a unit may stand on an unwalkable cell
+	if (!path_region_walkable(mapdata, x0, y0) || !path_region_walkable(mapdata, x1, y1))
+		return true;
+
+	return regions->component[path_region_at(regions, x0, y0)] == regions->component[path_region_at(regions, x1, y1)];
+}
+/// @}
+
 // Translates dx,dy into walking direction
 static enum directions walk_choices [3][3] =
 {
@@ -65,11 +354,12 @@ static enum directions walk_choices [3][3] =
 
 
 void do_init_path(){
-	BHEAP_INIT(g_open_set);	// [fwi]: BHEAP_STRUCT_VAR already initialized the heap, this is rudendant & just for code-conformance/readability
+	memset(path_cache, 0, sizeof(path_cache));
+	path_main_thread = std::this_thread::get_id();
 }//
 
 void do_final_path(){
-	BHEAP_CLEAR(g_open_set);
+	path_search_pool.clear();
 }//
 
 
@@ -126,6 +416,84 @@ int path_blownpos(int16 m,int16 x0,int16 y0,int16 dx,int16 dy,int count)
 	return (x0<<16)|y0; //TODO: use 'struct point' here instead?
 }
 
+/// Checks the line of path_search_long on the cell planes, both ends excluded.
+/// The line has to be inside the map and x0 <= x1.
+/// Lines wider than high are checked a row segment at a time instead of cell by cell.
+static bool path_search_long_planes(const struct s_cellplane_query& query, int16 x0, int16 y0, int16 x1, int16 y1)
+{
+	int dx = x1 - x0, dy = y1 - y0;
+	int weight, wx = 0, wy = 0;
+
+	if (dx > abs(dy)) {
+		// x advances every step, y changes after a run of steps
+		int16 run_x0 = x0 + 1;
+
+		weight = dx;
+
+		for (;;) {
+			int steps;
+
+			if (dy > 0)
+				steps = (weight - wy + dy - 1) / dy;
+			else if (dy < 0)
+				steps = wy / -dy + 1;
+			else
+				steps = x1 - x0;
+
+			if (steps >= x1 - x0) {
+				steps = x1 - x0;
+
+				// The row doesn't change before the end
+				if (dy == 0 || (dy > 0 && wy + steps * dy < weight) || (dy < 0 && wy + steps * dy >= 0))
+					return run_x0 > x1 - 1 || !map_cellplane_row(query, y0, run_x0, x1 - 1);
+			}
+
+			// Cells before the row changes
+			if (run_x0 <= x0 + steps - 1 && map_cellplane_row(query, y0, run_x0, x0 + steps - 1))
+				return false;
+
+			x0 += steps;
+			wy += steps * dy;
+			if (wy >= weight) {
+				wy -= weight;
+				y0++;
+			} else {
+				wy += weight;
+				y0--;
+			}
+
+			if (x0 == x1)
+				return true;
+
+			run_x0 = x0;
+		}
+	}
+
+	// y changes every step, every cell is on its own row
+	weight = abs(dy);
+
+	while (x0 != x1 || y0 != y1)
+	{
+		wx += dx;
+		wy += dy;
+		if (wx >= weight) {
+			wx -= weight;
+			x0++;
+		}
+		if (wy >= weight) {
+			wy -= weight;
+			y0++;
+		} else if (wy < 0) {
+			wy += weight;
+			y0--;
+		}
+		if ((x0 != x1 || y0 != y1) && map_cellplane_row(query, y0, x0, x0))
+			return false;
+	}
+
+	return true;
+}
+
 /*==========================================
  * is ranged attack from (x0,y0) to (x1,y1) possible?
  *------------------------------------------*/
@@ -164,6 +532,12 @@ bool path_search_long(struct shootpath_data *spd,int16 m,int16 x0,int16 y0,int16
 		spd->rx = 1;
 	}
 
+	struct s_cellplane_query query;
+
+	if (spd == &s_spd && map_cellplane_query(mapdata, cell, query)
+		&& x0 >= 0 && x1 < mapdata->xs - 1 && min(y0, y1) >= 0 && max(y0, y1) < mapdata->ys - 1)
+		return path_search_long_planes(query, x0, y0, x1, y1);
+
 	while (x0 != x1 || y0 != y1)
 	{
 		wx += dx;
@@ -195,68 +569,240 @@ bool path_search_long(struct shootpath_data *spd,int16 m,int16 x0,int16 y0,int16
 /// @name A* pathfinding related functions
 /// @{
 
-/// Pushes path_node to the binary node_heap.
-/// Ensures there is enough space in array to store new element.
-
-#define swap_ptrcast_pathnode(a, b) swap_ptrcast(struct path_node *, a, b)
+/// Swaps two path nodes of the binary node_heap, keeping track of their positions.
+#define swap_pathnode(a, b) do{ \
+		swap_ptrcast(struct path_node *, a, b); \
+		SWAP((a)->heap_index, (b)->heap_index); \
+	}while(0)
 
+/// Pushes path_node to the binary node_heap.
+/// The heap can hold every node of the node table, so it never has to grow.
 static void heap_push_node(struct node_heap *heap, struct path_node *node)
 {
 #ifndef __clang_analyzer__ // TODO: Figure out why clang's static analyzer doesn't like this
-	BHEAP_ENSURE2(*heap, 1, 256, struct path_node **);
-	BHEAP_PUSH2(*heap, node, NODE_MINTOPCMP, swap_ptrcast_pathnode);
+	node->heap_index = (int)BHEAP_LENGTH(*heap);
+	BHEAP_PUSH2(*heap, node, NODE_MINTOPCMP, swap_pathnode);
 #endif // __clang_analyzer__
 }
 
+/// Removes the path_node with the lowest cost from the binary node_heap.
+static struct path_node *heap_pop_node(struct node_heap *heap)
+{
+	struct path_node *node = BHEAP_PEEK(*heap);
+
+	// The last node takes the place of the top
+	BHEAP_DATA(*heap)[BHEAP_LENGTH(*heap) - 1]->heap_index = 0;
+	BHEAP_POP2(*heap, NODE_MINTOPCMP, swap_pathnode);
+
+	return node;
+}
+
 /// Updates path_node in the binary node_heap.
 static int heap_update_node(struct node_heap *heap, struct path_node *node)
 {
-	int i;
-	ARR_FIND(0, BHEAP_LENGTH(*heap), i, BHEAP_DATA(*heap)[i] == node);
-	if (i == BHEAP_LENGTH(*heap)) {
+	size_t i = node->heap_index;
+
+	if (i >= BHEAP_LENGTH(*heap) || BHEAP_DATA(*heap)[i] != node) {
 		ShowError("heap_update_node: node not found\n");
 		return 1;
 	}
-	BHEAP_UPDATE(*heap, i, NODE_MINTOPCMP, swap_ptrcast_pathnode);
+	BHEAP_UPDATE(*heap, i, NODE_MINTOPCMP, swap_pathnode);
 	return 0;
 }
 
 /// Path_node processing in A* pathfinding.
 /// Adds new node to heap and updates/re-adds old ones if necessary.
-static int add_path(struct node_heap *heap, struct path_node *tp, int16 x, int16 y, int g_cost, struct path_node *parent, int h_cost)
+/// Nodes too far away from the start for a walkpath are skipped.
+static int add_path(struct s_path_search *search, int16 x, int16 y, int g_cost, struct path_node *parent, int h_cost)
 {
-	int i = calc_index(x, y);
+	int i = calc_index(search, x, y);
+
+	if (i < 0)
+		return 0;
+
+	struct path_node *node = &search->nodes[i];
 
-	if (tp[i].x == x && tp[i].y == y) { // We processed this node before
-		if (g_cost < tp[i].g_cost) { // New path to this node is better than old one
+	if (node->search == search->search) { // We processed this node before
+		if (g_cost < node->g_cost) { // New path to this node is better than old one
 			// Update costs and parent
-			tp[i].g_cost = g_cost;
-			tp[i].parent = parent;
-			tp[i].f_cost = g_cost + h_cost;
-			if (tp[i].flag == SET_CLOSED) {
-				heap_push_node(heap, &tp[i]); // Put it in open set again
+			node->g_cost = g_cost;
+			node->parent = parent;
+			node->f_cost = g_cost + h_cost;
+			if (node->flag == SET_CLOSED) {
+				heap_push_node(&search->open_set, node); // Put it in open set again
 			}
-			else if (heap_update_node(heap, &tp[i])) {
+			else if (heap_update_node(&search->open_set, node)) {
 				return 1;
 			}
-			tp[i].flag = SET_OPEN;
+			node->flag = SET_OPEN;
 		}
 		return 0;
 	}
 
-	if (tp[i].x || tp[i].y) // Index is already taken; see `tp` array FIXME for details
-		return 1;
-
 	// New node
-	tp[i].x = x;
-	tp[i].y = y;
-	tp[i].g_cost = g_cost;
-	tp[i].parent = parent;
-	tp[i].f_cost = g_cost + h_cost;
-	tp[i].flag = SET_OPEN;
-	heap_push_node(heap, &tp[i]);
+	node->x = x;
+	node->y = y;
+	node->g_cost = g_cost;
+	node->parent = parent;
+	node->f_cost = g_cost + h_cost;
+	node->flag = SET_OPEN;
+	node->search = search->search;
+	heap_push_node(&search->open_set, node);
 	return 0;
 }
+
+/// Takes a search state from the pool of the current thread.
+static struct s_path_search *path_search_acquire(int16 x0, int16 y0)
+{
+	struct s_path_search *search;
+
+	if (path_search_pool.empty()) {
+		search = new s_path_search();
+		search->open_set._max_ = ARRAYLENGTH(search->open_set_data);
+		search->open_set._data_ = search->open_set_data;
+	} else {
+		search = path_search_pool.back().release();
+		path_search_pool.pop_back();
+	}
+
+	BHEAP_RESET(search->open_set);
+
+	// Nodes of the previous searches become unused, the table only has to be cleared once the counter wraps
+	if (++search->search == 0) {
+		memset(search->nodes, 0, sizeof(search->nodes));
+		search->search = 1;
+	}
+
+	search->x0 = x0;
+	search->y0 = y0;
+
+	return search;
+}
+
+/// Gives a search state back to the pool of the current thread.
+static void path_search_release(struct s_path_search *search)
+{
+	path_search_pool.emplace_back(search);
+}
+
+/// A* (A-star) pathfinding from (x0,y0) to (x1,y1), see path_search.
+static bool path_search_astar(struct s_path_search *search, struct map_data *mapdata, struct walkpath_data *wpd, int16 x0, int16 y0, int16 x1, int16 y1, cell_chk cell)
+{
+	struct path_node *current, *it;
+	int xs = mapdata->xs - 1;
+	int ys = mapdata->ys - 1;
+	int len = 0;
+	int i, j, x, y, dx, dy;
+
+	// Start node
+	i = calc_index(search, x0, y0);
+	search->nodes[i].parent = NULL;
+	search->nodes[i].x      = x0;
+	search->nodes[i].y      = y0;
+	search->nodes[i].g_cost = 0;
+	search->nodes[i].f_cost = heuristic(x0, y0, x1, y1);
+	search->nodes[i].flag   = SET_OPEN;
+	search->nodes[i].search = search->search;
+
+	heap_push_node(&search->open_set, &search->nodes[i]); // Put start node to 'open' set
+
+	for(;;) {
+		int e = 0; // error flag
+
+		// Saves allowed directions for the current cell. Diagonal directions
+		// are only allowed if both directions around it are allowed. This is
+		// to prevent cutting corner of nearby wall.
+		// For example, you can only go NW from the current cell, if you can
+		// go N *and* you can go W. Otherwise you need to walk around the
+		// (corner of the) non-walkable cell.
+		int allowed_dirs = 0;
+
+		int g_cost;
+
+		if (BHEAP_LENGTH(search->open_set) == 0) {
+			return false;
+		}
+
+		current = heap_pop_node(&search->open_set); // Remove the lowest f_cost node from the 'open' set
+
+		x      = current->x;
+		y      = current->y;
+		g_cost = current->g_cost;
+
+		current->flag = SET_CLOSED; // Add current node to 'closed' set
+
+		if (x == x1 && y == y1) {
+			break;
+		}
+
+		if (y < ys && !map_getcellp(mapdata, x, y+1, cell)) allowed_dirs |= PATH_DIR_NORTH;
+		if (y >  0 && !map_getcellp(mapdata, x, y-1, cell)) allowed_dirs |= PATH_DIR_SOUTH;
+		if (x < xs && !map_getcellp(mapdata, x+1, y, cell)) allowed_dirs |= PATH_DIR_EAST;
+		if (x >  0 && !map_getcellp(mapdata, x-1, y, cell)) allowed_dirs |= PATH_DIR_WEST;
+
+#define chk_dir(d) ((allowed_dirs & (d)) == (d))
+		// Process neighbors of current node
+		if (chk_dir(PATH_DIR_SOUTH|PATH_DIR_EAST) && !map_getcellp(mapdata, x+1, y-1, cell))
+			e += add_path(search, x+1, y-1, g_cost + MOVE_DIAGONAL_COST, current, heuristic(x+1, y-1, x1, y1)); // (x+1, y-1) 5
+		if (chk_dir(PATH_DIR_EAST))
+			e += add_path(search, x+1, y, g_cost + MOVE_COST, current, heuristic(x+1, y, x1, y1)); // (x+1, y) 6
+		if (chk_dir(PATH_DIR_NORTH|PATH_DIR_EAST) && !map_getcellp(mapdata, x+1, y+1, cell))
+			e += add_path(search, x+1, y+1, g_cost + MOVE_DIAGONAL_COST, current, heuristic(x+1, y+1, x1, y1)); // (x+1, y+1) 7
+		if (chk_dir(PATH_DIR_NORTH))
+			e += add_path(search, x, y+1, g_cost + MOVE_COST, current, heuristic(x, y+1, x1, y1)); // (x, y+1) 0
+		if (chk_dir(PATH_DIR_NORTH|PATH_DIR_WEST) && !map_getcellp(mapdata, x-1, y+1, cell))
+			e += add_path(search, x-1, y+1, g_cost + MOVE_DIAGONAL_COST, current, heuristic(x-1, y+1, x1, y1)); // (x-1, y+1) 1
+		if (chk_dir(PATH_DIR_WEST))
+			e += add_path(search, x-1, y, g_cost + MOVE_COST, current, heuristic(x-1, y, x1, y1)); // (x-1, y) 2
+		if (chk_dir(PATH_DIR_SOUTH|PATH_DIR_WEST) && !map_getcellp(mapdata, x-1, y-1, cell))
+			e += add_path(search, x-1, y-1, g_cost + MOVE_DIAGONAL_COST, current, heuristic(x-1, y-1, x1, y1)); // (x-1, y-1) 3
+		if (chk_dir(PATH_DIR_SOUTH))
+			e += add_path(search, x, y-1, g_cost + MOVE_COST, current, heuristic(x, y-1, x1, y1)); // (x, y-1) 4
+#undef chk_dir
+		if (e) {
+			return false;
+		}
+	}
+
+	for (it = current; it->parent != NULL; it = it->parent, len++);
+	if (len > sizeof(wpd->path))
+		return false;
+
+	// Recreate path
+	wpd->path_len = len;
+	wpd->path_pos = 0;
+
+	for (it = current, j = len-1; j >= 0; it = it->parent, j--) {
+		dx = it->x - it->parent->x;
+		dy = it->y - it->parent->y;
+		wpd->path[j] = walk_choices[-dy + 1][dx + 1];
+	}
+
+	return true;
+}
+
+/// Whether the result of a search only depends on the cells of the map and can be cached
+static bool path_cache_cacheable(cell_chk cell)
+{
+#ifdef CELL_NOSTACK
+	// The stacking limit changes with every move
+	if (cell == CELL_CHKPASS || cell == CELL_CHKNOPASS || cell == CELL_CHKSTACK)
+		return false;
+#endif
+	return true;
+}
+
+/// Returns the set of the path cache a search belongs to
+static struct s_path_cache_entry *path_cache_set(int16 m, int16 x0, int16 y0, int16 x1, int16 y1, cell_chk cell)
+{
+	uint32 hash = (uint32)m * 0x9E3779B1U;
+
+	hash = (hash ^ ((uint32)(uint16)x0 | ((uint32)(uint16)y0 << 16))) * 0x85EBCA77U;
+	hash = (hash ^ ((uint32)(uint16)x1 | ((uint32)(uint16)y1 << 16))) * 0xC2B2AE3DU;
+	hash = (hash ^ (uint32)cell) * 0x27D4EB2FU;
+
+	return path_cache[(hash >> 16) % PATH_CACHE_SETS];
+}
 ///@}
 
 /*==========================================
@@ -266,7 +812,7 @@ static int add_path(struct node_heap *heap, struct path_node *tp, int16 x, int16
  * flag: &2 = call path_search_long instead
  * cell: type of obstruction to check for
  *
- * Note: uses global g_open_set, therefore this method can't be called in parallel or recursivly.
+ * Note: the map must not change while a search runs, searches of the same map on several threads are fine.
  *------------------------------------------*/
 bool path_search(struct walkpath_data *wpd, int16 m, int16 x0, int16 y0, int16 x1, int16 y1, int flag, cell_chk cell)
 {
@@ -326,108 +872,64 @@ bool path_search(struct walkpath_data *wpd, int16 m, int16 x0, int16 y0, int16 x
 
 		return false; // easy path unsuccessful
 	} else { // !(flag&1)
-		// FIXME: This array is too small to ensure all paths shorter than MAX_WALKPATH
-		// can be found without node collision: calc_index(node1) = calc_index(node2).
-		// Figure out more proper size or another way to keep track of known nodes.
-		struct path_node tp[MAX_WALKPATH * MAX_WALKPATH];
-		struct path_node *current, *it;
-		int xs = mapdata->xs - 1;
-		int ys = mapdata->ys - 1;
-		int len = 0;
-		int j;
+		// A walkpath can't be longer than MAX_WALKPATH steps
+		if (abs(x1 - x0) > MAX_WALKPATH || abs(y1 - y0) > MAX_WALKPATH)
+			return false;
 
 		// A* (A-star) pathfinding
 		// We always use A* for finding walkpaths because it is what game client uses.
 		// Easy pathfinding cuts corners of non-walkable cells, but client always walks around it.
-		BHEAP_RESET(g_open_set);
-
-		memset(tp, 0, sizeof(tp));
-
-		// Start node
-		i = calc_index(x0, y0);
-		tp[i].parent = NULL;
-		tp[i].x      = x0;
-		tp[i].y      = y0;
-		tp[i].g_cost = 0;
-		tp[i].f_cost = heuristic(x0, y0, x1, y1);
-		tp[i].flag   = SET_OPEN;
-
-		heap_push_node(&g_open_set, &tp[i]); // Put start node to 'open' set
-
-		for(;;) {
-			int e = 0; // error flag
-
-			// Saves allowed directions for the current cell. Diagonal directions
-			// are only allowed if both directions around it are allowed. This is
-			// to prevent cutting corner of nearby wall.
-			// For example, you can only go NW from the current cell, if you can
-			// go N *and* you can go W. Otherwise you need to walk around the
-			// (corner of the) non-walkable cell.
-			int allowed_dirs = 0;
-
-			int g_cost;
-
-			if (BHEAP_LENGTH(g_open_set) == 0) {
-				return false;
-			}
-
-			current = BHEAP_PEEK(g_open_set); // Look for the lowest f_cost node in the 'open' set
-			BHEAP_POP2(g_open_set, NODE_MINTOPCMP, swap_ptrcast_pathnode); // Remove it from 'open' set
-
-			x      = current->x;
-			y      = current->y;
-			g_cost = current->g_cost;
-
-			current->flag = SET_CLOSED; // Add current node to 'closed' set
-
-			if (x == x1 && y == y1) {
-				break;
+		struct s_path_cache_entry *set = NULL, *entry;
+		bool found;
+
+		if (path_cache_cacheable(cell)) {
+			set = path_cache_set(m, x0, y0, x1, y1, cell);
+			path_cache_time++;
+
+			for (i = 0; i < PATH_CACHE_WAYS; i++) {
+				entry = &set[i];
+
+				if (entry->version == mapdata->cell_version && entry->m == m && entry->x0 == x0 && entry->y0 == y0
+					&& entry->x1 == x1 && entry->y1 == y1 && entry->cell == cell) {
+					entry->used = path_cache_time;
+					if (entry->found)
+						memcpy(wpd, &entry->wpd, sizeof(*wpd));
+					return entry->found;
+				}
 			}
+		}
 
-			if (y < ys && !map_getcellp(mapdata, x, y+1, cell)) allowed_dirs |= PATH_DIR_NORTH;
-			if (y >  0 && !map_getcellp(mapdata, x, y-1, cell)) allowed_dirs |= PATH_DIR_SOUTH;
-			if (x < xs && !map_getcellp(mapdata, x+1, y, cell)) allowed_dirs |= PATH_DIR_EAST;
-			if (x >  0 && !map_getcellp(mapdata, x-1, y, cell)) allowed_dirs |= PATH_DIR_WEST;
+		if ((cell == CELL_CHKNOPASS || cell == CELL_CHKNOREACH) && !path_regions_reachable(mapdata, x0, y0, x1, y1))
+			found = false; // The goal lies in another walkable region
+		else {
+			struct s_path_search *search = path_search_acquire(x0, y0);
 
-#define chk_dir(d) ((allowed_dirs & (d)) == (d))
-			// Process neighbors of current node
-			if (chk_dir(PATH_DIR_SOUTH|PATH_DIR_EAST) && !map_getcellp(mapdata, x+1, y-1, cell))
-				e += add_path(&g_open_set, tp, x+1, y-1, g_cost + MOVE_DIAGONAL_COST, current, heuristic(x+1, y-1, x1, y1)); // (x+1, y-1) 5
-			if (chk_dir(PATH_DIR_EAST))
-				e += add_path(&g_open_set, tp, x+1, y, g_cost + MOVE_COST, current, heuristic(x+1, y, x1, y1)); // (x+1, y) 6
-			if (chk_dir(PATH_DIR_NORTH|PATH_DIR_EAST) && !map_getcellp(mapdata, x+1, y+1, cell))
-				e += add_path(&g_open_set, tp, x+1, y+1, g_cost + MOVE_DIAGONAL_COST, current, heuristic(x+1, y+1, x1, y1)); // (x+1, y+1) 7
-			if (chk_dir(PATH_DIR_NORTH))
-				e += add_path(&g_open_set, tp, x, y+1, g_cost + MOVE_COST, current, heuristic(x, y+1, x1, y1)); // (x, y+1) 0
-			if (chk_dir(PATH_DIR_NORTH|PATH_DIR_WEST) && !map_getcellp(mapdata, x-1, y+1, cell))
-				e += add_path(&g_open_set, tp, x-1, y+1, g_cost + MOVE_DIAGONAL_COST, current, heuristic(x-1, y+1, x1, y1)); // (x-1, y+1) 1
-			if (chk_dir(PATH_DIR_WEST))
-				e += add_path(&g_open_set, tp, x-1, y, g_cost + MOVE_COST, current, heuristic(x-1, y, x1, y1)); // (x-1, y) 2
-			if (chk_dir(PATH_DIR_SOUTH|PATH_DIR_WEST) && !map_getcellp(mapdata, x-1, y-1, cell))
-				e += add_path(&g_open_set, tp, x-1, y-1, g_cost + MOVE_DIAGONAL_COST, current, heuristic(x-1, y-1, x1, y1)); // (x-1, y-1) 3
-			if (chk_dir(PATH_DIR_SOUTH))
-				e += add_path(&g_open_set, tp, x, y-1, g_cost + MOVE_COST, current, heuristic(x, y-1, x1, y1)); // (x, y-1) 4
-#undef chk_dir
-			if (e) {
-				return false;
-			}
+			found = path_search_astar(search, mapdata, wpd, x0, y0, x1, y1, cell);
+			path_search_release(search);
 		}
 
-		for (it = current; it->parent != NULL; it = it->parent, len++);
-		if (len > sizeof(wpd->path))
-			return false;
-
-		// Recreate path
-		wpd->path_len = len;
-		wpd->path_pos = 0;
+		if (set != NULL) {
+			// Replace the least recently used entry of the set
+			entry = &set[0];
+			for (i = 1; i < PATH_CACHE_WAYS; i++) {
+				if (set[i].used < entry->used)
+					entry = &set[i];
+			}
 
-		for (it = current, j = len-1; j >= 0; it = it->parent, j--) {
-			dx = it->x - it->parent->x;
-			dy = it->y - it->parent->y;
-			wpd->path[j] = walk_choices[-dy + 1][dx + 1];
+			entry->version = mapdata->cell_version;
+			entry->used = path_cache_time;
+			entry->m = m;
+			entry->x0 = x0;
+			entry->y0 = y0;
+			entry->x1 = x1;
+			entry->y1 = y1;
+			entry->cell = cell;
+			entry->found = found;
+			if (found)
+				memcpy(&entry->wpd, wpd, sizeof(*wpd));
 		}
 
-		return true;
+		return found;
 	} // A* end
 
 	return false;
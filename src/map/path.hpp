@@ -7,6 +7,7 @@
 #include "../common/cbasetypes.hpp"
 
 enum cell_chk : uint8;
+struct map_data;
 
 #define MOVE_COST 10
 #define MOVE_DIAGONAL_COST 14
@@ -62,6 +63,12 @@ bool path_search(struct walkpath_data *wpd,int16 m,int16 x0,int16 y0,int16 x1,in
 // tries to find a shootable path
 bool path_search_long(struct shootpath_data *spd,int16 m,int16 x0,int16 y0,int16 x1,int16 y1,cell_chk cell);
 
+// walkable regions of a map, used to reject unreachable goals
+void path_regions_build(struct map_data *mapdata);
+void path_regions_copy(struct map_data *dst, struct map_data *src);
+void path_regions_changed(struct map_data *mapdata, int16 x, int16 y);
+void path_regions_free(struct map_data *mapdata);
+
 // distance related functions
 bool check_distance(int dx, int dy, int distance);
 unsigned int distance(int dx, int dy);
@@ -6364,17 +6364,20 @@ enum e_setpos pc_setpos(struct map_session_data* sd, unsigned short mapindex, in
 			if (sc->cant.warp)
 				return SETPOS_MAPINDEX; // You may not get out!
 
-			for (const auto &it : status_db) {
-				if (sc->data[it.first]) {
-					if (it.second->flag[SCF_REMOVEONMAPWARP])
-						status_change_end(&sd->bl, static_cast<sc_type>(it.first), INVALID_TIMER);
+			for (int i = sc->data.next(SC_NONE); i < SC_MAX; i = sc->data.next(i)) {
+				sc_type type = static_cast<sc_type>(i);
+				std::shared_ptr<s_status_change_db> scdb = status_db.find(type);
 
-					if (it.second->flag[SCF_RESTARTONMAPWARP] && it.second->skill_id > 0) {
-						status_change_entry *sce = sd->sc.data[it.first];
+				if (scdb != nullptr) {
+					if (scdb->flag[SCF_REMOVEONMAPWARP])
+						status_change_end(&sd->bl, type, INVALID_TIMER);
+
+					if (scdb->flag[SCF_RESTARTONMAPWARP] && scdb->skill_id > 0) {
+						status_change_entry *sce = sd->sc.data[type];
 
 						if (sce->timer != INVALID_TIMER)
 							delete_timer(sce->timer, status_change_timer);
-						sce->timer = add_timer(gettick() + skill_get_time(it.second->skill_id, sce->val1), status_change_timer, sd->bl.id, it.first);
+						sce->timer = add_timer(gettick() + skill_get_time(scdb->skill_id, sce->val1), status_change_timer, sd->bl.id, type);
 					}
 				}
 			}
@@ -6783,14 +6786,19 @@ static void pc_checkallowskill(struct map_session_data *sd)
 	if(!sd->sc.count)
 		return;
 
-	for (const auto &it : status_db) {
-		sc_type status = it.second->type;
-		std::bitset<SCF_MAX> flag = it.second->flag;
+	for (int i = sd->sc.data.next(SC_NONE); i < SC_MAX; i = sd->sc.data.next(i)) {
+		sc_type status = static_cast<sc_type>(i);
+		std::shared_ptr<s_status_change_db> scdb = status_db.find(status);
+
+		if (scdb == nullptr)
+			continue;
+
+		std::bitset<SCF_MAX> flag = scdb->flag;
 
 		if (flag[SCF_REQUIREWEAPON]) { // Skills requiring specific weapon types
 			if (status == SC_DANCING && !battle_config.dancing_weaponswitch_fix)
 				continue;
-			if (sd->sc.data[status] && !pc_check_weapontype(sd, skill_get_weapontype(it.second->skill_id)))
+			if (sd->sc.data[status] && !pc_check_weapontype(sd, skill_get_weapontype(scdb->skill_id)))
 				status_change_end(&sd->bl, status, INVALID_TIMER);
 		}
 
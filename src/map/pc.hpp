@@ -322,6 +322,13 @@ struct map_session_data {
 	struct view_data vd;
 	struct status_data base_status, battle_status;
 	struct status_change sc;
+	/// Inputs of the last status_calc_pc_sub from the status changes, see status_calc_pc_
+	struct s_status_calc_deps {
+		uint64 types[SC_ENTRY_WORDS]; ///< Status changes that were looked up
+		unsigned int option, opt3;
+		unsigned short opt1, opt2;
+		bool valid; ///< The calculation finished with at least one status change active
+	} calc_deps;
 	struct regen_data regen;
 	struct regen_data_sub sregen, ssregen;
 	//NOTE: When deciding to add a flag to state or special_state, take into consideration that state is preserved in
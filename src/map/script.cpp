@@ -3611,6 +3611,8 @@ void script_free_code(struct script_code* code)
 	if (code->local.arrays)
 		code->local.arrays->destroy(code->local.arrays, script_free_array_db);
 	aFree(code->script_buf);
+	if (code->bonus)
+		aFree(code->bonus);
 	aFree(code);
 }
 
@@ -4179,6 +4181,146 @@ int run_func(struct script_state *st)
 /*==========================================
  * script execution
  *------------------------------------------*/
+int buildin_bonus(struct script_state* st);
+
+/// Whether a bonus type takes a skill as first value
+static bool script_bonus_skill_type(int type)
+{
+	switch( type ) {
+		case SP_AUTOSPELL:
+		case SP_AUTOSPELL_WHENHIT:
+		case SP_AUTOSPELL_ONSKILL:
+		case SP_SKILL_ATK:
+		case SP_SKILL_HEAL:
+		case SP_SKILL_HEAL2:
+		case SP_ADD_SKILL_BLOW:
+		case SP_CASTRATE:
+		case SP_ADDEFF_ONSKILL:
+		case SP_SKILL_USE_SP_RATE:
+		case SP_SKILL_COOLDOWN:
+		case SP_SKILL_FIXEDCAST:
+		case SP_SKILL_VARIABLECAST:
+		case SP_VARCASTRATE:
+		case SP_FIXCASTRATE:
+		case SP_SKILL_DELAY:
+		case SP_SKILL_USE_SP:
+		case SP_SUB_SKILL:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Precompiles a script that only consists of bonus commands with constant values,
+ * so that run_script can apply the bonuses without the script engine.
+ * Scripts with anything else (conditions, variables, parameters, skill names, other commands) stay interpreted.
+ * @param code: Script code
+ * @return True if the script was precompiled
+ */
+bool script_compile_bonus(struct script_code* code)
+{
+	std::vector<struct script_bonus> bonus;
+	int64 args[6];
+	int argc = -1; // -1: no bonus command, 0+: number of arguments
+	bool call = false;
+	int pos = 0;
+
+	if( code == NULL || code->bonus != NULL )
+		return false;
+
+	while( pos < code->script_size ) {
+		enum c_op c = get_com(code->script_buf, &pos);
+
+		switch( c ) {
+			case C_NAME: {
+				int func = GETVALUE(code->script_buf, pos);
+
+				pos += 3;
+				if( call || str_data[func].type != C_FUNC || str_data[func].func != buildin_bonus )
+					return false;
+				call = true;
+				break;
+			}
+			case C_ARG:
+				if( !call || argc >= 0 )
+					return false;
+				argc = 0;
+				break;
+			case C_INT:
+				if( argc < 0 || argc >= (int)ARRAYLENGTH(args) )
+					return false;
+				args[argc++] = get_num(code->script_buf, &pos);
+				break;
+			case C_NEG:
+				if( argc <= 0 )
+					return false;
+				args[argc - 1] = -args[argc - 1];
+				break;
+			case C_FUNC: {
+				struct script_bonus entry = {};
+
+				if( argc < 1 )
+					return false;
+				for( int i = 0; i < argc; i++ ) {
+					if( args[i] < INT_MIN || args[i] > INT_MAX )
+						return false;
+				}
+				// Skill IDs are validated when the command runs
+				if( script_bonus_skill_type((int)args[0]) )
+					return false;
+
+				entry.type = (int)args[0];
+				entry.argc = argc - 1;
+				for( int i = 1; i < argc; i++ )
+					entry.val[i - 1] = (int)args[i];
+				bonus.push_back(entry);
+				call = false;
+				argc = -1;
+				break;
+			}
+			case C_EOL:
+				if( call )
+					return false;
+				break;
+			case C_NOP: // End of the script
+				if( call || bonus.empty() )
+					return false;
+
+				code->bonus_count = (int)bonus.size();
+				CREATE(code->bonus, struct script_bonus, code->bonus_count);
+				memcpy(code->bonus, bonus.data(), bonus.size() * sizeof(struct script_bonus));
+				return true;
+			default:
+				return false;
+		}
+	}
+
+	return false;
+}
+
+/// Applies the precompiled bonuses of a script, see script_compile_bonus
+static void script_run_bonus(struct script_code *code, int rid)
+{
+	struct map_session_data *sd = map_id2sd(rid);
+
+	if( sd == NULL )
+		return; // no player attached
+
+	for( int i = 0; i < code->bonus_count; i++ ) {
+		const struct script_bonus& bonus = code->bonus[i];
+
+		switch( bonus.argc ) {
+			case 0:
+			case 1: pc_bonus(sd, bonus.type, bonus.val[0]); break;
+			case 2: pc_bonus2(sd, bonus.type, bonus.val[0], bonus.val[1]); break;
+			case 3: pc_bonus3(sd, bonus.type, bonus.val[0], bonus.val[1], bonus.val[2]); break;
+			case 4: pc_bonus4(sd, bonus.type, bonus.val[0], bonus.val[1], bonus.val[2], bonus.val[3]); break;
+			case 5: pc_bonus5(sd, bonus.type, bonus.val[0], bonus.val[1], bonus.val[2], bonus.val[3], bonus.val[4]); break;
+		}
+	}
+}
+
 void run_script(struct script_code *rootscript, int pos, int rid, int oid)
 {
 	struct script_state *st;
@@ -4186,6 +4328,11 @@ void run_script(struct script_code *rootscript, int pos, int rid, int oid)
 	if( rootscript == NULL || pos < 0 )
 		return;
 
+	if( rootscript->bonus != NULL && pos == 0 ) {
+		script_run_bonus(rootscript, rid);
+		return;
+	}
+
 	// TODO In jAthena, this function can take over the pending script in the player. [FlavioJS]
 	//      It is unclear how that can be triggered, so it needs the be traced/checked in more detail.
 	// NOTE At the time of this change, this function wasn't capable of taking over the script state because st->scriptroot was never set.
@@ -9728,46 +9875,26 @@ BUILDIN_FUNC(bonus)
 		return SCRIPT_CMD_SUCCESS; // no player attached
 
 	type = script_getnum(st,2);
-	switch( type ) {
-		case SP_AUTOSPELL:
-		case SP_AUTOSPELL_WHENHIT:
-		case SP_AUTOSPELL_ONSKILL:
-		case SP_SKILL_ATK:
-		case SP_SKILL_HEAL:
-		case SP_SKILL_HEAL2:
-		case SP_ADD_SKILL_BLOW:
-		case SP_CASTRATE:
-		case SP_ADDEFF_ONSKILL:
-		case SP_SKILL_USE_SP_RATE:
-		case SP_SKILL_COOLDOWN:
-		case SP_SKILL_FIXEDCAST:
-		case SP_SKILL_VARIABLECAST:
-		case SP_VARCASTRATE:
-		case SP_FIXCASTRATE:
-		case SP_SKILL_DELAY:
-		case SP_SKILL_USE_SP:
-		case SP_SUB_SKILL:
-			// these bonuses support skill names
-			if (script_isstring(st, 3)) {
-				const char *name = script_getstr(st, 3);
+	if( script_bonus_skill_type(type) ) {
+		// these bonuses support skill names
+		if (script_isstring(st, 3)) {
+			const char *name = script_getstr(st, 3);
 
-				if (!(val1 = skill_name2id(name))) {
-					ShowError("buildin_bonus: Invalid skill name %s passed to item bonus. Skipping.\n", name);
-					return SCRIPT_CMD_FAILURE;
-				}
-			} else {
-				val1 = script_getnum(st, 3);
+			if (!(val1 = skill_name2id(name))) {
+				ShowError("buildin_bonus: Invalid skill name %s passed to item bonus. Skipping.\n", name);
+				return SCRIPT_CMD_FAILURE;
+			}
+		} else {
+			val1 = script_getnum(st, 3);
 
-				if (strcmpi(script_getfuncname(st), "bonus") && !skill_get_index(val1)) { // Only check skill ID for bonus2, bonus3, bonus4, or bonus5
-					ShowError("buildin_bonus: Invalid skill ID %d passed to item bonus. Skipping.\n", val1);
-					return SCRIPT_CMD_FAILURE;
-				}
+			if (strcmpi(script_getfuncname(st), "bonus") && !skill_get_index(val1)) { // Only check skill ID for bonus2, bonus3, bonus4, or bonus5
+				ShowError("buildin_bonus: Invalid skill ID %d passed to item bonus. Skipping.\n", val1);
+				return SCRIPT_CMD_FAILURE;
 			}
-			break;
-		default:
-			if (script_hasdata(st, 3))
-				val1 = script_getnum(st, 3);
-			break;
+		}
+	} else {
+		if (script_hasdata(st, 3))
+			val1 = script_getnum(st, 3);
 	}
 
 	switch( script_lastdata(st)-2 ) {
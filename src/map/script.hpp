@@ -290,6 +290,15 @@ struct script_code {
 	unsigned char* script_buf;
 	struct reg_db local;
 	unsigned short instances;
+	struct script_bonus* bonus; // Precompiled bonus commands, NULL if the script is interpreted (see script_compile_bonus)
+	int bonus_count;
+};
+
+/// Bonus command with constant arguments
+struct script_bonus {
+	int type;
+	int argc; // Number of values
+	int val[5];
 };
 
 struct script_stack {
@@ -2097,6 +2106,7 @@ void script_warning(const char* src, const char* file, int start_line, const cha
 bool is_number(const char *p);
 struct script_code* parse_script(const char* src,const char* file,int line,int options);
 void run_script(struct script_code *rootscript,int pos,int rid,int oid);
+bool script_compile_bonus(struct script_code* code);
 
 bool set_reg_num(struct script_state* st, struct map_session_data* sd, int64 num, const char* name, const int64 value, struct reg_db *ref);
 bool set_reg_str(struct script_state* st, struct map_session_data* sd, int64 num, const char* name, const char* value, struct reg_db* ref);
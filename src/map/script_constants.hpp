@@ -538,6 +538,7 @@
 	export_constant(MF_NORENEWALEXPPENALTY);
 	export_constant(MF_NOPETCAPTURE);
 	export_constant(MF_NOBUYINGSTORE);
+	export_constant(MF_BLOCKSIZE);
 
 	/* setcell types */
 	export_constant(CELL_WALKABLE);
@@ -2047,15 +2047,16 @@ int skill_additional_effect(struct block_list* src, struct block_list *bl, uint1
 
 			uint16 n = skill_lv;
 
-			for (const auto &it : status_db) {
-				sc_type status = static_cast<sc_type>(it.first);
+			for (int i = tsc->data.next(SC_NONE); i < SC_MAX; i = tsc->data.next(i)) {
+				sc_type status = static_cast<sc_type>(i);
+				std::shared_ptr<s_status_change_db> scdb = status_db.find(status);
 
 				if (n <= 0)
 					break;
-				if (!tsc->data[status])
+				if (scdb == nullptr)
 					continue;
 
-				if (it.second->flag[SCF_NOBANISHINGBUSTER])
+				if (scdb->flag[SCF_NOBANISHINGBUSTER])
 					continue;
 
 				switch (status) {
@@ -9210,13 +9211,14 @@ int skill_castend_nodamage_id (struct block_list *src, struct block_list *bl, ui
 				break;
 
 			//Statuses that can't be Dispelled
-			for (const auto &it : status_db) {
-				sc_type status = static_cast<sc_type>(it.first);
+			for (int j = tsc->data.next(SC_NONE); j < SC_MAX; j = tsc->data.next(j)) {
+				sc_type status = static_cast<sc_type>(j);
+				std::shared_ptr<s_status_change_db> scdb = status_db.find(status);
 
-				if (!tsc->data[status])
+				if (scdb == nullptr)
 					continue;
 
-				if (it.second->flag[SCF_NODISPELL])
+				if (scdb->flag[SCF_NODISPELL])
 					continue;
 				switch (status) {
 					// bugreport:4888 these songs may only be dispelled if you're not in their song area anymore
@@ -10723,13 +10725,14 @@ int skill_castend_nodamage_id (struct block_list *src, struct block_list *bl, ui
 				break;
 
 			//Statuses change that can't be removed by Cleareance
-			for (const auto &it : status_db) {
-				sc_type status = static_cast<sc_type>(it.first);
+			for (int j = tsc->data.next(SC_NONE); j < SC_MAX; j = tsc->data.next(j)) {
+				sc_type status = static_cast<sc_type>(j);
+				std::shared_ptr<s_status_change_db> scdb = status_db.find(status);
 
-				if (!tsc->data[status])
+				if (scdb == nullptr)
 					continue;
 
-				if (it.second->flag[SCF_NOCLEARANCE])
+				if (scdb->flag[SCF_NOCLEARANCE])
 					continue;
 
 				switch (status) {
@@ -20229,7 +20232,7 @@ std::shared_ptr<s_skill_unit_group> skill_initunitgroup(struct block_list* src,
 	group->bg_id      = bg_team_get_id(src);
 	group->group_id   = skill_get_new_group_id();
 	group->link_group_id = 0;
-	group->unit       = (skill_unit *)aCalloc(count, sizeof(skill_unit));
+	group->unit       = (skill_unit *)map_allocblock(BL_SKILL, count);
 	group->unit_count = count;
 	group->alive_count = 0;
 	group->val1       = 0;
@@ -20489,11 +20492,8 @@ struct skill_unit_group_tickset *skill_unitgrouptickset_search(struct block_list
  * Check for validity skill unit that triggered by skill_unit_timer_sub
  * And trigger skill_unit_onplace_timer for object that maybe stands there (catched object is *bl)
  *------------------------------------------*/
-int skill_unit_timer_sub_onplace(struct block_list* bl, va_list ap)
+int skill_unit_timer_sub_onplace(struct block_list* bl, struct skill_unit* unit, t_tick tick)
 {
-	struct skill_unit* unit = va_arg(ap,struct skill_unit *);
-	t_tick tick = va_arg(ap,t_tick);
-
 	nullpo_ret(unit);
 
 	if( !unit->alive || bl->prev == NULL )
@@ -20767,7 +20767,9 @@ static int skill_unit_timer_sub(DBKey key, DBData *data, va_list ap)
 
 	if( unit->range >= 0 && group->interval != -1 )
 	{
-		map_foreachinrange(skill_unit_timer_sub_onplace, bl, unit->range, group->bl_flag, bl,tick);
+		map_foreachinrange(bl, unit->range, group->bl_flag, [&](struct block_list *target) {
+			return skill_unit_timer_sub_onplace(target, unit, tick);
+		});
 
 		if(unit->range == -1) //Unit disabled, but it should not be deleted yet.
 			group->unit_id = UNT_USED_TRAPS;
@@ -24636,7 +24638,7 @@ void do_init_skill(void)
 {
 	skill_readdb();
 
-	skillunit_db = idb_alloc(DB_OPT_BASE);
+	skillunit_db = idb_alloc(DB_OPT_OPEN_HASH);
 	skillusave_db = idb_alloc(DB_OPT_RELEASE_DATA);
 	bowling_db = idb_alloc(DB_OPT_BASE);
 	skill_timer_ers  = ers_new(sizeof(struct skill_timerskill),"skill.cpp::skill_timer_ers",ERS_CACHE_OPTIONS);
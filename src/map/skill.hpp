@@ -367,6 +367,7 @@ struct skill_unit {
 	short range;
 	bool alive;
 	bool hidden;
+	uint8 pool; /// Pool of the unit array, set on the first unit by map_allocblock
 };
 
 /// Skill unit group
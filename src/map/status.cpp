@@ -997,10 +997,11 @@ int status_damage(struct block_list *src,struct block_list *target,int64 dhp, in
 		if( sc ) {
 			struct status_change_entry *sce;
 
-			for (const auto &it : status_db) {
-				sc_type type = static_cast<sc_type>(it.first);
+			for (int i = sc->data.next(SC_NONE); i < SC_MAX; i = sc->data.next(i)) {
+				sc_type type = static_cast<sc_type>(i);
+				std::shared_ptr<s_status_change_db> scdb = status_db.find(type);
 
-				if (sc->data[type] && it.second->flag[SCF_REMOVEONDAMAGED])
+				if (scdb != nullptr && scdb->flag[SCF_REMOVEONDAMAGED])
 					status_change_end(target, type, INVALID_TIMER);
 			}
 			if ((sce=sc->data[SC_ENDURE]) && !sce->val4) {
@@ -4263,9 +4264,28 @@ int status_calc_pc_( struct map_session_data* sd, uint8 opt ){
 	// Save the old script the player was attached to
 	struct script_state* previous_st = sd->st;
 
+	struct map_session_data::s_status_calc_deps& deps = sd->calc_deps;
+	// Nested calculations add to the status changes recorded by the outer one
+	bool record = ( sd->sc.data.reads == nullptr );
+
+	if( record ){
+		memset( deps.types, 0, sizeof( deps.types ) );
+		sd->sc.data.reads = deps.types;
+	}
+
 	// Store the return value of the original function
 	int ret = status_calc_pc_sub( sd, opt );
 
+	if( record ){
+		sd->sc.data.reads = nullptr;
+		deps.option = sd->sc.option;
+		deps.opt1 = sd->sc.opt1;
+		deps.opt2 = sd->sc.opt2;
+		deps.opt3 = sd->sc.opt3;
+		// Conditions on sc.count are not recorded, so a calculation without status changes can not be reused
+		deps.valid = ( ret >= 0 && sd->sc.count > 0 );
+	}
+
 	// If an old script is present
 	if( previous_st ){
 		// Reattach the player to it, so that the limitations of that script kick back in
@@ -8639,6 +8659,62 @@ void status_change_init(struct block_list *bl)
 	memset(sc, 0, sizeof (struct status_change));
 }
 
+/**
+ * Stores the entry of a status change
+ * @param type: Status change (SC_*)
+ * @param entry: Entry of the status change
+ */
+void s_status_change_entries::set(enum sc_type type, struct status_change_entry* entry)
+{
+	int word = type / 64;
+	uint64 bit = (uint64)1 << (type % 64);
+	int index = this->rank[word] + status_popcount64(this->active[word] & (bit - 1));
+
+	if (this->active[word] & bit) {
+		this->entries[index] = entry;
+		return;
+	}
+
+	if (this->size == this->capacity) {
+		this->capacity = (this->capacity == 0) ? 4 : this->capacity * 2;
+		RECREATE(this->entries, struct status_change_entry*, this->capacity);
+	}
+
+	memmove(&this->entries[index + 1], &this->entries[index], (this->size - index) * sizeof(this->entries[0]));
+	this->entries[index] = entry;
+	this->size++;
+	this->active[word] |= bit;
+	for (int i = word + 1; i < SC_ENTRY_WORDS; i++)
+		this->rank[i]++;
+}
+
+/**
+ * Removes the entry of a status change, the entry itself is not freed
+ * @param type: Status change (SC_*)
+ */
+void s_status_change_entries::erase(enum sc_type type)
+{
+	int word = type / 64;
+	uint64 bit = (uint64)1 << (type % 64);
+
+	if (!(this->active[word] & bit))
+		return;
+
+	int index = this->rank[word] + status_popcount64(this->active[word] & (bit - 1));
+
+	memmove(&this->entries[index], &this->entries[index + 1], (this->size - index - 1) * sizeof(this->entries[0]));
+	this->size--;
+	this->active[word] &= ~bit;
+	for (int i = word + 1; i < SC_ENTRY_WORDS; i++)
+		this->rank[i]--;
+
+	if (this->size == 0) {
+		aFree(this->entries);
+		this->entries = nullptr;
+		this->capacity = 0;
+	}
+}
+
 /*========================================== [Playtester]
 * Returns the interval for status changes that iterate multiple times
 * through the timer (e.g. those that deal damage in regular intervals)
@@ -9179,6 +9255,27 @@ void status_display_remove(struct block_list *bl, enum sc_type type) {
 	}
 }
 
+/**
+ * Checks whether a started status change may change the result of status_calc_pc_sub
+ * The last calculation recorded the status changes it looked up, a status change that was not looked up
+ * only changes the values of its calc flags, which status_change_start already recalculated.
+ * @param sd: Player
+ * @param type: Started status change (SC_*)
+ * @param calc_flag: Values recalculated for the status change
+ * @return True - full recalculation required, False - otherwise
+ */
+static bool status_calc_pc_depends(struct map_session_data *sd, enum sc_type type, const std::bitset<SCB_MAX> &calc_flag)
+{
+	const struct map_session_data::s_status_calc_deps &deps = sd->calc_deps;
+
+	if (!battle_config.status_calc_deps || !deps.valid || calc_flag[SCB_BASE])
+		return true;
+	if (deps.option != sd->sc.option || deps.opt1 != sd->sc.opt1 || deps.opt2 != sd->sc.opt2 || deps.opt3 != sd->sc.opt3)
+		return true;
+
+	return (deps.types[type / 64] & ((uint64)1 << (type % 64))) != 0;
+}
+
 /**
  * Applies SC defense to a given status change
  * This function also determines whether or not the status change will be applied
@@ -12103,7 +12200,8 @@ int status_change_start(struct block_list* src, struct block_list* bl,enum sc_ty
 		sc_isnew = false;
 	} else { // New sc
 		++(sc->count);
-		sce = sc->data[type] = ers_alloc(sc_data_ers, struct status_change_entry);
+		sce = ers_alloc(sc_data_ers, struct status_change_entry);
+		sc->data.set(type, sce);
 	}
 	sce->val1 = val1;
 	sce->val2 = val2;
@@ -12145,7 +12243,7 @@ int status_change_start(struct block_list* src, struct block_list* bl,enum sc_ty
 				status_calc_pc(sd, SCO_FORCE);
 				break;
 			default:
-				if (!sd->state.connect_new)
+				if (!sd->state.connect_new && status_calc_pc_depends(sd, type, calc_flag))
 					status_calc_pc(sd, SCO_NONE);
 				break;
 		}
@@ -12269,13 +12367,14 @@ int status_change_clear(struct block_list* bl, int type)
 	if (!sc->count)
 		return 0;
 
-	for (const auto &it : status_db) {
-		sc_type status = static_cast<sc_type>(it.first);
+	for (int i = sc->data.next(SC_NONE); i < SC_MAX; i = sc->data.next(i)) {
+		sc_type status = static_cast<sc_type>(i);
+		std::shared_ptr<s_status_change_db> scdb = status_db.find(status);
 
-		if (!sc->data[status])
+		if (scdb == nullptr)
 			continue;
 		if (type == 0) { // Type 0: PC killed
-			if (it.second->flag[SCF_NOREMOVEONDEAD]) {
+			if (scdb->flag[SCF_NOREMOVEONDEAD]) {
 				switch (status) {
 					case SC_ELEMENTALCHANGE: // Only when its Holy or Dark that it doesn't dispell on death
 						if (sc->data[status]->val2 != ELE_HOLY && sc->data[status]->val2 != ELE_DARK)
@@ -12286,7 +12385,7 @@ int status_change_clear(struct block_list* bl, int type)
 			}
 		}
 
-		if (type == 3 && it.second->flag[SCF_NOCLEARBUFF])
+		if (type == 3 && scdb->flag[SCF_NOCLEARBUFF])
 			continue;
 
 		status_change_end(bl, status, INVALID_TIMER);
@@ -12295,7 +12394,7 @@ int status_change_clear(struct block_list* bl, int type)
 			if (sc->data[status]->timer != INVALID_TIMER)
 				delete_timer(sc->data[status]->timer, status_change_timer);
 			ers_free(sc_data_ers, sc->data[status]);
-			sc->data[status] = NULL;
+			sc->data.erase(status);
 		}
 	}
 
@@ -12408,7 +12507,7 @@ int status_change_end_(struct block_list* bl, enum sc_type type, int tid, const
 	if (scdb->state.any())
 		status_calc_state(bl,sc,scdb->state,false);
 
-	sc->data[type] = NULL;
+	sc->data.erase(type);
 
 	if (scdb->flag[SCF_DISPLAYPC] || scdb->flag[SCF_DISPLAYNPC])
 		status_display_remove(bl,type);
@@ -14201,11 +14300,16 @@ void status_change_clear_buffs(struct block_list* bl, uint8 type)
 		return;
 
 	//Clears buffs with specified flag and type
-	for (const auto &it : status_db) {
-		sc_type status = static_cast<sc_type>(it.first);
-		std::bitset<SCF_MAX> flag = it.second->flag;
+	for (int i = sc->data.next(SC_NONE); i < SC_MAX; i = sc->data.next(i)) {
+		sc_type status = static_cast<sc_type>(i);
+		std::shared_ptr<s_status_change_db> scdb = status_db.find(status);
+
+		if (scdb == nullptr)
+			continue;
+
+		std::bitset<SCF_MAX> flag = scdb->flag;
 
-		if (!sc->data[status] || flag[SCF_NOCLEARBUFF]) //Skip status with SCF_NOCLEARBUFF, no matter what
+		if (flag[SCF_NOCLEARBUFF]) //Skip status with SCF_NOCLEARBUFF, no matter what
 			continue;
 		// &SCCB_LUXANIMA : Cleared by RK_LUXANIMA
 		if (!(type&SCCB_LUXANIMA) && flag[SCF_REMOVEONLUXANIMA])
@@ -14271,11 +14375,12 @@ int status_change_spread(block_list *src, block_list *bl)
 	bool hasSpread = false;
 	t_tick tick = gettick(), sc_tick;
 
-	for (const auto &it : status_db) {
-		sc_type type = static_cast<sc_type>(it.first);
+	for (int i = sc->data.next(SC_NONE); i < SC_MAX; i = sc->data.next(i)) {
+		sc_type type = static_cast<sc_type>(i);
+		std::shared_ptr<s_status_change_db> scdb = status_db.find(type);
 		const TimerData *timer;
 
-		if (sc->data[type] && it.second->flag[SCF_SPREADEFFECT]) {
+		if (scdb != nullptr && scdb->flag[SCF_SPREADEFFECT]) {
 			if (sc->data[type]->timer != INVALID_TIMER) {
 				timer = get_timer(sc->data[type]->timer);
 
@@ -14558,10 +14663,10 @@ void status_change_clear_onChangeMap(struct block_list *bl, struct status_change
 		bool mapIsBG = mapdata->flag[MF_BATTLEGROUND] != 0;
 		bool mapIsTE = mapdata_flag_gvg2_te(mapdata);
 
-		for (const auto &it : status_db) {
-			sc_type type = static_cast<sc_type>(it.first);
+		for (int i = sc->data.next(SC_NONE); i < SC_MAX; i = sc->data.next(i)) {
+			sc_type type = static_cast<sc_type>(i);
 
-			if (!sc->data[type] || !SCDisabled[type])
+			if (!SCDisabled[type])
 				continue;
 
 			if (status_change_isDisabledOnMap_(type, mapIsVS, mapIsPVP, mapIsGVG, mapIsBG, mapdata->zone, mapIsTE))
@@ -3051,6 +3051,76 @@ struct status_change_entry {
 	int val1,val2,val3,val4;
 };
 
+#define SC_ENTRY_WORDS ((SC_MAX + 63) / 64)
+
+/// Returns the number of set bits
+static inline int status_popcount64(uint64 bits){
+#if defined(__GNUC__)
+	return __builtin_popcountll(bits);
+#else
+	bits = bits - ((bits >> 1) & 0x5555555555555555ULL);
+	bits = (bits & 0x3333333333333333ULL) + ((bits >> 2) & 0x3333333333333333ULL);
+	bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((bits * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+///Active status changes of an object, indexed by type (SC_*)
+///The active types are kept in a bitmap and only their entries are stored, sorted by type.
+///Zero filled memory is an empty set, see status_change_init.
+struct s_status_change_entries {
+	uint64 active[SC_ENTRY_WORDS]; ///< Bitmap of the active types
+	uint16 rank[SC_ENTRY_WORDS]; ///< Number of active types in the words before
+	uint16 size; ///< Number of active types
+	uint16 capacity; ///< Allocated length of entries, freed once the last status ends
+	struct status_change_entry** entries; ///< Entries of the active types
+	uint64* reads; ///< Bitmap the looked up types are recorded in, see status_calc_pc_ (nullptr if not recording)
+
+	///Returns the entry of a status change or nullptr if it is not active
+	struct status_change_entry* operator[](int type) const {
+		if ((unsigned int)type >= SC_MAX)
+			return nullptr;
+
+		uint64 bit = (uint64)1 << (type % 64);
+		uint64 word = this->active[type / 64];
+
+		if (this->reads != nullptr)
+			this->reads[type / 64] |= bit;
+
+		if (!(word & bit))
+			return nullptr;
+		return this->entries[this->rank[type / 64] + status_popcount64(word & (bit - 1))];
+	}
+
+	///Returns the first active type after a type or SC_MAX if there is none.
+	///Iterating with next(SC_NONE) stays valid while statuses start or end.
+	int next(int type) const {
+		for (int i = (type + 1) / 64; i < SC_ENTRY_WORDS; i++) {
+			uint64 bits = this->active[i];
+
+			if (i == (type + 1) / 64)
+				bits &= ~(uint64)0 << ((type + 1) % 64);
+			if (bits == 0)
+				continue;
+#if defined(__GNUC__)
+			return i * 64 + __builtin_ctzll(bits);
+#else
+			int bit = 0;
+
+			while (!(bits & 1)) {
+				bits >>= 1;
+				bit++;
+			}
+			return i * 64 + bit;
+#endif
+		}
+		return SC_MAX;
+	}
+
+	void set(enum sc_type type, struct status_change_entry* entry);
+	void erase(enum sc_type type);
+};
+
 ///Status change
 struct status_change {
 	unsigned int option;// effect state (bitfield)
@@ -3081,7 +3151,7 @@ struct status_change {
 #ifndef RENEWAL
 	unsigned char sg_counter; //Storm gust counter (previous hits from storm gust)
 #endif
-	struct status_change_entry *data[SC_MAX];
+	struct s_status_change_entries data;
 };
 
 int status_damage( struct block_list *src, struct block_list *target, int64 dhp, int64 dsp, int64 dap, t_tick walkdelay, int flag, uint16 skill_id );
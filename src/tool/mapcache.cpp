@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <unordered_map>
 #ifndef _WIN32
 #include <unistd.h>
 #endif
@@ -13,6 +14,7 @@
 #include "../common/core.hpp"
 #include "../common/grfio.hpp"
 #include "../common/malloc.hpp"
+#include "../common/mapcache.hpp"
 #include "../common/mmo.hpp"
 #include "../common/showmsg.hpp"
 #include "../common/utils.hpp"
@@ -22,10 +24,6 @@ std::string map_list_file = "map_index.txt";
 std::string map_cache_file;
 int rebuild = 0;
 
-FILE *map_cache_fp;
-
-unsigned long file_size;
-
 // Used internally, this structure contains the physical map cells
 struct map_data {
 	int16 xs;
@@ -33,20 +31,17 @@ struct map_data {
 	unsigned char *cells;
 };
 
-// This is the main header found at the very beginning of the file
-struct main_header {
-	uint32 file_size;
-	uint16 map_count;
-} header;
-
-// This is the header appended before every compressed map cells info
-struct map_info {
+// A map of the cache with its compressed cells
+struct s_cached_map {
 	char name[MAP_NAME_LENGTH];
 	int16 xs;
 	int16 ys;
-	int32 len;
+	std::vector<unsigned char> data;
 };
 
+std::vector<s_cached_map> cached_maps;
+std::unordered_map<std::string, size_t> cached_map_ids;
+
 
 // Reads a map from GRF's GAT and RSW files
 int read_map(char *name, struct map_data *m)
@@ -99,10 +94,24 @@ int read_map(char *name, struct map_data *m)
 	return 1;
 }
 
+// Adds a map with already compressed cells to the cache
+void add_cached_map(const char *name, int16 xs, int16 ys, const unsigned char *data, size_t len)
+{
+	s_cached_map cached;
+
+	strncpy(cached.name, name, MAP_NAME_LENGTH);
+	cached.name[MAP_NAME_LENGTH - 1] = '\0';
+	cached.xs = xs;
+	cached.ys = ys;
+	cached.data.assign(data, data + len);
+
+	cached_map_ids[cached.name] = cached_maps.size();
+	cached_maps.push_back(std::move(cached));
+}
+
 // Adds a map to the cache
 void cache_map(char *name, struct map_data *m)
 {
-	struct map_info info;
 	unsigned long len;
 	unsigned char *write_buf;
 
@@ -112,20 +121,9 @@ void cache_map(char *name, struct map_data *m)
 	// Compress the cells and get the compressed length
 	encode_zip(write_buf, &len, m->cells, m->xs*m->ys);
 
-	// Fill the map header
-	if (strlen(name) > MAP_NAME_LENGTH) // It does not hurt to warn that there are maps with name longer than allowed.
-		ShowWarning ("Map name '%s' size '%" PRIuPTR "' is too long. Truncating to '%d'.\n", name, strlen(name), MAP_NAME_LENGTH);
-	strncpy(info.name, name, MAP_NAME_LENGTH);
-	info.xs = MakeShortLE(m->xs);
-	info.ys = MakeShortLE(m->ys);
-	info.len = MakeLongLE(len);
-
-	// Append map header then compressed cells at the end of the file
-	fseek(map_cache_fp, header.file_size, SEEK_SET);
-	fwrite(&info, sizeof(struct map_info), 1, map_cache_fp);
-	fwrite(write_buf, 1, len, map_cache_fp);
-	header.file_size += sizeof(struct map_info) + len;
-	header.map_count++;
+	if (strlen(name) >= MAP_NAME_LENGTH) // It does not hurt to warn that there are maps with name longer than allowed.
+		ShowWarning ("Map name '%s' size '%" PRIuPTR "' is too long. Truncating to '%d'.\n", name, strlen(name), MAP_NAME_LENGTH - 1);
+	add_cached_map(name, m->xs, m->ys, write_buf, len);
 
 	aFree(write_buf);
 	aFree(m->cells);
@@ -136,20 +134,112 @@ void cache_map(char *name, struct map_data *m)
 // Checks whether a map is already is the cache
 int find_map(char *name)
 {
-	int i;
-	struct map_info info;
+	return cached_map_ids.find(name) != cached_map_ids.end();
+}
+
+// Loads the maps of an existing map cache, both versions are supported
+bool load_cache(FILE *fp)
+{
+	std::vector<unsigned char> buffer;
+	size_t size;
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	buffer.resize(size);
+	if (size == 0 || fread(buffer.data(), 1, size, fp) != size)
+		return false;
+
+	const unsigned char *buf = buffer.data();
+
+	if (size >= sizeof(struct map_cache_header) && memcmp(buf, MAP_CACHE_MAGIC, 4) == 0) {
+		if (GetULong(buf + offsetof(struct map_cache_header, version)) != MAP_CACHE_VERSION)
+			return false;
+
+		uint32 map_count = GetULong(buf + offsetof(struct map_cache_header, map_count));
+		uint32 index_size = GetULong(buf + offsetof(struct map_cache_header, index_size));
+		size_t table = sizeof(struct map_cache_header) + (size_t)index_size * sizeof(uint32);
+
+		if (table + (size_t)map_count * sizeof(struct map_cache_entry) > size)
+			return false;
+
+		for (uint32 i = 0; i < map_count; i++) {
+			const unsigned char *entry = buf + table + i * sizeof(struct map_cache_entry);
+			uint32 offset = GetULong(entry + offsetof(struct map_cache_entry, offset));
+			uint32 len = GetULong(entry + offsetof(struct map_cache_entry, len));
+
+			if ((size_t)offset + len > size)
+				return false;
+			add_cached_map((const char *)entry, (int16)GetUShort(entry + offsetof(struct map_cache_entry, xs)), (int16)GetUShort(entry + offsetof(struct map_cache_entry, ys)), buf + offset, len);
+		}
+	} else {
+		if (size < sizeof(struct map_cache_main_header))
+			return false;
+
+		uint16 map_count = GetUShort(buf + offsetof(struct map_cache_main_header, map_count));
+		size_t pos = sizeof(struct map_cache_main_header);
 
-	fseek(map_cache_fp, sizeof(struct main_header), SEEK_SET);
+		for (uint16 i = 0; i < map_count; i++) {
+			if (pos + sizeof(struct map_cache_map_info) > size)
+				return false;
 
-	for(i = 0; i < header.map_count; i++) {
-		if(fread(&info, sizeof(info), 1, map_cache_fp) != 1) printf("An error as occured in fread while reading map_cache\n");
-		if(strcmp(name, info.name) == 0) // Map found
-			return 1;
-		else // Map not found, jump to the beginning of the next map info header
-			fseek(map_cache_fp, GetLong((unsigned char *)&(info.len)), SEEK_CUR);
+			const unsigned char *info = buf + pos;
+			uint32 len = GetULong(info + offsetof(struct map_cache_map_info, len));
+
+			pos += sizeof(struct map_cache_map_info);
+			if (pos + len > size)
+				return false;
+			add_cached_map((const char *)info, (int16)GetUShort(info + offsetof(struct map_cache_map_info, xs)), (int16)GetUShort(info + offsetof(struct map_cache_map_info, ys)), buf + pos, len);
+			pos += len;
+		}
 	}
 
-	return 0;
+	return true;
+}
+
+// Writes all maps as a version 2 map cache
+bool write_cache(FILE *fp)
+{
+	uint32 map_count = (uint32)cached_maps.size();
+	uint32 index_size = map_cache_index_size(map_count);
+	const uint32 index_empty = (uint32)MakeLongLE(MAP_CACHE_INDEX_EMPTY);
+	std::vector<uint32> index(index_size, index_empty);
+	std::vector<struct map_cache_entry> entries(map_count);
+	struct map_cache_header header;
+	uint32 offset = (uint32)(sizeof(struct map_cache_header) + index_size * sizeof(uint32) + map_count * sizeof(struct map_cache_entry));
+
+	for (uint32 i = 0; i < map_count; i++) {
+		const s_cached_map &cached = cached_maps[i];
+		uint32 slot = map_cache_hash(cached.name) & (index_size - 1);
+
+		while (index[slot] != index_empty)
+			slot = (slot + 1) & (index_size - 1);
+		index[slot] = MakeLongLE(i);
+
+		memcpy(entries[i].name, cached.name, MAP_NAME_LENGTH);
+		entries[i].xs = MakeShortLE(cached.xs);
+		entries[i].ys = MakeShortLE(cached.ys);
+		entries[i].offset = MakeLongLE(offset);
+		entries[i].len = MakeLongLE((uint32)cached.data.size());
+		offset += (uint32)cached.data.size();
+	}
+
+	memcpy(header.magic, MAP_CACHE_MAGIC, 4);
+	header.version = MakeLongLE(MAP_CACHE_VERSION);
+	header.file_size = MakeLongLE(offset);
+	header.map_count = MakeLongLE(map_count);
+	header.index_size = MakeLongLE(index_size);
+
+	if (fwrite(&header, sizeof(header), 1, fp) != 1 || fwrite(index.data(), sizeof(uint32), index_size, fp) != index_size)
+		return false;
+	if (map_count > 0 && fwrite(entries.data(), sizeof(struct map_cache_entry), map_count, fp) != map_count)
+		return false;
+	for (const s_cached_map &cached : cached_maps) {
+		if (!cached.data.empty() && fwrite(cached.data.data(), 1, cached.data.size(), fp) != cached.data.size())
+			return false;
+	}
+
+	return true;
 }
 
 // Cuts the extension from a map name
@@ -196,23 +286,20 @@ int do_init(int argc, char** argv)
 	ShowStatus("Initializing grfio with %s\n", grf_list_file.c_str());
 	grfio_init(grf_list_file.c_str());
 
-	// Attempt to open the map cache file and force rebuild if not found
+	// Attempt to load the map cache file and force rebuild if not found
 	ShowStatus("Opening map cache: %s\n", map_cache_file.c_str());
 	if(!rebuild) {
-		map_cache_fp = fopen(map_cache_file.c_str(), "rb");
+		FILE *map_cache_fp = fopen(map_cache_file.c_str(), "rb");
 		if(map_cache_fp == NULL) {
 			ShowNotice("Existing map cache not found, forcing rebuild mode\n");
 			rebuild = 1;
-		} else
+		} else {
+			if(!load_cache(map_cache_fp)) {
+				ShowError("Failure when reading map cache file %s\n", map_cache_file.c_str());
+				exit(EXIT_FAILURE);
+			}
 			fclose(map_cache_fp);
-	}
-	if(rebuild)
-		map_cache_fp = fopen(map_cache_file.c_str(), "w+b");
-	else
-		map_cache_fp = fopen(map_cache_file.c_str(), "r+b");
-	if(map_cache_fp == NULL) {
-		ShowError("Failure when opening map cache file %s\n", map_cache_file.c_str());
-		exit(EXIT_FAILURE);
+		}
 	}
 
 	// Open the map list
@@ -229,16 +316,6 @@ int do_init(int argc, char** argv)
 			exit(EXIT_FAILURE);
 		}
 
-		// Initialize the main header
-		if (rebuild) {
-			header.file_size = sizeof(struct main_header);
-			header.map_count = 0;
-		} else {
-			if (fread(&header, sizeof(struct main_header), 1, map_cache_fp) != 1) { printf("An error as occured while reading map_cache_fp \n"); }
-			header.file_size = GetULong((unsigned char *)&(header.file_size));
-			header.map_count = GetUShort((unsigned char *)&(header.map_count));
-		}
-
 		// Read and process the map list
 		char line[1024];
 
@@ -274,16 +351,19 @@ int do_init(int argc, char** argv)
 		fclose(list);
 	}
 
-	// Write the main header and close the map cache
-	ShowStatus("Closing map cache: %s\n", map_cache_file.c_str());
-	fseek(map_cache_fp, 0, SEEK_SET);
-	fwrite(&header, sizeof(struct main_header), 1, map_cache_fp);
+	// Write the whole map cache in the current format
+	ShowStatus("Writing map cache: %s\n", map_cache_file.c_str());
+	FILE *map_cache_fp = fopen(map_cache_file.c_str(), "wb");
+	if(map_cache_fp == NULL || !write_cache(map_cache_fp)) {
+		ShowError("Failure when writing map cache file %s\n", map_cache_file.c_str());
+		exit(EXIT_FAILURE);
+	}
 	fclose(map_cache_fp);
 
 	ShowStatus("Finalizing grfio\n");
 	grfio_final();
 
-	ShowInfo("%d maps now in cache\n", header.map_count);
+	ShowInfo("%" PRIuPTR " maps now in cache\n", cached_maps.size());
 
 	return 0;
 }
@@ -0,0 +1,182 @@
+// Copyright (c) rAthena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#include <chrono>
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "../common/core.hpp"
+#include "../common/showmsg.hpp"
+#include "../common/timer.hpp"
+
+// Replays the timer load of a busy map-server against the timer queue the core was built with.
+// Build it with and without ENABLE_TIMER_WHEEL (--enable-timer-wheel) to compare both backends.
+//
+// Every unit owns one timer slot that is used like the server uses its unit timers:
+// - walking units restart a short timer from inside its callback (unit_walktoxy_timer)
+// - status units keep long timers that are mostly deleted or moved before they expire (status_change_timer)
+// - every 16th unit has an interval timer (mob spawn/ai like timers)
+
+int units = 20000;
+int seconds = 120;
+int churn = 200;
+int seed = 1;
+
+enum e_bench_unit {
+	BENCH_WALK,
+	BENCH_STATUS,
+	BENCH_INTERVAL,
+};
+
+std::vector<int> unit_timer;
+std::mt19937 rnd;
+
+uint64 executed = 0;
+uint64 operations = 0;
+uint64 checksum = 0;
+t_tick start_tick = 0;
+
+/// Delay of a timer restarted by a callback, independent from the order the timers of a tick run in
+static t_tick bench_delay(int id, t_tick tick, t_tick base, t_tick spread)
+{
+	uint64 hash = ((uint64)id * 0x9E3779B97F4A7C15ULL) ^ ((uint64)(tick - start_tick) * 0xC2B2AE3D27D4EB4FULL);
+
+	hash ^= hash >> 29;
+	return base + (t_tick)(hash % (uint64)spread);
+}
+
+static void bench_executed(int id, t_tick tick)
+{
+	executed++;
+	checksum += (uint64)id * 31 + (uint64)(tick - start_tick);
+}
+
+static TIMER_FUNC(bench_walk_timer)
+{
+	bench_executed(id, tick);
+	unit_timer[id] = add_timer(tick + bench_delay(id, tick, 100, 100), bench_walk_timer, id, 0);
+	operations++;
+	return 0;
+}
+
+static TIMER_FUNC(bench_status_timer)
+{
+	bench_executed(id, tick);
+	unit_timer[id] = INVALID_TIMER;
+	return 0;
+}
+
+static TIMER_FUNC(bench_interval_timer)
+{
+	bench_executed(id, tick);
+	return 0;
+}
+
+static enum e_bench_unit bench_unit_type(int id)
+{
+	if( id % 16 == 0 )
+		return BENCH_INTERVAL;
+	if( id % 2 == 0 )
+		return BENCH_WALK;
+	return BENCH_STATUS;
+}
+
+/// Starts, restarts or deletes the timer of a random status unit
+static void bench_churn(t_tick tick)
+{
+	int id = ( rnd() % ( units / 2 ) ) * 2 + 1; // odd units are status units
+
+	if( unit_timer[id] == INVALID_TIMER )
+		unit_timer[id] = add_timer(tick + 1000 + rnd() % 300000, bench_status_timer, id, 0);
+	else if( rnd() % 32 == 0 )
+		sett_tickimer(unit_timer[id], tick + 1000 + rnd() % 60000);
+	else
+	{
+		delete_timer(unit_timer[id], bench_status_timer);
+		unit_timer[id] = INVALID_TIMER;
+	}
+
+	operations++;
+}
+
+// Processes command-line arguments
+void process_args(int argc, char *argv[])
+{
+	for( int i = 1; i < argc; i++ ) {
+		if( strcmp(argv[i], "-units") == 0 ) {
+			if( ++i < argc )
+				units = max(atoi(argv[i]), 16);
+		} else if( strcmp(argv[i], "-seconds") == 0 ) {
+			if( ++i < argc )
+				seconds = max(atoi(argv[i]), 1);
+		} else if( strcmp(argv[i], "-churn") == 0 ) {
+			if( ++i < argc )
+				churn = max(atoi(argv[i]), 0);
+		} else if( strcmp(argv[i], "-seed") == 0 ) {
+			if( ++i < argc )
+				seed = atoi(argv[i]);
+		}
+	}
+}
+
+int do_init(int argc, char** argv)
+{
+	process_args(argc, argv);
+
+	timer_init();
+	rnd.seed(seed);
+	unit_timer.assign(units, INVALID_TIMER);
+
+#ifdef TIMER_WHEEL
+	ShowStatus("Timer queue: hierarchical timing wheel\n");
+#else
+	ShowStatus("Timer queue: binary heap\n");
+#endif
+	ShowStatus("Simulating %d units for %d seconds with %d timer changes per cycle...\n", units, seconds, churn);
+
+	t_tick tick = start_tick = gettick_nocache();
+	t_tick end = tick + seconds * 1000;
+
+	for( int id = 0; id < units; id++ ) {
+		switch( bench_unit_type(id) ) {
+			case BENCH_WALK:
+				unit_timer[id] = add_timer(tick + rnd() % 200, bench_walk_timer, id, 0);
+				break;
+			case BENCH_STATUS:
+				unit_timer[id] = add_timer(tick + 1000 + rnd() % 300000, bench_status_timer, id, 0);
+				break;
+			case BENCH_INTERVAL:
+				unit_timer[id] = add_timer_interval(tick + rnd() % 1000, bench_interval_timer, id, 0, 1000 + id % 9000);
+				break;
+		}
+		operations++;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	uint64 cycles = 0;
+
+	while( tick < end ) {
+		for( int i = 0; i < churn; i++ )
+			bench_churn(tick);
+
+		// the core sleeps for the returned time unless a socket wakes it up earlier
+		tick += min(do_timer(tick), (t_tick)20);
+		cycles++;
+	}
+
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count();
+
+	ShowInfo("%" PRIu64 " cycles, %" PRIu64 " timers executed, %" PRIu64 " timer operations\n", cycles, executed, operations);
+	ShowInfo("%.3f ms total, %.3f us per cycle, %.1f ns per timer\n", duration / 1000.0, (double)duration / cycles, duration * 1000.0 / ( executed + operations ));
+	ShowInfo("Checksum: %016" PRIx64 "\n", checksum);
+
+	timer_final();
+
+	return 0;
+}
+
+void do_final(void)
+{
+}